@@ -0,0 +1,80 @@
+#!/bin/bash
+# save as bench_broadcast.sh
+# Broadcast fan-out benchmark: send syscalls per delivered message.
+#
+# Usage: ./bench_broadcast.sh [receivers] [messages] [paused] [server args...]
+#   receivers  clients that only listen (default 8)
+#   messages   chat lines broadcast by the sender (default 200000)
+#   paused     receivers stopped (SIGSTOP) during the burst so their
+#              queues build up and get flushed in batches (default 2)
+#
+# Example: ./bench_broadcast.sh 8 200000 2 --mode epoll --queue-limit 100000
+# (raise --queue-limit so paused receivers queue instead of dropping)
+
+RECEIVERS=${1:-8}
+MESSAGES=${2:-200000}
+PAUSED=${3:-2}
+shift 3 2>/dev/null
+SERVER_ARGS="$@"
+
+stat_field() {
+    # $1 = /stats output, $2 = field (delivered|syscalls)
+    if [ "$2" == "delivered" ]; then
+        echo "$1" | grep -o 'Fan-out: [0-9]*' | tail -1 | grep -o '[0-9]*'
+    else
+        echo "$1" | grep -o 'with [0-9]* send syscalls' | tail -1 | grep -o '[0-9]*'
+    fi
+}
+
+./server $SERVER_ARGS > /tmp/bench_broadcast_server.log 2>&1 &
+SERVER_PID=$!
+sleep 1
+
+# $! of a pipeline is its last process, i.e. the client itself
+CLIENT_PIDS=()
+for i in $(seq 1 $RECEIVERS); do
+    ( echo "/register bench_rx$i pw"; sleep 0.3; echo "/login bench_rx$i pw"; exec sleep 3600 ) \
+        | ./client 127.0.0.1 > /dev/null 2>&1 &
+    CLIENT_PIDS+=($!)
+done
+sleep 1
+
+for i in $(seq 0 $((PAUSED - 1))); do
+    [ -n "${CLIENT_PIDS[$i]}" ] && kill -STOP ${CLIENT_PIDS[$i]}
+done
+
+OUTPUT=$( (
+    echo "/register bench_tx pw"; sleep 0.3
+    echo "/login bench_tx pw"; sleep 0.5
+    echo "/stats"; sleep 0.5
+    for i in $(seq 1 $MESSAGES); do
+        echo "benchmark message $i with some padding to look like real chat text"
+    done
+    sleep 1
+    for i in $(seq 0 $((PAUSED - 1))); do
+        [ -n "${CLIENT_PIDS[$i]}" ] && kill -CONT ${CLIENT_PIDS[$i]}
+    done
+    sleep 2
+    echo "/stats"; sleep 0.5
+    echo "exit"
+) | ./client 127.0.0.1 2>&1 )
+
+BEFORE=$(echo "$OUTPUT" | grep 'Fan-out' | head -1)
+AFTER=$(echo "$OUTPUT" | grep 'Fan-out' | tail -1)
+DELIVERED=$(( $(stat_field "$AFTER" delivered) - $(stat_field "$BEFORE" delivered) ))
+SYSCALLS=$(( $(stat_field "$AFTER" syscalls) - $(stat_field "$BEFORE" syscalls) ))
+
+echo "Receivers: $RECEIVERS ($PAUSED paused during the burst)"
+echo "Messages sent: $MESSAGES"
+echo "Messages delivered: $DELIVERED"
+echo "Send syscalls: $SYSCALLS"
+if [ $DELIVERED -gt 0 ]; then
+    echo "Syscalls per delivered message: $(awk "BEGIN { printf \"%.3f\", $SYSCALLS / $DELIVERED }")"
+fi
+
+for pid in "${CLIENT_PIDS[@]}"; do
+    kill -CONT $pid 2>/dev/null
+done
+# Job leaders are the server and the "sleep" feeding each receiver
+kill $(jobs -p) 2>/dev/null
+wait 2>/dev/null
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+# save as bench_faq.py
+# FAQ throughput benchmark: answers per second with micro-batching off and
+# on, and how long single answers took (p50/p99).
+#
+# Usage: python3 bench_faq.py [--url URL ...] [--clients N] [--questions N] [--batch N ...]
+#                             [--server-args "ARGS"]
+#   url          FAQ service to use, several for replicas (default http://127.0.0.1:5005/faq)
+#   clients      chat clients asking at the same time (default 8, max MAX_CLIENTS)
+#   questions    /faq questions each client pipelines (default 16)
+#   batch        --faq-batch values to compare (default 1 8 16; 1 = batching off)
+#   server-args  more ./server options, e.g. --server-args="--faq-hedge"
+#
+# Start gpt2_faq_bot.py (or faq_stub.py) first and build ./server. Each run
+# starts its own ./server on port 8080 in a scratch directory with the
+# answer cache disabled, so every question reaches the model.
+#
+# Tail latency with a replica that is sometimes slow, without and with hedging:
+#   python3 faq_stub.py --port 5006 --slow-rate 0.05 &
+#   python3 faq_stub.py --port 5007 &
+#   python3 bench_faq.py --url http://127.0.0.1:5006/faq http://127.0.0.1:5007/faq --batch 1
+#   python3 bench_faq.py --url http://127.0.0.1:5006/faq http://127.0.0.1:5007/faq --batch 1 \
+#       --server-args="--faq-hedge"
+
+import argparse
+import os
+import socket
+import struct
+import subprocess
+import tempfile
+import threading
+import time
+
+FRAME_HEADER = struct.Struct('>IBBH')   # Must match server.c
+FRAME_TEXT = 1
+
+
+def send_frame(sock, text, stream=0):
+    payload = text.encode()
+    sock.sendall(FRAME_HEADER.pack(len(payload), FRAME_TEXT, 0, stream) + payload)
+
+
+class FrameReader:
+    def __init__(self, sock, leftover=b''):
+        self.sock = sock
+        self.buf = leftover
+        self.stream = 0
+
+    def next_text(self):
+        """Next TEXT frame; its stream id is left in self.stream"""
+        while True:
+            if len(self.buf) >= FRAME_HEADER.size:
+                length, ftype, _, stream = FRAME_HEADER.unpack_from(self.buf)
+                if len(self.buf) >= FRAME_HEADER.size + length:
+                    payload = self.buf[FRAME_HEADER.size:FRAME_HEADER.size + length]
+                    self.buf = self.buf[FRAME_HEADER.size + length:]
+                    if ftype == FRAME_TEXT:
+                        self.stream = stream
+                        return payload.decode(errors='replace')
+                    continue
+            data = self.sock.recv(65536)
+            if not data:
+                raise ConnectionError('server closed the connection')
+            self.buf += data
+
+
+def connect(name):
+    sock = socket.create_connection(('127.0.0.1', 8080))
+    sock.settimeout(60)
+    buf = b''
+    sock.sendall(b'/proto framed')
+    while b'PROTO framed' not in buf:
+        buf += sock.recv(65536)
+    reader = FrameReader(sock, buf.split(b'PROTO framed', 1)[1])
+    send_frame(sock, f'/register {name} pw')
+    reader.next_text()
+    send_frame(sock, f'/login {name} pw')
+    while 'Login successful' not in reader.next_text():
+        pass
+    return sock, reader
+
+
+def ask_all(sock, reader, idx, count, done, latencies):
+    # Each question goes on its own stream, so answers can be matched up
+    sent = {}
+    for j in range(count):
+        sent[j + 1] = time.time()
+        send_frame(sock, f'/faq what is the meaning of question {idx}-{j}', stream=j + 1)
+    answered = 0
+    while answered < count:
+        if 'Bot:' in reader.next_text():
+            latencies.append(time.time() - sent.get(reader.stream, sent[1]))
+            answered += 1
+    done[idx] = time.time()
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def run(server, urls, batch, clients, questions, server_args):
+    workdir = tempfile.mkdtemp(prefix='bench_faq_')
+    cmd = [server, '--faq-batch', str(batch), '--faq-cache-ttl', '0'] + server_args
+    for url in urls:
+        cmd += ['--faq-url', url]
+    proc = subprocess.Popen(cmd, cwd=workdir, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        time.sleep(1)
+        conns = [connect(f'bench_faq{i}') for i in range(clients)]
+        done = [0.0] * clients
+        latencies = []
+        threads = [threading.Thread(target=ask_all, args=(s, r, i, questions, done, latencies))
+                   for i, (s, r) in enumerate(conns)]
+        start = time.time()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = max(done) - start
+
+        sock, reader = conns[0]
+        send_frame(sock, '/stats')
+        calls = '?'
+        for line in reader.next_text().splitlines():
+            if line.startswith('FAQ:'):
+                calls = line.split(' in ')[1].split()[0]
+        for s, _ in conns:
+            s.close()
+        return elapsed, calls, latencies
+    finally:
+        proc.terminate()
+        proc.wait()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='FAQ answers per second with batching off and on')
+    parser.add_argument('--url', nargs='+', default=['http://127.0.0.1:5005/faq'])
+    parser.add_argument('--clients', type=int, default=8)
+    parser.add_argument('--questions', type=int, default=16)
+    parser.add_argument('--batch', type=int, nargs='+', default=[1, 8, 16])
+    parser.add_argument('--server', default='./server')
+    parser.add_argument('--server-args', default='')
+    args = parser.parse_args()
+    server = os.path.abspath(args.server)
+
+    total = args.clients * args.questions
+    print(f'{total} questions from {args.clients} clients against {" ".join(args.url)} {args.server_args}')
+    print(f'{"batch":>6} {"calls":>7} {"seconds":>9} {"answers/s":>10} {"p50 ms":>8} {"p99 ms":>8}')
+    for batch in args.batch:
+        elapsed, calls, latencies = run(server, args.url, batch, args.clients, args.questions,
+                                        args.server_args.split())
+        print(f'{batch:>6} {calls:>7} {elapsed:>9.2f} {total / elapsed:>10.1f} '
+              f'{percentile(latencies, 50) * 1000:>8.0f} {percentile(latencies, 99) * 1000:>8.0f}')
+
+
+if __name__ == '__main__':
+    main()
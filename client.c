@@ -3,18 +3,619 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
 
 #define PORT 8080
 #define BUFFER_SIZE 2048
 #define DOWNLOAD_DIR "downloads"
 
+// Framed protocol, must match server.c
+#define FRAME_HEADER_SIZE 8
+#define MAX_FRAME_PAYLOAD 65536
+#define FRAME_TEXT 1
+#define FRAME_FILE_DATA 2
+#define FRAME_FILE_END 3
+#define FRAME_FILE_CHUNK 4
+#define FRAME_FLAG_ERROR 0x01
+#define FRAME_FLAG_MORE 0x02
+#define PROTO_FRAMED_ACK "PROTO framed"
+#define CHUNK_PREFIX_SIZE 12
+#define TRANSFER_CHUNK_SIZE 32768
+#define DOWNLOAD_STREAMS 4      // Ranges of one file fetched at once
+#define MAX_RANGES 16
+#define REPLY_TIMEOUT 10        // Seconds to wait for the answer to stat/putrange
+#define MAP_HEADER_LEN 33       // "<size> <crc32> <ranges>\n", fixed width
+#define MAP_RECORD_LEN 63       // "<start> <end> <done>\n", fixed width
+#define UPLOAD_NOTSENT_LOWAT (128 * 1024)   // Unsent file data allowed ahead of a chat line
+
+// Download in progress into downloads/<name>.part. Its .part.map file
+// records how far each range got, so getting the same file again after a
+// disconnect continues from there.
+typedef struct {
+    int fd;
+    int map_fd;
+    char filename[256];
+    long size;
+    uint32_t crc;
+    int ranges_left;        // Ranges still streaming
+    int failed;
+    long received;
+} download_t;
+
+// Upload running on its own thread, checksums included, so the prompt
+// stays free for chat while it runs
+typedef struct {
+    uint16_t stream;
+    char filename[256];
+} upload_t;
+
+// One range of a download, arriving as FILE_CHUNK frames on its stream
+typedef struct {
+    uint16_t stream;
+    download_t *dl;         // NULL when the slot is free
+    int record;             // Its line in the .part.map file
+    long start;
+    long end;
+    long done;              // Bytes from start already written
+} range_t;
+
 int sock = 0;
+int framed = 0;
+uint16_t next_stream = 1;
+pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;   // One frame at a time on the socket
+range_t ranges[MAX_RANGES];
+pthread_mutex_t ranges_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The answer to a stat/putrange, handed from the receiver thread to the
+// command waiting for it instead of being printed
+uint16_t reply_stream = 0;
+int reply_ready = 0;
+char reply_text[BUFFER_SIZE];
+pthread_mutex_t reply_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reply_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t request_mutex = PTHREAD_MUTEX_INITIALIZER;  // One stat/putrange waiting at a time
+
+uint32_t crc32_table[8][256];
+pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t bytes;
+    unsigned char block[64];
+    size_t fill;
+} sha256_t;
+
+// Bytes received right after the framing acknowledgement
+unsigned char early_input[BUFFER_SIZE];
+size_t early_len = 0;
 
 void *receive_handler(void *socket_desc);
 
+int send_all(const void *data, size_t len, int flags) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, flags);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int send_frame(uint8_t type, uint8_t flags, uint16_t stream, const void *payload, size_t len) {
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    hdr[0] = len >> 24;
+    hdr[1] = len >> 16;
+    hdr[2] = len >> 8;
+    hdr[3] = len;
+    hdr[4] = type;
+    hdr[5] = flags;
+    hdr[6] = stream >> 8;
+    hdr[7] = stream;
+    pthread_mutex_lock(&send_mutex);
+    int result = send_all(hdr, sizeof(hdr), len ? MSG_MORE : 0);
+    if (result == 0 && len) result = send_all(payload, len, 0);
+    pthread_mutex_unlock(&send_mutex);
+    return result;
+}
+
+// Send one command or chat line in whichever protocol is active
+int send_line(const char *line, uint16_t stream) {
+    if (framed) {
+        return send_frame(FRAME_TEXT, 0, stream, line, strlen(line));
+    }
+    return send(sock, line, strlen(line), 0) < 0 ? -1 : 0;
+}
+
+// Ask the server for the framed protocol. Anything before the
+// acknowledgement (the welcome text) is printed; anything after it is
+// kept for the receiver thread. Returns 0 if the server did not agree.
+int negotiate_framed() {
+    char reply[BUFFER_SIZE];
+    size_t len = 0;
+    struct timeval timeout = {3, 0};
+    struct timeval no_timeout = {0, 0};
+    int agreed = 0;
+
+    if (send(sock, "/proto framed", strlen("/proto framed"), 0) < 0) return 0;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (len < sizeof(reply) - 1) {
+        ssize_t n = recv(sock, reply + len, sizeof(reply) - 1 - len, 0);
+        if (n <= 0) break;
+        len += n;
+        reply[len] = '\0';
+
+        char *ack = strstr(reply, PROTO_FRAMED_ACK);
+        if (ack) {
+            size_t consumed = (ack - reply) + strlen(PROTO_FRAMED_ACK);
+            *ack = '\0';
+            if (ack > reply) printf("%s\n", reply);
+            early_len = len - consumed;
+            memcpy(early_input, reply + consumed, early_len);
+            agreed = 1;
+            break;
+        }
+        // An older server answers the unknown command like any other
+        if (strstr(reply, "Please login first")) break;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+
+    if (!agreed && len > 0) printf("%s\n", reply);
+    return agreed;
+}
+
+// CRC-32 (zlib polynomial), same as server.c
+void crc32_init_tables(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc32_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32_table[t][i] = (crc32_table[t - 1][i] >> 8) ^ crc32_table[0][crc32_table[t - 1][i] & 0xff];
+        }
+    }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    pthread_once(&crc32_once, crc32_init_tables);
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24) ^ crc;
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+              crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+              crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+              crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+int file_crc32(int fd, long size, uint32_t *crc) {
+    char buffer[8 * BUFFER_SIZE];
+    uint32_t sum = 0;
+
+    for (long offset = 0; offset < size; ) {
+        ssize_t got = pread(fd, buffer, sizeof(buffer), offset);
+        if (got <= 0) return -1;
+        sum = crc32_update(sum, buffer, got);
+        offset += got;
+    }
+    *crc = sum;
+    return 0;
+}
+
+// SHA-256, same as server.c; the server uses it to spot files it already has
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(sha256_t *s) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(s->state, initial, sizeof(initial));
+    s->bytes = 0;
+    s->fill = 0;
+}
+
+void sha256_block(sha256_t *s, const unsigned char *p) {
+    uint32_t w[64], v[8];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, s->state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = v[7] + (ROTR32(v[4], 6) ^ ROTR32(v[4], 11) ^ ROTR32(v[4], 25)) +
+                      ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR32(v[0], 2) ^ ROTR32(v[0], 13) ^ ROTR32(v[0], 22)) +
+                      ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) s->state[i] += v[i];
+}
+
+void sha256_update(sha256_t *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    s->bytes += len;
+    if (s->fill) {
+        size_t take = 64 - s->fill < len ? 64 - s->fill : len;
+        memcpy(s->block + s->fill, p, take);
+        s->fill += take;
+        p += take;
+        len -= take;
+        if (s->fill < 64) return;
+        sha256_block(s, s->block);
+        s->fill = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) sha256_block(s, p);
+    memcpy(s->block, p, len);
+    s->fill = len;
+}
+
+void sha256_final(sha256_t *s, unsigned char out[32]) {
+    uint64_t bits = s->bytes * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t pad_len = (s->fill < 56 ? 56 : 120) - s->fill;
+
+    for (int i = 0; i < 8; i++) pad[pad_len + i] = bits >> (56 - 8 * i);
+    sha256_update(s, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = s->state[i] >> 24;
+        out[4 * i + 1] = s->state[i] >> 16;
+        out[4 * i + 2] = s->state[i] >> 8;
+        out[4 * i + 3] = s->state[i];
+    }
+}
+
+void hex_encode(const unsigned char *in, size_t n, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < n; i++) {
+        out[2 * i] = digits[in[i] >> 4];
+        out[2 * i + 1] = digits[in[i] & 15];
+    }
+    out[2 * n] = '\0';
+}
+
+// CRC-32 and SHA-256 of a whole file in one read, for putrange
+int file_checksums(int fd, long size, uint32_t *crc, char sha_hex[65]) {
+    char buffer[8 * BUFFER_SIZE];
+    unsigned char sha[32];
+    uint32_t sum = 0;
+    sha256_t s;
+
+    sha256_init(&s);
+    for (long offset = 0; offset < size; ) {
+        ssize_t got = pread(fd, buffer, sizeof(buffer), offset);
+        if (got <= 0) return -1;
+        sum = crc32_update(sum, buffer, got);
+        sha256_update(&s, buffer, got);
+        offset += got;
+    }
+    sha256_final(&s, sha);
+    hex_encode(sha, 32, sha_hex);
+    *crc = sum;
+    return 0;
+}
+
+// Send a command whose answer comes back on its stream, and wait for it.
+// Callers on other threads (uploads) take turns. Returns -1 if the server
+// did not answer in time.
+int request_reply(const char *command, uint16_t stream, char *reply, size_t size) {
+    struct timespec deadline;
+    int result = 0;
+
+    pthread_mutex_lock(&request_mutex);
+    pthread_mutex_lock(&reply_mutex);
+    reply_stream = stream;
+    reply_ready = 0;
+    pthread_mutex_unlock(&reply_mutex);
+
+    if (send_line(command, stream) < 0) {
+        pthread_mutex_unlock(&request_mutex);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPLY_TIMEOUT;
+    pthread_mutex_lock(&reply_mutex);
+    while (!reply_ready && result == 0) {
+        result = pthread_cond_timedwait(&reply_cond, &reply_mutex, &deadline);
+    }
+    if (reply_ready) {
+        snprintf(reply, size, "%s", reply_text);
+        result = 0;
+    } else {
+        result = -1;
+    }
+    reply_stream = 0;
+    pthread_mutex_unlock(&reply_mutex);
+    pthread_mutex_unlock(&request_mutex);
+    return result;
+}
+
+// Framed upload: announce size and checksums with putrange, then send the
+// file as FILE_CHUNK frames from wherever the server says it has it up to.
+// Nothing is sent if the server already has the same content. The
+// server's verdict arrives later as a reply on the upload's stream.
+void *upload_thread(void *arg) {
+    upload_t *up = arg;
+    unsigned char payload[CHUNK_PREFIX_SIZE + TRANSFER_CHUNK_SIZE];
+    char command[BUFFER_SIZE];
+    char reply[BUFFER_SIZE];
+    char sha[65];
+    struct stat st;
+    uint32_t crc;
+    long offset;
+    int failed = 0;
+
+    int fd = open(up->filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || file_checksums(fd, st.st_size, &crc, sha) < 0) {
+        printf("Client: File '%s' not found.\n", up->filename);
+        goto done;
+    }
+    snprintf(command, sizeof(command), "putrange %ld %08x %s %s", (long)st.st_size, crc, sha, up->filename);
+    if (request_reply(command, up->stream, reply, sizeof(reply)) < 0) {
+        printf("Client: No answer from server for '%s'.\n", up->filename);
+        goto done;
+    }
+    if (strcmp(reply, "DEDUP") == 0) {
+        printf("Server already has the contents of '%s'; stored without uploading.\n", up->filename);
+        goto done;
+    }
+    if (sscanf(reply, "RESUME %ld", &offset) != 1) {
+        printf("%s\n", reply);
+        goto done;
+    }
+    if (offset > 0) {
+        printf("Resuming upload of '%s' at %ld of %ld bytes.\n", up->filename, offset, (long)st.st_size);
+    }
+
+    while (offset < st.st_size) {
+        ssize_t got = pread(fd, payload + CHUNK_PREFIX_SIZE, TRANSFER_CHUNK_SIZE, offset);
+        if (got <= 0) {
+            failed = 1;
+            break;
+        }
+        for (int i = 0; i < 8; i++) payload[i] = (uint64_t)offset >> (56 - 8 * i);
+        uint32_t chunk_crc = htonl(crc32_update(0, payload + CHUNK_PREFIX_SIZE, got));
+        memcpy(payload + 8, &chunk_crc, 4);
+        if (send_frame(FRAME_FILE_CHUNK, 0, up->stream, payload, CHUNK_PREFIX_SIZE + got) < 0) {
+            printf("Client: Upload of '%s' was cut off.\n", up->filename);
+            goto done;
+        }
+        offset += got;
+    }
+    send_frame(FRAME_FILE_END, failed ? FRAME_FLAG_ERROR : 0, up->stream, NULL, 0);
+done:
+    if (fd >= 0) close(fd);
+    free(up);
+    return NULL;
+}
+
+void handle_framed_put(char *filename) {
+    upload_t *up = calloc(1, sizeof(upload_t));
+    pthread_t tid;
+
+    if (up == NULL) return;
+    up->stream = next_stream++;
+    snprintf(up->filename, sizeof(up->filename), "%s", filename);
+    if (pthread_create(&tid, NULL, upload_thread, up) != 0) {
+        perror("Client: Could not start upload");
+        free(up);
+        return;
+    }
+    pthread_detach(tid);
+    printf("Uploading '%s' in the background.\n", filename);
+}
+
+void write_map_record(range_t *r) {
+    char record[MAP_RECORD_LEN + 1];
+    snprintf(record, sizeof(record), "%020ld %020ld %020ld\n", r->start, r->end, r->done);
+    if (pwrite(r->dl->map_fd, record, MAP_RECORD_LEN, MAP_HEADER_LEN + (off_t)r->record * MAP_RECORD_LEN) < 0) {
+        perror("Client: Failed to save download progress");
+    }
+}
+
+// Ranges left over from an earlier attempt at the same file (same size and
+// checksum), or -1 if there is nothing to resume
+int load_download_map(int map_fd, long size, uint32_t crc, range_t *plan) {
+    char text[MAP_HEADER_LEN + DOWNLOAD_STREAMS * MAP_RECORD_LEN + 1];
+    long map_size;
+    unsigned map_crc;
+    int count;
+
+    ssize_t len = pread(map_fd, text, sizeof(text) - 1, 0);
+    if (len < MAP_HEADER_LEN) return -1;
+    text[len] = '\0';
+    if (sscanf(text, "%ld %x %d", &map_size, &map_crc, &count) != 3 || map_size != size ||
+        map_crc != crc || count < 1 || count > DOWNLOAD_STREAMS ||
+        len < MAP_HEADER_LEN + count * MAP_RECORD_LEN) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        plan[i].record = i;
+        if (sscanf(text + MAP_HEADER_LEN + i * MAP_RECORD_LEN, "%ld %ld %ld",
+                   &plan[i].start, &plan[i].end, &plan[i].done) != 3) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+// All ranges are in: check the whole file against the server's CRC-32
+void finish_download(download_t *dl) {
+    char partpath[512], mappath[512], filepath[512];
+    uint32_t crc;
+
+    snprintf(filepath, sizeof(filepath), "%s/%s", DOWNLOAD_DIR, dl->filename);
+    snprintf(partpath, sizeof(partpath), "%s/%s.part", DOWNLOAD_DIR, dl->filename);
+    snprintf(mappath, sizeof(mappath), "%s/%s.part.map", DOWNLOAD_DIR, dl->filename);
+
+    if (dl->failed) {
+        printf("\rDownload of '%s' stopped; get it again to resume.\n> ", dl->filename);
+    } else if (file_crc32(dl->fd, dl->size, &crc) < 0 || crc != dl->crc) {
+        unlink(partpath);
+        unlink(mappath);
+        printf("\rFile '%s' failed verification and was discarded.\n> ", dl->filename);
+    } else if (rename(partpath, filepath) < 0) {
+        perror("Client: Failed to store download");
+    } else {
+        unlink(mappath);
+        printf("\rFile '%s' downloaded and verified to '%s' folder (%ld bytes, CRC-32 %08x).\n> ",
+               dl->filename, DOWNLOAD_DIR, dl->size, crc);
+    }
+    fflush(stdout);
+    close(dl->fd);
+    close(dl->map_fd);
+    free(dl);
+}
+
+// Framed download: stat for size and checksum, then fetch the file as up
+// to DOWNLOAD_STREAMS ranges at once, each on its own stream. The receiver
+// thread writes chunks as they arrive, so chat keeps flowing meanwhile.
+void handle_framed_get(char *filename) {
+    char command[BUFFER_SIZE];
+    char reply[BUFFER_SIZE];
+    char partpath[512], mappath[512];
+    range_t plan[DOWNLOAD_STREAMS];
+    long size;
+    unsigned crc;
+
+    uint16_t stream = next_stream++;
+    snprintf(command, sizeof(command), "stat %s", filename);
+    if (request_reply(command, stream, reply, sizeof(reply)) < 0) {
+        printf("Client: No answer from server for '%s'.\n", filename);
+        return;
+    }
+    if (sscanf(reply, "FILE %ld %x", &size, &crc) != 2) {
+        printf("%s\n", reply);
+        return;
+    }
+
+    download_t *dl = calloc(1, sizeof(download_t));
+    if (dl == NULL) return;
+    mkdir(DOWNLOAD_DIR, 0777);
+    snprintf(partpath, sizeof(partpath), "%s/%s.part", DOWNLOAD_DIR, filename);
+    snprintf(mappath, sizeof(mappath), "%s/%s.part.map", DOWNLOAD_DIR, filename);
+    dl->fd = open(partpath, O_RDWR | O_CREAT, 0666);
+    dl->map_fd = open(mappath, O_RDWR | O_CREAT, 0666);
+    if (dl->fd < 0 || dl->map_fd < 0) {
+        perror("Client: Failed to create file");
+        if (dl->fd >= 0) close(dl->fd);
+        if (dl->map_fd >= 0) close(dl->map_fd);
+        free(dl);
+        return;
+    }
+    snprintf(dl->filename, sizeof(dl->filename), "%s", filename);
+    dl->size = size;
+    dl->crc = crc;
+
+    int count = load_download_map(dl->map_fd, size, crc, plan);
+    long have = 0;
+    if (count > 0) {
+        for (int i = 0; i < count; i++) have += plan[i].done;
+    } else {
+        // Fresh start: equal whole-chunk ranges
+        char header[64];
+        long chunks = (size + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE;
+        count = chunks < DOWNLOAD_STREAMS ? (chunks > 0 ? (int)chunks : 1) : DOWNLOAD_STREAMS;
+        long per = (chunks + count - 1) / count * TRANSFER_CHUNK_SIZE;
+        for (int i = 0; i < count; i++) {
+            plan[i].record = i;
+            plan[i].start = i * per < size ? i * per : size;
+            plan[i].end = (i + 1) * per < size ? (i + 1) * per : size;
+            plan[i].done = 0;
+        }
+        if (ftruncate(dl->fd, 0) < 0 || ftruncate(dl->map_fd, 0) < 0) perror("Client: Failed to reset download");
+        snprintf(header, sizeof(header), "%020ld %08x %02d\n", size, crc, count);
+        if (pwrite(dl->map_fd, header, MAP_HEADER_LEN, 0) < 0) perror("Client: Failed to save download progress");
+    }
+    dl->received = have;
+
+    // Claim a slot per unfinished range before asking for any of them
+    range_t *claimed[DOWNLOAD_STREAMS];
+    int wanted = 0, got = 0;
+    pthread_mutex_lock(&ranges_mutex);
+    for (int i = 0; i < count; i++) {
+        if (plan[i].done >= plan[i].end - plan[i].start) continue;
+        wanted++;
+        for (int j = 0; j < MAX_RANGES; j++) {
+            if (ranges[j].dl == NULL) {
+                ranges[j] = plan[i];
+                ranges[j].dl = dl;
+                ranges[j].stream = next_stream++;
+                claimed[got++] = &ranges[j];
+                write_map_record(&ranges[j]);
+                break;
+            }
+        }
+    }
+    if (got < wanted) {
+        for (int i = 0; i < got; i++) claimed[i]->dl = NULL;
+        pthread_mutex_unlock(&ranges_mutex);
+        printf("Client: Too many downloads in progress.\n");
+        close(dl->fd);
+        close(dl->map_fd);
+        free(dl);
+        return;
+    }
+    dl->ranges_left = got;
+    // Copy what to ask for while the slots are still ours to read
+    long asks[DOWNLOAD_STREAMS][2];
+    uint16_t streams[DOWNLOAD_STREAMS];
+    for (int i = 0; i < got; i++) {
+        asks[i][0] = claimed[i]->start + claimed[i]->done;
+        asks[i][1] = claimed[i]->end - asks[i][0];
+        streams[i] = claimed[i]->stream;
+    }
+    pthread_mutex_unlock(&ranges_mutex);
+
+    if (got == 0) {
+        finish_download(dl);
+        return;
+    }
+    if (have > 0) {
+        printf("Resuming '%s': %ld of %ld bytes already here, %d streams.\n", filename, have, size, got);
+    } else {
+        printf("Downloading '%s' (%ld bytes) over %d streams.\n", filename, size, got);
+    }
+    for (int i = 0; i < got; i++) {
+        snprintf(command, sizeof(command), "getrange %ld %ld %s", asks[i][0], asks[i][1], filename);
+        send_line(command, streams[i]);
+    }
+}
+
 void handle_file_put(char* filename) {
     char command[BUFFER_SIZE];
     snprintf(command, sizeof(command), "put %s", filename);
@@ -96,9 +697,11 @@ void handle_file_get(char* filename) {
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <server_ip> [--text]\n", argv[0]);
+        fprintf(stderr, "  --text   use the original unframed protocol\n");
         exit(EXIT_FAILURE);
     }
+    int want_framed = !(argc > 2 && strcmp(argv[2], "--text") == 0);
 
     struct sockaddr_in server_address;
     sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -117,11 +720,26 @@ int main(int argc, char *argv[]) {
     }
     
     printf("Connected to server!\n");
+    if (want_framed) {
+        framed = negotiate_framed();
+        printf(framed ? "Using framed protocol.\n" : "Server does not support framing, using text protocol.\n");
+        if (framed) {
+            // Keep background uploads from piling megabytes into the
+            // socket ahead of what gets typed
+            int lowat = UPLOAD_NOTSENT_LOWAT;
+            setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+        }
+    }
     printf("Commands:\n");
     printf("  /login <username> <password>  - Login to your account\n");
     printf("  /register <username> <password> - Create new account\n");
-    printf("  /msg <username> <message>     - Send private message\n");
-    printf("  /users                        - List online users\n");
+    printf("  /msg <username> <message>     - Send private message (saved if offline)\n");
+    printf("  /users [page]                 - List online users\n");
+    printf("  /presence on|off              - Batched login/logout updates\n");
+    printf("  /join <channel>               - Talk in a channel\n");
+    printf("  /leave [channel]              - Leave a channel\n");
+    printf("  /channels                     - List channels\n");
+    printf("  /history [n|30m|HH:MM]        - Show recent messages\n");
     printf("  put <filename>                - Upload file\n");
     printf("  get <filename>                - Download file\n");
     printf("  exit                          - Quit\n");
@@ -142,7 +760,11 @@ int main(int argc, char *argv[]) {
 
         if (strlen(message) == 0) continue;
 
-        if (strncmp(message, "put ", 4) == 0) {
+        if (framed && strncmp(message, "put ", 4) == 0) {
+            handle_framed_put(message + 4);
+        } else if (framed && strncmp(message, "get ", 4) == 0) {
+            handle_framed_get(message + 4);
+        } else if (strncmp(message, "put ", 4) == 0) {
             handle_file_put(message + 4);
         } else if (strncmp(message, "get ", 4) == 0) {
             pthread_cancel(recv_thread);
@@ -155,7 +777,9 @@ int main(int argc, char *argv[]) {
                 break;
             }
         } else {
-             if (send(sock, message, strlen(message), 0) < 0) {
+             // Each /faq gets its own stream so streamed answers stay apart
+             uint16_t stream = strncmp(message, "/faq ", 5) == 0 ? next_stream++ : 0;
+             if (send_line(message, stream) < 0) {
                 perror("Send failed");
                 break;
             }
@@ -172,11 +796,151 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
+int partial_stream = -1;      // Stream whose text line is still open, or -1
+
+range_t *find_range(uint16_t stream) {
+    for (int i = 0; i < MAX_RANGES; i++) {
+        if (ranges[i].dl && ranges[i].stream == stream) return &ranges[i];
+    }
+    return NULL;
+}
+
+// Release a range's slot. Returns its download once no range of it is
+// left, for the caller to finish outside ranges_mutex.
+download_t *end_range(range_t *r, const char *error) {
+    download_t *dl = r->dl;
+
+    if (error) {
+        printf("\rDownload of '%s' bytes %ld-%ld: %s.\n> ", dl->filename, r->start, r->end, error);
+        fflush(stdout);
+        dl->failed = 1;
+    }
+    r->dl = NULL;
+    return --dl->ranges_left == 0 ? dl : NULL;
+}
+
+// FILE_CHUNK: verify its checksum and that it continues the range, then
+// write it in place and record the progress
+download_t *handle_chunk(range_t *r, unsigned char *payload, size_t len) {
+    uint64_t offset = 0;
+    uint32_t crc;
+
+    if (len < CHUNK_PREFIX_SIZE) return end_range(r, "malformed chunk");
+    for (int i = 0; i < 8; i++) offset = offset << 8 | payload[i];
+    memcpy(&crc, payload + 8, 4);
+    len -= CHUNK_PREFIX_SIZE;
+    payload += CHUNK_PREFIX_SIZE;
+
+    if ((long)offset != r->start + r->done || r->done + (long)len > r->end - r->start) {
+        return end_range(r, "chunk out of order");
+    }
+    if (crc32_update(0, payload, len) != ntohl(crc)) return end_range(r, "chunk checksum mismatch");
+    if (pwrite(r->dl->fd, payload, len, offset) != (ssize_t)len) return end_range(r, "write failed");
+    r->done += len;
+    r->dl->received += len;
+    write_map_record(r);
+    return NULL;
+}
+
+void handle_frame(uint8_t type, uint8_t flags, uint16_t stream, unsigned char *payload, size_t len) {
+    download_t *finished = NULL;
+    range_t *r;
+
+    switch (type) {
+    case FRAME_TEXT:
+        pthread_mutex_lock(&reply_mutex);
+        if (stream && stream == reply_stream && !reply_ready) {
+            snprintf(reply_text, sizeof(reply_text), "%.*s", (int)len, (char *)payload);
+            reply_ready = 1;
+            pthread_cond_signal(&reply_cond);
+            pthread_mutex_unlock(&reply_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&reply_mutex);
+        // Streamed text (FAQ answers) arrives in pieces flagged MORE and is
+        // printed as it comes; the last piece ends the line
+        if (partial_stream >= 0 && partial_stream != stream) {
+            printf("\n");
+            partial_stream = -1;
+        }
+        printf("%s%.*s", partial_stream < 0 ? "\r" : "", (int)len, (char *)payload);
+        if (flags & FRAME_FLAG_MORE) {
+            partial_stream = stream;
+        } else {
+            printf("\n> ");
+            partial_stream = -1;
+        }
+        fflush(stdout);
+        break;
+    case FRAME_FILE_CHUNK:
+        pthread_mutex_lock(&ranges_mutex);
+        r = find_range(stream);
+        if (r) finished = handle_chunk(r, payload, len);
+        pthread_mutex_unlock(&ranges_mutex);
+        break;
+    case FRAME_FILE_END:
+        pthread_mutex_lock(&ranges_mutex);
+        r = find_range(stream);
+        if (r && (flags & FRAME_FLAG_ERROR)) {
+            char error[256];
+            snprintf(error, sizeof(error), "%.*s", (int)len, (char *)payload);
+            finished = end_range(r, error);
+        } else if (r) {
+            finished = end_range(r, r->done == r->end - r->start ? NULL : "range ended early");
+        }
+        pthread_mutex_unlock(&ranges_mutex);
+        break;
+    }
+    if (finished) finish_download(finished);
+}
+
+// Framed receiver: several frames may arrive in one recv(), or one frame
+// across several.
+void framed_receive_loop() {
+    static unsigned char buffer[FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD];
+    size_t len = early_len;
+    ssize_t bytes_received;
+
+    memcpy(buffer, early_input, early_len);
+    while (1) {
+        size_t pos = 0;
+        while (len - pos >= FRAME_HEADER_SIZE) {
+            unsigned char *hdr = buffer + pos;
+            uint32_t length = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) |
+                              ((uint32_t)hdr[2] << 8) | hdr[3];
+            if (length > MAX_FRAME_PAYLOAD) {
+                printf("\rProtocol error: oversized frame from server.\n");
+                close(sock);
+                exit(1);
+            }
+            if (len - pos < FRAME_HEADER_SIZE + length) break;
+            handle_frame(hdr[4], hdr[5], (hdr[6] << 8) | hdr[7], hdr + FRAME_HEADER_SIZE, length);
+            pos += FRAME_HEADER_SIZE + length;
+        }
+        memmove(buffer, buffer + pos, len - pos);
+        len -= pos;
+
+        bytes_received = recv(sock, buffer + len, sizeof(buffer) - len, 0);
+        if (bytes_received <= 0) break;
+        len += bytes_received;
+    }
+
+    printf("\rServer disconnected. Press Enter to exit.\n");
+    fflush(stdout);
+    close(sock);
+    exit(0);
+}
+
 void *receive_handler(void *socket_desc) {
     char server_reply[BUFFER_SIZE];
     ssize_t bytes_received;
 
-    while ((bytes_received = recv(sock, server_reply, BUFFER_SIZE, 0)) > 0) {
+    if (framed) {
+        framed_receive_loop();
+        return NULL;
+    }
+
+    while ((bytes_received = recv(sock, server_reply, BUFFER_SIZE - 1, 0)) > 0) {
         server_reply[bytes_received] = '\0';
         printf("\r%s\n> ", server_reply);
         fflush(stdout);
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+# save as faq_stub.py
+# Stand-in for gpt2_faq_bot.py that answers instantly or as badly as you ask
+# it to, for testing the server's FAQ timeouts, hedging and circuit breaker.
+#
+# Usage: python3 faq_stub.py [--port N] [--delay MS] [--jitter MS]
+#                            [--slow-rate P] [--slow-delay MS] [--fail-rate P]
+#   port        port to listen on (default 5005)
+#   delay       time every answer takes (default 100)
+#   jitter      up to this much extra, uniformly random (default 0)
+#   slow-rate   share of answers that take --slow-delay instead (default 0)
+#   slow-delay  how long a slow answer takes (default 3000)
+#   fail-rate   share of requests answered with HTTP 503 (default 0)
+#
+# The same settings can be changed while it runs, e.g. to take it down
+# and bring it back:
+#   curl -d '{"fail_rate": 1}' http://127.0.0.1:5005/admin
+#   curl -d '{"fail_rate": 0, "delay": 50}' http://127.0.0.1:5005/admin
+# "hang": true makes every request wait until hang is switched off again.
+
+import argparse
+import json
+import random
+import threading
+import time
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
+
+settings = {}
+settings_lock = threading.Lock()
+served = {'requests': 0, 'failed': 0, 'slow': 0}
+
+
+def answer_for(question):
+    return f'Stub Bot: an answer to "{question}"'
+
+
+class StubHandler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'   # Keep-alive, like the real bot
+    disable_nagle_algorithm = True  # Headers and body go out as separate writes
+
+    def reply(self, status, body=b'', content_type='application/json'):
+        self.send_response(status)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def wait_like_a_model(self, items):
+        with settings_lock:
+            s = dict(settings)
+            served['requests'] += 1
+        while s['hang']:
+            time.sleep(0.05)
+            with settings_lock:
+                s = dict(settings)
+        if random.random() < s['fail_rate']:
+            with settings_lock:
+                served['failed'] += 1
+            return False
+        if random.random() < s['slow_rate']:
+            with settings_lock:
+                served['slow'] += 1
+            delay = s['slow_delay']
+        else:
+            delay = s['delay'] + random.uniform(0, s['jitter'])
+        time.sleep(delay * (1 + 0.05 * (items - 1)) / 1000)
+        return True
+
+    def do_POST(self):
+        length = int(self.headers.get('Content-Length', 0))
+        try:
+            data = json.loads(self.rfile.read(length) or b'{}')
+        except ValueError:
+            return self.reply(400, b'{"error": "bad json"}')
+
+        if self.path == '/admin':
+            with settings_lock:
+                settings.update({k: v for k, v in data.items() if k in settings})
+                body = json.dumps(dict(settings, **served)).encode()
+            print(f'settings now {settings}')
+            return self.reply(200, body)
+
+        if self.path == '/faq':
+            if not self.wait_like_a_model(1):
+                return self.reply(503, b'{"error": "injected failure"}')
+            return self.reply(200, json.dumps({'answer': answer_for(data.get('question', ''))}).encode())
+
+        if self.path == '/faq/batch':
+            questions = data.get('questions', [])
+            if not self.wait_like_a_model(len(questions)):
+                return self.reply(503, b'{"error": "injected failure"}')
+            return self.reply(200, json.dumps({'answers': [answer_for(q) for q in questions]}).encode())
+
+        if self.path == '/faq/stream':
+            if not self.wait_like_a_model(1):
+                return self.reply(503, b'{"error": "injected failure"}')
+            self.send_response(200)
+            self.send_header('Content-Type', 'text/event-stream')
+            self.send_header('Transfer-Encoding', 'chunked')
+            self.end_headers()
+            for word in answer_for(data.get('question', '')).split(' '):
+                event = ('data: ' + json.dumps({'token': word + ' '}) + '\n\n').encode()
+                self.wfile.write(b'%x\r\n%s\r\n' % (len(event), event))
+                self.wfile.flush()
+            done = b'data: {"done": true}\n\n'
+            self.wfile.write(b'%x\r\n%s\r\n0\r\n\r\n' % (len(done), done))
+            return
+
+        self.reply(404)
+
+    def do_GET(self):
+        if self.path == '/admin':
+            with settings_lock:
+                return self.reply(200, json.dumps(dict(settings, **served)).encode())
+        self.reply(404)
+
+    def log_message(self, *args):
+        pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description='FAQ service stub with injectable delays and failures')
+    parser.add_argument('--port', type=int, default=5005)
+    parser.add_argument('--delay', type=float, default=100)
+    parser.add_argument('--jitter', type=float, default=0)
+    parser.add_argument('--slow-rate', type=float, default=0)
+    parser.add_argument('--slow-delay', type=float, default=3000)
+    parser.add_argument('--fail-rate', type=float, default=0)
+    args = parser.parse_args()
+
+    settings.update(delay=args.delay, jitter=args.jitter, slow_rate=args.slow_rate,
+                    slow_delay=args.slow_delay, fail_rate=args.fail_rate, hang=False)
+    print(f'FAQ stub on port {args.port}: {settings}')
+    ThreadingHTTPServer(('127.0.0.1', args.port), StubHandler).serve_forever()
+
+
+if __name__ == '__main__':
+    main()
@@ -1,5 +1,9 @@
-from flask import Flask, request, jsonify
-from transformers import GPT2LMHeadModel, GPT2Tokenizer
+from flask import Flask, request, jsonify, Response
+from werkzeug.serving import WSGIRequestHandler
+from transformers import GPT2LMHeadModel, GPT2Tokenizer, TextIteratorStreamer
+from threading import Thread
+import json
+import os
 import torch
 import re
 
@@ -9,16 +13,29 @@ print("Loading GPT-2 model...")
 tokenizer = GPT2Tokenizer.from_pretrained("gpt2")
 model = GPT2LMHeadModel.from_pretrained("gpt2")
 tokenizer.pad_token = tokenizer.eos_token
+tokenizer.padding_side = "left"  # Batched generation continues after the prompt
 print("GPT-2 model loaded successfully!")
 
-# PROJECT KNOWLEDGE (for project-specific questions)
-PROJECT_KNOWLEDGE = {
-    "how to run": "FAQ Bot: To run this chat server project:\n1. gcc server.c -o server -lpthread -lcurl -ljson-c\n2. gcc client.c -o client -lpthread\n3. ./server (start server)\n4. ./client 127.0.0.1 (connect client)",
-    "compile": "FAQ Bot: Compilation steps:\n• Install: sudo apt install libcurl4-openssl-dev libjson-c-dev\n• Server: gcc server.c -o server -lpthread -lcurl -ljson-c\n• Client: gcc client.c -o client -lpthread",
-    "features": "FAQ Bot: Project Features:\n• Multi-threading (50 concurrent users)\n• User authentication (register/login)\n• Private messaging (/msg username)\n• File transfer (put/get commands)\n• Memory efficient (7KB per client)\n• AI-powered FAQ bot (that's me!)",
-    "difficulty": "FAQ Bot: Project Difficulty:\n• Level: Intermediate to Advanced\n• Skills needed: C programming, socket programming, multi-threading",
-    "commands": "FAQ Bot: Available Commands:\n• /login, /register, /msg, /users, /faq, put, get"
-}
+# PROJECT KNOWLEDGE (for project-specific questions), shared with the chat
+# server: keyword (first Q of each entry) -> answer
+def load_project_knowledge(path):
+    knowledge = {}
+    try:
+        with open(path, encoding="utf-8") as f:
+            entries = f.read().split("\n\n")
+    except OSError as e:
+        print(f"⚠️ No project knowledge: {e}")
+        return knowledge
+    for entry in entries:
+        lines = [l for l in entry.splitlines() if not l.startswith("#")]
+        questions = [l[2:].strip().lower() for l in lines if l.startswith("Q:")]
+        answers = [l[2:].strip().replace("\\n", "\n") for l in lines if l.startswith("A:")]
+        if questions and answers:
+            knowledge[questions[0]] = answers[0]
+    return knowledge
+
+PROJECT_KNOWLEDGE = load_project_knowledge(
+    os.path.join(os.path.dirname(os.path.abspath(__file__)), "faq_corpus.txt"))
 
 def get_project_response(question):
     """Check if question is about the project"""
@@ -35,26 +52,67 @@ def get_project_response(question):
     
     return None
 
+def build_prompt(question):
+    """Better prompt engineering for different question types"""
+    if "what is" in question.lower():
+        return f"Q: {question}\nA: {question.split('what is')[-1].strip().title()} is"
+    elif "explain" in question.lower():
+        return f"Question: {question}\nExplanation:"
+    elif "how are you" in question.lower():
+        return "Human: How are you?\nAI: I am"
+    elif "tell me" in question.lower():
+        return f"Human: {question}\nAI:"
+    elif "joke" in question.lower():
+        return "Human: Tell me a joke\nAI: Here's a joke:"
+    elif "name" in question.lower():
+        return "Human: What is your name?\nAI: My name is"
+    else:
+        return f"Human: {question}\nAI:"
+
+# Sampling settings shared by single and batched generation
+GENERATE_ARGS = dict(
+    num_return_sequences=1,
+    temperature=0.8,  # Control randomness
+    top_k=50,        # Limit vocabulary
+    top_p=0.95,      # Nucleus sampling
+    do_sample=True,
+    pad_token_id=tokenizer.eos_token_id,
+    repetition_penalty=1.2,  # Reduce repetition
+    no_repeat_ngram_size=2   # Avoid repeating phrases
+)
+
+def clean_generated(generated_text):
+    """Turn raw GPT-2 output into a one-sentence answer"""
+    print(f"🔥 Raw GPT-2 output: {generated_text}")
+    
+    # Clean up the response
+    if generated_text:
+        # Take the first complete sentence
+        sentences = re.split(r'[.!?]+', generated_text)
+        if sentences:
+            clean_response = sentences[0].strip()
+            
+            # Remove unwanted patterns
+            clean_response = re.sub(r'(Human|AI|Assistant|User):', '', clean_response)
+            clean_response = re.sub(r'\n.*', '', clean_response, flags=re.DOTALL)
+            clean_response = clean_response.strip()
+            
+            # Ensure it's reasonable length and content
+            if 5 < len(clean_response) < 200:
+                # Add proper ending if missing
+                if not clean_response.endswith(('.', '!', '?')):
+                    clean_response += '.'
+                
+                return f"GPT-2 Bot: {clean_response}"
+    
+    # Fallback if GPT-2 output is too weird
+    return "GPT-2 Bot: I'm still learning to answer that properly. Try asking something simpler!"
+
 def generate_real_gpt2_response(question):
     """Generate ACTUAL GPT-2 responses with better prompting"""
     try:
         print(f"🤖 Using REAL GPT-2 for: {question}")
-        
-        # Better prompt engineering for different question types
-        if "what is" in question.lower():
-            prompt = f"Q: {question}\nA: {question.split('what is')[-1].strip().title()} is"
-        elif "explain" in question.lower():
-            prompt = f"Question: {question}\nExplanation:"
-        elif "how are you" in question.lower():
-            prompt = "Human: How are you?\nAI: I am"
-        elif "tell me" in question.lower():
-            prompt = f"Human: {question}\nAI:"
-        elif "joke" in question.lower():
-            prompt = "Human: Tell me a joke\nAI: Here's a joke:"
-        elif "name" in question.lower():
-            prompt = "Human: What is your name?\nAI: My name is"
-        else:
-            prompt = f"Human: {question}\nAI:"
+        prompt = build_prompt(question)
         
         # Tokenize input
         inputs = tokenizer.encode(prompt, return_tensors="pt", max_length=100, truncation=True)
@@ -64,50 +122,43 @@ def generate_real_gpt2_response(question):
             outputs = model.generate(
                 inputs,
                 max_length=inputs.shape[1] + 30,  # Generate 30 new tokens
-                num_return_sequences=1,
-                temperature=0.8,  # Control randomness
-                top_k=50,        # Limit vocabulary
-                top_p=0.95,      # Nucleus sampling
-                do_sample=True,
-                pad_token_id=tokenizer.eos_token_id,
-                repetition_penalty=1.2,  # Reduce repetition
-                no_repeat_ngram_size=2   # Avoid repeating phrases
+                **GENERATE_ARGS
             )
         
         # Decode the response
         full_response = tokenizer.decode(outputs[0], skip_special_tokens=True)
         
         # Extract only the generated part
-        generated_text = full_response[len(prompt):].strip()
+        return clean_generated(full_response[len(prompt):].strip())
         
-        print(f"🔥 Raw GPT-2 output: {generated_text}")
+    except Exception as e:
+        print(f"❌ GPT-2 Error: {e}")
+        return "GPT-2 Bot: I'm having trouble processing that question right now."
+
+def generate_real_gpt2_batch(questions):
+    """Answer several questions with ONE padded, batched generate call"""
+    try:
+        print(f"🤖 Using REAL GPT-2 for a batch of {len(questions)}")
+        prompts = [build_prompt(q) for q in questions]
         
-        # Clean up the response
-        if generated_text:
-            # Take the first complete sentence
-            sentences = re.split(r'[.!?]+', generated_text)
-            if sentences:
-                clean_response = sentences[0].strip()
-                
-                # Remove unwanted patterns
-                clean_response = re.sub(r'(Human|AI|Assistant|User):', '', clean_response)
-                clean_response = re.sub(r'\n.*', '', clean_response, flags=re.DOTALL)
-                clean_response = clean_response.strip()
-                
-                # Ensure it's reasonable length and content
-                if 5 < len(clean_response) < 200:
-                    # Add proper ending if missing
-                    if not clean_response.endswith(('.', '!', '?')):
-                        clean_response += '.'
-                    
-                    return f"GPT-2 Bot: {clean_response}"
+        # Left padding keeps every prompt flush against its generated tokens
+        inputs = tokenizer(prompts, return_tensors="pt", padding=True, max_length=100, truncation=True)
+        prompt_len = inputs["input_ids"].shape[1]
+        
+        with torch.no_grad():
+            outputs = model.generate(
+                inputs["input_ids"],
+                attention_mask=inputs["attention_mask"],
+                max_length=prompt_len + 30,  # Generate 30 new tokens
+                **GENERATE_ARGS
+            )
         
-        # Fallback if GPT-2 output is too weird
-        return "GPT-2 Bot: I'm still learning to answer that properly. Try asking something simpler!"
+        return [clean_generated(tokenizer.decode(output[prompt_len:], skip_special_tokens=True).strip())
+                for output in outputs]
         
     except Exception as e:
         print(f"❌ GPT-2 Error: {e}")
-        return "GPT-2 Bot: I'm having trouble processing that question right now."
+        return ["GPT-2 Bot: I'm having trouble processing that question right now."] * len(questions)
 
 @app.route('/faq', methods=['POST'])
 def faq():
@@ -134,8 +185,97 @@ def faq():
     except Exception as e:
         return jsonify({'answer': f'FAQ Bot: Error - {str(e)}'})
 
+@app.route('/faq/batch', methods=['POST'])
+def faq_batch():
+    """Answer a batch of questions collected by the chat server"""
+    data = request.get_json(silent=True) or {}
+    questions = [str(q).strip() for q in data.get('questions', [])]
+    try:
+        answers = [None] * len(questions)
+        print(f"📥 Batch of {len(questions)} questions received")
+        
+        # Project questions and empty ones never reach the model
+        model_questions = []
+        for i, question in enumerate(questions):
+            if not question:
+                answers[i] = 'FAQ Bot: Please ask a question!'
+            else:
+                answers[i] = get_project_response(question)
+                if answers[i] is None:
+                    model_questions.append(i)
+        
+        if model_questions:
+            generated = generate_real_gpt2_batch([questions[i] for i in model_questions])
+            for i, answer in zip(model_questions, generated):
+                answers[i] = answer
+        
+        return jsonify({'answers': answers})
+        
+    except Exception as e:
+        return jsonify({'answers': [f'FAQ Bot: Error - {str(e)}'] * len(questions)})
+
+def sse(event):
+    """One server-sent event carrying a JSON object"""
+    return f"data: {json.dumps(event)}\n\n"
+
+def stream_real_gpt2_response(question):
+    """Yield the answer piece by piece while GPT-2 is still generating"""
+    print(f"🤖 Streaming REAL GPT-2 for: {question}")
+    prompt = build_prompt(question)
+    inputs = tokenizer.encode(prompt, return_tensors="pt", max_length=100, truncation=True)
+    streamer = TextIteratorStreamer(tokenizer, skip_prompt=True, skip_special_tokens=True)
+    
+    def generate():
+        with torch.no_grad():
+            model.generate(inputs, max_length=inputs.shape[1] + 30, streamer=streamer, **GENERATE_ARGS)
+    Thread(target=generate, daemon=True).start()
+    
+    # Same shape as clean_generated(): the first sentence, without role labels
+    prefix = "GPT-2 Bot: "
+    sent = 0
+    for text in streamer:
+        text = re.sub(r'(Human|AI|Assistant|User):', '', text)
+        end = re.search(r'[.!?\n]', text)
+        piece = text[:end.end()] if end else text
+        if sent == 0:
+            piece = piece.lstrip()
+        if piece.strip() or sent:
+            yield prefix + piece if sent == 0 else piece
+            prefix = ""
+            sent += len(piece)
+        if end:
+            break
+    if sent == 0:
+        yield "GPT-2 Bot: I'm still learning to answer that properly. Try asking something simpler!"
+
+@app.route('/faq/stream', methods=['POST'])
+def faq_stream():
+    """Like /faq, but as server-sent events: {"token": ...} pieces, then {"done": true}"""
+    data = request.get_json(silent=True) or {}
+    question = str(data.get('question', '')).strip()
+    print(f"📥 Streaming question received: {question}")
+    
+    def events():
+        try:
+            if not question:
+                yield sse({'token': 'FAQ Bot: Please ask a question!'})
+            else:
+                project_answer = get_project_response(question)
+                if project_answer:
+                    yield sse({'token': project_answer})
+                else:
+                    for piece in stream_real_gpt2_response(question):
+                        yield sse({'token': piece})
+        except Exception as e:
+            yield sse({'token': f'FAQ Bot: Error - {str(e)}'})
+        yield sse({'done': True})
+    
+    return Response(events(), mimetype='text/event-stream', headers={'Cache-Control': 'no-cache'})
+
 if __name__ == '__main__':
     print("🚀 Starting REAL GPT-2 FAQ Bot")
     print("📋 Project questions → Predefined answers")
     print("🤖 General questions → ACTUAL GPT-2 generation")
-    app.run(host='0.0.0.0', port=5005, debug=False)
+    # HTTP/1.1 so the chat server can keep its connections open between questions
+    WSGIRequestHandler.protocol_version = "HTTP/1.1"
+    app.run(host='0.0.0.0', port=5005, debug=False, threaded=True)
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE             // splice(), RUSAGE_THREAD
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,53 +6,964 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#include <ctype.h>
 #include <time.h>
+#include <math.h>
 #include <json-c/json.h>
 #include <curl/curl.h>        // Add this line
 #include <json-c/json.h> 
 
 #define PORT 8080
 #define BUFFER_SIZE 2048
-#define MAX_CLIENTS 10
-#define MAX_USERS 100
+#define DEFAULT_MAX_CLIENTS 10000
+#define REGISTRY_MIN 64            // Initial sessions/ids/name buckets per registry
+#define USER_TABLE_MIN 64
 #define UPLOAD_DIR "uploads"
+#define STORE_DIR UPLOAD_DIR "/.store"
+#define FILE_NAME_MAX 200          // Longest upload name, leaving room for a part file's suffix
+#define STORE_CHUNK_SIZE (1 << 20)  // Bytes per content-addressed blob
+#define STORE_BUCKETS 16384
 #define USER_DB_FILE "users.db"
+#define USER_JOURNAL_FILE "users.journal"
+#define FAQ_SERVICE_URL "http://10.14.94.221:5005/faq"
+#define FAQ_MAX_BACKENDS 4               // --faq-url can be given this many times
+#define DEFAULT_FAQ_TIMEOUT_MS 10000    // Longest any FAQ call may take
+#define FAQ_TIMEOUT_FLOOR_MS 200        // Adaptive timeouts never go below this
+#define FAQ_CONNECT_TIMEOUT_MS 1000
+#define FAQ_LATENCY_SAMPLES 64          // Recent call times kept per backend
+#define FAQ_MIN_SAMPLES 10              // Fewer than this: fixed timeout, no hedging
+#define DEFAULT_FAQ_BREAKER 5           // Consecutive failures that open a backend's circuit
+#define FAQ_BREAKER_COOLDOWN 5          // Seconds an open circuit fails fast before a probe call
+#define DEFAULT_FAQ_CONCURRENCY 8       // Model calls in flight at once
+#define FAQ_QUEUE_MAX 256               // Questions waiting for a slot before we answer "busy"
+#define DEFAULT_FAQ_BATCH 8             // Questions per call to /faq/batch, 1 = no batching
+#define DEFAULT_FAQ_BATCH_WINDOW 20     // Milliseconds to wait for a batch to fill
+#define FAQ_BATCH_LIMIT 64
+#define FAQ_CACHE_SHARDS 16             // Independently locked LRU caches
+#define FAQ_CACHE_BUCKETS 256           // Hash chains per shard
+#define DEFAULT_FAQ_CACHE_TTL 600       // Seconds an answer stays fresh
+#define DEFAULT_FAQ_CACHE_MB 4          // Memory budget across all shards
+#define FAQ_CORPUS_FILE "faq_corpus.txt"
+#define DEFAULT_FAQ_CONFIDENCE 0.6      // Share of a question the best corpus entry must match
+#define FAQ_INDEX_BUCKETS 1024          // Hash chains in the term dictionary
+#define FAQ_TERM_MAX 32                 // Longer words are cut
+#define FAQ_QUERY_TERMS 64
+#define FAQ_DEFAULT_FALLBACK "FAQ Bot: Service temporarily unavailable. Try asking about 'how to run', or say hello!"
+#define USER_SNAP_FILE "users.snap"
+#define USER_SNAP_MAGIC "CHATUSRS"
+#define USER_SNAP_VERSION 1
+#define USER_SNAP_BYTE_ORDER 0x01020304    // Written natively; a mismatch means another endianness
+#define JOURNAL_COMPACT_MIN 10000       // Records before size-triggered compaction
+#define JOURNAL_STALE_FRACTION 16       // Periodic compaction once records reach users/16
+#define DEFAULT_COMPACT_INTERVAL 300    // Seconds between periodic compactions
+#define MAX_EVENTS 64
+#define DEFAULT_QUEUE_LIMIT 256
+#define FLUSH_IOV_MAX 64
+#define FILE_IO_TIMEOUT_MS 30000      // Longest a transfer waits on a stalled peer
+#define SPLICE_CHUNK 65536             // Bytes per splice(); the default pipe capacity
+#define COPY_BUFFER_SIZE (8 * BUFFER_SIZE)  // Pooled buffer for file I/O that is not zero-copy
+#define STATS_SIZE (4 * BUFFER_SIZE)
+#define BENCH_TRANSFER_MB 512
 
-// FIXED: Proper array declarations
+// Framed protocol, negotiated with "/proto framed". Every frame is an
+// 8-byte big-endian header (payload length, type, flags, stream id)
+// followed by the payload. Must match client.c.
+#define FRAME_HEADER_SIZE 8
+#define MAX_FRAME_PAYLOAD 65536
+#define FRAME_TEXT 1            // Command or chat line / server reply
+#define FRAME_FILE_DATA 2       // File bytes for the transfer on this stream
+#define FRAME_FILE_END 3        // End of transfer on this stream
+#define FRAME_FILE_CHUNK 4      // File bytes at an offset: 8-byte offset, 4-byte CRC-32, data
+#define FRAME_FLAG_ERROR 0x01   // FILE_END: transfer failed, payload says why
+#define FRAME_FLAG_MORE 0x02    // TEXT: partial text, continued by the next TEXT frame on the stream
+#define PROTO_FRAMED_ACK "PROTO framed"
+#define CHUNK_PREFIX_SIZE 12
+#define TRANSFER_CHUNK_SIZE 32768   // Data per FILE_CHUNK; resume points are multiples of it
+#define FILE_CRC_CACHE 64           // Whole-file checksums remembered by inode
+#define MAX_DOWNLOADS 16            // Background downloads per client
+#define DOWNLOAD_BURST 16           // File frames written per flush before other clients get a turn
+#define DOWNLOAD_NOTSENT_LOWAT (128 * 1024) // Unsent file data the kernel may hold ahead of chat
+#define CHANNEL_NAME_MAX 32
+#define CHANNEL_TABLE_MIN 64
+#define MAX_CLIENT_CHANNELS 64      // Channels one session may be in
+#define HISTORY_DIR "history"
+#define HISTORY_SEGMENT_SIZE (4 << 20)  // Bytes per message log file, preallocated
+#define DEFAULT_HISTORY_MB 64           // Log kept on disk before the oldest segments go
+#define HISTORY_RING 1024               // Most recent lines kept in memory
+#define HISTORY_INDEX_EVERY 64          // Records per seq/time index entry
+#define HISTORY_DEFAULT_LINES 20
+#define HISTORY_MAX_LINES 100           // Lines one /history may send
+#define HISTORY_SCAN_LIMIT 100000       // Records one /history may look at
+#define HISTORY_LOGIN_LINES 20          // Catch-up shown at login
+#define SLAB_OBJECTS 64                 // Connection objects carved from one allocation
+#define POOL_CLASSES 10
+#ifndef POOL_CACHE_BYTES
+#define POOL_CACHE_BYTES (4 << 20)      // Free buffers kept per size class; 0 hands every one back to malloc
+#endif
+#define IN_BUF_SIZE (FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD)
+#define THREAD_STACK_SIZE (256 * 1024)  // Thread-per-client mode
+#define MAILBOX_FILE "mailboxes.log"
+#define DEFAULT_MAILBOX_LIMIT 1000      // Messages kept for one offline user
+#define DEFAULT_MAILBOX_DAYS 7          // Undelivered messages expire after this
+#define MAILBOX_TABLE_MIN 64
+#define MAILBOX_BATCH_BYTES 32768       // Login delivery packs messages into chunks of this size
+#define MAILBOX_READ_GAP 4096           // Records closer than this are read with one pread()
+#define MAILBOX_FLUSH_BATCHES 8         // Batches sent per flush before other clients get a turn
+#define MAIL_RECORD_MAX (sizeof(mail_record_t) + 2 * 50 + BUFFER_SIZE + 8)
+#define MAILBOX_COMPACT_MIN (1 << 20)   // Log size before dead records are worth rewriting
+#define MAIL_STORED 1
+#define MAIL_DRAINED 2
+#define USERS_PAGE_SIZE 50              // Names per /users page
+#define PRESENCE_CACHE_PAGES 16         // Rendered /users pages kept for the current version
+#define PRESENCE_BATCH_MAX 32           // Changes named in one update before it is summed up
+#define PRESENCE_INTERVAL_MS 1000       // Subscribers get at most one update this often
+#define DEFAULT_JOIN_NOTICES 1000       // Logins announced to everyone up to this many online
+#define COMMAND_SLOTS 64                // Perfect hash slots for command words (a power of two)
+#define COMMAND_WORD_MAX 16             // Longer first words are never commands
+#define CMD_AUTH 1                      // Needs a logged-in session
+#define CMD_FRAMED 2                    // Needs the framed protocol
+#define RANGE_USAGE "Usage: stat <file> | getrange <offset> <length> <file> | putrange <size> <crc32> <sha256> <file>"
+#define BAD_FILE_NAME "Server: Invalid file name"
+
+// Presence of one account. Only last_seen is persisted.
 typedef struct {
-    char username[50];      // Array of 50 chars
-    char password[100];     // Array of 100 chars (not single char)
     int is_online;
     time_t last_seen;
+    int shard;              // Shard holding the session (sharded mode)
+} user_state_t;
+
+// Account registered since users.snap was written. Strings are never freed,
+// since accounts are never removed.
+typedef struct {
+    char *username;
+    char *password;
+    user_state_t state;
 } user_account_t;
 
-// FIXED: Proper array declaration for username
+// users.snap: header, records, hash index, then a string arena. Offsets are
+// in bytes from the start of the file (records/index) or the arena (strings).
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t user_count;
+    uint64_t index_slots;       // Power of two, same layout as user_index
+    uint64_t records_off;
+    uint64_t index_off;
+    uint64_t arena_off;
+    uint64_t arena_len;
+} user_snap_header_t;
+
+typedef struct {
+    uint64_t name_off;
+    uint64_t pass_off;
+    int64_t last_seen;
+} user_snap_record_t;
+
+// One account as handed to write_user_snapshot()
+typedef struct {
+    const char *username;
+    const char *password;
+    time_t last_seen;
+} user_snap_entry_t;
+
+// An encoded message, built once and shared by every queue it is sent to.
+typedef struct {
+    atomic_int refs;
+    uint8_t frame_type;     // Frame type, flags and stream id for framed clients
+    uint8_t frame_flags;
+    uint16_t stream;
+    size_t len;
+    size_t size;            // Bytes allocated, for the buffer pool
+    char *data;             // bytes, or a record in a mapped history segment
+    struct history_segment *segment;    // Holds the mapping while data points into it
+    char bytes[];
+} msg_buf_t;
+
+// Fixed-size objects carved from slabs. Freed objects are linked through
+// their first word and handed out again before a new slab is allocated;
+// slabs are never given back.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t size;
+    void *free;
+    void **slabs;
+    int slab_count;
+    int slab_cap;
+    int in_use;
+    int peak;
+    unsigned long allocs;
+} slab_pool_t;
+
+// Free list for one buffer size class
 typedef struct {
+    pthread_mutex_t lock;
+    size_t size;
+    void *free;
+    size_t cached;                  // Buffers on the free list
+    long in_use;
+    long peak;
+    unsigned long allocs;
+    unsigned long reused;
+    unsigned long released;         // Handed back to malloc because the class cache was full
+} buf_class_t;
+
+// One queued outbound message: an optional per-recipient frame header
+// followed by the shared payload. off counts bytes of both; off > 0 means
+// it is partly written and must go out in full before anything behind it.
+typedef struct out_msg {
+    struct out_msg *next;
+    msg_buf_t *buf;
+    size_t off;
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    size_t hdr_len;
+} out_msg_t;
+
+typedef enum {
+    ARGS_NONE,              // The word alone
+    ARGS_OPTIONAL,          // The word alone, or followed by a space and anything
+    ARGS_REQUIRED           // The word, a space and anything (possibly nothing)
+} command_args_t;
+
+typedef enum {
+    SLOW_DROP_OLDEST,       // Full queue: discard the oldest unsent message
+    SLOW_DISCONNECT         // Full queue: drop the connection
+} slow_policy_t;
+
+// FIXED: Proper array declaration for username
+typedef struct client {
     int socket;
-    int id;
+    int id;                 // The socket, so ids stay small and dense
+    slab_pool_t *pool;      // Where the object goes back to
+    int slot;               // Position in its registry's live[]
+    struct client *name_next;       // Registry username chain, while logged in
+    unsigned long name_hash;
     char username[50];      // Array of 50 chars (not single char)
     int is_authenticated;
     struct sockaddr_in address;
+    struct reactor *reactor; // Owning reactor (NULL in thread mode)
+    // Bounded outbound queue, drained with non-blocking writes
+    pthread_mutex_t out_lock;
+    out_msg_t *out_head;
+    out_msg_t *out_tail;
+    size_t out_depth;       // Queued messages
+    size_t out_bytes;       // Queued bytes not yet written
+    unsigned long out_dropped;
+    int out_closing;        // Over the high-water mark, being disconnected
+    int in_transfer;        // Text-protocol put/get owns the socket; queue everything
+    atomic_int presence_sub; // /presence on; read by whichever thread sends the updates
+    int wake_fd;            // Thread mode: wakes handle_client when output is queued
+    // Framed protocol
+    int framed;
+    unsigned char *in_buf;  // Pooled; held only while a partial frame is pending
+    size_t in_len;
+    uint16_t cur_stream;    // Stream of the frame being dispatched
+    FILE *upload_fp;        // Upload in progress on upload_stream
+    uint16_t upload_stream;
+    char *upload_name;      // While an upload is open
+    long upload_bytes;
+    int upload_chunked;     // putrange: verified chunks into a .part file kept for resuming
+    long upload_size;
+    uint32_t upload_crc;
+    unsigned char upload_sha[32];   // SHA-256 the upload must have
+    struct out_transfer *downloads; // get/getrange streams, sent between chat messages
+    int download_count;
+    int download_partial;   // A file frame is partly written; nothing else may go out
+    struct mail_drain *mail_drain;  // Offline messages still being delivered
+    // Channels, touched only by the session's own thread
+    struct channel_member **channels;
+    int channel_count;
+    int channel_cap;
+    struct channel *channel;        // Where plain chat lines go, NULL = everyone
 } client_t;
 
+// One command: its first word, how it takes arguments, what the session
+// needs (CMD_*), and the handler, which returns 1 when the client asked to
+// exit
+typedef struct {
+    const char *word;
+    command_args_t args;
+    int flags;
+    int (*handler)(client_t *client, char *args);
+} command_t;
+
+// Live sessions: a slot map from connection id to a dense array, plus a
+// username index over the logged-in ones. Adds, removes and lookups are
+// O(1); fan-out walks only live[]. One registry behind clients_mutex, or
+// one per shard touched only by its thread.
+typedef struct {
+    client_t **live;
+    int count;
+    int cap;
+    int *slots;             // id -> position in live[] + 1, 0 = none
+    int slot_cap;
+    client_t **names;       // Buckets by username hash
+    size_t name_mask;
+    int named;
+} client_registry_t;
+
+typedef enum {
+    FSYNC_ALWAYS,           // Callers wait until their record is on disk (group commit)
+    FSYNC_INTERVAL,         // Written at once, fsync'd at most once per second
+    FSYNC_OFF               // Written at once, flushed by the OS
+} fsync_policy_t;
+
+// Append-only log of register and presence events in front of the
+// users.db snapshot. Callers append to an in-memory batch; the journal
+// thread writes whole batches (group commit) and compacts in the background.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t durable;
+    int fd;
+    char *pending;
+    size_t pending_len;
+    size_t pending_cap;
+    unsigned long appended_seq;     // Last record handed to the journal
+    unsigned long synced_seq;       // Last record durable under the policy
+    unsigned long records;          // Records in the current journal file
+    unsigned long commits;
+    unsigned long compactions;
+    int compact_now;
+    time_t last_sync;
+    time_t last_compaction;
+} user_journal_t;
+
+// Outbound queue counters, server wide
+typedef struct {
+    atomic_ulong queued;
+    atomic_ulong dropped;
+    atomic_ulong slow_disconnects;
+    atomic_ulong max_depth;
+    atomic_ulong send_calls;    // send()/sendmsg() syscalls issued for chat output
+    atomic_ulong delivered;     // Messages completely written to a socket
+} queue_stats_t;
+
+// Checksum of a file as it was when computed; stale once size or times change
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    uint32_t crc;
+    int valid;
+} file_crc_entry_t;
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t bytes;
+    unsigned char block[64];
+    size_t fill;
+} sha256_t;
+
+// Upload store blob: one STORE_CHUNK_SIZE piece of some file, by SHA-256
+typedef struct store_blob {
+    unsigned char hash[32];
+    unsigned int refs;          // Contents that use it (a content using it twice counts twice)
+    size_t size;
+    struct store_blob *next;
+} store_blob_t;
+
+// One distinct file content, shared by every name that holds it. Also the
+// parsed form of a manifest.
+typedef struct store_content {
+    unsigned char sha[32];      // SHA-256 of the whole file
+    long size;
+    uint32_t crc;               // CRC-32 of the whole file, answered by stat
+    int names;                  // Manifests pointing at it
+    int chunks;
+    unsigned char (*hashes)[32];
+    struct store_content *next;
+} store_content_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    store_blob_t *blobs[STORE_BUCKETS];
+    store_content_t *contents[STORE_BUCKETS];
+    unsigned long names;
+    unsigned long logical_bytes;    // Sizes of all named files
+    unsigned long blob_count;
+    unsigned long blob_bytes;       // What they take on disk
+    unsigned long dedup_uploads;    // Uploads skipped, the content was already here
+    unsigned long dedup_bytes;
+    unsigned long dedup_chunks;     // Chunks of stored uploads that were already here
+    unsigned long collected;        // Blobs deleted once unused
+} upload_store_t;
+
+// A file being downloaded: blobs from the store, or a plain file left in
+// UPLOAD_DIR from before the store
+typedef struct {
+    long size;
+    uint32_t crc;
+    int chunks;
+    unsigned char (*hashes)[32];
+    int *fds;                   // Blob fds, -1 until reached
+    int plain_fd;               // -1 for stored files
+    struct stat st;             // Of the plain file
+} stored_file_t;
+
+// A framed download running in the background. client_flush() writes one
+// frame of it at a time, and only while no chat is queued, so chat waits
+// for at most the frame already on its way.
+typedef struct out_transfer {
+    struct out_transfer *next;
+    uint16_t stream;
+    int chunked;                // getrange: FILE_CHUNK frames; get: FILE_DATA
+    int ending;                 // frame[] holds the FILE_END
+    stored_file_t sf;
+    char name[256];
+    long start;
+    long pos;
+    long end;
+    unsigned char frame[FRAME_HEADER_SIZE + CHUNK_PREFIX_SIZE + TRANSFER_CHUNK_SIZE];
+    size_t frame_len;           // Bytes of frame[] to write
+    size_t frame_off;           // Of those, already written
+    size_t file_left;           // FILE_DATA payload still to go by sendfile()
+} out_transfer_t;
+
+// An upload whose data is all in. Checking and storing it reads the
+// whole file, so that runs on a thread of its own and the reply finds the
+// session afterwards, like a FAQ answer.
+typedef struct {
+    char path[512];         // Renamed out of the way of the next upload
+    char name[256];
+    long size;
+    int verify;             // putrange: must match crc and sha
+    uint32_t crc;
+    unsigned char sha[32];
+    int client_id;
+    int shard;
+    char username[50];
+    uint16_t stream;
+} upload_finish_t;
+
+// File transfer counters, server wide
+typedef struct {
+    atomic_ulong zero_copy_bytes;   // Moved by sendfile()/splice()
+    atomic_ulong copied_bytes;      // Moved through a user-space buffer
+    atomic_ulong fallbacks;         // Transfers where the kernel refused zero-copy
+    atomic_ulong downloads;         // Background downloads in progress
+} transfer_stats_t;
+
+typedef enum {
+    SERVER_MODE_THREAD,     // One thread per connection, blocking recv()
+    SERVER_MODE_EPOLL,      // Edge-triggered epoll reactors on a fixed thread pool
+    SERVER_MODE_SHARDED     // Reactors with their own listener and client table
+} server_mode_t;
+
+typedef enum {
+    INBOX_BROADCAST,
+    INBOX_PRIVATE,
+    INBOX_SESSION,          // Reply for one session, matched by id and username
+    INBOX_CHANNEL,
+    INBOX_PRESENCE          // Presence update for the shard's subscribers
+} inbox_type_t;
+
+// One session's membership of one channel, indexed from both sides so
+// joining and leaving cost the same in a channel of two or of 100000
+typedef struct channel_member {
+    struct channel *channel;
+    client_t *client;
+    int slot;               // Position in the channel's member set
+    int client_slot;        // Position in client->channels
+} channel_member_t;
+
+// A channel's members on one shard (the only set outside sharded mode)
+typedef struct {
+    channel_member_t **members;
+    int count;
+    int cap;
+    atomic_int present;     // count, for other shards deciding whether to post here
+} channel_set_t;
+
+typedef struct channel {
+    struct channel *next;   // Hash chain in channel_table
+    unsigned long hash;
+    char name[CHANNEL_NAME_MAX + 1];
+    int linked;             // Still in channel_table
+    atomic_int refs;        // The table's, plus inbox messages in flight
+    atomic_int members;     // On every shard; back to 0 takes it out of the table
+    pthread_rwlock_t lock;  // Guards sets[0] outside sharded mode
+    int set_count;
+    channel_set_t sets[];   // One per shard in sharded mode
+} channel_t;
+
+// One line of the message log, 8-byte aligned, followed by the channel
+// name and the text as /history shows it (NUL-terminated). A zero size
+// ends a segment's records.
+typedef struct {
+    uint32_t size;
+    uint32_t prev;          // Size of the record before it, 0 for a segment's first
+    uint64_t seq;
+    int64_t time;
+    uint32_t channel_hash;  // 0 with channel_len 0: said to everyone
+    uint16_t text_len;
+    uint8_t channel_len;
+    uint8_t reserved;
+} history_record_t;
+
+typedef struct {
+    uint64_t seq;
+    int64_t time;
+    uint32_t offset;
+} history_index_t;
+
+// One file of the message log, mapped for its whole preallocated size.
+// Records below tail never change. Unmapped once retention has dropped it
+// and no queued /history line points into it.
+typedef struct history_segment {
+    atomic_int refs;
+    char path[64];
+    int fd;
+    char *map;
+    uint32_t tail;          // End of the last record
+    uint32_t last_size;     // Size of the last record
+    uint64_t first_seq;
+    uint64_t last_seq;      // first_seq - 1 while empty
+    int64_t last_time;
+    history_index_t *index; // Every HISTORY_INDEX_EVERY-th record from first_seq
+    int index_count;
+    int index_cap;
+} history_segment_t;
+
+typedef struct {
+    uint64_t seq;
+    uint32_t channel_hash;
+    char channel[CHANNEL_NAME_MAX + 1];
+    msg_buf_t *buf;
+} history_entry_t;
+
+// The log, oldest segment first, and a ring of the newest lines in front
+// of it. Appends take the lock exclusively; /history shares it.
+typedef struct {
+    pthread_rwlock_t lock;
+    history_segment_t **segments;
+    int segment_count;
+    int segment_cap;
+    int max_segments;
+    uint64_t next_seq;
+    history_entry_t ring[HISTORY_RING];     // ring[seq % HISTORY_RING]
+    unsigned long dropped_segments;
+    atomic_ulong replays;
+    atomic_ulong replayed_lines;
+    atomic_ulong mapped_lines;      // Of those, sent straight from a segment
+} history_log_t;
+
+// One record of mailboxes.log, padded to 8 bytes, followed by the
+// recipient, sender and text. MAIL_DRAINED has no sender and retires every
+// message to its recipient before it, or with a text (a log offset) only
+// those up to that record.
+typedef struct {
+    uint32_t size;
+    uint32_t crc;           // CRC-32 of everything after this field
+    int64_t time;
+    uint8_t type;
+    uint8_t recipient_len;
+    uint8_t sender_len;
+    uint8_t reserved;
+    uint16_t text_len;
+    uint16_t reserved2;
+} mail_record_t;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t size;
+    int64_t time;
+} mail_entry_t;
+
+// Undelivered messages to one user, in log order
+typedef struct mailbox {
+    struct mailbox *next;
+    unsigned long hash;
+    char name[50];
+    int online;             // Drained for a session that is still logged in
+    mail_entry_t *entries;
+    int count;
+    int cap;
+    uint64_t bytes;
+} mailbox_t;
+
+// A login delivery in progress: the mailbox's index as it was at login,
+// sent a batch at a time by client_flush() whenever the queue is empty
+typedef struct mail_drain {
+    mail_entry_t *entries;
+    int count;
+    int next;               // First entry not sent yet
+    int acked;              // Entries before this are retired from the mailbox
+    int batches;            // Sent since the last ack
+    int fd;                 // The log these entries point into
+    unsigned char *span;    // Read buffer
+    unsigned long dropped;  // client->out_dropped when the last batch was sent
+    int text;               // Start every entry on a new line
+} mail_drain_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int fd;
+    uint64_t size;          // Bytes in the log
+    uint64_t live_bytes;    // Of those, messages still waiting
+    mailbox_t **buckets;
+    size_t mask;
+    int count;
+    unsigned long waiting;
+    unsigned long stored;
+    unsigned long delivered;
+    unsigned long batches;
+    unsigned long expired;
+    unsigned long refused;
+    unsigned long compactions;
+    time_t last_sync;
+} mail_store_t;
+
+// One login or logout waiting for the next presence update
+typedef struct {
+    char name[50];
+    int joined;
+} presence_change_t;
+
+// Who is online, sorted by name. version goes up with every login and
+// logout; /users pages rendered at one version are reused until the next.
+// Changes since the last update to subscribers wait in pending, where a
+// login and logout of the same user cancel out.
+typedef struct {
+    pthread_mutex_t lock;
+    char **names;
+    int count;
+    int cap;
+    unsigned long version;
+    msg_buf_t *pages[PRESENCE_CACHE_PAGES];
+    unsigned long page_version[PRESENCE_CACHE_PAGES];
+    presence_change_t pending[PRESENCE_BATCH_MAX];
+    int pending_count;
+    unsigned long joins;            // Since the last update, named in pending or not
+    unsigned long leaves;
+    int overflow;                   // Too many changes to name them all
+    atomic_int subscribers;
+    unsigned long updates;
+    unsigned long pages_served;
+    unsigned long pages_rendered;
+} presence_t;
+
+typedef enum {
+    MAIL_OK,
+    MAIL_FULL,
+    MAIL_ONLINE,            // Logged in meanwhile; deliver it live instead
+    MAIL_FAILED
+} mail_status_t;
+
+// Every channel by name. Chains are short; the table doubles past one
+// channel per bucket.
+typedef struct {
+    pthread_rwlock_t lock;
+    channel_t **buckets;
+    size_t mask;
+    int count;
+    atomic_ulong memberships;
+    atomic_ulong messages;          // Lines posted to channels
+    atomic_ulong deliveries;        // Members they were handed to
+} channel_table_t;
+
+// Work posted to another shard. Pushed onto a lock-free stack by any
+// thread, drained only by the owning shard.
+typedef struct inbox_msg {
+    struct inbox_msg *next;
+    inbox_type_t type;
+    int sender_id;                  // INBOX_SESSION: the session's own id
+    char target[50];
+    struct channel *channel;        // INBOX_CHANNEL: holds a reference
+    msg_buf_t *buf;
+} inbox_msg_t;
+
+typedef struct reactor {
+    int id;
+    int epoll_fd;
+    pthread_t thread;
+    // Sharded mode only
+    int listen_fd;                      // SO_REUSEPORT listener of this shard
+    int wake_fd;                        // eventfd signalled when the inbox becomes non-empty
+    _Atomic(inbox_msg_t *) inbox;
+    client_registry_t registry;          // Clients owned by this shard, touched only by its thread
+    slab_pool_t client_pool;            // client_t objects of this reactor's sessions
+} reactor_t;
+
 struct http_response {
-    char *memory;
+    char *memory;                   // From the buffer pool
     size_t size;
+    size_t cap;
 };
 
+// A /faq question on its way through the FAQ engine. The answer goes back
+// to the client by id and username, since it may have left meanwhile.
+typedef struct faq_request {
+    struct faq_request *next;
+    int client_id;
+    int shard;                      // Shard of the asking client (sharded mode)
+    char username[50];
+    int framed;                     // Client can take a streamed answer
+    uint16_t stream;                // Stream of the /faq frame, answers go back on it
+    char *question;
+    char *fallback;                 // Sent instead if the service fails
+    char *cache_key;                // Normalized question the answer is cached under
+    double queued_at;
+    double first_token_at;          // When the first text reached the client
+    struct http_response streamed;  // Answer relayed so far (streaming calls)
+} faq_request_t;
+
+typedef enum {
+    CIRCUIT_CLOSED,                 // Healthy, takes calls
+    CIRCUIT_OPEN,                   // Failing, skipped until retry_at
+    CIRCUIT_HALF_OPEN               // One probe call decides whether it is back
+} circuit_state_t;
+
+// One FAQ service endpoint and what we have seen of it. Only the FAQ thread
+// changes it, under faq_engine.lock so /stats can read it.
+typedef struct {
+    const char *url;
+    char batch_url[512];
+    char stream_url[512];
+    circuit_state_t circuit;
+    int consecutive_failures;
+    double retry_at;                // When an open circuit lets a probe through
+    int in_flight;
+    double samples[FAQ_LATENCY_SAMPLES];    // Seconds per call, ring buffer
+    int sample_count;
+    int next_sample;
+    double p50, p95, p99;           // Over the samples, refreshed as they arrive
+    long timeout_ms;                // Adaptive timeout for the next call
+    unsigned long calls;
+    unsigned long failures;
+    unsigned long trips;            // Times the circuit opened
+    unsigned long hedges_won;       // Hedged calls this backend answered first
+} faq_backend_t;
+
+struct faq_call;
+
+// One try of a call against one backend. A hedged call runs two at once.
+typedef struct {
+    struct faq_call *call;
+    CURL *curl;                     // NULL when not running
+    faq_backend_t *backend;
+    double started;
+    struct http_response body;      // Whole reply, or the unparsed tail of a stream
+} faq_attempt_t;
+
+// One HTTP call to the FAQ service: a single question to /faq, or a batch
+// of them to /faq/batch answered by one batched model call
+typedef struct faq_call {
+    struct faq_call *next;          // Calls in flight, checked for hedging
+    faq_request_t *reqs;            // Linked through next, in submission order
+    int count;
+    int streaming;                  // One question to /faq/stream, relayed token by token
+    char *payload;                  // JSON request body
+    faq_attempt_t attempts[2];      // The first try, then a hedge or failover
+    int tries;                      // Attempts started so far
+    double hedge_at;                // Hedge if still unanswered by then, 0 = never
+} faq_call_t;
+
+// One thread drives every FAQ call through a curl multi handle. Easy
+// handles are kept after use, so the connections in the multi handle's
+// cache are reused (keep-alive) instead of reconnecting per question.
+typedef struct {
+    pthread_mutex_t lock;
+    faq_request_t *wait_head;       // Submitted, waiting for a free slot
+    faq_request_t *wait_tail;
+    int waiting;
+    CURLM *multi;
+    CURL **idle;                    // Finished easy handles, ready for reuse
+    int idle_count;
+    int in_flight;                  // Only touched by the FAQ thread
+    faq_call_t *active;             // Calls in flight (FAQ thread only)
+    struct curl_slist *headers;
+    faq_backend_t backends[FAQ_MAX_BACKENDS];
+    int backend_count;
+    unsigned long asked;
+    unsigned long answered;
+    unsigned long failed;
+    unsigned long calls;            // HTTP calls made (one per batch)
+    unsigned long connects;         // New TCP connections opened
+    unsigned long streams;          // Answers relayed token by token
+    unsigned long hedges;           // Second attempts sent because the first was slow
+    unsigned long failovers;        // Failed calls retried on another backend
+    unsigned long failed_fast;      // Answered locally because every circuit was open
+    double first_token_total;       // Seconds from /faq to first text, summed over answers
+    double first_token_max;
+    double complete_total;          // Seconds from /faq to the full answer
+} faq_engine_t;
+
+// Cached answer. The text is kept as a ready-to-send buffer so a hit is
+// just a reference count bump and a queue append.
+typedef struct faq_cache_entry {
+    struct faq_cache_entry *chain;  // Next in the hash bucket
+    struct faq_cache_entry *prev;   // LRU list, most recently used first
+    struct faq_cache_entry *next;
+    unsigned long hash;
+    time_t expires;
+    size_t cost;                    // Bytes charged against the budget
+    msg_buf_t *answer;
+    char key[];
+} faq_cache_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    faq_cache_entry_t *buckets[FAQ_CACHE_BUCKETS];
+    faq_cache_entry_t *head;
+    faq_cache_entry_t *tail;
+    size_t bytes;
+    size_t entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} faq_cache_shard_t;
+
+// Local FAQ retrieval: an inverted index over the Q lines of the corpus,
+// scored with BM25. Built once at startup and read-only afterwards, so
+// lookups take no locks.
+typedef struct {
+    int doc;
+    int tf;                         // Times the term occurs in the entry's questions
+} faq_posting_t;
+
+typedef struct faq_term {
+    struct faq_term *chain;
+    unsigned long hash;
+    double idf;
+    faq_posting_t *postings;        // In entry order
+    int count;
+    int cap;
+    char term[];
+} faq_term_t;
+
+typedef struct {
+    char *answer;
+    int length;                     // Indexed terms, for length normalization
+} faq_doc_t;
+
+typedef struct {
+    faq_term_t *buckets[FAQ_INDEX_BUCKETS];
+    size_t terms;
+    faq_doc_t *docs;
+    int doc_count;
+    double avg_length;
+    atomic_ulong lookups;
+    atomic_ulong local;             // Answered from the index without the model
+    atomic_ulong lookup_ns;         // Time spent scoring, for the /stats average
+} faq_index_t;
+
 static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp);
-char* ask_gpt2_faq(const char* question);
+int faq_engine_start(void);
+void faq_cache_init(void);
+int faq_index_load(const char *path);
+const char *faq_index_lookup(const char *question, double *confidence);
+void faq_submit(client_t *client, const char *question);
+
+client_registry_t registry;
+// Open-addressing index over users[]: each slot keeps the full hash so
+// most probes never touch the record. idx is the users[] index + 1, 0 = empty.
+typedef struct {
+    uint32_t hash;
+    int32_t idx;
+} user_slot_t;
+
+// Accounts from users.snap are served straight from the read-only mapping;
+// their ids are 0..count-1. Accounts added later get ids from count up and
+// live in users[]/user_index.
+typedef struct {
+    void *map;
+    size_t map_len;
+    const user_snap_record_t *records;
+    const user_slot_t *index;
+    size_t index_mask;
+    const char *arena;
+    uint64_t arena_len;
+    int count;
+    user_state_t *state;            // Presence per snapshot account, zeroed until used
+} user_snap_t;
 
-client_t *clients[MAX_CLIENTS];
-user_account_t users[MAX_USERS];
+user_snap_t user_snap;
+user_account_t *users = NULL;      // Dense records in registration order
+user_slot_t *user_index = NULL;    // Power-of-two slots, load factor <= 1/2
+size_t user_index_mask = 0;
+int user_capacity = 0;
+int user_snapshot_stale = 0;       // Loaded from text users.db; write users.snap soon
 pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
-int client_count = 0;
+// Lookups (including /login) share users_lock; only registration and table
+// growth take it exclusively. Presence fields are updated with atomics.
+pthread_rwlock_t users_lock = PTHREAD_RWLOCK_INITIALIZER;
+user_journal_t user_journal = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .durable = PTHREAD_COND_INITIALIZER,
+    .fd = -1
+};
+fsync_policy_t fsync_policy = FSYNC_INTERVAL;
+int compact_interval = DEFAULT_COMPACT_INTERVAL;
+faq_engine_t faq_engine = { .lock = PTHREAD_MUTEX_INITIALIZER };
+int faq_concurrency = DEFAULT_FAQ_CONCURRENCY;
+const char *faq_urls[FAQ_MAX_BACKENDS];
+int faq_url_count = 0;
+long faq_timeout_ms = DEFAULT_FAQ_TIMEOUT_MS;
+int faq_hedge = 0;
+int faq_breaker_failures = DEFAULT_FAQ_BREAKER;
+int faq_stream = 0;
+int faq_batch_max = DEFAULT_FAQ_BATCH;
+int faq_batch_window = DEFAULT_FAQ_BATCH_WINDOW;
+faq_cache_shard_t faq_cache[FAQ_CACHE_SHARDS];
+int faq_cache_ttl = DEFAULT_FAQ_CACHE_TTL;
+size_t faq_cache_budget = (size_t)DEFAULT_FAQ_CACHE_MB << 20;
+faq_index_t faq_index;
+const char *faq_corpus_path = FAQ_CORPUS_FILE;
+double faq_min_confidence = DEFAULT_FAQ_CONFIDENCE;
+atomic_int client_count;           // Sessions open in every mode, checked against max_clients
+int max_clients = DEFAULT_MAX_CLIENTS;
 int user_count = 0;
+server_mode_t server_mode = SERVER_MODE_EPOLL;
+size_t queue_limit = DEFAULT_QUEUE_LIMIT;
+slow_policy_t slow_policy = SLOW_DROP_OLDEST;
+queue_stats_t queue_stats;
+transfer_stats_t transfer_stats;
+channel_table_t channel_table = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+history_log_t history = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+mail_store_t mail = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+presence_t presence = { .lock = PTHREAD_MUTEX_INITIALIZER };
+int join_notices = DEFAULT_JOIN_NOTICES;
+const char *mail_path = MAILBOX_FILE;
+int mailbox_limit = DEFAULT_MAILBOX_LIMIT;
+int mailbox_days = DEFAULT_MAILBOX_DAYS;
+int history_mb = DEFAULT_HISTORY_MB;
+upload_store_t upload_store = { .lock = PTHREAD_MUTEX_INITIALIZER };
+uint32_t crc32_table[8][256];
+pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+file_crc_entry_t file_crc_cache[FILE_CRC_CACHE];
+pthread_mutex_t file_crc_lock = PTHREAD_MUTEX_INITIALIZER;
+int zero_copy_transfers = 1;
+int reactor_count = 0;
+reactor_t *reactors = NULL;
+__thread reactor_t *current_reactor = NULL;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 // Simple hash function
-unsigned long simple_hash(char *str) {
+unsigned long simple_hash(const char *str) {
     unsigned long hash = 5381;
     int c;
     while ((c = *str++))
@@ -59,665 +971,7912 @@ unsigned long simple_hash(char *str) {
     return hash;
 }
 
-// Load users from file
-void load_users() {
-    FILE *fp = fopen(USER_DB_FILE, "r");
-    if (fp == NULL) {
-        printf("No user database found. Starting fresh.\n");
-        return;
-    }
-    
-    while (fscanf(fp, "%49s %99s %d %ld", 
-                  users[user_count].username, 
-                  users[user_count].password,
-                  &users[user_count].is_online,
-                  &users[user_count].last_seen) == 4) {
-        users[user_count].is_online = 0;
-        user_count++;
-        if (user_count >= MAX_USERS) break;
-    }
-    fclose(fp);
-    printf("Loaded %d users from database.\n", user_count);
+static size_t user_slot(unsigned long hash, size_t mask) {
+    return ((hash * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
 }
 
-// Save users to file
-void save_users() {
-    FILE *fp = fopen(USER_DB_FILE, "w");
-    if (fp == NULL) {
-        perror("Failed to save user database");
-        return;
-    }
-    
-    for (int i = 0; i < user_count; i++) {
-        fprintf(fp, "%s %s %d %ld\n", 
-                users[i].username, 
-                users[i].password,
-                users[i].is_online,
-                users[i].last_seen);
+static const char *snap_string(uint64_t off) {
+    return off < user_snap.arena_len ? user_snap.arena + off : "";
+}
+
+// Accessors by user id, covering both the snapshot and later accounts.
+// Caller holds users_lock (read or write).
+const char *user_name(int idx) {
+    if (idx < user_snap.count) return snap_string(user_snap.records[idx].name_off);
+    return users[idx - user_snap.count].username;
+}
+
+const char *user_password(int idx) {
+    if (idx < user_snap.count) return snap_string(user_snap.records[idx].pass_off);
+    return users[idx - user_snap.count].password;
+}
+
+user_state_t *user_state(int idx) {
+    if (idx < user_snap.count) return &user_snap.state[idx];
+    return &users[idx - user_snap.count].state;
+}
+
+// Snapshot accounts report their stored last_seen until they log in or out
+time_t user_last_seen(int idx) {
+    time_t seen = __atomic_load_n(&user_state(idx)->last_seen, __ATOMIC_RELAXED);
+    if (seen == 0 && idx < user_snap.count) seen = user_snap.records[idx].last_seen;
+    return seen;
+}
+
+// Rebuild the index with the given number of slots (a power of two)
+int user_index_rebuild(size_t slots) {
+    user_slot_t *index = calloc(slots, sizeof(user_slot_t));
+    if (index == NULL) return -1;
+    free(user_index);
+    user_index = index;
+    user_index_mask = slots - 1;
+
+    for (int i = 0; i < user_count - user_snap.count; i++) {
+        unsigned long hash = simple_hash(users[i].username);
+        size_t slot = user_slot(hash, user_index_mask);
+        while (user_index[slot].idx) slot = (slot + 1) & user_index_mask;
+        user_index[slot].hash = (uint32_t)hash;
+        user_index[slot].idx = i + 1;
     }
-    fclose(fp);
+    return 0;
+}
+
+// Make room for one more record. Caller holds users_lock for writing.
+int user_table_reserve() {
+    if (user_count - user_snap.count < user_capacity) return 0;
+
+    int new_capacity = user_capacity ? user_capacity * 2 : USER_TABLE_MIN;
+    user_account_t *grown = realloc(users, new_capacity * sizeof(user_account_t));
+    if (grown == NULL) return -1;
+    users = grown;
+    user_capacity = new_capacity;
+    return user_index_rebuild((size_t)new_capacity * 2);
 }
 
-// Find user by username
+// Find user by username. Caller holds users_lock (read or write).
 int find_user(char *username) {
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].username, username) == 0) {
-            return i;
+    unsigned long hash = simple_hash(username);
+    
+    // Snapshot accounts are probed in the mapped index itself
+    if (user_snap.count > 0) {
+        size_t slot = user_slot(hash, user_snap.index_mask);
+        while (user_snap.index[slot].idx) {
+            if (user_snap.index[slot].hash == (uint32_t)hash) {
+                int i = user_snap.index[slot].idx - 1;
+                if (i < user_snap.count && strcmp(user_name(i), username) == 0) return i;
+            }
+            slot = (slot + 1) & user_snap.index_mask;
         }
     }
+    
+    if (user_index == NULL) return -1;
+    size_t slot = user_slot(hash, user_index_mask);
+    while (user_index[slot].idx) {
+        if (user_index[slot].hash == (uint32_t)hash) {
+            int i = user_index[slot].idx - 1;
+            if (strcmp(users[i].username, username) == 0) return user_snap.count + i;
+        }
+        slot = (slot + 1) & user_index_mask;
+    }
     return -1;
 }
 
-// Register new user
-int register_user(char *username, char *password) {
-    pthread_mutex_lock(&users_mutex);
+// Append a record and index it. Caller holds users_lock for writing.
+int add_user_record(const char *username, const char *password, time_t last_seen) {
+    if (user_table_reserve() < 0) return -1;
+
+    // Same limits as the fixed-size fields this used to be stored in
+    size_t name_len = strnlen(username, 49);
+    size_t pass_len = strnlen(password, 99);
+    char *strings = malloc(name_len + pass_len + 2);
+    if (strings == NULL) return -1;
     
-    if (find_user(username) != -1) {
-        pthread_mutex_unlock(&users_mutex);
-        return 0;
+    int added = user_count - user_snap.count;
+    user_account_t *user = &users[added];
+    user->username = strings;
+    memcpy(user->username, username, name_len);
+    user->username[name_len] = '\0';
+    user->password = strings + name_len + 1;
+    memcpy(user->password, password, pass_len);
+    user->password[pass_len] = '\0';
+    user->state.is_online = 0;
+    user->state.last_seen = last_seen;
+    user->state.shard = -1;
+
+    unsigned long hash = simple_hash(user->username);
+    size_t slot = user_slot(hash, user_index_mask);
+    while (user_index[slot].idx) slot = (slot + 1) & user_index_mask;
+    user_index[slot].hash = (uint32_t)hash;
+    user_index[slot].idx = added + 1;
+    return user_count++;
+}
+
+// Apply a journal on top of the loaded snapshot. Replaying is idempotent,
+// so records already in the snapshot are harmless. A torn last line from
+// a crash simply ends the replay.
+void replay_journal(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return;
+    
+    char type[2], username[50], value[100];
+    long last_seen;
+    int replayed = 0;
+    while (fscanf(fp, "%1s %49s %99s %ld", type, username, value, &last_seen) == 4) {
+        int user_idx = find_user(username);
+        if (type[0] == 'R' && user_idx == -1) {
+            add_user_record(username, value, last_seen);
+        } else if (type[0] == 'P' && user_idx != -1) {
+            user_state(user_idx)->last_seen = last_seen;
+        }
+        replayed++;
+    }
+    fclose(fp);
+    printf("Replayed %d journal records from %s.\n", replayed, path);
+}
+
+// Map users.snap and check its header. Records, index and arena are used
+// in place, so this costs the same for a thousand accounts as for millions.
+// Returns 1 if mapped, 0 if there is no snapshot, -1 if it is unusable.
+int map_user_snapshot(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return 0;
+        perror("Failed to open user snapshot");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(user_snap_header_t)) {
+        fprintf(stderr, "%s: not a user snapshot\n", path);
+        close(fd);
+        return -1;
     }
     
-    if (user_count >= MAX_USERS) {
-        pthread_mutex_unlock(&users_mutex);
+    uint64_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map user snapshot");
         return -1;
     }
     
-    strcpy(users[user_count].username, username);
-    sprintf(users[user_count].password, "%lu", simple_hash(password));
-    users[user_count].is_online = 0;
-    users[user_count].last_seen = time(NULL);
-    user_count++;
+    const user_snap_header_t *hdr = map;
+    if (memcmp(hdr->magic, USER_SNAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != USER_SNAP_VERSION ||
+        hdr->byte_order != USER_SNAP_BYTE_ORDER ||
+        hdr->user_count > INT_MAX / 2 ||
+        hdr->index_slots <= hdr->user_count ||
+        (hdr->index_slots & (hdr->index_slots - 1)) != 0 ||
+        (hdr->records_off | hdr->index_off) % 8 != 0 ||
+        hdr->records_off > size ||
+        hdr->user_count > (size - hdr->records_off) / sizeof(user_snap_record_t) ||
+        hdr->index_off > size ||
+        hdr->index_slots > (size - hdr->index_off) / sizeof(user_slot_t) ||
+        hdr->arena_off > size ||
+        hdr->arena_len > size - hdr->arena_off ||
+        (hdr->arena_len > 0 && ((const char *)map)[hdr->arena_off + hdr->arena_len - 1] != '\0')) {
+        fprintf(stderr, "%s: bad or unsupported user snapshot\n", path);
+        munmap(map, size);
+        return -1;
+    }
     
-    save_users();
-    pthread_mutex_unlock(&users_mutex);
+    // calloc of a large block is fresh zero pages, so this is not O(users) either
+    user_snap.state = calloc(hdr->user_count ? hdr->user_count : 1, sizeof(user_state_t));
+    if (user_snap.state == NULL) {
+        munmap(map, size);
+        return -1;
+    }
+    user_snap.map = map;
+    user_snap.map_len = size;
+    user_snap.records = (const user_snap_record_t *)((const char *)map + hdr->records_off);
+    user_snap.index = (const user_slot_t *)((const char *)map + hdr->index_off);
+    user_snap.index_mask = hdr->index_slots - 1;
+    user_snap.arena = (const char *)map + hdr->arena_off;
+    user_snap.arena_len = hdr->arena_len;
+    user_snap.count = (int)hdr->user_count;
+    user_count = user_snap.count;
     return 1;
 }
 
-// Authenticate user
-int authenticate_user(char *username, char *password) {
-    pthread_mutex_lock(&users_mutex);
+// Parse a text users.db (one "user passhash online last_seen" per line)
+// into the in-memory table. Returns the number of accounts read, or -1.
+int load_user_text(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
     
-    int user_idx = find_user(username);
-    if (user_idx == -1) {
-        pthread_mutex_unlock(&users_mutex);
-        return 0;
+    char username[50], password[100];
+    int is_online;
+    long last_seen;
+    int loaded = 0;
+    while (fscanf(fp, "%49s %99s %d %ld", username, password, &is_online, &last_seen) == 4) {
+        if (find_user(username) != -1) continue;
+        if (add_user_record(username, password, last_seen) < 0) {
+            perror("Failed to grow user table");
+            break;
+        }
+        loaded++;
     }
+    fclose(fp);
+    return loaded;
+}
+
+// Load users: the binary snapshot if there is one, else the old text
+// users.db, then whatever the journal recorded since.
+int load_users() {
+    double start = now_seconds();
+    int mapped = map_user_snapshot(USER_SNAP_FILE);
     
-    char hashed_pass[100];
-    sprintf(hashed_pass, "%lu", simple_hash(password));
-    
-    if (strcmp(users[user_idx].password, hashed_pass) == 0) {
-        users[user_idx].is_online = 1;
-        users[user_idx].last_seen = time(NULL);
-        save_users();
-        pthread_mutex_unlock(&users_mutex);
-        return 1;
+    if (mapped < 0) {
+        // Falling back to users.db here would silently lose accounts
+        return -1;
+    } else if (mapped) {
+        printf("Mapped %d users from %s in %.1f ms.\n", user_snap.count, USER_SNAP_FILE,
+               (now_seconds() - start) * 1000);
+    } else if (load_user_text(USER_DB_FILE) >= 0) {
+        printf("Read %d users from %s; converting to %s.\n", user_count, USER_DB_FILE, USER_SNAP_FILE);
+        user_snapshot_stale = 1;
+    } else {
+        printf("No user database found. Starting fresh.\n");
     }
     
-    pthread_mutex_unlock(&users_mutex);
+    // A journal left over from an interrupted compaction comes first
+    replay_journal(USER_JOURNAL_FILE ".old");
+    replay_journal(USER_JOURNAL_FILE);
+    printf("Loaded %d users from database.\n", user_count);
     return 0;
 }
 
-// Logout user
-void logout_user(char *username) {
-    pthread_mutex_lock(&users_mutex);
-    int user_idx = find_user(username);
-    if (user_idx != -1) {
-        users[user_idx].is_online = 0;
-        users[user_idx].last_seen = time(NULL);
-        save_users();
+// Write a snapshot of the given accounts to path.tmp and rename it into place
+int write_user_snapshot(const char *path, const user_snap_entry_t *entries, int count) {
+    char tmp_path[256];
+    user_snap_header_t hdr;
+    size_t slots = 16;
+    
+    while (slots < (size_t)count * 2) slots <<= 1;
+    user_slot_t *index = calloc(slots, sizeof(user_slot_t));
+    if (index == NULL) return -1;
+    
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, USER_SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = USER_SNAP_VERSION;
+    hdr.byte_order = USER_SNAP_BYTE_ORDER;
+    hdr.user_count = count;
+    hdr.index_slots = slots;
+    hdr.records_off = sizeof(hdr);
+    hdr.index_off = hdr.records_off + (uint64_t)count * sizeof(user_snap_record_t);
+    hdr.arena_off = hdr.index_off + slots * sizeof(user_slot_t);
+    for (int i = 0; i < count; i++) {
+        unsigned long hash = simple_hash(entries[i].username);
+        size_t slot = user_slot(hash, slots - 1);
+        while (index[slot].idx) slot = (slot + 1) & (slots - 1);
+        index[slot].hash = (uint32_t)hash;
+        index[slot].idx = i + 1;
+        hdr.arena_len += strlen(entries[i].username) + 1 + strlen(entries[i].password) + 1;
+    }
+    
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        perror("Failed to save user snapshot");
+        free(index);
+        return -1;
+    }
+    
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    uint64_t off = 0;
+    for (int i = 0; i < count; i++) {
+        user_snap_record_t rec;
+        rec.name_off = off;
+        off += strlen(entries[i].username) + 1;
+        rec.pass_off = off;
+        off += strlen(entries[i].password) + 1;
+        rec.last_seen = entries[i].last_seen;
+        fwrite(&rec, sizeof(rec), 1, fp);
+    }
+    fwrite(index, sizeof(user_slot_t), slots, fp);
+    for (int i = 0; i < count; i++) {
+        fwrite(entries[i].username, 1, strlen(entries[i].username) + 1, fp);
+        fwrite(entries[i].password, 1, strlen(entries[i].password) + 1, fp);
+    }
+    free(index);
+    
+    if (ferror(fp) || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        perror("Failed to save user snapshot");
+        fclose(fp);
+        unlink(tmp_path);
+        return -1;
     }
-    pthread_mutex_unlock(&users_mutex);
+    fclose(fp);
+    return rename(tmp_path, path);
 }
 
-// Find client by username
-client_t* find_client_by_username(char *username) {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i] && strcmp(clients[i]->username, username) == 0) {
-            return clients[i];
-        }
+// List every account for a snapshot. Caller holds users_lock; the strings
+// stay valid after it is released because accounts are never removed.
+user_snap_entry_t *collect_user_entries(int *count) {
+    user_snap_entry_t *entries = malloc((user_count ? user_count : 1) * sizeof(user_snap_entry_t));
+    if (entries == NULL) return NULL;
+    for (int i = 0; i < user_count; i++) {
+        entries[i].username = user_name(i);
+        entries[i].password = user_password(i);
+        entries[i].last_seen = user_last_seen(i);
     }
-    return NULL;
+    *count = user_count;
+    return entries;
 }
 
-// Add client
-void add_client(client_t *client) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i] == NULL) {
-            clients[i] = client;
-            client_count++;
-            break;
-        }
+// ./server --convert-users: one-shot conversion of a text users.db
+int convert_user_db(const char *text_path, const char *snap_path) {
+    double start = now_seconds();
+    int count;
+    
+    if (load_user_text(text_path) < 0) {
+        perror(text_path);
+        return -1;
     }
-    pthread_mutex_unlock(&clients_mutex);
+    user_snap_entry_t *entries = collect_user_entries(&count);
+    if (entries == NULL || write_user_snapshot(snap_path, entries, count) < 0) {
+        fprintf(stderr, "Failed to write %s\n", snap_path);
+        free(entries);
+        return -1;
+    }
+    free(entries);
+    printf("Converted %d users from %s to %s in %.2f s\n", count, text_path, snap_path,
+           now_seconds() - start);
+    return 0;
 }
 
-// Remove client
-void remove_client(int id) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i] && clients[i]->id == id) {
-            if (clients[i]->is_authenticated) {
-                logout_user(clients[i]->username);
+// Queue one journal record. Returns its sequence number, or 0 if the
+// journal is not running.
+unsigned long journal_append(char type, const char *username, const char *value, time_t when) {
+    char line[200];
+    int len = snprintf(line, sizeof(line), "%c %s %s %ld\n", type, username, value, (long)when);
+    unsigned long seq = 0;
+    
+    pthread_mutex_lock(&user_journal.lock);
+    if (user_journal.fd >= 0) {
+        if (user_journal.pending_len + len > user_journal.pending_cap) {
+            size_t cap = user_journal.pending_cap ? user_journal.pending_cap * 2 : 4096;
+            while (cap < user_journal.pending_len + len) cap *= 2;
+            char *grown = realloc(user_journal.pending, cap);
+            if (grown == NULL) {
+                pthread_mutex_unlock(&user_journal.lock);
+                return 0;
             }
-            clients[i] = NULL;
-            client_count--;
-            break;
+            user_journal.pending = grown;
+            user_journal.pending_cap = cap;
         }
+        memcpy(user_journal.pending + user_journal.pending_len, line, len);
+        user_journal.pending_len += len;
+        seq = ++user_journal.appended_seq;
+        pthread_cond_signal(&user_journal.work);
     }
-    pthread_mutex_unlock(&clients_mutex);
+    pthread_mutex_unlock(&user_journal.lock);
+    return seq;
 }
 
-// Send message to all authenticated clients
-void send_message_to_all(char *message, int sender_id) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i] && clients[i]->id != sender_id && clients[i]->is_authenticated) {
-            if (send(clients[i]->socket, message, strlen(message), 0) < 0) {
-                perror("Failed to send message");
-            }
-        }
+// With FSYNC_ALWAYS, block until the record is on disk. Everyone waiting
+// on the same batch is released by a single fsync.
+void journal_wait(unsigned long seq) {
+    if (fsync_policy != FSYNC_ALWAYS || seq == 0) return;
+    pthread_mutex_lock(&user_journal.lock);
+    while (user_journal.synced_seq < seq && user_journal.fd >= 0) {
+        pthread_cond_wait(&user_journal.durable, &user_journal.lock);
     }
-    pthread_mutex_unlock(&clients_mutex);
+    pthread_mutex_unlock(&user_journal.lock);
 }
 
-// Handle private message
-void handle_private_message(int sender_id, char* target_user, char* message) {
-    client_t *sender = NULL;
-    client_t *target = NULL;
+// Write the pending batch. Called by the journal thread with the lock held;
+// the lock is dropped around the I/O so appenders never wait for the disk.
+void journal_commit(int force_sync) {
+    char *batch = user_journal.pending;
+    size_t len = user_journal.pending_len;
+    unsigned long seq = user_journal.appended_seq;
+    unsigned long records = 0;
     
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i] && clients[i]->id == sender_id) {
-            sender = clients[i];
+    for (size_t i = 0; i < len; i++) {
+        if (batch[i] == '\n') records++;
+    }
+    user_journal.pending = NULL;
+    user_journal.pending_len = 0;
+    user_journal.pending_cap = 0;
+    pthread_mutex_unlock(&user_journal.lock);
+    
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(user_journal.fd, batch + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("Failed to write user journal");
             break;
         }
+        off += n;
     }
+    free(batch);
     
-    target = find_client_by_username(target_user);
-    pthread_mutex_unlock(&clients_mutex);
-    
-    if (!sender || !sender->is_authenticated) {
-        char error_msg[] = "Error: You must be logged in to send private messages";
-        send(sender_id, error_msg, strlen(error_msg), 0);
-        return;
+    time_t now = time(NULL);
+    int do_sync = force_sync || fsync_policy == FSYNC_ALWAYS ||
+                  (fsync_policy == FSYNC_INTERVAL && now != user_journal.last_sync);
+    if (do_sync && fdatasync(user_journal.fd) < 0) {
+        perror("Failed to sync user journal");
     }
     
-    if (!target || !target->is_authenticated) {
-        char error_msg[200];
-        snprintf(error_msg, sizeof(error_msg), "Error: User '%s' not found or offline", target_user);
-        send(sender->socket, error_msg, strlen(error_msg), 0);
+    pthread_mutex_lock(&user_journal.lock);
+    if (do_sync) user_journal.last_sync = now;
+    if (do_sync || fsync_policy == FSYNC_OFF) user_journal.synced_seq = seq;
+    user_journal.records += records;
+    user_journal.commits++;
+    pthread_cond_broadcast(&user_journal.durable);
+}
+
+// Fold the journal into a new users.snap. The journal is rotated first, so
+// logins keep appending to a fresh file while the snapshot is written
+// from a list of the accounts taken under the shared users_lock.
+void journal_compact() {
+    pthread_mutex_lock(&user_journal.lock);
+    if (user_journal.pending_len > 0) journal_commit(1);
+    // A previous compaction failed: keep its journal and just retry the snapshot
+    if (access(USER_JOURNAL_FILE ".old", F_OK) == 0) {
+        user_journal.compact_now = 0;
+        pthread_mutex_unlock(&user_journal.lock);
+    } else if (rename(USER_JOURNAL_FILE, USER_JOURNAL_FILE ".old") < 0 && errno != ENOENT) {
+        perror("Failed to rotate user journal");
+        pthread_mutex_unlock(&user_journal.lock);
         return;
+    } else {
+        int fd = open(USER_JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (fd < 0) {
+            perror("Failed to open user journal");
+            rename(USER_JOURNAL_FILE ".old", USER_JOURNAL_FILE);
+            pthread_mutex_unlock(&user_journal.lock);
+            return;
+        }
+        close(user_journal.fd);
+        user_journal.fd = fd;
+        user_journal.records = 0;
+        user_journal.compact_now = 0;
+        pthread_mutex_unlock(&user_journal.lock);
     }
     
-    char private_msg[BUFFER_SIZE + 100];
-    snprintf(private_msg, sizeof(private_msg), "[PRIVATE] %s: %s", sender->username, message);
-    send(target->socket, private_msg, strlen(private_msg), 0);
+    int count;
+    pthread_rwlock_rdlock(&users_lock);
+    user_snap_entry_t *entries = collect_user_entries(&count);
+    pthread_rwlock_unlock(&users_lock);
+    if (entries == NULL) return;
     
-    char confirm_msg[200];
-    snprintf(confirm_msg, sizeof(confirm_msg), "Private message sent to %s", target_user);
-    send(sender->socket, confirm_msg, strlen(confirm_msg), 0);
+    if (write_user_snapshot(USER_SNAP_FILE, entries, count) == 0) {
+        unlink(USER_JOURNAL_FILE ".old");
+    }
+    free(entries);
     
-    printf("Private message from %s to %s: %s\n", sender->username, target_user, message);
+    pthread_mutex_lock(&user_journal.lock);
+    user_journal.compactions++;
+    user_journal.last_compaction = time(NULL);
+    pthread_mutex_unlock(&user_journal.lock);
 }
 
-// List online users
-void list_online_users(int client_socket) {
-    char user_list[BUFFER_SIZE] = "Online users: ";
-    int first = 1;
-    
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i] && clients[i]->is_authenticated) {
-            if (!first) strcat(user_list, ", ");
-            strcat(user_list, clients[i]->username);
-            first = 0;
+void *journal_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&user_journal.lock);
+    while (1) {
+        if (user_journal.pending_len == 0 && !user_journal.compact_now) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&user_journal.work, &user_journal.lock, &deadline);
+        }
+        
+        if (user_journal.pending_len > 0) {
+            journal_commit(0);
+        } else if (fsync_policy == FSYNC_INTERVAL &&
+                   user_journal.synced_seq < user_journal.appended_seq) {
+            // Cover records written since the last once-per-second sync
+            journal_commit(1);
+        }
+        
+        time_t now = time(NULL);
+        int big = user_journal.records >= JOURNAL_COMPACT_MIN &&
+                  user_journal.records >= (unsigned long)user_count;
+        // Rewriting the whole snapshot for a handful of logins isn't worth it
+        int stale = user_journal.records > 0 &&
+                    user_journal.records * JOURNAL_STALE_FRACTION >= (unsigned long)user_count &&
+                    now - user_journal.last_compaction >= compact_interval;
+        if (user_journal.compact_now || big || stale) {
+            pthread_mutex_unlock(&user_journal.lock);
+            journal_compact();
+            pthread_mutex_lock(&user_journal.lock);
         }
     }
-    pthread_mutex_unlock(&clients_mutex);
-    
-    if (first) {
-        strcpy(user_list, "No users online");
-    }
-    
-    send(client_socket, user_list, strlen(user_list), 0);
+    return NULL;
 }
 
-// File handling functions (unchanged)
-void handle_file_put(int client_socket, char *filename) {
-    long file_size;
+int start_user_journal() {
+    struct stat st;
+    pthread_t tid;
     
-    if (recv(client_socket, &file_size, sizeof(file_size), 0) <= 0) {
-        printf("Failed to receive file size\n");
-        return;
+    user_journal.fd = open(USER_JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (user_journal.fd < 0) {
+        perror("Failed to open user journal");
+        return -1;
     }
-    file_size = ntohl(file_size);
+    user_journal.last_compaction = time(NULL);
+    // Records replayed at startup are folded into the snapshot right away
+    if (user_snapshot_stale || stat(USER_JOURNAL_FILE ".old", &st) == 0 ||
+        (fstat(user_journal.fd, &st) == 0 && st.st_size > 0)) {
+        user_journal.compact_now = 1;
+    }
+    if (pthread_create(&tid, NULL, journal_thread, NULL) != 0) {
+        perror("Failed to create journal thread");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Register new user
+int register_user(char *username, char *password) {
+    char hashed_pass[100];
+    sprintf(hashed_pass, "%lu", simple_hash(password));
+    
+    pthread_rwlock_wrlock(&users_lock);
+    
+    if (find_user(username) != -1) {
+        pthread_rwlock_unlock(&users_lock);
+        return 0;
+    }
+    
+    time_t now = time(NULL);
+    if (add_user_record(username, hashed_pass, now) < 0) {
+        pthread_rwlock_unlock(&users_lock);
+        return -1;
+    }
+    
+    unsigned long seq = journal_append('R', username, hashed_pass, now);
+    pthread_rwlock_unlock(&users_lock);
+    journal_wait(seq);
+    return 1;
+}
+
+// Authenticate user; *last_seen gets when they were last here
+int authenticate_user(char *username, char *password, time_t *last_seen) {
+    char hashed_pass[100];
+    sprintf(hashed_pass, "%lu", simple_hash(password));
+    
+    pthread_rwlock_rdlock(&users_lock);
+    
+    int user_idx = find_user(username);
+    if (user_idx == -1) {
+        pthread_rwlock_unlock(&users_lock);
+        return 0;
+    }
+    
+    if (strcmp(user_password(user_idx), hashed_pass) == 0) {
+        time_t now = time(NULL);
+        user_state_t *state = user_state(user_idx);
+        *last_seen = user_last_seen(user_idx);
+        __atomic_store_n(&state->is_online, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&state->last_seen, now, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&users_lock);
+        journal_wait(journal_append('P', username, "1", now));
+        return 1;
+    }
+    
+    pthread_rwlock_unlock(&users_lock);
+    return 0;
+}
+
+// Logout user
+void logout_user(char *username) {
+    pthread_rwlock_rdlock(&users_lock);
+    int user_idx = find_user(username);
+    time_t now = time(NULL);
+    if (user_idx != -1) {
+        user_state_t *state = user_state(user_idx);
+        __atomic_store_n(&state->is_online, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&state->last_seen, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&state->shard, -1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&users_lock);
+    if (user_idx != -1) {
+        journal_append('P', username, "0", now);
+    }
+}
+
+// Record which shard a logged-in user lives on
+void set_user_shard(char *username, int shard) {
+    pthread_rwlock_rdlock(&users_lock);
+    int user_idx = find_user(username);
+    if (user_idx != -1) {
+        __atomic_store_n(&user_state(user_idx)->shard, shard, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&users_lock);
+}
+
+// Shard a user is logged in on, or -1 if offline
+int find_user_shard(char *username) {
+    int shard = -1;
+    pthread_rwlock_rdlock(&users_lock);
+    int user_idx = find_user(username);
+    if (user_idx != -1 && __atomic_load_n(&user_state(user_idx)->is_online, __ATOMIC_RELAXED)) {
+        shard = __atomic_load_n(&user_state(user_idx)->shard, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&users_lock);
+    return shard;
+}
+
+// Connection registry
+
+// Index a session by id. Returns -1 when out of memory.
+int registry_add(client_registry_t *r, client_t *client) {
+    if (r->count == r->cap) {
+        int cap = r->cap ? r->cap * 2 : REGISTRY_MIN;
+        client_t **live = realloc(r->live, cap * sizeof(client_t *));
+        if (live == NULL) return -1;
+        r->live = live;
+        r->cap = cap;
+    }
+    if (client->id >= r->slot_cap) {
+        int cap = r->slot_cap ? r->slot_cap : REGISTRY_MIN;
+        while (cap <= client->id) cap *= 2;
+        int *slots = realloc(r->slots, cap * sizeof(int));
+        if (slots == NULL) return -1;
+        memset(slots + r->slot_cap, 0, (cap - r->slot_cap) * sizeof(int));
+        r->slots = slots;
+        r->slot_cap = cap;
+    }
+    client->slot = r->count;
+    r->live[r->count++] = client;
+    r->slots[client->id] = client->slot + 1;
+    return 0;
+}
+
+client_t *registry_get(client_registry_t *r, int id) {
+    if (id < 0 || id >= r->slot_cap || r->slots[id] == 0) return NULL;
+    return r->live[r->slots[id] - 1];
+}
+
+client_t *registry_find_name(client_registry_t *r, const char *username) {
+    if (r->names == NULL) return NULL;
+    unsigned long hash = simple_hash(username);
+    for (client_t *c = r->names[hash & r->name_mask]; c; c = c->name_next) {
+        if (c->name_hash == hash && strcmp(c->username, username) == 0) return c;
+    }
+    return NULL;
+}
+
+// Index a logged-in session by client->username
+int registry_set_name(client_registry_t *r, client_t *client) {
+    if (r->names == NULL || (size_t)r->named > r->name_mask) {
+        size_t old_size = r->names ? r->name_mask + 1 : 0;
+        size_t size = old_size ? old_size * 2 : REGISTRY_MIN;
+        client_t **names = calloc(size, sizeof(client_t *));
+        if (names == NULL) {
+            if (r->names == NULL) return -1;
+        } else {
+            for (size_t i = 0; i < old_size; i++) {
+                while (r->names[i]) {
+                    client_t *c = r->names[i];
+                    r->names[i] = c->name_next;
+                    c->name_next = names[c->name_hash & (size - 1)];
+                    names[c->name_hash & (size - 1)] = c;
+                }
+            }
+            free(r->names);
+            r->names = names;
+            r->name_mask = size - 1;
+        }
+    }
+    client->name_hash = simple_hash(client->username);
+    client_t **bucket = &r->names[client->name_hash & r->name_mask];
+    client->name_next = *bucket;
+    *bucket = client;
+    r->named++;
+    return 0;
+}
+
+// Drop a session from the id and name indexes. The last live session takes
+// its place in live[].
+void registry_remove(client_registry_t *r, client_t *client) {
+    if (registry_get(r, client->id) != client) return;
+    if (client->is_authenticated) {
+        client_t **link = &r->names[client->name_hash & r->name_mask];
+        while (*link && *link != client) link = &(*link)->name_next;
+        if (*link) {
+            *link = client->name_next;
+            r->named--;
+        }
+    }
+    client_t *last = r->live[--r->count];
+    r->live[client->slot] = last;
+    last->slot = client->slot;
+    r->slots[last->id] = last->slot + 1;
+    r->slots[client->id] = 0;
+}
+
+// Find a client in the calling shard's table
+client_t* shard_find_client(reactor_t *shard, int id, char *username) {
+    return username ? registry_find_name(&shard->registry, username) : registry_get(&shard->registry, id);
+}
+
+// Find client by username. Caller holds clients_mutex.
+client_t* find_client_by_username(char *username) {
+    return registry_find_name(&registry, username);
+}
+
+// Whether a session for this user exists anywhere on the server
+int is_user_logged_in(char *username) {
+    if (server_mode == SERVER_MODE_SHARDED) {
+        return find_user_shard(username) >= 0;
+    }
+    pthread_mutex_lock(&clients_mutex);
+    int found = find_client_by_username(username) != NULL;
+    pthread_mutex_unlock(&clients_mutex);
+    return found;
+}
+
+// Add client. Returns -1 when the server is at --max-clients.
+int add_client(client_t *client) {
+    if (atomic_fetch_add(&client_count, 1) >= max_clients) {
+        atomic_fetch_sub(&client_count, 1);
+        return -1;
+    }
+    int result;
+    if (server_mode == SERVER_MODE_SHARDED) {
+        result = registry_add(&client->reactor->registry, client);
+    } else {
+        pthread_mutex_lock(&clients_mutex);
+        result = registry_add(&registry, client);
+        pthread_mutex_unlock(&clients_mutex);
+    }
+    if (result < 0) atomic_fetch_sub(&client_count, 1);
+    return result;
+}
+
+void presence_join(const char *name);
+void presence_leave(const char *name);
+
+// Mark a session logged in and index it under its username. Returns -1
+// when out of memory.
+int set_client_user(client_t *client, const char *username) {
+    client_registry_t *r = server_mode == SERVER_MODE_SHARDED ? &client->reactor->registry : &registry;
+    if (server_mode != SERVER_MODE_SHARDED) pthread_mutex_lock(&clients_mutex);
+    strcpy(client->username, username);
+    int result = registry_set_name(r, client);
+    if (result == 0) {
+        client->is_authenticated = 1;
+        presence_join(username);
+    }
+    if (server_mode != SERVER_MODE_SHARDED) pthread_mutex_unlock(&clients_mutex);
+    return result;
+}
+
+// Remove client
+void remove_client(int id) {
+    client_registry_t *r = server_mode == SERVER_MODE_SHARDED ? &current_reactor->registry : &registry;
+    if (server_mode != SERVER_MODE_SHARDED) pthread_mutex_lock(&clients_mutex);
+    client_t *client = registry_get(r, id);
+    if (client) {
+        if (client->is_authenticated) {
+            logout_user(client->username);
+            presence_leave(client->username);
+        }
+        if (client->presence_sub) atomic_fetch_sub(&presence.subscribers, 1);
+        registry_remove(r, client);
+        atomic_fetch_sub(&client_count, 1);
+    }
+    if (server_mode != SERVER_MODE_SHARDED) pthread_mutex_unlock(&clients_mutex);
+}
+
+int set_nonblocking(int fd, int enable) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+// Memory pools
+//
+// Sessions come from per-reactor slab pools (thread mode shares one).
+// Message buffers, queue entries, socket input and scratch space for
+// commands come from size classes, each with a free list that keeps up to
+// POOL_CACHE_BYTES of released buffers for reuse. Allocations larger than
+// every class go straight to malloc.
+
+#define BUF_CLASS(n) { .lock = PTHREAD_MUTEX_INITIALIZER, .size = (n) }
+buf_class_t buf_classes[POOL_CLASSES] = {
+    BUF_CLASS(64), BUF_CLASS(128), BUF_CLASS(256), BUF_CLASS(512), BUF_CLASS(1024),
+    BUF_CLASS(2048), BUF_CLASS(4096), BUF_CLASS(8192), BUF_CLASS(16384), BUF_CLASS(IN_BUF_SIZE)
+};
+slab_pool_t client_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .size = (sizeof(client_t) + 15) & ~(size_t)15 };
+
+static buf_class_t *buf_class_for(size_t size) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        if (size <= buf_classes[i].size) return &buf_classes[i];
+    }
+    return NULL;
+}
+
+// Get a buffer of at least size bytes. Give it back with buf_pool_free()
+// and the same size.
+void *buf_pool_alloc(size_t size) {
+    buf_class_t *c = buf_class_for(size);
+    if (c == NULL) return malloc(size);
+
+    pthread_mutex_lock(&c->lock);
+    void *p = c->free;
+    if (p) {
+        c->free = *(void **)p;
+        c->cached--;
+        c->reused++;
+    }
+    c->allocs++;
+    if (++c->in_use > c->peak) c->peak = c->in_use;
+    pthread_mutex_unlock(&c->lock);
+
+    if (p == NULL && (p = malloc(c->size)) == NULL) {
+        pthread_mutex_lock(&c->lock);
+        c->allocs--;
+        c->in_use--;
+        pthread_mutex_unlock(&c->lock);
+    }
+    return p;
+}
+
+void buf_pool_free(void *p, size_t size) {
+    if (p == NULL) return;
+    buf_class_t *c = buf_class_for(size);
+    if (c == NULL) {
+        free(p);
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->in_use--;
+    int keep = (c->cached + 1) * c->size <= POOL_CACHE_BYTES;
+    if (keep) {
+        *(void **)p = c->free;
+        c->free = p;
+        c->cached++;
+    } else {
+        c->released++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (!keep) free(p);
+}
+
+void slab_pool_init(slab_pool_t *pool, size_t size) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->size = (size + 15) & ~(size_t)15;
+}
+
+void *slab_alloc(slab_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free == NULL) {
+        if (pool->slab_count == pool->slab_cap) {
+            int cap = pool->slab_cap ? pool->slab_cap * 2 : 16;
+            void **slabs = realloc(pool->slabs, cap * sizeof(void *));
+            if (slabs == NULL) {
+                pthread_mutex_unlock(&pool->lock);
+                return NULL;
+            }
+            pool->slabs = slabs;
+            pool->slab_cap = cap;
+        }
+        char *slab = malloc(pool->size * SLAB_OBJECTS);
+        if (slab == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        pool->slabs[pool->slab_count++] = slab;
+        for (int i = SLAB_OBJECTS - 1; i >= 0; i--) {
+            *(void **)(slab + i * pool->size) = pool->free;
+            pool->free = slab + i * pool->size;
+        }
+    }
+    void *p = pool->free;
+    pool->free = *(void **)p;
+    pool->allocs++;
+    if (++pool->in_use > pool->peak) pool->peak = pool->in_use;
+    pthread_mutex_unlock(&pool->lock);
+    return p;
+}
+
+void slab_free(slab_pool_t *pool, void *p) {
+    pthread_mutex_lock(&pool->lock);
+    *(void **)p = pool->free;
+    pool->free = p;
+    pool->in_use--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+typedef struct {
+    int objects;                    // Session objects handed out
+    int slabs;
+    long buffers;                   // Pooled buffers handed out
+    size_t cached_bytes;            // Free buffers waiting for reuse
+    unsigned long allocs;
+    unsigned long reused;
+    unsigned long released;
+} pool_stats_t;
+
+void pool_stats(pool_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = -1; i < reactor_count; i++) {
+        slab_pool_t *pool = i < 0 ? &client_pool : &reactors[i].client_pool;
+        pthread_mutex_lock(&pool->lock);
+        out->objects += pool->in_use;
+        out->slabs += pool->slab_count;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        buf_class_t *c = &buf_classes[i];
+        pthread_mutex_lock(&c->lock);
+        out->buffers += c->in_use;
+        out->cached_bytes += c->cached * c->size;
+        out->allocs += c->allocs;
+        out->reused += c->reused;
+        out->released += c->released;
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+// Resident set size of the whole server
+size_t resident_bytes() {
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) return 0;
+    if (fscanf(f, "%*s %ld", &pages) != 1) pages = 0;
+    fclose(f);
+    return (size_t)pages * sysconf(_SC_PAGESIZE);
+}
+
+msg_buf_t *msg_buf_new(const char *data, size_t len) {
+    msg_buf_t *buf = buf_pool_alloc(sizeof(msg_buf_t) + len + 1);
+    if (buf == NULL) return NULL;
+    atomic_init(&buf->refs, 1);
+    buf->frame_type = FRAME_TEXT;
+    buf->frame_flags = 0;
+    buf->stream = 0;
+    buf->len = len;
+    buf->size = sizeof(msg_buf_t) + len + 1;
+    buf->data = buf->bytes;
+    buf->segment = NULL;
+    if (data) memcpy(buf->data, data, len);
+    buf->data[len] = '\0';
+    return buf;
+}
+
+// Format straight into a new buffer, so the text is encoded exactly once
+msg_buf_t *msg_buf_printf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0) return NULL;
+    
+    msg_buf_t *buf = msg_buf_new(NULL, len);
+    if (buf == NULL) return NULL;
+    va_start(args, fmt);
+    vsnprintf(buf->data, len + 1, fmt, args);
+    va_end(args);
+    return buf;
+}
+
+msg_buf_t *msg_buf_ref(msg_buf_t *buf) {
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    return buf;
+}
+
+void history_segment_unref(history_segment_t *seg);
+
+void msg_buf_unref(msg_buf_t *buf) {
+    if (buf && atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+        if (buf->segment) history_segment_unref(buf->segment);
+        buf_pool_free(buf, buf->size);
+    }
+}
+
+void frame_encode_header(unsigned char *hdr, uint32_t length, uint8_t type, uint8_t flags, uint16_t stream) {
+    hdr[0] = length >> 24;
+    hdr[1] = length >> 16;
+    hdr[2] = length >> 8;
+    hdr[3] = length;
+    hdr[4] = type;
+    hdr[5] = flags;
+    hdr[6] = stream >> 8;
+    hdr[7] = stream;
+}
+
+// Describe the unwritten part of (hdr, buf) starting at off. Returns the
+// number of iovec entries used (at most 2).
+int out_iov(struct iovec *iov, const unsigned char *hdr, size_t hdr_len, msg_buf_t *buf, size_t off) {
+    int n = 0;
+    if (off < hdr_len) {
+        iov[n].iov_base = (void *)(hdr + off);
+        iov[n].iov_len = hdr_len - off;
+        n++;
+        off = 0;
+    } else {
+        off -= hdr_len;
+    }
+    if (off < buf->len) {
+        iov[n].iov_base = buf->data + off;
+        iov[n].iov_len = buf->len - off;
+        n++;
+    }
+    return n;
+}
+
+void client_queue_append(client_t *client, msg_buf_t *buf, size_t off,
+                         const unsigned char *hdr, size_t hdr_len) {
+    out_msg_t *msg = buf_pool_alloc(sizeof(out_msg_t));
+    if (msg == NULL) return;
+    msg->next = NULL;
+    msg->buf = msg_buf_ref(buf);
+    msg->off = off;
+    msg->hdr_len = hdr_len;
+    if (hdr_len) memcpy(msg->hdr, hdr, hdr_len);
+
+    if (client->out_tail) {
+        client->out_tail->next = msg;
+    } else {
+        client->out_head = msg;
+    }
+    client->out_tail = msg;
+    client->out_depth++;
+    client->out_bytes += hdr_len + buf->len - off;
+
+    atomic_fetch_add(&queue_stats.queued, 1);
+    unsigned long max = atomic_load(&queue_stats.max_depth);
+    while (client->out_depth > max &&
+           !atomic_compare_exchange_weak(&queue_stats.max_depth, &max, client->out_depth)) {
+    }
+}
+
+void out_msg_free(out_msg_t *msg) {
+    msg_buf_unref(msg->buf);
+    buf_pool_free(msg, sizeof(out_msg_t));
+}
+
+// Drop the oldest message that has not started going out. Returns 0 if
+// the only queued message is already partly written.
+int client_queue_drop_oldest(client_t *client) {
+    out_msg_t *prev = NULL;
+    out_msg_t *victim = client->out_head;
+    if (victim && victim->off > 0) {
+        prev = victim;
+        victim = victim->next;
+    }
+    if (victim == NULL) return 0;
+
+    if (prev) {
+        prev->next = victim->next;
+    } else {
+        client->out_head = victim->next;
+    }
+    if (client->out_tail == victim) client->out_tail = prev;
+    client->out_depth--;
+    client->out_bytes -= victim->hdr_len + victim->buf->len;
+    client->out_dropped++;
+    atomic_fetch_add(&queue_stats.dropped, 1);
+    out_msg_free(victim);
+    return 1;
+}
+
+// Send a shared buffer to a client without ever blocking. If nothing is
+// queued it is written straight away; whatever the socket does not take
+// is queued by reference and written when the socket becomes writable.
+// A full queue is handled according to slow_policy. Returns -1 if the
+// client is being dropped.
+int client_send_buf(client_t *client, msg_buf_t *buf) {
+    size_t sent = 0;
+    int was_empty;
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    size_t hdr_len = 0;
+
+    pthread_mutex_lock(&client->out_lock);
+    if (client->out_closing) {
+        pthread_mutex_unlock(&client->out_lock);
+        return -1;
+    }
+    if (client->framed) {
+        frame_encode_header(hdr, buf->len, buf->frame_type, buf->frame_flags, buf->stream);
+        hdr_len = FRAME_HEADER_SIZE;
+    }
+
+    was_empty = client->out_head == NULL;
+    if (was_empty && !client->in_transfer && !client->download_partial) {
+        while (sent < hdr_len + buf->len) {
+            struct iovec iov[2];
+            struct msghdr mh;
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_iov = iov;
+            mh.msg_iovlen = out_iov(iov, hdr, hdr_len, buf, sent);
+            ssize_t n = sendmsg(client->socket, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+            atomic_fetch_add_explicit(&queue_stats.send_calls, 1, memory_order_relaxed);
+            if (n > 0) {
+                sent += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                pthread_mutex_unlock(&client->out_lock);
+                return -1;
+            }
+        }
+        if (sent == hdr_len + buf->len) {
+            atomic_fetch_add_explicit(&queue_stats.delivered, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&client->out_lock);
+            return 0;
+        }
+    }
+
+    if (client->out_depth >= queue_limit) {
+        // A transfer in progress is not a slow reader, so never cut it off
+        if (slow_policy == SLOW_DISCONNECT && !client->in_transfer) {
+            client->out_closing = 1;
+            atomic_fetch_add(&queue_stats.slow_disconnects, 1);
+            printf("Client %d exceeded %zu queued messages, disconnecting\n", client->id, queue_limit);
+            shutdown(client->socket, SHUT_RDWR);
+            pthread_mutex_unlock(&client->out_lock);
+            return -1;
+        }
+        if (!client_queue_drop_oldest(client)) {
+            client->out_dropped++;
+            atomic_fetch_add(&queue_stats.dropped, 1);
+            pthread_mutex_unlock(&client->out_lock);
+            return 0;
+        }
+    }
+
+    client_queue_append(client, buf, sent, hdr, hdr_len);
+    pthread_mutex_unlock(&client->out_lock);
+
+    if (was_empty && client->wake_fd >= 0) {
+        uint64_t one = 1;
+        if (write(client->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("Failed to wake client thread");
+        }
+    }
+    return 0;
+}
+
+// Send a one-off reply (copied into a fresh buffer)
+int client_send(client_t *client, const char *data, size_t len) {
+    msg_buf_t *buf = msg_buf_new(data, len);
+    if (buf == NULL) return -1;
+    int result = client_send_buf(client, buf);
+    msg_buf_unref(buf);
+    return result;
+}
+
+// Reply on the stream of the command it answers, so a framed client can
+// tell it apart from chat
+int client_send_stream(client_t *client, uint16_t stream, const char *data, size_t len) {
+    msg_buf_t *buf = msg_buf_new(data, len);
+    if (buf == NULL) return -1;
+    buf->stream = stream;
+    int result = client_send_buf(client, buf);
+    msg_buf_unref(buf);
+    return result;
+}
+
+// Write as much queued output as the socket accepts, gathering up to
+// FLUSH_IOV_MAX queued messages into each sendmsg() call. Returns -1 if
+// the connection is broken, 1 if the socket filled up before the queue
+// was empty.
+int client_flush_queue(client_t *client) {
+    int result = 0;
+
+    pthread_mutex_lock(&client->out_lock);
+    while (client->out_head) {
+        struct iovec iov[FLUSH_IOV_MAX];
+        struct msghdr mh;
+        int iovcnt = 0;
+        
+        for (out_msg_t *msg = client->out_head; msg && iovcnt + 2 <= FLUSH_IOV_MAX; msg = msg->next) {
+            iovcnt += out_iov(iov + iovcnt, msg->hdr, msg->hdr_len, msg->buf, msg->off);
+        }
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = iovcnt;
+        
+        ssize_t n = sendmsg(client->socket, &mh, MSG_NOSIGNAL);
+        atomic_fetch_add_explicit(&queue_stats.send_calls, 1, memory_order_relaxed);
+        if (n > 0) {
+            size_t written = n;
+            client->out_bytes -= written;
+            while (written > 0) {
+                out_msg_t *msg = client->out_head;
+                size_t left = msg->hdr_len + msg->buf->len - msg->off;
+                if (written < left) {
+                    msg->off += written;
+                    break;
+                }
+                written -= left;
+                client->out_head = msg->next;
+                if (client->out_head == NULL) client->out_tail = NULL;
+                client->out_depth--;
+                out_msg_free(msg);
+                atomic_fetch_add_explicit(&queue_stats.delivered, 1, memory_order_relaxed);
+            }
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            result = 1;
+            break;
+        } else {
+            result = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&client->out_lock);
+    return result;
+}
+
+int download_write(client_t *client);
+int mailbox_drain_step(client_t *client);
+
+// Make the connection's loop call client_flush() again soon. Thread mode
+// polls for POLLOUT whenever client_has_output(); an edge-triggered
+// reactor only reports a socket that is already writable once its
+// registration is refreshed.
+void client_rearm(client_t *client) {
+    if (client->reactor) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = client;
+        epoll_ctl(client->reactor->epoll_fd, EPOLL_CTL_MOD, client->socket, &ev);
+    }
+}
+
+// Write queued chat, then offline messages a batch at a time, then
+// background downloads a frame at a time, checking the queue again in
+// between. After DOWNLOAD_BURST frames (MAILBOX_FLUSH_BATCHES batches) the
+// loop yields so one client cannot monopolise a reactor.
+// Only the thread that owns the connection calls this.
+// Returns -1 if the connection is broken.
+int client_flush(client_t *client) {
+    for (int burst = 0; ; burst++) {
+        if (!client->download_partial) {
+            int queued = client_flush_queue(client);
+            if (queued != 0) return queued < 0 ? -1 : 0;
+            if (client->mail_drain && !client->in_transfer) {
+                if (burst == MAILBOX_FLUSH_BATCHES) {
+                    client_rearm(client);
+                    return 0;
+                }
+                if (mailbox_drain_step(client)) continue;
+            }
+            if (client->downloads == NULL) return 0;
+            if (burst == DOWNLOAD_BURST) {
+                client_rearm(client);
+                return 0;
+            }
+        }
+        int sent = download_write(client);
+        if (sent <= 0) return sent;
+    }
+}
+
+int client_has_output(client_t *client) {
+    pthread_mutex_lock(&client->out_lock);
+    int pending = client->out_head != NULL || client->downloads != NULL || client->mail_drain != NULL;
+    pthread_mutex_unlock(&client->out_lock);
+    return pending;
+}
+
+// Push a message onto another shard's inbox. Lock-free: a CAS push onto
+// a stack; the eventfd is only written when the inbox was empty.
+void shard_push(reactor_t *shard, inbox_msg_t *msg) {
+    inbox_msg_t *head = atomic_load_explicit(&shard->inbox, memory_order_relaxed);
+    do {
+        msg->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&shard->inbox, &head, msg,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(shard->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("Failed to wake shard");
+        }
+    }
+}
+
+void shard_post(reactor_t *shard, inbox_type_t type, int sender_id,
+                const char *target, msg_buf_t *buf) {
+    inbox_msg_t *msg = buf_pool_alloc(sizeof(inbox_msg_t));
+    if (msg == NULL) return;
+    msg->type = type;
+    msg->sender_id = sender_id;
+    msg->target[0] = '\0';
+    if (target) {
+        strncpy(msg->target, target, sizeof(msg->target) - 1);
+        msg->target[sizeof(msg->target) - 1] = '\0';
+    }
+    msg->channel = NULL;
+    msg->buf = msg_buf_ref(buf);
+    shard_push(shard, msg);
+}
+
+// Hand a reply to a session that may have moved on or gone away since it
+// asked: found again by id and username, or through its shard's inbox.
+void session_deliver(int client_id, int shard, const char *username, msg_buf_t *buf) {
+    if (server_mode == SERVER_MODE_SHARDED) {
+        shard_post(&reactors[shard], INBOX_SESSION, client_id, username, buf);
+        return;
+    }
+    pthread_mutex_lock(&clients_mutex);
+    client_t *c = registry_get(&registry, client_id);
+    if (c && c->is_authenticated && strcmp(c->username, username) == 0) {
+        client_send_buf(c, buf);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Deliver a broadcast to the authenticated clients of one shard
+void shard_deliver_broadcast(reactor_t *shard, msg_buf_t *buf, int sender_id) {
+    for (int i = 0; i < shard->registry.count; i++) {
+        client_t *c = shard->registry.live[i];
+        if (c->id != sender_id && c->is_authenticated) {
+            client_send_buf(c, buf);
+        }
+    }
+}
+
+void channel_deliver_set(channel_set_t *set, msg_buf_t *buf, int sender_id);
+void channel_unref(channel_t *channel);
+void presence_deliver(client_registry_t *r, msg_buf_t *buf);
+
+// Take everything from the inbox and deliver it in arrival order
+void shard_drain_inbox(reactor_t *shard) {
+    uint64_t count;
+    if (read(shard->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Failed to read shard eventfd");
+    }
+
+    inbox_msg_t *list = atomic_exchange_explicit(&shard->inbox, NULL, memory_order_acquire);
+    inbox_msg_t *ordered = NULL;
+    while (list) {
+        inbox_msg_t *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while (ordered) {
+        inbox_msg_t *msg = ordered;
+        ordered = msg->next;
+        if (msg->type == INBOX_BROADCAST) {
+            shard_deliver_broadcast(shard, msg->buf, msg->sender_id);
+        } else if (msg->type == INBOX_CHANNEL) {
+            channel_deliver_set(&msg->channel->sets[shard->id], msg->buf, msg->sender_id);
+            channel_unref(msg->channel);
+        } else if (msg->type == INBOX_PRESENCE) {
+            presence_deliver(&shard->registry, msg->buf);
+        } else if (msg->type == INBOX_SESSION) {
+            // Not whoever took over the id since, nor another login of the user
+            client_t *target = shard_find_client(shard, msg->sender_id, NULL);
+            if (target && target->is_authenticated && strcmp(target->username, msg->target) == 0) {
+                client_send_buf(target, msg->buf);
+            }
+        } else {
+            client_t *target = shard_find_client(shard, 0, msg->target);
+            if (target && target->is_authenticated) {
+                client_send_buf(target, msg->buf);
+            }
+        }
+        msg_buf_unref(msg->buf);
+        buf_pool_free(msg, sizeof(inbox_msg_t));
+    }
+}
+
+// Fan one encoded buffer out to all authenticated clients
+void broadcast_buf(msg_buf_t *buf, int sender_id) {
+    if (server_mode == SERVER_MODE_SHARDED) {
+        for (int i = 0; i < reactor_count; i++) {
+            if (&reactors[i] == current_reactor) {
+                shard_deliver_broadcast(current_reactor, buf, sender_id);
+            } else {
+                shard_post(&reactors[i], INBOX_BROADCAST, sender_id, NULL, buf);
+            }
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < registry.count; i++) {
+        client_t *c = registry.live[i];
+        if (c->id != sender_id && c->is_authenticated) {
+            client_send_buf(c, buf);
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Offline mailboxes
+//
+// A private message to a registered user who is not logged in is appended
+// to mailboxes.log, and an in-memory index per recipient points at its
+// record. Logging in reads the user's records (neighbouring ones with one
+// pread()) and packs them into large messages, sent one at a time as the
+// client's queue empties; once one has gone out a MAIL_DRAINED record
+// retires what it held. Once dead records outweigh live ones, the log is
+// rewritten with only the messages still waiting.
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+int write_all(int fd, const void *data, size_t len);
+
+static mailbox_t *mailbox_find(const char *name, unsigned long hash) {
+    if (mail.buckets == NULL) return NULL;
+    for (mailbox_t *mb = mail.buckets[hash & mail.mask]; mb; mb = mb->next) {
+        if (mb->hash == hash && strcmp(mb->name, name) == 0) return mb;
+    }
+    return NULL;
+}
+
+// Find or create a mailbox. Called with mail.lock held.
+static mailbox_t *mailbox_get(const char *name) {
+    unsigned long hash = simple_hash(name);
+    mailbox_t *mb = mailbox_find(name, hash);
+    if (mb) return mb;
+
+    if (mail.buckets == NULL || (size_t)mail.count > mail.mask) {
+        size_t old_size = mail.buckets ? mail.mask + 1 : 0;
+        size_t size = old_size ? old_size * 2 : MAILBOX_TABLE_MIN;
+        mailbox_t **buckets = calloc(size, sizeof(mailbox_t *));
+        if (buckets) {
+            for (size_t i = 0; i < old_size; i++) {
+                while (mail.buckets[i]) {
+                    mailbox_t *m = mail.buckets[i];
+                    mail.buckets[i] = m->next;
+                    m->next = buckets[m->hash & (size - 1)];
+                    buckets[m->hash & (size - 1)] = m;
+                }
+            }
+            free(mail.buckets);
+            mail.buckets = buckets;
+            mail.mask = size - 1;
+        }
+        if (mail.buckets == NULL) return NULL;
+    }
+    mb = calloc(1, sizeof(mailbox_t));
+    if (mb == NULL) return NULL;
+    strncpy(mb->name, name, sizeof(mb->name) - 1);
+    mb->hash = hash;
+    mb->next = mail.buckets[hash & mail.mask];
+    mail.buckets[hash & mail.mask] = mb;
+    mail.count++;
+    return mb;
+}
+
+// Forget a mailbox nobody needs: empty and its user offline
+static void mailbox_release(mailbox_t *mb) {
+    if (mb->count > 0 || mb->online) return;
+    mailbox_t **p = &mail.buckets[mb->hash & mail.mask];
+    while (*p != mb) p = &(*p)->next;
+    *p = mb->next;
+    mail.count--;
+    free(mb->entries);
+    free(mb);
+}
+
+static int mailbox_add_entry(mailbox_t *mb, uint64_t offset, uint32_t size, int64_t when) {
+    if (mb->count == mb->cap) {
+        int cap = mb->cap ? mb->cap * 2 : 8;
+        mail_entry_t *entries = realloc(mb->entries, cap * sizeof(mail_entry_t));
+        if (entries == NULL) return -1;
+        mb->entries = entries;
+        mb->cap = cap;
+    }
+    mb->entries[mb->count++] = (mail_entry_t){ offset, size, when };
+    mb->bytes += size;
+    mail.live_bytes += size;
+    mail.waiting++;
+    return 0;
+}
+
+// Drop the oldest n messages, delivered
+static void mailbox_retire(mailbox_t *mb, int n) {
+    uint64_t bytes = 0;
+    for (int i = 0; i < n; i++) bytes += mb->entries[i].size;
+    memmove(mb->entries, mb->entries + n, (mb->count - n) * sizeof(mail_entry_t));
+    mb->count -= n;
+    mb->bytes -= bytes;
+    mail.live_bytes -= bytes;
+    mail.waiting -= n;
+}
+
+// How many of the oldest messages a MAIL_DRAINED record retires: all of
+// them, or with a text only those up to the log offset it holds
+static int mail_drained_count(const mailbox_t *mb, const mail_record_t *rec) {
+    if (rec->text_len == 0) return mb->count;
+    char text[24];
+    const char *body = (const char *)(rec + 1);
+    size_t len = rec->text_len < sizeof(text) - 1 ? rec->text_len : sizeof(text) - 1;
+    memcpy(text, body + rec->recipient_len + rec->sender_len, len);
+    text[len] = '\0';
+    uint64_t through = strtoull(text, NULL, 10);
+    int n = 0;
+    while (n < mb->count && mb->entries[n].offset <= through) n++;
+    return n;
+}
+
+// Drop messages past their expiry; they are the oldest, so at the front
+static void mailbox_expire(mailbox_t *mb, time_t now) {
+    if (mailbox_days <= 0) return;
+    time_t cutoff = now - (time_t)mailbox_days * 86400;
+    int n = 0;
+    uint64_t bytes = 0;
+    while (n < mb->count && mb->entries[n].time < cutoff) bytes += mb->entries[n++].size;
+    if (n == 0) return;
+    memmove(mb->entries, mb->entries + n, (mb->count - n) * sizeof(mail_entry_t));
+    mb->count -= n;
+    mb->bytes -= bytes;
+    mail.live_bytes -= bytes;
+    mail.waiting -= n;
+    mail.expired += n;
+}
+
+// Lay out a record in buf (room for the largest). Returns its size.
+static uint32_t mail_record_build(unsigned char *buf, uint8_t type, time_t when, const char *recipient,
+                                  const char *sender, const char *text) {
+    mail_record_t *rec = (mail_record_t *)buf;
+    size_t recipient_len = strlen(recipient), sender_len = strlen(sender), text_len = strlen(text);
+    char *body = (char *)(rec + 1);
+    memset(rec, 0, sizeof(*rec));
+    rec->time = when;
+    rec->type = type;
+    rec->recipient_len = recipient_len;
+    rec->sender_len = sender_len;
+    rec->text_len = text_len;
+    memcpy(body, recipient, recipient_len);
+    memcpy(body + recipient_len, sender, sender_len);
+    memcpy(body + recipient_len + sender_len, text, text_len);
+    uint32_t used = sizeof(*rec) + recipient_len + sender_len + text_len;
+    uint32_t size = (used + 7) & ~7u;
+    memset(buf + used, 0, size - used);
+    rec->size = size;
+    rec->crc = crc32_update(0, buf + 8, size - 8);
+    return size;
+}
+
+static int mail_record_valid(const unsigned char *p, uint64_t left) {
+    const mail_record_t *rec = (const mail_record_t *)p;
+    return left >= sizeof(mail_record_t) && rec->size >= sizeof(mail_record_t) &&
+           rec->size % 8 == 0 && rec->size <= left &&
+           sizeof(mail_record_t) + rec->recipient_len + rec->sender_len + rec->text_len <= rec->size &&
+           rec->recipient_len < 50 && rec->sender_len < 50 &&
+           (rec->type == MAIL_STORED || rec->type == MAIL_DRAINED) &&
+           crc32_update(0, p + 8, rec->size - 8) == rec->crc;
+}
+
+static int mail_append(const unsigned char *buf, uint32_t size, uint64_t *offset) {
+    size_t off = 0;
+    while (off < size) {
+        ssize_t n = pwrite(mail.fd, buf + off, size - off, mail.size + off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("Failed to write mailbox log");
+            return -1;
+        }
+        off += n;
+    }
+    *offset = mail.size;
+    mail.size += size;
+    return 0;
+}
+
+// Rewrite the log with only the messages still waiting. Called with
+// mail.lock held; on failure the old log stays in use.
+static int mail_compact() {
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", mail_path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+
+    uint64_t *offsets = malloc((mail.waiting + 1) * sizeof(uint64_t));
+    unsigned char buf[sizeof(mail_record_t) + 2 * 50 + BUFFER_SIZE + 8];
+    uint64_t size = 0;
+    size_t n = 0;
+    int failed = offsets == NULL;
+    for (size_t b = 0; mail.buckets && b <= mail.mask && !failed; b++) {
+        for (mailbox_t *mb = mail.buckets[b]; mb && !failed; mb = mb->next) {
+            for (int i = 0; i < mb->count; i++) {
+                mail_entry_t *e = &mb->entries[i];
+                if (e->size > sizeof(buf) || pread(mail.fd, buf, e->size, e->offset) != (ssize_t)e->size ||
+                    write_all(fd, buf, e->size) < 0) {
+                    failed = 1;
+                    break;
+                }
+                offsets[n++] = size;
+                size += e->size;
+            }
+        }
+    }
+    if (failed || fdatasync(fd) < 0 || rename(tmp_path, mail_path) < 0) {
+        perror("Failed to compact mailbox log");
+        close(fd);
+        unlink(tmp_path);
+        free(offsets);
+        return -1;
+    }
+
+    // Same walk again to hand out the new offsets
+    n = 0;
+    for (size_t b = 0; mail.buckets && b <= mail.mask; b++) {
+        for (mailbox_t *mb = mail.buckets[b]; mb; mb = mb->next) {
+            for (int i = 0; i < mb->count; i++) mb->entries[i].offset = offsets[n++];
+        }
+    }
+    free(offsets);
+    close(mail.fd);
+    mail.fd = fd;
+    mail.size = size;
+    mail.compactions++;
+    return 0;
+}
+
+static void mail_maybe_compact() {
+    if (mail.size >= MAILBOX_COMPACT_MIN && mail.live_bytes * 2 < mail.size) mail_compact();
+}
+
+// Load mailboxes.log: replay stores and drains, cut a torn tail, expire
+int mail_init(const char *path) {
+    mail_path = path;
+    mail.fd = open(path, O_RDWR | O_CREAT, 0600);
+    struct stat st;
+    if (mail.fd < 0 || fstat(mail.fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+
+    uint64_t off = 0;
+    if (st.st_size > 0) {
+        unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, mail.fd, 0);
+        if (map == MAP_FAILED) {
+            perror(path);
+            return -1;
+        }
+        pthread_mutex_lock(&mail.lock);
+        while (off < (uint64_t)st.st_size && mail_record_valid(map + off, st.st_size - off)) {
+            const mail_record_t *rec = (const mail_record_t *)(map + off);
+            char recipient[50];
+            memcpy(recipient, rec + 1, rec->recipient_len);
+            recipient[rec->recipient_len] = '\0';
+            mailbox_t *mb = mailbox_get(recipient);
+            if (mb == NULL) break;
+            if (rec->type == MAIL_DRAINED) {
+                mailbox_retire(mb, mail_drained_count(mb, rec));
+            } else if (mailbox_add_entry(mb, off, rec->size, rec->time) < 0) {
+                break;
+            }
+            off += rec->size;
+        }
+        pthread_mutex_unlock(&mail.lock);
+        munmap(map, st.st_size);
+        if (off < (uint64_t)st.st_size) {
+            fprintf(stderr, "Mailbox log: dropping %llu bytes after the last whole record\n",
+                    (unsigned long long)(st.st_size - off));
+            if (ftruncate(mail.fd, off) < 0) perror(path);
+        }
+    }
+
+    pthread_mutex_lock(&mail.lock);
+    mail.size = off;
+    time_t now = time(NULL);
+    for (size_t b = 0; mail.buckets && b <= mail.mask; b++) {
+        mailbox_t *mb = mail.buckets[b];
+        while (mb) {
+            mailbox_t *next = mb->next;
+            mailbox_expire(mb, now);
+            mailbox_release(mb);
+            mb = next;
+        }
+    }
+    mail_maybe_compact();
+    printf("Mailboxes: %lu messages waiting in %d mailboxes\n", mail.waiting, mail.count);
+    pthread_mutex_unlock(&mail.lock);
+    return 0;
+}
+
+// Keep a private message for an offline user
+mail_status_t mailbox_store(const char *recipient, const char *sender, const char *text) {
+    unsigned char buf[sizeof(mail_record_t) + 2 * 50 + BUFFER_SIZE + 8];
+    mail_status_t status = MAIL_OK;
+    time_t now = time(NULL);
+    int do_sync = 0;
+
+    if (strlen(text) > BUFFER_SIZE) return MAIL_FAILED;
+    pthread_mutex_lock(&mail.lock);
+    mailbox_t *mb = mailbox_get(recipient);
+    if (mb == NULL) {
+        status = MAIL_FAILED;
+    } else if (mb->online) {
+        status = MAIL_ONLINE;
+    } else {
+        mailbox_expire(mb, now);
+        if (mb->count >= mailbox_limit) {
+            mail.refused++;
+            status = MAIL_FULL;
+        } else {
+            uint32_t size = mail_record_build(buf, MAIL_STORED, now, recipient, sender, text);
+            uint64_t offset;
+            if (mail_append(buf, size, &offset) < 0 || mailbox_add_entry(mb, offset, size, now) < 0) {
+                status = MAIL_FAILED;
+            } else {
+                mail.stored++;
+                do_sync = fsync_policy == FSYNC_ALWAYS ||
+                          (fsync_policy == FSYNC_INTERVAL && now != mail.last_sync);
+                if (do_sync) mail.last_sync = now;
+            }
+        }
+        mailbox_release(mb);
+    }
+    int fd = do_sync ? dup(mail.fd) : -1;
+    pthread_mutex_unlock(&mail.lock);
+
+    // Outside the lock, so senders to other users are not held up by the disk
+    if (fd >= 0) {
+        if (fdatasync(fd) < 0) perror("Failed to sync mailbox log");
+        close(fd);
+    }
+    return status;
+}
+
+// At login: hand what is waiting for this user to client_flush(), which
+// sends it a batch at a time whenever the queue is empty. From now until
+// logout new messages for them are delivered live.
+void mailbox_deliver(client_t *client) {
+    mail_drain_t *d = calloc(1, sizeof(mail_drain_t));
+    if (d == NULL) return;
+    d->fd = -1;
+
+    pthread_mutex_lock(&mail.lock);
+    mailbox_t *mb = mailbox_get(client->username);
+    if (mb == NULL) {
+        pthread_mutex_unlock(&mail.lock);
+        free(d);
+        return;
+    }
+    mb->online = 1;
+    mailbox_expire(mb, time(NULL));
+    // Read from a copy of the index and the log as it is now, so the
+    // reads and formatting happen without mail.lock; a compaction
+    // meanwhile replaces mail.fd but not this one
+    if (mb->count > 0 && (d->entries = malloc(mb->count * sizeof(mail_entry_t))) != NULL &&
+        (d->fd = dup(mail.fd)) >= 0) {
+        memcpy(d->entries, mb->entries, mb->count * sizeof(mail_entry_t));
+        d->count = mb->count;
+    }
+    pthread_mutex_unlock(&mail.lock);
+
+    if (d->count == 0) {
+        free(d->entries);
+        free(d);
+        return;
+    }
+    // A text client sees the header and batches run together, so every
+    // entry starts a new line there; framed clients only need it inside a batch
+    d->text = !client->framed;
+    pthread_mutex_lock(&client->out_lock);
+    d->dropped = client->out_dropped;
+    pthread_mutex_unlock(&client->out_lock);
+
+    char header[100];
+    snprintf(header, sizeof(header), "%d private message%s while you were offline:",
+             d->count, d->count == 1 ? "" : "s");
+    client_send(client, header, strlen(header));
+    // A batch counts as delivered once the socket took it; keep the
+    // kernel's unsent backlog to about one batch so that is close to the truth
+    int lowat = MAILBOX_BATCH_BYTES;
+    setsockopt(client->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    client->mail_drain = d;
+    client_rearm(client);
+}
+
+// Retire the oldest n messages of a mailbox once they have gone out. Only
+// these are covered by the drained record, so a drain cut short leaves
+// the rest for next time.
+static int mailbox_ack(const char *username, int n, int batches) {
+    unsigned char buf[sizeof(mail_record_t) + 2 * 50 + 32];
+    char through[24] = "";
+    uint64_t offset;
+    int result = -1;
+
+    pthread_mutex_lock(&mail.lock);
+    mailbox_t *mb = mailbox_find(username, simple_hash(username));
+    if (mb && n <= mb->count) {
+        if (n < mb->count) {
+            snprintf(through, sizeof(through), "%llu", (unsigned long long)mb->entries[n - 1].offset);
+        }
+        uint32_t size = mail_record_build(buf, MAIL_DRAINED, time(NULL), username, "", through);
+        if (mail_append(buf, size, &offset) == 0) {
+            mailbox_retire(mb, n);
+            mail.delivered += n;
+            mail.batches += batches;
+            // Compacting while this drain still runs would rewrite what is left of it
+            if (mb->count == 0) mail_maybe_compact();
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&mail.lock);
+    return result;
+}
+
+// Format the next batch of a drain, reading runs of neighbouring records
+// with one pread(). Returns NULL if nothing could be read.
+static msg_buf_t *mailbox_batch(mail_drain_t *d) {
+    size_t span_cap = MAILBOX_BATCH_BYTES + MAIL_RECORD_MAX;
+    if (d->span == NULL && (d->span = malloc(span_cap)) == NULL) return NULL;
+    msg_buf_t *batch = msg_buf_new(NULL, MAILBOX_BATCH_BYTES + MAIL_RECORD_MAX);
+    if (batch == NULL) return NULL;
+    batch->len = 0;
+
+    int i = d->next, full = 0;
+    while (i < d->count && !full) {
+        int j = i + 1;
+        while (j < d->count &&
+               d->entries[j].offset - (d->entries[j - 1].offset + d->entries[j - 1].size) < MAILBOX_READ_GAP &&
+               d->entries[j].offset + d->entries[j].size - d->entries[i].offset <= MAILBOX_BATCH_BYTES) {
+            j++;
+        }
+        uint64_t start = d->entries[i].offset;
+        size_t len = d->entries[j - 1].offset + d->entries[j - 1].size - start;
+        if (len > span_cap || pread(d->fd, d->span, len, start) != (ssize_t)len) {
+            perror("Failed to read mailbox log");
+            break;
+        }
+
+        for (; i < j; i++) {
+            const mail_record_t *rec = (const mail_record_t *)(d->span + (d->entries[i].offset - start));
+            const char *body = (const char *)(rec + 1);
+            char stamp[32];
+            struct tm tm;
+            time_t when = rec->time;
+            localtime_r(&when, &tm);
+            strftime(stamp, sizeof(stamp), "%m-%d %H:%M", &tm);
+            size_t need = 32 + rec->sender_len + strlen(stamp) + rec->text_len;
+            if (batch->len > 0 && batch->len + need > MAILBOX_BATCH_BYTES) {
+                full = 1;
+                break;
+            }
+            batch->len += snprintf(batch->data + batch->len, need + 1, "%s[PRIVATE] %.*s (%s): %.*s",
+                                   batch->len || d->text ? "\n" : "", rec->sender_len, body + rec->recipient_len,
+                                   stamp, rec->text_len, body + rec->recipient_len + rec->sender_len);
+        }
+    }
+    d->next = i;
+    if (batch->len == 0) {
+        msg_buf_unref(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+void mailbox_drain_free(client_t *client) {
+    mail_drain_t *d = client->mail_drain;
+    if (d == NULL) return;
+    if (d->fd >= 0) close(d->fd);
+    free(d->entries);
+    free(d->span);
+    free(d);
+    client->mail_drain = NULL;
+}
+
+// Called by client_flush() with the queue empty, so every batch sent
+// before this has gone out: retire those, then send the next one.
+// Returns 1 if a batch was sent, 0 once the drain is over.
+int mailbox_drain_step(client_t *client) {
+    mail_drain_t *d = client->mail_drain;
+
+    pthread_mutex_lock(&client->out_lock);
+    unsigned long dropped = client->out_dropped;
+    pthread_mutex_unlock(&client->out_lock);
+    if (dropped != d->dropped) {
+        // The queue overflowed and may have dropped a batch: send again
+        // everything not yet retired
+        d->next = d->acked;
+        d->batches = 0;
+        d->dropped = dropped;
+    } else if (d->next > d->acked && mailbox_ack(client->username, d->next - d->acked, d->batches) == 0) {
+        d->acked = d->next;
+        d->batches = 0;
+    }
+
+    msg_buf_t *batch = d->next < d->count ? mailbox_batch(d) : NULL;
+    if (batch == NULL) {
+        mailbox_drain_free(client);
+        return 0;
+    }
+    d->batches++;
+    client_send_buf(client, batch);
+    msg_buf_unref(batch);
+    return 1;
+}
+
+// At logout, before the session can no longer be found
+void mailbox_logout(const char *username) {
+    pthread_mutex_lock(&mail.lock);
+    mailbox_t *mb = mailbox_find(username, simple_hash(username));
+    if (mb) {
+        mb->online = 0;
+        mailbox_release(mb);
+    }
+    pthread_mutex_unlock(&mail.lock);
+}
+
+// Hand a private message to the session the user is logged in on now.
+// Returns -1 if there is none.
+int private_deliver_live(client_t *sender, const char *target_user, const char *message) {
+    int result = -1;
+    msg_buf_t *private_msg = msg_buf_printf("[PRIVATE] %s: %s", sender->username, message);
+    if (private_msg == NULL) return -1;
+    
+    if (server_mode == SERVER_MODE_SHARDED) {
+        // The target's shard, possibly this one, finds it by name
+        int shard = find_user_shard((char *)target_user);
+        if (shard >= 0) {
+            shard_post(&reactors[shard], INBOX_PRIVATE, sender->id, target_user, private_msg);
+            result = 0;
+        }
+    } else {
+        pthread_mutex_lock(&clients_mutex);
+        client_t *target = find_client_by_username((char *)target_user);
+        if (target && target->is_authenticated) {
+            client_send_buf(target, private_msg);
+            result = 0;
+        }
+        pthread_mutex_unlock(&clients_mutex);
+    }
+    msg_buf_unref(private_msg);
+    return result;
+}
+
+// /msg to someone not logged in: keep it if they exist
+void mailbox_offer(client_t *sender, const char *target_user, const char *message) {
+    char reply[200];
+    pthread_rwlock_rdlock(&users_lock);
+    int exists = find_user((char *)target_user) != -1;
+    pthread_rwlock_unlock(&users_lock);
+
+    if (!exists) {
+        snprintf(reply, sizeof(reply), "Error: User '%s' not found", target_user);
+    } else if (mail.fd < 0) {
+        snprintf(reply, sizeof(reply), "Error: User '%s' is offline", target_user);
+    } else {
+        mail_status_t status = mailbox_store(target_user, sender->username, message);
+        int delivered = 0;
+        if (status == MAIL_ONLINE) {
+            // Logged in meanwhile. If they are gone again already, the
+            // mailbox takes it after all.
+            delivered = private_deliver_live(sender, target_user, message) == 0;
+            if (!delivered) status = mailbox_store(target_user, sender->username, message);
+        }
+        switch (status) {
+        case MAIL_OK:
+            snprintf(reply, sizeof(reply), "%s is offline; message saved for their next login", target_user);
+            printf("Private message from %s to %s saved for later\n", sender->username, target_user);
+            break;
+        case MAIL_FULL:
+            snprintf(reply, sizeof(reply), "Error: %s's mailbox is full", target_user);
+            break;
+        case MAIL_ONLINE:
+            if (delivered) {
+                snprintf(reply, sizeof(reply), "Private message sent to %s", target_user);
+                printf("Private message from %s to %s: %s\n", sender->username, target_user, message);
+            } else {
+                snprintf(reply, sizeof(reply), "Error: %s just logged in, please send it again", target_user);
+            }
+            break;
+        default:
+            snprintf(reply, sizeof(reply), "Error: Could not save the message for %s", target_user);
+            break;
+        }
+    }
+    client_send(sender, reply, strlen(reply));
+}
+
+// Handle private message
+void handle_private_message(int sender_id, char* target_user, char* message) {
+    client_t *sender = NULL;
+    client_t *target = NULL;
+    int target_shard = -1;
+    int offline = 0;
+    
+    // In the shared-table modes clients_mutex stays held until the replies
+    // are queued, so the target cannot disconnect underneath us.
+    // client_send() never blocks, so this no longer stalls other threads.
+    if (server_mode == SERVER_MODE_SHARDED) {
+        sender = shard_find_client(current_reactor, sender_id, NULL);
+        target = shard_find_client(current_reactor, 0, target_user);
+        if (!target) {
+            target_shard = find_user_shard(target_user);
+        }
+    } else {
+        pthread_mutex_lock(&clients_mutex);
+        sender = registry_get(&registry, sender_id);
+        target = find_client_by_username(target_user);
+    }
+    
+    if (!sender || !sender->is_authenticated) {
+        char error_msg[] = "Error: You must be logged in to send private messages";
+        if (sender) {
+            client_send(sender, error_msg, strlen(error_msg));
+        } else {
+            send(sender_id, error_msg, strlen(error_msg), MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+    } else if ((!target || !target->is_authenticated) && target_shard < 0) {
+        offline = 1;
+    } else {
+        msg_buf_t *private_msg = msg_buf_printf("[PRIVATE] %s: %s", sender->username, message);
+        if (private_msg) {
+            if (target && target->is_authenticated) {
+                client_send_buf(target, private_msg);
+            } else {
+                shard_post(&reactors[target_shard], INBOX_PRIVATE, sender_id, target_user, private_msg);
+            }
+            msg_buf_unref(private_msg);
+        }
+        
+        char confirm_msg[200];
+        snprintf(confirm_msg, sizeof(confirm_msg), "Private message sent to %s", target_user);
+        client_send(sender, confirm_msg, strlen(confirm_msg));
+        
+        printf("Private message from %s to %s: %s\n", sender->username, target_user, message);
+    }
+    
+    if (server_mode != SERVER_MODE_SHARDED) {
+        pthread_mutex_unlock(&clients_mutex);
+    }
+    // The sender is the caller's own session, safe to use unlocked
+    if (offline) {
+        mailbox_offer(sender, target_user, message);
+    }
+}
+
+// Presence
+//
+// presence holds who is online, sorted by name, and is updated as users
+// log in and out instead of being rebuilt from the sessions. /users pages
+// are rendered from it once per version and shared by every reader until
+// the next change. Sessions that ask for it (/presence on) get the changes
+// batched into at most one message every PRESENCE_INTERVAL_MS.
+
+// Position of name in the sorted list, or where it would go
+static int presence_find(const char *name, int *found) {
+    int lo = 0, hi = presence.count;
+    *found = 0;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(presence.names[mid], name);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Queue a change for subscribers. Caller holds presence.lock.
+static void presence_note(const char *name, int joined) {
+    presence.version++;
+    for (int i = 0; i < presence.pending_count; i++) {
+        if (strcmp(presence.pending[i].name, name) == 0) {
+            // Back where they were at the last update: nothing to report
+            if (presence.pending[i].joined) presence.joins--;
+            else presence.leaves--;
+            memmove(&presence.pending[i], &presence.pending[i + 1],
+                    (presence.pending_count - i - 1) * sizeof(presence_change_t));
+            presence.pending_count--;
+            return;
+        }
+    }
+    if (joined) presence.joins++;
+    else presence.leaves++;
+    if (presence.pending_count < PRESENCE_BATCH_MAX) {
+        presence_change_t *change = &presence.pending[presence.pending_count++];
+        strncpy(change->name, name, sizeof(change->name) - 1);
+        change->name[sizeof(change->name) - 1] = '\0';
+        change->joined = joined;
+    } else {
+        presence.overflow = 1;
+    }
+}
+
+void presence_join(const char *name) {
+    int found;
+    pthread_mutex_lock(&presence.lock);
+    int pos = presence_find(name, &found);
+    if (!found) {
+        if (presence.count == presence.cap) {
+            int cap = presence.cap ? presence.cap * 2 : REGISTRY_MIN;
+            char **names = realloc(presence.names, cap * sizeof(char *));
+            if (names == NULL) goto out;
+            presence.names = names;
+            presence.cap = cap;
+        }
+        char *copy = strdup(name);
+        if (copy == NULL) goto out;
+        memmove(&presence.names[pos + 1], &presence.names[pos], (presence.count - pos) * sizeof(char *));
+        presence.names[pos] = copy;
+        presence.count++;
+        presence_note(name, 1);
+    }
+out:
+    pthread_mutex_unlock(&presence.lock);
+}
+
+void presence_leave(const char *name) {
+    int found;
+    pthread_mutex_lock(&presence.lock);
+    int pos = presence_find(name, &found);
+    if (found) {
+        free(presence.names[pos]);
+        memmove(&presence.names[pos], &presence.names[pos + 1], (presence.count - pos - 1) * sizeof(char *));
+        presence.count--;
+        presence_note(name, 0);
+    }
+    pthread_mutex_unlock(&presence.lock);
+}
+
+int presence_online() {
+    pthread_mutex_lock(&presence.lock);
+    int count = presence.count;
+    pthread_mutex_unlock(&presence.lock);
+    return count;
+}
+
+// Render one page of the list. Caller holds presence.lock.
+static msg_buf_t *presence_render(int page, int pages) {
+    int first = page * USERS_PAGE_SIZE;
+    int last = first + USERS_PAGE_SIZE < presence.count ? first + USERS_PAGE_SIZE : presence.count;
+    size_t len = 80;
+    for (int i = first; i < last; i++) {
+        len += strlen(presence.names[i]) + 2;
+    }
+    msg_buf_t *buf = msg_buf_new(NULL, len);
+    if (buf == NULL) return NULL;
+    
+    size_t used;
+    if (pages > 1) {
+        used = snprintf(buf->data, len, "Online users (page %d of %d, %d online): ",
+                        page + 1, pages, presence.count);
+    } else {
+        used = snprintf(buf->data, len, "Online users: ");
+    }
+    for (int i = first; i < last; i++) {
+        size_t name_len = strlen(presence.names[i]);
+        if (i > first) {
+            memcpy(buf->data + used, ", ", 2);
+            used += 2;
+        }
+        memcpy(buf->data + used, presence.names[i], name_len);
+        used += name_len;
+    }
+    buf->data[used] = '\0';
+    buf->len = used;
+    return buf;
+}
+
+// /users [page]
+void list_online_users(client_t *client, const char *arg) {
+    int page = *arg ? atoi(arg) - 1 : 0;
+    
+    pthread_mutex_lock(&presence.lock);
+    if (presence.count == 0) {
+        pthread_mutex_unlock(&presence.lock);
+        client_send(client, "No users online", 15);
+        return;
+    }
+    int pages = (presence.count + USERS_PAGE_SIZE - 1) / USERS_PAGE_SIZE;
+    if (page < 0 || page >= pages) {
+        pthread_mutex_unlock(&presence.lock);
+        char error_msg[64];
+        snprintf(error_msg, sizeof(error_msg), "Usage: /users [page], pages 1-%d", pages);
+        client_send(client, error_msg, strlen(error_msg));
+        return;
+    }
+    
+    msg_buf_t *buf;
+    int slot = page < PRESENCE_CACHE_PAGES ? page : -1;
+    if (slot >= 0 && presence.pages[slot] && presence.page_version[slot] == presence.version) {
+        buf = msg_buf_ref(presence.pages[slot]);
+    } else {
+        buf = presence_render(page, pages);
+        presence.pages_rendered++;
+        if (buf && slot >= 0) {
+            msg_buf_unref(presence.pages[slot]);
+            presence.pages[slot] = msg_buf_ref(buf);
+            presence.page_version[slot] = presence.version;
+        }
+    }
+    presence.pages_served++;
+    pthread_mutex_unlock(&presence.lock);
+    
+    if (buf) {
+        client_send_buf(client, buf);
+        msg_buf_unref(buf);
+    }
+}
+
+// /presence on|off
+void handle_presence(client_t *client, const char *arg) {
+    char reply[96];
+    if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0) {
+        int on = arg[1] == 'n';
+        if (atomic_exchange(&client->presence_sub, on) != on) {
+            atomic_fetch_add(&presence.subscribers, on ? 1 : -1);
+        }
+        pthread_mutex_lock(&presence.lock);
+        snprintf(reply, sizeof(reply), "Presence updates %s (%d online, version %lu)",
+                 on ? "on" : "off", presence.count, presence.version);
+        pthread_mutex_unlock(&presence.lock);
+    } else {
+        snprintf(reply, sizeof(reply), "Usage: /presence on|off");
+    }
+    client_send(client, reply, strlen(reply));
+}
+
+// Send an update to the subscribed sessions of one registry
+void presence_deliver(client_registry_t *r, msg_buf_t *buf) {
+    for (int i = 0; i < r->count; i++) {
+        client_t *c = r->live[i];
+        if (c->presence_sub && c->is_authenticated) {
+            client_send_buf(c, buf);
+        }
+    }
+}
+
+// Turn the changes since the last update into one message. Caller holds
+// presence.lock.
+static msg_buf_t *presence_batch() {
+    if (presence.overflow) {
+        return msg_buf_printf("Presence: %lu joined, %lu left (%d online, version %lu); /users for the list",
+                              presence.joins, presence.leaves, presence.count, presence.version);
+    }
+    size_t len = 80;
+    for (int i = 0; i < presence.pending_count; i++) {
+        len += strlen(presence.pending[i].name) + 2;
+    }
+    msg_buf_t *buf = msg_buf_new(NULL, len);
+    if (buf == NULL) return NULL;
+    
+    size_t used = snprintf(buf->data, len, "Presence:");
+    for (int i = 0; i < presence.pending_count; i++) {
+        used += snprintf(buf->data + used, len - used, " %c%s",
+                         presence.pending[i].joined ? '+' : '-', presence.pending[i].name);
+    }
+    used += snprintf(buf->data + used, len - used, " (%d online, version %lu)",
+                     presence.count, presence.version);
+    buf->len = used;
+    return buf;
+}
+
+void *presence_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        usleep(PRESENCE_INTERVAL_MS * 1000);
+        
+        msg_buf_t *buf = NULL;
+        pthread_mutex_lock(&presence.lock);
+        if (presence.pending_count > 0 || presence.overflow) {
+            // With nobody listening the changes are just dropped
+            if (atomic_load(&presence.subscribers) > 0) {
+                buf = presence_batch();
+                presence.updates++;
+            }
+            presence.pending_count = 0;
+            presence.joins = presence.leaves = 0;
+            presence.overflow = 0;
+        }
+        pthread_mutex_unlock(&presence.lock);
+        if (buf == NULL) continue;
+        
+        if (server_mode == SERVER_MODE_SHARDED) {
+            for (int i = 0; i < reactor_count; i++) {
+                shard_post(&reactors[i], INBOX_PRESENCE, -1, NULL, buf);
+            }
+        } else {
+            pthread_mutex_lock(&clients_mutex);
+            presence_deliver(&registry, buf);
+            pthread_mutex_unlock(&clients_mutex);
+        }
+        msg_buf_unref(buf);
+    }
+    return NULL;
+}
+
+int start_presence() {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, presence_thread, NULL) != 0) {
+        perror("Failed to create presence thread");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Channels
+//
+// A line posted to a channel touches only that channel's members. Outside
+// sharded mode a channel's members are one set under its rwlock, so posts
+// to a busy channel run side by side and only join/leave take it
+// exclusively. In sharded mode every shard keeps its own members of each
+// channel, touched only by its thread: the poster's shard delivers
+// directly, and each other shard with members gets the line in its inbox.
+
+int channel_name_valid(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > CHANNEL_NAME_MAX) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') return 0;
+    }
+    return 1;
+}
+
+static channel_t *channel_table_find(const char *name, unsigned long hash) {
+    if (channel_table.buckets == NULL) return NULL;
+    for (channel_t *c = channel_table.buckets[hash & channel_table.mask]; c; c = c->next) {
+        if (c->hash == hash && strcmp(c->name, name) == 0) return c;
+    }
+    return NULL;
+}
+
+// Double the bucket array. Called with the table locked exclusively.
+static int channel_table_grow() {
+    size_t old_size = channel_table.buckets ? channel_table.mask + 1 : 0;
+    size_t size = old_size ? old_size * 2 : CHANNEL_TABLE_MIN;
+    channel_t **buckets = calloc(size, sizeof(channel_t *));
+    if (buckets == NULL) return -1;
+    for (size_t i = 0; i < old_size; i++) {
+        channel_t *c = channel_table.buckets[i];
+        while (c) {
+            channel_t *next = c->next;
+            c->next = buckets[c->hash & (size - 1)];
+            buckets[c->hash & (size - 1)] = c;
+            c = next;
+        }
+    }
+    free(channel_table.buckets);
+    channel_table.buckets = buckets;
+    channel_table.mask = size - 1;
+    return 0;
+}
+
+static channel_t *channel_new(const char *name, unsigned long hash) {
+    int sets = server_mode == SERVER_MODE_SHARDED ? reactor_count : 1;
+    channel_t *c = calloc(1, sizeof(channel_t) + sets * sizeof(channel_set_t));
+    if (c == NULL) return NULL;
+    strcpy(c->name, name);
+    c->hash = hash;
+    c->linked = 1;
+    atomic_init(&c->refs, 1);
+    atomic_init(&c->members, 0);
+    pthread_rwlock_init(&c->lock, NULL);
+    c->set_count = sets;
+    return c;
+}
+
+void channel_unref(channel_t *c) {
+    if (atomic_fetch_sub(&c->refs, 1) != 1) return;
+    for (int i = 0; i < c->set_count; i++) free(c->sets[i].members);
+    pthread_rwlock_destroy(&c->lock);
+    free(c);
+}
+
+// Find or create a channel and count the caller in. The table keeps it
+// until the count drops back to zero.
+channel_t *channel_enter(const char *name) {
+    unsigned long hash = simple_hash(name);
+    pthread_rwlock_rdlock(&channel_table.lock);
+    channel_t *c = channel_table_find(name, hash);
+    if (c) atomic_fetch_add(&c->members, 1);
+    pthread_rwlock_unlock(&channel_table.lock);
+    if (c) return c;
+
+    pthread_rwlock_wrlock(&channel_table.lock);
+    c = channel_table_find(name, hash);
+    if (c == NULL) {
+        if (channel_table.buckets == NULL || (size_t)channel_table.count > channel_table.mask) {
+            channel_table_grow();
+        }
+        if (channel_table.buckets) c = channel_new(name, hash);
+        if (c) {
+            c->next = channel_table.buckets[hash & channel_table.mask];
+            channel_table.buckets[hash & channel_table.mask] = c;
+            channel_table.count++;
+        }
+    }
+    if (c) atomic_fetch_add(&c->members, 1);
+    pthread_rwlock_unlock(&channel_table.lock);
+    return c;
+}
+
+// Undo channel_enter; the last member out takes the channel out of the table
+void channel_exit(channel_t *c) {
+    if (atomic_fetch_sub(&c->members, 1) != 1) return;
+    int dropped = 0;
+    pthread_rwlock_wrlock(&channel_table.lock);
+    // Someone may have entered again since the count hit zero
+    if (c->linked && atomic_load(&c->members) == 0) {
+        channel_t **p = &channel_table.buckets[c->hash & channel_table.mask];
+        while (*p != c) p = &(*p)->next;
+        *p = c->next;
+        c->linked = 0;
+        channel_table.count--;
+        dropped = 1;
+    }
+    pthread_rwlock_unlock(&channel_table.lock);
+    if (dropped) channel_unref(c);
+}
+
+// The set a client's membership lives in
+static channel_set_t *channel_client_set(channel_t *c, client_t *client) {
+    return server_mode == SERVER_MODE_SHARDED ? &c->sets[client->reactor->id] : &c->sets[0];
+}
+
+static int channel_set_add(channel_set_t *set, channel_member_t *m) {
+    if (set->count == set->cap) {
+        int cap = set->cap ? set->cap * 2 : 4;
+        channel_member_t **members = realloc(set->members, cap * sizeof(channel_member_t *));
+        if (members == NULL) return -1;
+        set->members = members;
+        set->cap = cap;
+    }
+    m->slot = set->count;
+    set->members[set->count++] = m;
+    atomic_store_explicit(&set->present, set->count, memory_order_relaxed);
+    return 0;
+}
+
+// Swap the last member into the hole
+static void channel_set_remove(channel_set_t *set, channel_member_t *m) {
+    channel_member_t *last = set->members[--set->count];
+    set->members[m->slot] = last;
+    last->slot = m->slot;
+    atomic_store_explicit(&set->present, set->count, memory_order_relaxed);
+}
+
+channel_member_t *channel_find_member(client_t *client, const char *name) {
+    for (int i = 0; i < client->channel_count; i++) {
+        if (strcmp(client->channels[i]->channel->name, name) == 0) return client->channels[i];
+    }
+    return NULL;
+}
+
+// Add a client to a channel. NULL when out of memory.
+channel_member_t *channel_join(client_t *client, const char *name) {
+    if (client->channel_count == client->channel_cap) {
+        int cap = client->channel_cap ? client->channel_cap * 2 : 4;
+        channel_member_t **channels = realloc(client->channels, cap * sizeof(channel_member_t *));
+        if (channels == NULL) return NULL;
+        client->channels = channels;
+        client->channel_cap = cap;
+    }
+    channel_member_t *m = malloc(sizeof(channel_member_t));
+    channel_t *c = m ? channel_enter(name) : NULL;
+    if (c == NULL) {
+        free(m);
+        return NULL;
+    }
+    m->channel = c;
+    m->client = client;
+
+    int shared = server_mode != SERVER_MODE_SHARDED;
+    if (shared) pthread_rwlock_wrlock(&c->lock);
+    int added = channel_set_add(channel_client_set(c, client), m);
+    if (shared) pthread_rwlock_unlock(&c->lock);
+    if (added < 0) {
+        channel_exit(c);
+        free(m);
+        return NULL;
+    }
+
+    m->client_slot = client->channel_count;
+    client->channels[client->channel_count++] = m;
+    atomic_fetch_add(&channel_table.memberships, 1);
+    return m;
+}
+
+void channel_leave(client_t *client, channel_member_t *m) {
+    channel_t *c = m->channel;
+    int shared = server_mode != SERVER_MODE_SHARDED;
+    if (shared) pthread_rwlock_wrlock(&c->lock);
+    channel_set_remove(channel_client_set(c, client), m);
+    if (shared) pthread_rwlock_unlock(&c->lock);
+
+    channel_member_t *last = client->channels[--client->channel_count];
+    client->channels[m->client_slot] = last;
+    last->client_slot = m->client_slot;
+    if (client->channel == c) client->channel = NULL;
+    free(m);
+    atomic_fetch_sub(&channel_table.memberships, 1);
+    channel_exit(c);
+}
+
+void channel_leave_all(client_t *client) {
+    while (client->channel_count > 0) {
+        channel_leave(client, client->channels[client->channel_count - 1]);
+    }
+}
+
+void channel_deliver_set(channel_set_t *set, msg_buf_t *buf, int sender_id) {
+    unsigned long delivered = 0;
+    for (int i = 0; i < set->count; i++) {
+        client_t *member = set->members[i]->client;
+        if (member->id != sender_id) {
+            client_send_buf(member, buf);
+            delivered++;
+        }
+    }
+    atomic_fetch_add_explicit(&channel_table.deliveries, delivered, memory_order_relaxed);
+}
+
+// Send to every member of a channel but the sender, who must be one
+void channel_post(channel_t *c, msg_buf_t *buf, int sender_id) {
+    atomic_fetch_add_explicit(&channel_table.messages, 1, memory_order_relaxed);
+    if (server_mode != SERVER_MODE_SHARDED) {
+        pthread_rwlock_rdlock(&c->lock);
+        channel_deliver_set(&c->sets[0], buf, sender_id);
+        pthread_rwlock_unlock(&c->lock);
+        return;
+    }
+
+    for (int i = 0; i < c->set_count; i++) {
+        if (atomic_load_explicit(&c->sets[i].present, memory_order_relaxed) == 0) continue;
+        if (&reactors[i] == current_reactor) {
+            channel_deliver_set(&c->sets[i], buf, sender_id);
+            continue;
+        }
+        inbox_msg_t *msg = buf_pool_alloc(sizeof(inbox_msg_t));
+        if (msg == NULL) continue;
+        msg->type = INBOX_CHANNEL;
+        msg->sender_id = sender_id;
+        msg->target[0] = '\0';
+        msg->channel = c;
+        atomic_fetch_add(&c->refs, 1);
+        msg->buf = msg_buf_ref(buf);
+        shard_push(&reactors[i], msg);
+    }
+}
+
+// /join <channel>: join it if need be and send plain lines there
+void handle_join(client_t *client, char *name) {
+    char reply[200];
+    if (*name == '#') name++;
+    if (!channel_name_valid(name)) {
+        snprintf(reply, sizeof(reply), "Usage: /join <channel> (up to %d letters, digits, - or _)", CHANNEL_NAME_MAX);
+        client_send(client, reply, strlen(reply));
+        return;
+    }
+
+    channel_member_t *m = channel_find_member(client, name);
+    if (m == NULL) {
+        if (client->channel_count >= MAX_CLIENT_CHANNELS) {
+            snprintf(reply, sizeof(reply), "Error: You are already in %d channels", MAX_CLIENT_CHANNELS);
+            client_send(client, reply, strlen(reply));
+            return;
+        }
+        m = channel_join(client, name);
+        if (m == NULL) {
+            snprintf(reply, sizeof(reply), "Error: Could not join #%s", name);
+            client_send(client, reply, strlen(reply));
+            return;
+        }
+        msg_buf_t *notice = msg_buf_printf("%s joined #%s", client->username, name);
+        if (notice) {
+            channel_post(m->channel, notice, client->id);
+            msg_buf_unref(notice);
+        }
+        printf("User %s joined #%s\n", client->username, name);
+    }
+    client->channel = m->channel;
+    int members = atomic_load(&m->channel->members);
+    snprintf(reply, sizeof(reply), "Now talking in #%s (%d member%s). /leave to stop.",
+             name, members, members == 1 ? "" : "s");
+    client_send(client, reply, strlen(reply));
+}
+
+// /leave [channel]: the current one when none is named
+void handle_leave(client_t *client, char *name) {
+    char reply[200];
+    channel_member_t *m = NULL;
+    if (*name == '#') name++;
+    if (*name) {
+        m = channel_find_member(client, name);
+    } else if (client->channel) {
+        m = channel_find_member(client, client->channel->name);
+    }
+    if (m == NULL) {
+        if (*name) {
+            snprintf(reply, sizeof(reply), "Error: You are not in #%s", name);
+        } else {
+            snprintf(reply, sizeof(reply), "Usage: /leave <channel>");
+        }
+        client_send(client, reply, strlen(reply));
+        return;
+    }
+
+    int was_current = client->channel == m->channel;
+    char left[CHANNEL_NAME_MAX + 1];
+    strcpy(left, m->channel->name);
+    msg_buf_t *notice = msg_buf_printf("%s left #%s", client->username, left);
+    if (notice) {
+        channel_post(m->channel, notice, client->id);
+        msg_buf_unref(notice);
+    }
+    channel_leave(client, m);
+    printf("User %s left #%s\n", client->username, left);
+    snprintf(reply, sizeof(reply), "Left #%s%s", left, was_current ? ", messages go to everyone again" : "");
+    client_send(client, reply, strlen(reply));
+}
+
+static int compare_pointers(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void * const *)a, y = (uintptr_t)*(void * const *)b;
+    return x < y ? -1 : x > y;
+}
+
+// /channels: every channel with its member count, as many as fit
+void list_channels(client_t *client) {
+    size_t len;
+    int truncated = 0;
+    // The client's own channels, sorted so each table entry is one bsearch
+    channel_t *joined[MAX_CLIENT_CHANNELS];
+    int joined_count = client->channel_count;
+    for (int i = 0; i < joined_count; i++) joined[i] = client->channels[i]->channel;
+    qsort(joined, joined_count, sizeof(channel_t *), compare_pointers);
+
+    pthread_rwlock_rdlock(&channel_table.lock);
+    if (channel_table.count == 0) {
+        pthread_rwlock_unlock(&channel_table.lock);
+        char empty[] = "No channels yet. /join <channel> starts one.";
+        client_send(client, empty, strlen(empty));
+        return;
+    }
+    char *list = buf_pool_alloc(BUFFER_SIZE);
+    if (list == NULL) {
+        pthread_rwlock_unlock(&channel_table.lock);
+        return;
+    }
+    len = snprintf(list, BUFFER_SIZE, "%d channels (* = joined):", channel_table.count);
+    for (size_t b = 0; b <= channel_table.mask && !truncated; b++) {
+        for (channel_t *c = channel_table.buckets[b]; c; c = c->next) {
+            char entry[CHANNEL_NAME_MAX + 32];
+            int n = snprintf(entry, sizeof(entry), " #%s (%d)%s,", c->name, atomic_load(&c->members),
+                             bsearch(&c, joined, joined_count, sizeof(channel_t *), compare_pointers) ? "*" : "");
+            if (len + n + 5 > BUFFER_SIZE) {
+                truncated = 1;
+                break;
+            }
+            memcpy(list + len, entry, n + 1);
+            len += n;
+        }
+    }
+    pthread_rwlock_unlock(&channel_table.lock);
+
+    if (truncated) {
+        strcpy(list + len, " ...");
+    } else {
+        list[len - 1] = '\0';   // Trailing comma
+    }
+    client_send(client, list, strlen(list));
+    buf_pool_free(list, BUFFER_SIZE);
+}
+
+// Message history
+//
+// Chat lines are appended to numbered segment files under history/, each
+// preallocated and mapped once. Every record carries its sequence number,
+// time and channel, plus the size of the record before it, so the log can
+// be walked either way. /history sends records straight out of the mapping.
+// Retention drops whole segments, oldest first.
+
+void history_segment_unref(history_segment_t *seg) {
+    if (atomic_fetch_sub(&seg->refs, 1) != 1) return;
+    munmap(seg->map, HISTORY_SEGMENT_SIZE);
+    close(seg->fd);
+    free(seg->index);
+    free(seg);
+}
+
+static history_segment_t *history_segment_open(uint64_t first_seq) {
+    history_segment_t *seg = calloc(1, sizeof(history_segment_t));
+    if (seg == NULL) return NULL;
+    snprintf(seg->path, sizeof(seg->path), HISTORY_DIR "/%016llx.log", (unsigned long long)first_seq);
+    seg->fd = open(seg->path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (seg->fd < 0 || fstat(seg->fd, &st) < 0 ||
+        (st.st_size < HISTORY_SEGMENT_SIZE && ftruncate(seg->fd, HISTORY_SEGMENT_SIZE) < 0)) {
+        perror(seg->path);
+        if (seg->fd >= 0) close(seg->fd);
+        free(seg);
+        return NULL;
+    }
+    seg->map = mmap(NULL, HISTORY_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        perror(seg->path);
+        close(seg->fd);
+        free(seg);
+        return NULL;
+    }
+    atomic_init(&seg->refs, 1);
+    seg->first_seq = first_seq;
+    seg->last_seq = first_seq - 1;
+    return seg;
+}
+
+static int history_index_add(history_segment_t *seg, const history_record_t *rec, uint32_t offset) {
+    if ((rec->seq - seg->first_seq) % HISTORY_INDEX_EVERY) return 0;
+    if (seg->index_count == seg->index_cap) {
+        int cap = seg->index_cap ? seg->index_cap * 2 : 64;
+        history_index_t *index = realloc(seg->index, cap * sizeof(history_index_t));
+        if (index == NULL) return -1;
+        seg->index = index;
+        seg->index_cap = cap;
+    }
+    seg->index[seg->index_count++] = (history_index_t){ rec->seq, rec->time, offset };
+    return 0;
+}
+
+// Rebuild tail and index from the records of a segment found at startup.
+// A torn record from a crash ends it and is cleared.
+static void history_segment_scan(history_segment_t *seg) {
+    uint32_t off = 0;
+    while (off + sizeof(history_record_t) <= HISTORY_SEGMENT_SIZE) {
+        const history_record_t *rec = (const history_record_t *)(seg->map + off);
+        if (rec->size == 0 || rec->size % 8 || rec->size > HISTORY_SEGMENT_SIZE - off ||
+            rec->size < sizeof(history_record_t) + rec->channel_len + rec->text_len + 1 ||
+            rec->seq != seg->last_seq + 1 || rec->prev != seg->last_size ||
+            history_index_add(seg, rec, off) < 0) {
+            break;
+        }
+        seg->last_seq = rec->seq;
+        seg->last_time = rec->time;
+        seg->last_size = rec->size;
+        off += rec->size;
+    }
+    seg->tail = off;
+    if (off + sizeof(uint32_t) <= HISTORY_SEGMENT_SIZE && *(uint32_t *)(seg->map + off) != 0) {
+        memset(seg->map + off, 0, HISTORY_SEGMENT_SIZE - off);
+    }
+}
+
+static int history_add_segment(history_segment_t *seg) {
+    if (history.segment_count == history.segment_cap) {
+        int cap = history.segment_cap ? history.segment_cap * 2 : 16;
+        history_segment_t **segments = realloc(history.segments, cap * sizeof(history_segment_t *));
+        if (segments == NULL) return -1;
+        history.segments = segments;
+        history.segment_cap = cap;
+    }
+    history.segments[history.segment_count++] = seg;
+    return 0;
+}
+
+// Delete segments beyond the retention limit. Lines of theirs still
+// queued keep the mapping until they are sent.
+static void history_retain() {
+    while (history.segment_count > history.max_segments) {
+        history_segment_t *oldest = history.segments[0];
+        memmove(history.segments, history.segments + 1,
+                (history.segment_count - 1) * sizeof(history_segment_t *));
+        history.segment_count--;
+        history.dropped_segments++;
+        unlink(oldest->path);
+        history_segment_unref(oldest);
+    }
+}
+
+static int compare_segment_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int history_init() {
+    history.max_segments = (int)(((long)history_mb << 20) / HISTORY_SEGMENT_SIZE);
+    if (history.max_segments < 2) history.max_segments = 2;
+    mkdir(HISTORY_DIR, 0777);
+
+    // Segments are named after their first sequence number in fixed-width hex
+    char *names[4096];
+    int count = 0;
+    DIR *dir = opendir(HISTORY_DIR);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL && count < 4096) {
+            if (strlen(entry->d_name) == 20 && strcmp(entry->d_name + 16, ".log") == 0) {
+                names[count++] = strdup(entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    qsort(names, count, sizeof(char *), compare_segment_names);
+
+    for (int i = 0; i < count; i++) {
+        history_segment_t *seg = names[i] ? history_segment_open(strtoull(names[i], NULL, 16)) : NULL;
+        free(names[i]);
+        if (seg == NULL) continue;
+        history_segment_scan(seg);
+        // Nothing may follow a gap: a later segment with lower numbers is stale
+        if (history.segment_count > 0 && seg->first_seq != history.next_seq) {
+            fprintf(stderr, "History: skipping %s, expected sequence %llu\n",
+                    seg->path, (unsigned long long)history.next_seq);
+            history_segment_unref(seg);
+            continue;
+        }
+        if (history_add_segment(seg) < 0) {
+            history_segment_unref(seg);
+            continue;
+        }
+        history.next_seq = seg->last_seq + 1;
+    }
+
+    if (history.segment_count == 0) {
+        history_segment_t *seg = history_segment_open(1);
+        if (seg == NULL || history_add_segment(seg) < 0) return -1;
+        history.next_seq = 1;
+    }
+    history_retain();
+    printf("History: %llu messages in %d segments (keeping %d MB)\n",
+           (unsigned long long)(history.next_seq - history.segments[0]->first_seq),
+           history.segment_count, history.max_segments * (HISTORY_SEGMENT_SIZE >> 20));
+    return 0;
+}
+
+// Log a chat line as "[MM-DD HH:MM] alice: hi" (with the channel for a
+// channel post) and keep it in the ring
+void history_append(const char *channel, const char *username, const char *text) {
+    if (history.segment_count == 0) return;
+    time_t now = time(NULL);
+    struct tm tm;
+    char stamp[32];
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%m-%d %H:%M", &tm);
+    msg_buf_t *line = channel ? msg_buf_printf("[%s] [#%s] %s: %s", stamp, channel, username, text)
+                              : msg_buf_printf("[%s] %s: %s", stamp, username, text);
+    if (line == NULL) return;
+    if (line->len > UINT16_MAX) line->len = UINT16_MAX;
+
+    size_t channel_len = channel ? strlen(channel) : 0;
+    uint32_t size = (sizeof(history_record_t) + channel_len + line->len + 1 + 7) & ~7u;
+
+    pthread_rwlock_wrlock(&history.lock);
+    history_segment_t *seg = history.segments[history.segment_count - 1];
+    if (seg->tail + size + sizeof(uint32_t) > HISTORY_SEGMENT_SIZE) {
+        history_segment_t *next = history_segment_open(history.next_seq);
+        if (next == NULL || history_add_segment(next) < 0) {
+            if (next) {
+                unlink(next->path);
+                history_segment_unref(next);
+            }
+            pthread_rwlock_unlock(&history.lock);
+            msg_buf_unref(line);
+            return;
+        }
+        seg = next;
+        history_retain();
+    }
+
+    history_record_t *rec = (history_record_t *)(seg->map + seg->tail);
+    char *body = (char *)(rec + 1);
+    memcpy(body, channel ? channel : "", channel_len);
+    memcpy(body + channel_len, line->data, line->len);
+    body[channel_len + line->len] = '\0';
+    rec->prev = seg->last_size;
+    rec->seq = history.next_seq;
+    rec->time = now;
+    rec->channel_hash = channel ? (uint32_t)simple_hash(channel) : 0;
+    rec->text_len = line->len;
+    rec->channel_len = channel_len;
+    rec->reserved = 0;
+    rec->size = size;
+    if (history_index_add(seg, rec, seg->tail) < 0) {
+        memset(rec, 0, sizeof(*rec));
+        pthread_rwlock_unlock(&history.lock);
+        msg_buf_unref(line);
+        return;
+    }
+    seg->tail += size;
+    seg->last_size = size;
+    seg->last_seq = rec->seq;
+    seg->last_time = now;
+
+    history_entry_t *e = &history.ring[rec->seq % HISTORY_RING];
+    msg_buf_unref(e->buf);
+    e->seq = rec->seq;
+    e->channel_hash = rec->channel_hash;
+    strcpy(e->channel, channel ? channel : "");
+    e->buf = line;
+    history.next_seq++;
+    pthread_rwlock_unlock(&history.lock);
+}
+
+// Segment holding seq, or -1. Called with the lock held.
+static int history_find_segment(uint64_t seq) {
+    int lo = 0, hi = history.segment_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        history_segment_t *seg = history.segments[mid];
+        if (seq < seg->first_seq) hi = mid - 1;
+        else if (seq > seg->last_seq) lo = mid + 1;
+        else return mid;
+    }
+    return -1;
+}
+
+// Offset of record seq in its segment: the index entry at or before it,
+// then at most HISTORY_INDEX_EVERY - 1 records forward
+static uint32_t history_offset_of(history_segment_t *seg, uint64_t seq) {
+    const history_index_t *ix = &seg->index[(seq - seg->first_seq) / HISTORY_INDEX_EVERY];
+    uint32_t off = ix->offset;
+    for (uint64_t s = ix->seq; s < seq; s++) {
+        off += ((const history_record_t *)(seg->map + off))->size;
+    }
+    return off;
+}
+
+// First sequence number logged at or after a time. Called with the lock held.
+static uint64_t history_seq_at(time_t since) {
+    int lo = 0, hi = history.segment_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        history_segment_t *seg = history.segments[mid];
+        if (seg->last_seq < seg->first_seq || seg->last_time < since) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == history.segment_count) return history.next_seq;
+
+    history_segment_t *seg = history.segments[lo];
+    int a = 0, b = seg->index_count - 1;
+    while (a < b) {
+        int mid = (a + b + 1) / 2;
+        if (seg->index[mid].time < since) a = mid; else b = mid - 1;
+    }
+    uint64_t seq = seg->index[a].seq;
+    uint32_t off = seg->index[a].offset;
+    while (seq <= seg->last_seq) {
+        const history_record_t *rec = (const history_record_t *)(seg->map + off);
+        if (rec->time >= since) return seq;
+        off += rec->size;
+        seq++;
+    }
+    return seq;
+}
+
+// A message whose text is a record in the mapping, not a copy of it
+static msg_buf_t *history_view(history_segment_t *seg, const history_record_t *rec) {
+    msg_buf_t *buf = buf_pool_alloc(sizeof(msg_buf_t));
+    if (buf == NULL) return NULL;
+    atomic_init(&buf->refs, 1);
+    buf->frame_type = FRAME_TEXT;
+    buf->frame_flags = 0;
+    buf->stream = 0;
+    buf->len = rec->text_len;
+    buf->size = sizeof(msg_buf_t);
+    buf->data = (char *)(rec + 1) + rec->channel_len;
+    buf->segment = seg;
+    atomic_fetch_add(&seg->refs, 1);
+    return buf;
+}
+
+static int history_matches(const history_record_t *rec, const char *channel,
+                           size_t channel_len, uint32_t hash) {
+    return rec->channel_hash == hash && rec->channel_len == channel_len &&
+           memcmp(rec + 1, channel, channel_len) == 0;
+}
+
+// The newest lines said to a channel (NULL: to everyone) at or after since,
+// up to max, oldest first. Recent ones come from the ring, older ones
+// from the mapped segments; neither is copied.
+int history_collect(const char *channel, time_t since, int max, msg_buf_t **lines) {
+    uint32_t hash = channel ? (uint32_t)simple_hash(channel) : 0;
+    int count = 0, scanned = 0;
+    if (channel == NULL) channel = "";
+    size_t channel_len = strlen(channel);
+
+    pthread_rwlock_rdlock(&history.lock);
+    if (history.segment_count == 0) {
+        pthread_rwlock_unlock(&history.lock);
+        return 0;
+    }
+    uint64_t first = history.segments[0]->first_seq;
+    if (since > 0) {
+        uint64_t at = history_seq_at(since);
+        if (at > first) first = at;
+    }
+
+    uint64_t seq = history.next_seq - 1;
+    for (; seq >= first && seq > 0 && count < max && scanned < HISTORY_SCAN_LIMIT; seq--, scanned++) {
+        history_entry_t *e = &history.ring[seq % HISTORY_RING];
+        if (e->buf == NULL || e->seq != seq) break;
+        if (e->channel_hash == hash && strcmp(e->channel, channel) == 0) {
+            lines[count++] = msg_buf_ref(e->buf);
+        }
+    }
+
+    int segi = seq >= first && seq > 0 ? history_find_segment(seq) : -1;
+    if (segi >= 0 && count < max) {
+        history_segment_t *seg = history.segments[segi];
+        uint32_t off = history_offset_of(seg, seq);
+        while (count < max && scanned < HISTORY_SCAN_LIMIT) {
+            const history_record_t *rec = (const history_record_t *)(seg->map + off);
+            if (rec->seq < first) break;
+            scanned++;
+            if (history_matches(rec, channel, channel_len, hash)) {
+                msg_buf_t *view = history_view(seg, rec);
+                if (view == NULL) break;
+                lines[count++] = view;
+                atomic_fetch_add(&history.mapped_lines, 1);
+            }
+            if (rec->prev) {
+                off -= rec->prev;
+            } else if (--segi >= 0 && history.segments[segi]->tail > 0) {
+                seg = history.segments[segi];
+                off = seg->tail - seg->last_size;
+            } else {
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&history.lock);
+
+    // Collected newest first
+    for (int i = 0; i < count / 2; i++) {
+        msg_buf_t *t = lines[i];
+        lines[i] = lines[count - 1 - i];
+        lines[count - 1 - i] = t;
+    }
+    atomic_fetch_add(&history.replays, 1);
+    atomic_fetch_add(&history.replayed_lines, count);
+    return count;
+}
+
+// Queue collected lines behind a header, handing over their references.
+// Framed clients get one frame per line; a text client has nothing to tell
+// messages apart, so it gets a single newline-separated message instead.
+void history_send(client_t *client, const char *header, msg_buf_t **lines, int count) {
+    if (!client->framed) {
+        size_t total = strlen(header);
+        for (int i = 0; i < count; i++) total += 1 + lines[i]->len;
+        msg_buf_t *joined = msg_buf_new(NULL, total);
+        if (joined) {
+            size_t pos = strlen(header);
+            memcpy(joined->data, header, pos);
+            for (int i = 0; i < count; i++) {
+                joined->data[pos++] = '\n';
+                memcpy(joined->data + pos, lines[i]->data, lines[i]->len);
+                pos += lines[i]->len;
+            }
+            client_send_buf(client, joined);
+            msg_buf_unref(joined);
+        }
+        for (int i = 0; i < count; i++) msg_buf_unref(lines[i]);
+        return;
+    }
+    client_send(client, header, strlen(header));
+    for (int i = 0; i < count; i++) {
+        client_send_buf(client, lines[i]);
+        msg_buf_unref(lines[i]);
+    }
+}
+
+// /history [n | 30m | 2h | 1d | HH:MM] for the channel you talk in, or
+// for everyone when you are in none
+void handle_history(client_t *client, char *arg) {
+    msg_buf_t *lines[HISTORY_MAX_LINES];
+    char header[200];
+    const char *channel = client->channel ? client->channel->name : NULL;
+    int max = HISTORY_DEFAULT_LINES;
+    time_t since = 0;
+    char unit = 0;
+    int value = 0, hour, minute;
+    int limit = HISTORY_MAX_LINES < (int)queue_limit / 2 ? HISTORY_MAX_LINES : (int)queue_limit / 2;
+
+    if (history.segment_count == 0) {
+        char error_msg[] = "History is turned off on this server";
+        client_send(client, error_msg, strlen(error_msg));
+        return;
+    }
+    if (*arg == '\0') {
+        // Defaults
+    } else if (sscanf(arg, "%d:%d", &hour, &minute) == 2 && strchr(arg, ':')) {
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        tm.tm_hour = hour;
+        tm.tm_min = minute;
+        tm.tm_sec = 0;
+        since = mktime(&tm);
+        if (since > now) since -= 24 * 3600;
+        max = limit;
+    } else if (sscanf(arg, "%d%c", &value, &unit) == 2 && value > 0 && strchr("smhd", unit)) {
+        int seconds = unit == 's' ? 1 : unit == 'm' ? 60 : unit == 'h' ? 3600 : 86400;
+        since = time(NULL) - (time_t)value * seconds;
+        max = limit;
+    } else if (sscanf(arg, "%d", &value) == 1 && value > 0 && strspn(arg, "0123456789") == strlen(arg)) {
+        max = value;
+    } else {
+        char usage[] = "Usage: /history [lines | 30m | 2h | 1d | HH:MM]";
+        client_send(client, usage, strlen(usage));
+        return;
+    }
+    if (max > limit) max = limit;
+
+    int count = history_collect(channel, since, max, lines);
+    if (count == 0) {
+        snprintf(header, sizeof(header), "No messages%s%s%s", channel ? " in #" : "",
+                 channel ? channel : "", since ? " in that time" : "");
+    } else {
+        snprintf(header, sizeof(header), "Last %d message%s%s%s:", count, count == 1 ? "" : "s",
+                 channel ? " in #" : "", channel ? channel : "");
+    }
+    history_send(client, header, lines, count);
+}
+
+// At login: what was said to everyone since the user was last seen
+void history_catch_up(client_t *client, time_t last_seen) {
+    msg_buf_t *lines[HISTORY_LOGIN_LINES];
+    char header[100];
+    if (last_seen <= 0 || history.segment_count == 0) return;
+    int count = history_collect(NULL, last_seen, HISTORY_LOGIN_LINES, lines);
+    if (count == 0) return;
+    snprintf(header, sizeof(header), "While you were away (last %d message%s):", count, count == 1 ? "" : "s");
+    history_send(client, header, lines, count);
+}
+
+// Report outbound queue counters for this connection and the server
+void send_stats(client_t *client) {
+    size_t depth, bytes;
+    unsigned long dropped;
+    unsigned long delivered = atomic_load(&queue_stats.delivered);
+    unsigned long send_calls = atomic_load(&queue_stats.send_calls);
+    
+    pthread_mutex_lock(&client->out_lock);
+    depth = client->out_depth;
+    bytes = client->out_bytes;
+    dropped = client->out_dropped;
+    pthread_mutex_unlock(&client->out_lock);
+    
+    pthread_mutex_lock(&user_journal.lock);
+    unsigned long journal_records = user_journal.records;
+    unsigned long journal_appended = user_journal.appended_seq;
+    unsigned long journal_commits = user_journal.commits;
+    unsigned long journal_compactions = user_journal.compactions;
+    pthread_mutex_unlock(&user_journal.lock);
+    
+    pthread_mutex_lock(&faq_engine.lock);
+    unsigned long faq_asked = faq_engine.asked;
+    unsigned long faq_answered = faq_engine.answered;
+    unsigned long faq_failed = faq_engine.failed;
+    unsigned long faq_calls = faq_engine.calls;
+    unsigned long faq_streams = faq_engine.streams;
+    double first_token_avg = faq_answered ? faq_engine.first_token_total / faq_answered : 0.0;
+    double first_token_max = faq_engine.first_token_max;
+    double complete_avg = faq_answered ? faq_engine.complete_total / faq_answered : 0.0;
+    unsigned long faq_connects = faq_engine.connects;
+    int faq_waiting = faq_engine.waiting;
+    unsigned long faq_hedges = faq_engine.hedges;
+    unsigned long faq_failovers = faq_engine.failovers;
+    unsigned long faq_failed_fast = faq_engine.failed_fast;
+    char backend_lines[BUFFER_SIZE / 2] = "";
+    size_t backend_len = 0;
+    for (int i = 0; i < faq_engine.backend_count && backend_len < sizeof(backend_lines); i++) {
+        faq_backend_t *b = &faq_engine.backends[i];
+        static const char *circuit_names[] = { "up", "down", "probing" };
+        backend_len += snprintf(backend_lines + backend_len, sizeof(backend_lines) - backend_len,
+                                "\nFAQ backend %s: %s, p50/p95/p99 %.0f/%.0f/%.0f ms, timeout %ld ms, "
+                                "%lu calls, %lu failed, circuit opened %lu times, %lu hedges won",
+                                b->url, circuit_names[b->circuit], b->p50 * 1000, b->p95 * 1000,
+                                b->p99 * 1000, b->timeout_ms, b->calls, b->failures, b->trips, b->hedges_won);
+    }
+    pthread_mutex_unlock(&faq_engine.lock);
+    
+    unsigned long cache_hits = 0, cache_misses = 0, cache_evictions = 0;
+    size_t cache_entries = 0, cache_bytes = 0;
+    for (int i = 0; i < FAQ_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&faq_cache[i].lock);
+        cache_hits += faq_cache[i].hits;
+        cache_misses += faq_cache[i].misses;
+        cache_evictions += faq_cache[i].evictions;
+        cache_entries += faq_cache[i].entries;
+        cache_bytes += faq_cache[i].bytes;
+        pthread_mutex_unlock(&faq_cache[i].lock);
+    }
+    
+    pthread_mutex_lock(&upload_store.lock);
+    unsigned long store_names = upload_store.names, store_logical = upload_store.logical_bytes;
+    unsigned long store_blobs = upload_store.blob_count, store_disk = upload_store.blob_bytes;
+    unsigned long store_dedups = upload_store.dedup_uploads, store_dedup_bytes = upload_store.dedup_bytes;
+    unsigned long store_shared = upload_store.dedup_chunks, store_collected = upload_store.collected;
+    pthread_mutex_unlock(&upload_store.lock);
+    
+    pthread_rwlock_rdlock(&channel_table.lock);
+    int channels = channel_table.count;
+    pthread_rwlock_unlock(&channel_table.lock);
+    
+    pthread_mutex_lock(&presence.lock);
+    int presence_count = presence.count;
+    unsigned long presence_version = presence.version, presence_updates = presence.updates;
+    unsigned long pages_served = presence.pages_served, pages_rendered = presence.pages_rendered;
+    pthread_mutex_unlock(&presence.lock);
+    
+    pthread_mutex_lock(&mail.lock);
+    unsigned long mail_waiting = mail.waiting, mail_stored = mail.stored, mail_delivered = mail.delivered;
+    unsigned long mail_batches = mail.batches, mail_expired = mail.expired, mail_refused = mail.refused;
+    unsigned long mail_compactions = mail.compactions;
+    int mail_users = mail.count;
+    double mail_log_kb = mail.size / 1024.0;
+    pthread_mutex_unlock(&mail.lock);
+    
+    pthread_rwlock_rdlock(&history.lock);
+    unsigned long history_lines = history.segment_count ? history.next_seq - history.segments[0]->first_seq : 0;
+    int history_segments = history.segment_count;
+    unsigned long history_dropped = history.dropped_segments;
+    pthread_rwlock_unlock(&history.lock);
+    
+    unsigned long index_lookups = atomic_load(&faq_index.lookups);
+    unsigned long index_ns = atomic_load(&faq_index.lookup_ns);
+    
+    pool_stats_t pools;
+    pool_stats(&pools);
+    
+    char *stats = buf_pool_alloc(STATS_SIZE);
+    if (stats == NULL) return;
+    snprintf(stats, STATS_SIZE,
+             "Your queue: %zu messages (%zu bytes), %lu dropped\n"
+             "Sessions: %d open (limit %d)\n"
+             "Presence: %d online (version %lu), %d subscribed, %lu updates sent, %lu /users pages served (%lu rendered), join notices up to %d online\n"
+             "Memory: %.1f MB resident; %d session objects in %d slabs of %d; %ld pooled buffers in use, "
+             "%zu KB cached, %.1f%% of %lu allocations reused, %lu handed back to malloc\n"
+             "Server queues: %lu queued, %lu dropped, %lu slow-consumer disconnects, max depth %lu (limit %zu, policy %s)\n"
+             "Fan-out: %lu messages delivered with %lu send syscalls (%.3f per message)\n"
+             "Channels: %d channels, %lu memberships, %lu lines posted to %lu members\n"
+             "History: %lu lines in %d segments (limit %d MB), %lu segments dropped, %lu replays sent %lu lines (%lu from disk)\n"
+             "Mailboxes: %lu messages waiting in %d mailboxes (%.1f KB log), %lu stored, %lu delivered in %lu batches, %lu expired, %lu refused when full, %lu compactions\n"
+             "User journal: %lu records appended in %lu commits, %lu in current journal, %lu compactions (fsync %s)\n"
+             "Transfers: %.1f MB zero-copy, %.1f MB copied, %lu fallbacks to copying (zero-copy %s), %lu downloads in progress\n"
+             "Upload store: %lu files, %lu blobs (%.1f MB on disk for %.1f MB of files), %lu uploads deduplicated (%.1f MB not sent), %lu chunks shared, %lu blobs collected\n"
+             "FAQ: %lu asked, %lu answered, %lu failed in %lu calls (batches of up to %d), %d waiting (limit %d in flight), %lu connections opened\n"
+             "FAQ latency: first text after %.0f ms avg (max %.0f), full answer after %.0f ms avg, %lu streamed\n"
+             "FAQ cache: %lu hits, %lu misses (%.1f%% hit rate), %zu answers in %zu/%zu KB, %lu evictions\n"
+             "FAQ index: %lu of %lu questions answered locally (%.1f us per lookup), %d answers, %zu terms\n"
+             "FAQ resilience: %lu hedged calls, %lu failovers, %lu failed fast with every backend down%s",
+             depth, bytes, dropped,
+             atomic_load(&client_count), max_clients,
+             presence_count, presence_version, atomic_load(&presence.subscribers), presence_updates,
+             pages_served, pages_rendered, join_notices,
+             resident_bytes() / 1048576.0, pools.objects, pools.slabs, SLAB_OBJECTS, pools.buffers,
+             pools.cached_bytes / 1024, pools.allocs ? 100.0 * pools.reused / pools.allocs : 0.0,
+             pools.allocs, pools.released,
+             atomic_load(&queue_stats.queued),
+             atomic_load(&queue_stats.dropped),
+             atomic_load(&queue_stats.slow_disconnects),
+             atomic_load(&queue_stats.max_depth),
+             queue_limit,
+             slow_policy == SLOW_DISCONNECT ? "disconnect" : "drop-oldest",
+             delivered, send_calls,
+             delivered ? (double)send_calls / delivered : 0.0,
+             channels, atomic_load(&channel_table.memberships),
+             atomic_load(&channel_table.messages), atomic_load(&channel_table.deliveries),
+             history_lines, history_segments, history_mb, history_dropped,
+             atomic_load(&history.replays), atomic_load(&history.replayed_lines),
+             atomic_load(&history.mapped_lines),
+             mail_waiting, mail_users, mail_log_kb, mail_stored, mail_delivered, mail_batches,
+             mail_expired, mail_refused, mail_compactions,
+             journal_appended, journal_commits, journal_records, journal_compactions,
+             fsync_policy == FSYNC_ALWAYS ? "always" : fsync_policy == FSYNC_OFF ? "off" : "interval",
+             atomic_load(&transfer_stats.zero_copy_bytes) / 1048576.0,
+             atomic_load(&transfer_stats.copied_bytes) / 1048576.0,
+             atomic_load(&transfer_stats.fallbacks), zero_copy_transfers ? "on" : "off",
+             atomic_load(&transfer_stats.downloads),
+             store_names, store_blobs, store_disk / 1048576.0, store_logical / 1048576.0,
+             store_dedups, store_dedup_bytes / 1048576.0, store_shared, store_collected,
+             faq_asked, faq_answered, faq_failed, faq_calls, faq_batch_max, faq_waiting, faq_concurrency, faq_connects,
+             first_token_avg * 1000, first_token_max * 1000, complete_avg * 1000, faq_streams,
+             cache_hits, cache_misses,
+             cache_hits + cache_misses ? 100.0 * cache_hits / (cache_hits + cache_misses) : 0.0,
+             cache_entries, cache_bytes / 1024, faq_cache_budget / 1024, cache_evictions,
+             atomic_load(&faq_index.local), index_lookups,
+             index_lookups ? index_ns / 1000.0 / index_lookups : 0.0,
+             faq_index.doc_count, faq_index.terms,
+             faq_hedges, faq_failovers, faq_failed_fast, backend_lines);
+    client_send(client, stats, strlen(stats));
+    buf_pool_free(stats, STATS_SIZE);
+}
+
+// File handling functions
+//
+// Sockets stay non-blocking during transfers: a short read or write or
+// EAGAIN means wait for the socket, up to FILE_IO_TIMEOUT_MS, and carry on
+// from where the kernel stopped. A stalled peer times out instead of
+// holding the thread forever.
+
+// Waits up to FILE_IO_TIMEOUT_MS for the socket to become readable or
+// writable. Returns -1 on timeout or error.
+int wait_socket(int sock, short events) {
+    struct pollfd pfd = { .fd = sock, .events = events };
+    int ready;
+    
+    do {
+        ready = poll(&pfd, 1, FILE_IO_TIMEOUT_MS);
+    } while (ready < 0 && errno == EINTR);
+    if (ready == 0) errno = ETIMEDOUT;
+    return ready > 0 ? 0 : -1;
+}
+
+// Receive exactly len bytes, for use during file transfers
+int recv_all(int sock, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_socket(sock, POLLIN) < 0) return -1;
+            continue;
+        }
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send of the whole buffer, for use during file transfers
+int send_all(int sock, const void *data, size_t len, int flags) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, flags | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_socket(sock, POLLOUT) < 0) return -1;
+            continue;
+        }
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// pread()/send() through a buffer, chunk bytes at a time. The fallback for
+// send_file_range(), and the path every download took before sendfile().
+int copy_file_to_socket(int sock, int fd, off_t *offset, size_t len, size_t chunk) {
+    char *buffer = buf_pool_alloc(COPY_BUFFER_SIZE);
+    int result = 0;
+    
+    if (buffer == NULL) return -1;
+    if (chunk > COPY_BUFFER_SIZE) chunk = COPY_BUFFER_SIZE;
+    while (len > 0) {
+        ssize_t got = pread(fd, buffer, len < chunk ? len : chunk, *offset);
+        if (got < 0 && errno == EINTR) continue;
+        // Stop if the file ended early or the peer went away
+        if (got <= 0 || send_all(sock, buffer, got, 0) < 0) {
+            result = -1;
+            break;
+        }
+        *offset += got;
+        len -= got;
+        atomic_fetch_add(&transfer_stats.copied_bytes, got);
+    }
+    buf_pool_free(buffer, COPY_BUFFER_SIZE);
+    return result;
+}
+
+// Sends len bytes of fd starting at *offset, advancing it. sendfile() hands
+// page cache pages straight to the socket; if the kernel will not do that
+// for this file, the rest goes through copy_file_to_socket().
+int send_file_range(int sock, int fd, off_t *offset, size_t len) {
+    while (len > 0 && zero_copy_transfers) {
+        ssize_t n = sendfile(sock, fd, offset, len);
+        if (n > 0) {
+            len -= n;
+            atomic_fetch_add(&transfer_stats.zero_copy_bytes, n);
+            continue;
+        }
+        if (n == 0) return -1;      // File ended early
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (wait_socket(sock, POLLOUT) < 0) return -1;
+            continue;
+        }
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+        atomic_fetch_add(&transfer_stats.fallbacks, 1);
+        break;
+    }
+    return copy_file_to_socket(sock, fd, offset, len, COPY_BUFFER_SIZE);
+}
+
+// recv()/write() through a buffer; the counterpart of copy_file_to_socket().
+// Never reads past len, so whatever the client sends next stays queued.
+long copy_socket_to_file(int sock, int fd, long len, size_t chunk) {
+    char *buffer = buf_pool_alloc(COPY_BUFFER_SIZE);
+    long total = 0;
+    
+    if (buffer == NULL) return 0;
+    if (chunk > COPY_BUFFER_SIZE) chunk = COPY_BUFFER_SIZE;
+    while (total < len) {
+        size_t want = (size_t)(len - total) < chunk ? (size_t)(len - total) : chunk;
+        ssize_t n = recv(sock, buffer, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_socket(sock, POLLIN) < 0) break;
+            continue;
+        }
+        if (n <= 0 || write_all(fd, buffer, n) < 0) break;
+        total += n;
+        atomic_fetch_add(&transfer_stats.copied_bytes, n);
+    }
+    buf_pool_free(buffer, COPY_BUFFER_SIZE);
+    return total;
+}
+
+// Moves len bytes from the socket into fd through a pipe: socket buffer to
+// pipe to page cache, never through user space. Falls back to
+// copy_socket_to_file() where splice() is not supported. Returns the bytes
+// written to fd.
+long recv_file_range(int sock, int fd, long len) {
+    int pipefd[2];
+    long total = 0;
+    
+    if (!zero_copy_transfers || pipe2(pipefd, O_CLOEXEC) < 0) {
+        return copy_socket_to_file(sock, fd, len, COPY_BUFFER_SIZE);
+    }
+    while (total < len) {
+        size_t want = len - total < SPLICE_CHUNK ? (size_t)(len - total) : SPLICE_CHUNK;
+        ssize_t in = splice(sock, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_socket(sock, POLLIN) < 0) break;
+            continue;
+        }
+        if (in < 0 && errno == EINVAL) {
+            atomic_fetch_add(&transfer_stats.fallbacks, 1);
+            total += copy_socket_to_file(sock, fd, len - total, COPY_BUFFER_SIZE);
+            break;
+        }
+        if (in <= 0) break;
+        
+        // Empty the pipe into the file. If the file cannot take spliced
+        // pages, what is already in the pipe is read out the ordinary way.
+        ssize_t left = in;
+        while (left > 0) {
+            ssize_t out = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out < 0 && errno == EINVAL) {
+                char *buffer = buf_pool_alloc(COPY_BUFFER_SIZE);
+                if (buffer == NULL) break;
+                ssize_t got = read(pipefd[0], buffer, left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE);
+                if (got > 0 && write_all(fd, buffer, got) < 0) got = -1;
+                buf_pool_free(buffer, COPY_BUFFER_SIZE);
+                if (got <= 0) break;
+                out = got;
+            }
+            if (out <= 0) break;
+            left -= out;
+        }
+        if (left > 0) {
+            total += in - left;
+            break;
+        }
+        total += in;
+        atomic_fetch_add(&transfer_stats.zero_copy_bytes, in);
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return total;
+}
+
+// CRC-32 (the zlib/PNG polynomial), eight bytes per step. Pass 0 to
+// start, or the previous result to continue over more data.
+void crc32_init_tables(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc32_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32_table[t][i] = (crc32_table[t - 1][i] >> 8) ^ crc32_table[0][crc32_table[t - 1][i] & 0xff];
+        }
+    }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    
+    pthread_once(&crc32_once, crc32_init_tables);
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24) ^ crc;
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+              crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+              crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+              crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Whole-file CRC-32 of an open file. Remembered per inode until the file
+// changes, so resumed and parallel downloads of a big file read it once.
+int file_crc32(int fd, const struct stat *st, uint32_t *crc) {
+    file_crc_entry_t *slot = &file_crc_cache[st->st_ino % FILE_CRC_CACHE];
+    uint32_t sum = 0;
+    
+    pthread_mutex_lock(&file_crc_lock);
+    if (slot->valid && slot->dev == st->st_dev && slot->ino == st->st_ino && slot->size == st->st_size &&
+        slot->mtime.tv_sec == st->st_mtim.tv_sec && slot->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+        slot->ctime.tv_sec == st->st_ctim.tv_sec && slot->ctime.tv_nsec == st->st_ctim.tv_nsec) {
+        *crc = slot->crc;
+        pthread_mutex_unlock(&file_crc_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&file_crc_lock);
+    
+    char *buffer = buf_pool_alloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL) return -1;
+    for (off_t offset = 0; offset < st->st_size; ) {
+        ssize_t got = pread(fd, buffer, COPY_BUFFER_SIZE, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            buf_pool_free(buffer, COPY_BUFFER_SIZE);
+            return -1;
+        }
+        sum = crc32_update(sum, buffer, got);
+        offset += got;
+    }
+    buf_pool_free(buffer, COPY_BUFFER_SIZE);
+    
+    pthread_mutex_lock(&file_crc_lock);
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->size = st->st_size;
+    slot->mtime = st->st_mtim;
+    slot->ctime = st->st_ctim;
+    slot->crc = sum;
+    slot->valid = 1;
+    pthread_mutex_unlock(&file_crc_lock);
+    *crc = sum;
+    return 0;
+}
+
+// Opens a file under UPLOAD_DIR for download. Returns -1 unless it is a
+// regular file.
+int open_download(const char *filename, struct stat *st) {
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "%s/%s", UPLOAD_DIR, filename);
+    
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// SHA-256, for naming blobs and recognising files the store already has
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(sha256_t *s) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(s->state, initial, sizeof(initial));
+    s->bytes = 0;
+    s->fill = 0;
+}
+
+void sha256_block(sha256_t *s, const unsigned char *p) {
+    uint32_t w[64], v[8];
+    
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, s->state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = v[7] + (ROTR32(v[4], 6) ^ ROTR32(v[4], 11) ^ ROTR32(v[4], 25)) +
+                      ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR32(v[0], 2) ^ ROTR32(v[0], 13) ^ ROTR32(v[0], 22)) +
+                      ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) s->state[i] += v[i];
+}
+
+void sha256_update(sha256_t *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    
+    s->bytes += len;
+    if (s->fill) {
+        size_t take = 64 - s->fill < len ? 64 - s->fill : len;
+        memcpy(s->block + s->fill, p, take);
+        s->fill += take;
+        p += take;
+        len -= take;
+        if (s->fill < 64) return;
+        sha256_block(s, s->block);
+        s->fill = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) sha256_block(s, p);
+    memcpy(s->block, p, len);
+    s->fill = len;
+}
+
+void sha256_final(sha256_t *s, unsigned char out[32]) {
+    uint64_t bits = s->bytes * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t pad_len = (s->fill < 56 ? 56 : 120) - s->fill;
+    
+    for (int i = 0; i < 8; i++) pad[pad_len + i] = bits >> (56 - 8 * i);
+    sha256_update(s, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = s->state[i] >> 24;
+        out[4 * i + 1] = s->state[i] >> 16;
+        out[4 * i + 2] = s->state[i] >> 8;
+        out[4 * i + 3] = s->state[i];
+    }
+}
+
+void hex_encode(const unsigned char *in, size_t n, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < n; i++) {
+        out[2 * i] = digits[in[i] >> 4];
+        out[2 * i + 1] = digits[in[i] & 15];
+    }
+    out[2 * n] = '\0';
+}
+
+int hex_decode(const char *in, unsigned char *out, size_t n) {
+    for (size_t i = 0; i < 2 * n; i++) {
+        int c = tolower((unsigned char)in[i]);
+        int d = isdigit(c) ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (d < 0) return -1;
+        out[i / 2] = i % 2 ? (out[i / 2] | d) : d << 4;
+    }
+    return 0;
+}
+
+// Upload store. Every upload is cut into STORE_CHUNK_SIZE blobs stored once
+// under .store/blobs/<xx>/<sha256>, and .store/manifests/<name> lists the
+// blobs of the file that name holds. In memory, each distinct content
+// counts the names pointing at it and each blob counts the contents using
+// it; both are rebuilt from the manifests at startup. A blob is deleted as
+// soon as its count reaches zero.
+
+uint32_t store_bucket(const unsigned char hash[32]) {
+    return ((uint32_t)hash[0] << 24 | (uint32_t)hash[1] << 16 | (uint32_t)hash[2] << 8 | hash[3]) % STORE_BUCKETS;
+}
+
+void store_blob_path(char *path, size_t size, const unsigned char hash[32]) {
+    char hex[65];
+    hex_encode(hash, 32, hex);
+    snprintf(path, size, "%s/blobs/%.2s/%s", STORE_DIR, hex, hex);
+}
+
+void store_manifest_path(char *path, size_t size, const char *name) {
+    snprintf(path, size, "%s/manifests/%s", STORE_DIR, name);
+}
+
+// Where a non-resumable upload is written before it is stored
+void store_upload_path(char *path, size_t size, int client_id) {
+    snprintf(path, size, "%s/tmp/upload.%d", STORE_DIR, client_id);
+}
+
+store_blob_t *store_find_blob(const unsigned char hash[32]) {
+    store_blob_t *blob = upload_store.blobs[store_bucket(hash)];
+    while (blob && memcmp(blob->hash, hash, 32) != 0) blob = blob->next;
+    return blob;
+}
+
+store_content_t *store_find_content(const unsigned char sha[32]) {
+    store_content_t *content = upload_store.contents[store_bucket(sha)];
+    while (content && memcmp(content->sha, sha, 32) != 0) content = content->next;
+    return content;
+}
+
+// Drops one reference to a blob, deleting it when it was the last.
+// Caller holds upload_store.lock.
+void store_release_blob(const unsigned char hash[32]) {
+    store_blob_t **link = &upload_store.blobs[store_bucket(hash)];
+    while (*link && memcmp((*link)->hash, hash, 32) != 0) link = &(*link)->next;
+    store_blob_t *blob = *link;
+    if (blob == NULL || --blob->refs > 0) return;
+    
+    char path[512];
+    store_blob_path(path, sizeof(path), hash);
+    unlink(path);
+    *link = blob->next;
+    upload_store.blob_count--;
+    upload_store.blob_bytes -= blob->size;
+    upload_store.collected++;
+    free(blob);
+}
+
+// Drops a content no name points at any more, and its blob references.
+// Caller holds upload_store.lock.
+void store_drop_content(store_content_t *content) {
+    store_content_t **link = &upload_store.contents[store_bucket(content->sha)];
+    while (*link && *link != content) link = &(*link)->next;
+    if (*link) *link = content->next;
+    for (int i = 0; i < content->chunks; i++) store_release_blob(content->hashes[i]);
+    free(content->hashes);
+    free(content);
+}
+
+// Where chunk i of an upload being stored waits before store_add_content()
+// renames it into the blobs
+void store_blob_tmp_path(char *path, size_t size, unsigned long ingest, int i) {
+    snprintf(path, size, "%s/tmp/blob.%lu.%d", STORE_DIR, ingest, i);
+}
+
+// Copies one chunk of an upload into a temporary blob file
+int store_write_blob(int src_fd, off_t offset, size_t len, const char *tmp) {
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    // copy_file_range() lets the filesystem share or copy the extent
+    // itself; whatever it will not do goes through a buffer
+    while (len > 0) {
+        ssize_t n = copy_file_range(src_fd, &offset, fd, NULL, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len -= n;
+    }
+    char *buffer = len > 0 ? buf_pool_alloc(COPY_BUFFER_SIZE) : NULL;
+    while (len > 0 && buffer) {
+        ssize_t got = pread(src_fd, buffer, len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0 || write_all(fd, buffer, got) < 0) break;
+        offset += got;
+        len -= got;
+    }
+    buf_pool_free(buffer, COPY_BUFFER_SIZE);
+    if (close(fd) < 0 || len > 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Moves a temporary blob file to where the blob lives
+int store_place_blob(const char *tmp, const unsigned char hash[32]) {
+    char path[512], dir[512];
+    
+    store_blob_path(path, sizeof(path), hash);
+    snprintf(dir, sizeof(dir), "%s", path);
+    *strrchr(dir, '/') = '\0';
+    mkdir(dir, 0777);
+    return rename(tmp, path);
+}
+
+// Registers a content and takes a reference on each of its blobs. With
+// written, blobs the store lacks were copied beforehand to the temporary
+// files of that ingest that written marks, and are renamed into place;
+// without, they are already on disk (startup). The marks of files renamed
+// are cleared. Returns the store's entry, which may be an existing one, or
+// NULL. Caller holds upload_store.lock.
+store_content_t *store_add_content(store_content_t *parsed, unsigned long ingest, unsigned char *written) {
+    store_content_t *content = store_find_content(parsed->sha);
+    if (content) return content;
+    
+    content = malloc(sizeof(store_content_t));
+    unsigned char (*hashes)[32] = malloc((size_t)parsed->chunks * 32 + 1);
+    if (content == NULL || hashes == NULL) {
+        free(content);
+        free(hashes);
+        return NULL;
+    }
+    
+    for (int i = 0; i < parsed->chunks; i++) {
+        store_blob_t *blob = store_find_blob(parsed->hashes[i]);
+        size_t size = i < parsed->chunks - 1 ? STORE_CHUNK_SIZE : (size_t)(parsed->size - (long)i * STORE_CHUNK_SIZE);
+        if (blob) {
+            blob->refs++;
+            if (written) upload_store.dedup_chunks++;
+            continue;
+        }
+        char tmp[512];
+        if (written) store_blob_tmp_path(tmp, sizeof(tmp), ingest, i);
+        if ((written && (!written[i] || store_place_blob(tmp, parsed->hashes[i]) < 0)) ||
+            (blob = calloc(1, sizeof(store_blob_t))) == NULL) {
+            while (--i >= 0) store_release_blob(parsed->hashes[i]);
+            free(content);
+            free(hashes);
+            return NULL;
+        }
+        if (written) written[i] = 0;
+        memcpy(blob->hash, parsed->hashes[i], 32);
+        blob->refs = 1;
+        blob->size = size;
+        uint32_t bucket = store_bucket(blob->hash);
+        blob->next = upload_store.blobs[bucket];
+        upload_store.blobs[bucket] = blob;
+        upload_store.blob_count++;
+        upload_store.blob_bytes += size;
+    }
+    
+    *content = *parsed;
+    content->names = 0;
+    content->hashes = hashes;
+    memcpy(hashes, parsed->hashes, (size_t)parsed->chunks * 32);
+    uint32_t bucket = store_bucket(content->sha);
+    content->next = upload_store.contents[bucket];
+    upload_store.contents[bucket] = content;
+    return content;
+}
+
+int manifest_read(const char *path, store_content_t *m) {
+    char line[128], hex[65];
+    FILE *fp = fopen(path, "r");
+    int n = 0;
+    
+    memset(m, 0, sizeof(*m));
+    if (fp == NULL) return -1;
+    if (fscanf(fp, "size %ld\nsha256 %64s\ncrc32 %x\n", &m->size, hex, &m->crc) != 3 ||
+        hex_decode(hex, m->sha, 32) < 0 || m->size < 0) {
+        fclose(fp);
+        return -1;
+    }
+    m->chunks = (m->size + STORE_CHUNK_SIZE - 1) / STORE_CHUNK_SIZE;
+    m->hashes = malloc((size_t)m->chunks * 32 + 1);
+    while (m->hashes && n < m->chunks && fgets(line, sizeof(line), fp)) {
+        if (strlen(line) < 64 || hex_decode(line, m->hashes[n], 32) < 0) break;
+        n++;
+    }
+    fclose(fp);
+    if (n < m->chunks) {
+        free(m->hashes);
+        m->hashes = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int manifest_write(const char *name, const store_content_t *c) {
+    char path[512], tmp[520], hex[65];
+    
+    store_manifest_path(path, sizeof(path), name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) return -1;
+    hex_encode(c->sha, 32, hex);
+    fprintf(fp, "size %ld\nsha256 %s\ncrc32 %08x\n", c->size, hex, c->crc);
+    for (int i = 0; i < c->chunks; i++) {
+        hex_encode(c->hashes[i], 32, hex);
+        fprintf(fp, "%s\n", hex);
+    }
+    if (fclose(fp) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return rename(tmp, path);
+}
+
+// Points name at content, replacing whatever it held before. Caller holds
+// upload_store.lock.
+int store_set_name(const char *name, store_content_t *content) {
+    char path[512];
+    store_content_t old;
+    
+    store_manifest_path(path, sizeof(path), name);
+    int had_old = manifest_read(path, &old) == 0;
+    if (manifest_write(name, content) < 0) {
+        free(old.hashes);
+        return -1;
+    }
+    content->names++;
+    upload_store.names++;
+    upload_store.logical_bytes += content->size;
+    
+    if (had_old) {
+        store_content_t *prev = store_find_content(old.sha);
+        if (prev) {
+            upload_store.names--;
+            upload_store.logical_bytes -= prev->size;
+            if (--prev->names == 0) store_drop_content(prev);
+        }
+        free(old.hashes);
+    } else {
+        // A plain file of that name from before the store would shadow nothing
+        // now, but would still take up the space
+        snprintf(path, sizeof(path), "%s/%s", UPLOAD_DIR, name);
+        unlink(path);
+    }
+    return 0;
+}
+
+// Moves a finished upload into the store under name. Chunks the store
+// already has are not written again. With expect_sha, the file must hash
+// to it. The upload file is removed either way.
+int store_ingest(const char *path, const char *name, const unsigned char *expect_sha) {
+    char *buffer = buf_pool_alloc(COPY_BUFFER_SIZE);
+    struct stat st;
+    store_content_t parsed = {0};
+    sha256_t whole;
+    unsigned char *written = NULL;
+    static atomic_ulong ingests;
+    unsigned long ingest = atomic_fetch_add(&ingests, 1);
+    char tmp[512];
+    int result = -1;
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (buffer == NULL || fd < 0 || fstat(fd, &st) < 0) goto done;
+    parsed.size = st.st_size;
+    parsed.chunks = (parsed.size + STORE_CHUNK_SIZE - 1) / STORE_CHUNK_SIZE;
+    parsed.hashes = malloc((size_t)parsed.chunks * 32 + 1);
+    written = calloc((size_t)parsed.chunks + 1, 1);
+    if (parsed.hashes == NULL || written == NULL) goto done;
+    
+    // Hashing is the slow part and needs no lock
+    sha256_init(&whole);
+    for (int i = 0; i < parsed.chunks; i++) {
+        sha256_t chunk;
+        off_t offset = (off_t)i * STORE_CHUNK_SIZE;
+        off_t end = offset + STORE_CHUNK_SIZE < st.st_size ? offset + STORE_CHUNK_SIZE : st.st_size;
+        sha256_init(&chunk);
+        while (offset < end) {
+            size_t want = end - offset < COPY_BUFFER_SIZE ? (size_t)(end - offset) : COPY_BUFFER_SIZE;
+            ssize_t got = pread(fd, buffer, want, offset);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) goto done;
+            sha256_update(&chunk, buffer, got);
+            sha256_update(&whole, buffer, got);
+            parsed.crc = crc32_update(parsed.crc, buffer, got);
+            offset += got;
+        }
+        sha256_final(&chunk, parsed.hashes[i]);
+    }
+    sha256_final(&whole, parsed.sha);
+    if (expect_sha && memcmp(expect_sha, parsed.sha, 32) != 0) goto done;
+    
+    // So is copying the chunks the store lacks, so the lock is held only to
+    // see which those are, and then to rename them into place and publish
+    // the name. A blob released between the two is missing again and gets
+    // copied on another pass. written[i] is 2 while chunk i is due, 1 once
+    // its temporary file is complete.
+    while (1) {
+        int missing = 0;
+        pthread_mutex_lock(&upload_store.lock);
+        for (int i = 0; i < parsed.chunks && store_find_content(parsed.sha) == NULL; i++) {
+            if (written[i] || store_find_blob(parsed.hashes[i])) continue;
+            int j = 0;
+            while (j < i && !(written[j] && memcmp(parsed.hashes[j], parsed.hashes[i], 32) == 0)) j++;
+            if (j < i) continue;
+            written[i] = 2;
+            missing++;
+        }
+        if (missing == 0) {
+            store_content_t *content = store_add_content(&parsed, ingest, written);
+            if (content) {
+                result = store_set_name(name, content);
+                if (content->names == 0) store_drop_content(content);
+            }
+            pthread_mutex_unlock(&upload_store.lock);
+            break;
+        }
+        pthread_mutex_unlock(&upload_store.lock);
+        
+        for (int i = 0; i < parsed.chunks; i++) {
+            if (written[i] != 2) continue;
+            size_t size = i < parsed.chunks - 1 ? STORE_CHUNK_SIZE : (size_t)(parsed.size - (long)i * STORE_CHUNK_SIZE);
+            store_blob_tmp_path(tmp, sizeof(tmp), ingest, i);
+            if (store_write_blob(fd, (off_t)i * STORE_CHUNK_SIZE, size, tmp) < 0) goto done;
+            written[i] = 1;
+        }
+    }
+    
+done:
+    // Temporary blobs the store did not take: already there, or a failure
+    for (int i = 0; written && i < parsed.chunks; i++) {
+        if (written[i] == 0) continue;
+        store_blob_tmp_path(tmp, sizeof(tmp), ingest, i);
+        unlink(tmp);
+    }
+    free(written);
+    if (fd >= 0) close(fd);
+    buf_pool_free(buffer, COPY_BUFFER_SIZE);
+    free(parsed.hashes);
+    unlink(path);
+    return result;
+}
+
+// Gives name the content with this SHA-256 if the store already has it,
+// so the upload can be skipped. Returns 1 if it did.
+int store_link_existing(const char *name, const unsigned char sha[32], long size) {
+    int linked = 0;
+    
+    pthread_mutex_lock(&upload_store.lock);
+    store_content_t *content = store_find_content(sha);
+    if (content && content->size == size && store_set_name(name, content) == 0) {
+        upload_store.dedup_uploads++;
+        upload_store.dedup_bytes += size;
+        linked = 1;
+    }
+    pthread_mutex_unlock(&upload_store.lock);
+    return linked;
+}
+
+// Rebuilds the reference counts from the manifests, then deletes blobs no
+// manifest uses (left by a crash between writing blobs and the manifest)
+void store_init() {
+    char path[768];
+    struct dirent *entry;
+    
+    mkdir(UPLOAD_DIR, 0777);
+    mkdir(STORE_DIR, 0777);
+    mkdir(STORE_DIR "/blobs", 0777);
+    mkdir(STORE_DIR "/manifests", 0777);
+    mkdir(STORE_DIR "/parts", 0777);
+    mkdir(STORE_DIR "/tmp", 0777);
+    
+    DIR *dir = opendir(STORE_DIR "/manifests");
+    while (dir && (entry = readdir(dir)) != NULL) {
+        store_content_t m;
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/manifests/%s", STORE_DIR, entry->d_name);
+        size_t len = strlen(entry->d_name);
+        if (len > 4 && strcmp(entry->d_name + len - 4, ".tmp") == 0) {
+            unlink(path);
+            continue;
+        }
+        if (manifest_read(path, &m) < 0) {
+            fprintf(stderr, "Upload store: ignoring unreadable manifest %s\n", path);
+            continue;
+        }
+        store_content_t *content = store_add_content(&m, 0, NULL);
+        if (content) {
+            content->names++;
+            upload_store.names++;
+            upload_store.logical_bytes += content->size;
+        }
+        free(m.hashes);
+    }
+    if (dir) closedir(dir);
+    
+    unsigned long swept = 0;
+    dir = opendir(STORE_DIR "/blobs");
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char sub[512];
+        snprintf(sub, sizeof(sub), "%s/blobs/%s", STORE_DIR, entry->d_name);
+        DIR *blobs = opendir(sub);
+        struct dirent *blob;
+        while (blobs && (blob = readdir(blobs)) != NULL) {
+            unsigned char hash[32];
+            if (blob->d_name[0] == '.') continue;
+            if (strlen(blob->d_name) == 64 && hex_decode(blob->d_name, hash, 32) == 0 && store_find_blob(hash)) continue;
+            snprintf(path, sizeof(path), "%s/%s", sub, blob->d_name);
+            unlink(path);
+            swept++;
+        }
+        if (blobs) closedir(blobs);
+    }
+    if (dir) closedir(dir);
+    
+    dir = opendir(STORE_DIR "/tmp");
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/tmp/%s", STORE_DIR, entry->d_name);
+        unlink(path);
+    }
+    if (dir) closedir(dir);
+    
+    if (upload_store.names || swept) {
+        printf("Upload store: %lu files, %lu blobs (%.1f MB), %lu unused blobs removed\n",
+               upload_store.names, upload_store.blob_count, upload_store.blob_bytes / 1048576.0, swept);
+    }
+}
+
+// Opens name for download: its manifest, or a plain file left in
+// UPLOAD_DIR from before the store. Returns -1 if there is neither.
+int stored_file_open(const char *name, stored_file_t *sf) {
+    char path[512];
+    store_content_t m;
+    
+    memset(sf, 0, sizeof(*sf));
+    sf->plain_fd = -1;
+    store_manifest_path(path, sizeof(path), name);
+    if (manifest_read(path, &m) == 0) {
+        sf->size = m.size;
+        sf->crc = m.crc;
+        sf->chunks = m.chunks;
+        sf->hashes = m.hashes;
+        sf->fds = malloc(sizeof(int) * (m.chunks + 1));
+        if (sf->fds == NULL) {
+            free(m.hashes);
+            return -1;
+        }
+        for (int i = 0; i < m.chunks; i++) sf->fds[i] = -1;
+        return 0;
+    }
+    sf->plain_fd = open_download(name, &sf->st);
+    if (sf->plain_fd < 0) return -1;
+    sf->size = sf->st.st_size;
+    return 0;
+}
+
+void stored_file_close(stored_file_t *sf) {
+    for (int i = 0; sf->fds && i < sf->chunks; i++) {
+        if (sf->fds[i] >= 0) close(sf->fds[i]);
+    }
+    if (sf->plain_fd >= 0) close(sf->plain_fd);
+    free(sf->fds);
+    free(sf->hashes);
+}
+
+// Blobs are opened as a download reaches them
+int stored_file_blob(stored_file_t *sf, int i) {
+    if (sf->fds[i] < 0) {
+        char path[512];
+        store_blob_path(path, sizeof(path), sf->hashes[i]);
+        sf->fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    return sf->fds[i];
+}
+
+int stored_file_crc32(stored_file_t *sf, uint32_t *crc) {
+    if (sf->plain_fd >= 0) return file_crc32(sf->plain_fd, &sf->st, crc);
+    *crc = sf->crc;
+    return 0;
+}
+
+// pread() across blob boundaries. Returns -1 unless all len bytes were read.
+int stored_file_pread(stored_file_t *sf, void *buf, size_t len, off_t offset) {
+    char *p = buf;
+    
+    while (len > 0) {
+        int fd = sf->plain_fd;
+        off_t at = offset;
+        size_t want = len;
+        if (fd < 0) {
+            int i = offset / STORE_CHUNK_SIZE;
+            at = offset % STORE_CHUNK_SIZE;
+            want = (size_t)(STORE_CHUNK_SIZE - at) < len ? (size_t)(STORE_CHUNK_SIZE - at) : len;
+            if (i >= sf->chunks || (fd = stored_file_blob(sf, i)) < 0) return -1;
+        }
+        ssize_t got = pread(fd, p, want, at);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        p += got;
+        offset += got;
+        len -= got;
+    }
+    return 0;
+}
+
+// send_file_range() across blob boundaries, so stored files still go out
+// with sendfile()
+int stored_file_send(int sock, stored_file_t *sf, off_t *offset, size_t len) {
+    if (sf->plain_fd >= 0) return send_file_range(sock, sf->plain_fd, offset, len);
+    while (len > 0) {
+        int i = *offset / STORE_CHUNK_SIZE;
+        off_t at = *offset % STORE_CHUNK_SIZE;
+        size_t n = (size_t)(STORE_CHUNK_SIZE - at) < len ? (size_t)(STORE_CHUNK_SIZE - at) : len;
+        int fd;
+        if (i >= sf->chunks || (fd = stored_file_blob(sf, i)) < 0) return -1;
+        if (send_file_range(sock, fd, &at, n) < 0) return -1;
+        *offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// A NULL filename is a put refused at the command: the data is read and
+// thrown away so the connection stays in step.
+void handle_file_put(int client_socket, char *filename) {
+    long file_size;
+    
+    if (recv_all(client_socket, &file_size, sizeof(file_size)) < 0) {
+        printf("Failed to receive file size\n");
+        return;
+    }
+    file_size = ntohl(file_size);
+    
+    if (filename == NULL) {
+        int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (fd >= 0 && file_size > 0) recv_file_range(client_socket, fd, file_size);
+        if (fd >= 0) close(fd);
+        char response[] = "Server: Invalid file name";
+        send_all(client_socket, response, strlen(response), 0);
+        return;
+    }
+    
+    if (file_size < 0) {
+        printf("Client reported file not found: %s\n", filename);
+        char response[] = "File not found on client side";
+        send_all(client_socket, response, strlen(response), 0);
+        return;
+    }
+    
+    // Received into a temporary file, then moved into the store
+    char filepath[512];
+    store_upload_path(filepath, sizeof(filepath), client_socket);
+    
+    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        perror("Failed to create file");
+        char response[] = "Server: Failed to create file";
+        send_all(client_socket, response, strlen(response), 0);
+        return;
+    }
+    
+    long total_received = recv_file_range(client_socket, fd, file_size);
+    close(fd);
+    
+    if (total_received == file_size && store_ingest(filepath, filename, NULL) < 0) {
+        printf("File '%s' could not be stored\n", filename);
+        char response[] = "Server: Failed to store file";
+        send_all(client_socket, response, strlen(response), 0);
+    } else if (total_received == file_size) {
+        printf("File '%s' uploaded successfully (%ld bytes)\n", filename, file_size);
+        char response[256];
+        snprintf(response, sizeof(response), "Server: File '%s' uploaded successfully", filename);
+        send_all(client_socket, response, strlen(response), 0);
+    } else {
+        printf("File upload failed. Expected %ld, got %ld\n", file_size, total_received);
+        unlink(filepath);
+        char response[] = "Server: File upload failed";
+        send_all(client_socket, response, strlen(response), 0);
+    }
+}
+
+void handle_file_get(int client_socket, char *filename) {
+    stored_file_t sf;
+    long file_size;
+    
+    if (filename == NULL || stored_file_open(filename, &sf) < 0) {
+        file_size = -1;
+        long net_size = htonl(file_size);
+        send_all(client_socket, &net_size, sizeof(net_size), 0);
+        if (filename) printf("File '%s' not found for download\n", filename);
+        return;
+    }
+    
+    file_size = sf.size;
+    long net_size = htonl(file_size);
+    off_t offset = 0;
+    if (send_all(client_socket, &net_size, sizeof(net_size), MSG_MORE) < 0 ||
+        stored_file_send(client_socket, &sf, &offset, file_size) < 0) {
+        perror("Failed to send file");
+        stored_file_close(&sf);
+        return;
+    }
+    stored_file_close(&sf);
+    
+    printf("File '%s' sent to client (%ld bytes)\n", filename, file_size);
+}
+
+// Framed upload: the file arrives as FILE_DATA frames on the command's
+// stream and ends with FILE_END, interleaved with any other frames.
+// The name of an upload is kept only while it is open
+static int upload_set_name(client_t *client, const char *filename) {
+    free(client->upload_name);
+    client->upload_name = strdup(filename);
+    return client->upload_name ? 0 : -1;
+}
+
+static void upload_clear_name(client_t *client) {
+    free(client->upload_name);
+    client->upload_name = NULL;
+}
+
+void framed_file_put_begin(client_t *client, uint16_t stream, char *filename) {
+    char filepath[512];
+    
+    if (client->upload_fp) {
+        char response[] = "Server: Another upload is already in progress";
+        client_send(client, response, strlen(response));
+        return;
+    }
+    if (upload_set_name(client, filename) < 0) {
+        char response[] = "Server: Out of memory";
+        client_send(client, response, strlen(response));
+        return;
+    }
+    
+    store_upload_path(filepath, sizeof(filepath), client->id);
+    client->upload_fp = fopen(filepath, "wb");
+    if (client->upload_fp == NULL) {
+        perror("Failed to create file");
+        char response[] = "Server: Failed to create file";
+        client_send(client, response, strlen(response));
+        return;
+    }
+    client->upload_stream = stream;
+    client->upload_bytes = 0;
+}
+
+void *upload_finish_thread(void *arg) {
+    upload_finish_t *job = arg;
+    char response[768];
+    struct stat st;
+    uint32_t crc = 0;
+    
+    int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    int ok = fd >= 0 && fstat(fd, &st) == 0 &&
+             (!job->verify || (file_crc32(fd, &st, &crc) == 0 && crc == job->crc));
+    if (fd >= 0) close(fd);
+    
+    if (!ok) {
+        unlink(job->path);
+        printf("Upload of '%s' failed verification\n", job->name);
+        snprintf(response, sizeof(response), "Server: File '%s' failed verification and was discarded", job->name);
+    } else if (store_ingest(job->path, job->name, job->verify ? job->sha : NULL) < 0) {
+        printf("File '%s' could not be stored\n", job->name);
+        snprintf(response, sizeof(response), "Server: Failed to store '%s'", job->name);
+    } else if (job->verify) {
+        printf("File '%s' uploaded and verified (%ld bytes, CRC-32 %08x)\n", job->name, job->size, crc);
+        snprintf(response, sizeof(response), "Server: File '%s' uploaded and verified (%ld bytes, CRC-32 %08x)",
+                 job->name, job->size, crc);
+    } else {
+        printf("File '%s' uploaded successfully (%ld bytes)\n", job->name, job->size);
+        snprintf(response, sizeof(response), "Server: File '%s' uploaded successfully", job->name);
+    }
+    
+    msg_buf_t *buf = msg_buf_new(response, strlen(response));
+    if (buf) {
+        buf->stream = job->stream;
+        session_deliver(job->client_id, job->shard, job->username, buf);
+        msg_buf_unref(buf);
+    }
+    free(job);
+    return NULL;
+}
+
+// Hand a complete framed upload at path to upload_finish_thread(). The
+// connection is free for chat and the next upload straight away.
+void upload_finish_start(client_t *client, const char *path, uint16_t stream, int verify) {
+    static atomic_ulong finishing;
+    upload_finish_t *job = calloc(1, sizeof(upload_finish_t));
+    pthread_t tid;
+    
+    if (job == NULL) {
+        unlink(path);
+        char response[] = "Server: Failed to store file";
+        client_send_stream(client, stream, response, strlen(response));
+        return;
+    }
+    snprintf(job->path, sizeof(job->path), "%s/tmp/finish.%lu", STORE_DIR, atomic_fetch_add(&finishing, 1));
+    if (rename(path, job->path) < 0) snprintf(job->path, sizeof(job->path), "%s", path);
+    snprintf(job->name, sizeof(job->name), "%s", client->upload_name);
+    job->size = client->upload_bytes;
+    job->verify = verify;
+    job->crc = client->upload_crc;
+    memcpy(job->sha, client->upload_sha, 32);
+    job->client_id = client->id;
+    job->shard = current_reactor ? current_reactor->id : 0;
+    snprintf(job->username, sizeof(job->username), "%s", client->username);
+    job->stream = stream;
+    
+    if (pthread_create(&tid, NULL, upload_finish_thread, job) != 0) {
+        upload_finish_thread(job);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+void framed_file_put_range_end(client_t *client, int failed, const char *reason);
+
+void framed_file_put_end(client_t *client, int failed, const char *reason) {
+    char response[512];
+    char filepath[512];
+    
+    if (client->upload_chunked) {
+        framed_file_put_range_end(client, failed, reason);
+        return;
+    }
+    if (fclose(client->upload_fp) != 0) failed = 1;
+    client->upload_fp = NULL;
+    store_upload_path(filepath, sizeof(filepath), client->id);
+    if (!failed) {
+        upload_finish_start(client, filepath, 0, 0);
+        upload_clear_name(client);
+        return;
+    }
+    unlink(filepath);
+    printf("File upload failed: %s\n", client->upload_name);
+    upload_clear_name(client);
+    snprintf(response, sizeof(response), "Server: File upload failed");
+    client_send(client, response, strlen(response));
+}
+
+// Resumable transfers (framed only). Files move as FILE_CHUNK frames, each
+// carrying its offset and the CRC-32 of its data, and the whole file is
+// checked against the CRC-32 from "stat" or "putrange" at the end:
+//   stat <name>                      -> "FILE <size> <crc32> <name>"
+//   getrange <offset> <length> <name> -> FILE_CHUNKs, then FILE_END "<bytes>"
+//   putrange <size> <crc32> <sha256> <name>
+//                                    -> "DEDUP" if the store already has that
+//                                       content, nothing to send; otherwise
+//                                       "RESUME <offset>", then the client
+//                                       sends FILE_CHUNKs from there and FILE_END
+// A client fetches several ranges of one file at once on separate streams.
+// An interrupted upload leaves .store/parts/<name>.<crc32>.part behind, and
+// sending the same file again continues it.
+
+void upload_part_path(char *path, size_t size, const char *filename, uint32_t crc) {
+    snprintf(path, size, "%s/parts/%s.%08x.part", STORE_DIR, filename, crc);
+}
+
+void put_be64(unsigned char *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8) p[i] = v & 0xff;
+}
+
+uint64_t get_be64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = v << 8 | p[i];
+    return v;
+}
+
+void framed_file_stat(client_t *client, uint16_t stream, char *filename) {
+    stored_file_t sf;
+    uint32_t crc;
+    char reply[512];
+    
+    int found = stored_file_open(filename, &sf) == 0;
+    if (found && stored_file_crc32(&sf, &crc) == 0) {
+        snprintf(reply, sizeof(reply), "FILE %ld %08x %s", sf.size, crc, filename);
+    } else {
+        snprintf(reply, sizeof(reply), "Server: File '%s' not found", filename);
+    }
+    if (found) stored_file_close(&sf);
+    client_send_stream(client, stream, reply, strlen(reply));
+}
+
+// Background downloads (framed only). get sends the whole file as
+// FILE_DATA frames and getrange one range as FILE_CHUNK frames; both end
+// with FILE_END carrying the byte count. Frames are built one at a time
+// as client_flush() asks for them, downloads on different streams take
+// turns, and chat queued meanwhile goes out between frames.
+
+// Put the FILE_END in t->frame; the download is freed once it is written
+void download_set_end(out_transfer_t *t, int error, const char *text) {
+    size_t len = strlen(text);
+    frame_encode_header(t->frame, len, FRAME_FILE_END, error ? FRAME_FLAG_ERROR : 0, t->stream);
+    memcpy(t->frame + FRAME_HEADER_SIZE, text, len);
+    t->frame_len = FRAME_HEADER_SIZE + len;
+    t->frame_off = 0;
+    t->file_left = 0;
+    t->ending = 1;
+}
+
+// Build the next frame of t. FILE_CHUNK data is read and checksummed in
+// user space. A FILE_DATA payload follows its header by sendfile(),
+// unless zero-copy is off. No frame spans two blobs.
+void download_next_frame(out_transfer_t *t) {
+    unsigned char *data = t->frame + FRAME_HEADER_SIZE + (t->chunked ? CHUNK_PREFIX_SIZE : 0);
+    size_t len = t->end - t->pos < TRANSFER_CHUNK_SIZE ? (size_t)(t->end - t->pos) : TRANSFER_CHUNK_SIZE;
+    
+    if (t->pos >= t->end) {
+        char text[32];
+        snprintf(text, sizeof(text), "%ld", t->end - t->start);
+        download_set_end(t, 0, text);
+        return;
+    }
+    if (t->sf.plain_fd < 0 && (size_t)(STORE_CHUNK_SIZE - t->pos % STORE_CHUNK_SIZE) < len) {
+        len = STORE_CHUNK_SIZE - t->pos % STORE_CHUNK_SIZE;
+    }
+    t->frame_off = 0;
+    if (!t->chunked && zero_copy_transfers) {
+        frame_encode_header(t->frame, len, FRAME_FILE_DATA, 0, t->stream);
+        t->frame_len = FRAME_HEADER_SIZE;
+        t->file_left = len;
+        return;
+    }
+    if (stored_file_pread(&t->sf, data, len, t->pos) < 0) {
+        download_set_end(t, 1, "File changed during download");
+        return;
+    }
+    if (t->chunked) {
+        frame_encode_header(t->frame, CHUNK_PREFIX_SIZE + len, FRAME_FILE_CHUNK, 0, t->stream);
+        put_be64(t->frame + FRAME_HEADER_SIZE, t->pos);
+        uint32_t crc = htonl(crc32_update(0, data, len));
+        memcpy(t->frame + FRAME_HEADER_SIZE + 8, &crc, 4);
+    } else {
+        frame_encode_header(t->frame, len, FRAME_FILE_DATA, 0, t->stream);
+    }
+    t->frame_len = (data - t->frame) + len;
+    t->file_left = 0;
+    t->pos += len;
+    atomic_fetch_add(&transfer_stats.copied_bytes, len);
+}
+
+// One sendfile() towards the FILE_DATA payload in flight. If the kernel
+// refuses, the rest of the payload is read into frame[] and sent from
+// there. Returns 1 on progress, 0 if the socket is full, -1 on error.
+int download_sendfile(client_t *client, out_transfer_t *t) {
+    off_t at = t->pos;
+    int fd = t->sf.plain_fd;
+    
+    if (fd < 0) {
+        int i = t->pos / STORE_CHUNK_SIZE;
+        at = t->pos % STORE_CHUNK_SIZE;
+        if (i >= t->sf.chunks || (fd = stored_file_blob(&t->sf, i)) < 0) return -1;
+    }
+    ssize_t n = sendfile(client->socket, fd, &at, t->file_left);
+    if (n > 0) {
+        t->pos += n;
+        t->file_left -= n;
+        atomic_fetch_add(&transfer_stats.zero_copy_bytes, n);
+        return 1;
+    }
+    if (n < 0 && errno == EINTR) return 1;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        atomic_fetch_add(&transfer_stats.fallbacks, 1);
+        if (stored_file_pread(&t->sf, t->frame, t->file_left, t->pos) < 0) return -1;
+        t->frame_len = t->file_left;
+        t->frame_off = 0;
+        t->pos += t->file_left;
+        atomic_fetch_add(&transfer_stats.copied_bytes, t->file_left);
+        t->file_left = 0;
+        return 1;
+    }
+    return -1;      // File ended early
+}
+
+// Write more of the current frame of the first download, building a new
+// one if none is in flight. A finished frame sends the download to the
+// back of the list, or frees it if it was the FILE_END. Returns 1 when a
+// frame was completed, 0 if the socket is full, -1 if the connection is
+// broken.
+int download_write(client_t *client) {
+    out_transfer_t *t = client->downloads;
+    
+    if (!client->download_partial) {
+        download_next_frame(t);
+        pthread_mutex_lock(&client->out_lock);
+        client->download_partial = 1;
+        pthread_mutex_unlock(&client->out_lock);
+    }
+    while (t->frame_off < t->frame_len || t->file_left > 0) {
+        if (t->frame_off == t->frame_len) {
+            int result = download_sendfile(client, t);
+            if (result < 0) {
+                // A frame cut short (the file shrank, or the peer went
+                // away) leaves nothing on this connection parseable
+                printf("Download of '%s' cut off mid-frame\n", t->name);
+                return -1;
+            }
+            if (result == 0) return 0;
+            continue;
+        }
+        ssize_t n = send(client->socket, t->frame + t->frame_off, t->frame_len - t->frame_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT | (t->file_left ? MSG_MORE : 0));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        t->frame_off += n;
+    }
+    
+    pthread_mutex_lock(&client->out_lock);
+    client->download_partial = 0;
+    client->downloads = t->next;
+    t->next = NULL;
+    if (!t->ending) {
+        out_transfer_t **tail = &client->downloads;
+        while (*tail) tail = &(*tail)->next;
+        *tail = t;
+    }
+    pthread_mutex_unlock(&client->out_lock);
+    
+    if (t->ending) {
+        if (!t->chunked && t->pos == t->end) {
+            printf("File '%s' sent to client (%ld bytes)\n", t->name, t->end);
+        }
+        stored_file_close(&t->sf);
+        free(t);
+        client->download_count--;
+        atomic_fetch_sub(&transfer_stats.downloads, 1);
+    }
+    return 1;
+}
+
+// FILE_END with FRAME_FLAG_ERROR for a download that never started. It
+// goes through the ordinary queue, as nothing else is on its stream.
+void download_refuse(client_t *client, uint16_t stream, const char *reason) {
+    msg_buf_t *buf = msg_buf_new(reason, strlen(reason));
+    if (buf == NULL) return;
+    buf->frame_type = FRAME_FILE_END;
+    buf->frame_flags = FRAME_FLAG_ERROR;
+    buf->stream = stream;
+    client_send_buf(client, buf);
+    msg_buf_unref(buf);
+}
+
+// Start sending a file (get, length < 0) or one range of it (getrange)
+// in the background and return to the connection's loop at once.
+void framed_download_start(client_t *client, uint16_t stream, const char *filename,
+                           long offset, long length, int chunked) {
+    if (client->download_count >= MAX_DOWNLOADS) {
+        download_refuse(client, stream, "Too many downloads in progress");
+        return;
+    }
+    out_transfer_t *t = calloc(1, sizeof(out_transfer_t));
+    if (t == NULL) {
+        download_refuse(client, stream, "Out of memory");
+        return;
+    }
+    if (stored_file_open(filename, &t->sf) < 0) {
+        printf("File '%s' not found for download\n", filename);
+        download_refuse(client, stream, "File not found");
+        free(t);
+        return;
+    }
+    if (length < 0) length = t->sf.size;
+    if (offset < 0 || offset > t->sf.size) {
+        download_refuse(client, stream, "Bad range");
+        stored_file_close(&t->sf);
+        free(t);
+        return;
+    }
+    if (length > t->sf.size - offset) length = t->sf.size - offset;
+    
+    t->stream = stream;
+    t->chunked = chunked;
+    snprintf(t->name, sizeof(t->name), "%s", filename);
+    t->start = t->pos = offset;
+    t->end = offset + length;
+    
+    // Cap how much file data the kernel may queue unsent, so a chat
+    // message written after it does not wait behind megabytes of file
+    int lowat = DOWNLOAD_NOTSENT_LOWAT;
+    setsockopt(client->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    
+    pthread_mutex_lock(&client->out_lock);
+    out_transfer_t **tail = &client->downloads;
+    while (*tail) tail = &(*tail)->next;
+    *tail = t;
+    pthread_mutex_unlock(&client->out_lock);
+    client->download_count++;
+    atomic_fetch_add(&transfer_stats.downloads, 1);
+    client_rearm(client);
+}
+
+void framed_file_put_range_begin(client_t *client, uint16_t stream, long size, uint32_t crc,
+                                 const unsigned char sha[32], char *filename) {
+    char partpath[512];
+    char reply[64];
+    struct stat st;
+    
+    if (client->upload_fp) {
+        char response[] = "Server: Another upload is already in progress";
+        client_send_stream(client, stream, response, strlen(response));
+        return;
+    }
+    if (upload_set_name(client, filename) < 0) {
+        char response[] = "Server: Out of memory";
+        client_send_stream(client, stream, response, strlen(response));
+        return;
+    }
+    
+    // Same content already stored under any name: point this name at it
+    if (store_link_existing(filename, sha, size)) {
+        printf("File '%s' deduplicated (%ld bytes not sent)\n", filename, size);
+        client_send_stream(client, stream, "DEDUP", 5);
+        return;
+    }
+    
+    upload_part_path(partpath, sizeof(partpath), filename, crc);
+    int fd = open(partpath, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Failed to create file");
+        char response[] = "Server: Failed to create file";
+        client_send_stream(client, stream, response, strlen(response));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    
+    // Keep whole chunks only; a chunk cut off mid-write is sent again
+    long resume = st.st_size < size ? (long)st.st_size : size;
+    resume -= resume % TRANSFER_CHUNK_SIZE;
+    if (ftruncate(fd, resume) < 0 || (client->upload_fp = fdopen(fd, "r+b")) == NULL ||
+        fseek(client->upload_fp, resume, SEEK_SET) < 0) {
+        perror("Failed to open partial upload");
+        if (client->upload_fp) fclose(client->upload_fp); else close(fd);
+        client->upload_fp = NULL;
+        char response[] = "Server: Failed to create file";
+        client_send_stream(client, stream, response, strlen(response));
+        return;
+    }
+    
+    client->upload_stream = stream;
+    client->upload_bytes = resume;
+    client->upload_chunked = 1;
+    client->upload_size = size;
+    client->upload_crc = crc;
+    memcpy(client->upload_sha, sha, 32);
+    if (resume > 0) printf("Resuming upload of '%s' at %ld of %ld bytes\n", filename, resume, size);
+    
+    snprintf(reply, sizeof(reply), "RESUME %ld", resume);
+    client_send_stream(client, stream, reply, strlen(reply));
+}
+
+void framed_file_put_chunk(client_t *client, unsigned char *payload, size_t len) {
+    uint32_t crc;
+    
+    if (len < CHUNK_PREFIX_SIZE) {
+        framed_file_put_end(client, 1, "malformed chunk");
+        return;
+    }
+    long offset = (long)get_be64(payload);
+    size_t data_len = len - CHUNK_PREFIX_SIZE;
+    memcpy(&crc, payload + 8, 4);
+    
+    if (offset != client->upload_bytes || data_len > TRANSFER_CHUNK_SIZE ||
+        client->upload_bytes + (long)data_len > client->upload_size) {
+        framed_file_put_end(client, 1, "chunk out of order");
+    } else if (crc32_update(0, payload + CHUNK_PREFIX_SIZE, data_len) != ntohl(crc)) {
+        framed_file_put_end(client, 1, "chunk checksum mismatch");
+    } else if (fwrite(payload + CHUNK_PREFIX_SIZE, 1, data_len, client->upload_fp) != data_len) {
+        framed_file_put_end(client, 1, "write failed");
+    } else {
+        client->upload_bytes += data_len;
+    }
+}
+
+// Finish a putrange upload. A failed one keeps its verified chunks in the
+// .part file for the next attempt; a complete one must match the whole-file
+// CRC-32 and SHA-256 before it goes into the store.
+void framed_file_put_range_end(client_t *client, int failed, const char *reason) {
+    char partpath[512];
+    char response[768];
+    int fd = fileno(client->upload_fp);
+    
+    upload_part_path(partpath, sizeof(partpath), client->upload_name, client->upload_crc);
+    
+    if (fflush(client->upload_fp) != 0 || ftruncate(fd, client->upload_bytes) < 0) {
+        failed = 1;
+        reason = "write failed";
+    }
+    if (!failed && client->upload_bytes != client->upload_size) {
+        failed = 1;
+        reason = "file ended early";
+    }
+    
+    fclose(client->upload_fp);
+    client->upload_fp = NULL;
+    client->upload_chunked = 0;
+    if (!failed) {
+        upload_finish_start(client, partpath, client->upload_stream, 1);
+        upload_clear_name(client);
+        return;
+    }
+    printf("Upload of '%s' stopped at %ld of %ld bytes: %s\n", client->upload_name,
+           client->upload_bytes, client->upload_size, reason ? reason : "client gave up");
+    snprintf(response, sizeof(response), "Server: Upload of '%s' stopped at %ld of %ld bytes (%s); send it again to resume",
+             client->upload_name, client->upload_bytes, client->upload_size, reason ? reason : "client gave up");
+    upload_clear_name(client);
+    client_send_stream(client, client->upload_stream, response, strlen(response));
+}
+
+// Text-protocol transfers read and write the socket directly. Chat output
+// for the client is held in its queue meanwhile; only a partly written
+// message has to be finished first so the file data does not land in the
+// middle of it.
+void begin_file_transfer(client_t *client) {
+    pthread_mutex_lock(&client->out_lock);
+    client->in_transfer = 1;
+    pthread_mutex_unlock(&client->out_lock);
+    
+    while (1) {
+        pthread_mutex_lock(&client->out_lock);
+        int partial = client->out_head && client->out_head->off > 0;
+        pthread_mutex_unlock(&client->out_lock);
+        if (!partial) break;
+        
+        struct pollfd pfd = { .fd = client->socket, .events = POLLOUT };
+        if (poll(&pfd, 1, 1000) <= 0 || client_flush(client) < 0) break;
+    }
+}
+
+void end_file_transfer(client_t *client) {
+    pthread_mutex_lock(&client->out_lock);
+    client->in_transfer = 0;
+    pthread_mutex_unlock(&client->out_lock);
+    // No EPOLLOUT edge is coming for output queued during the transfer
+    client_flush(client);
+}
+
+// A text-protocol put/get owns the socket until the file is through. On a
+// reactor that would hold up every other connection it serves, so the
+// transfer gets a thread of its own and the socket leaves the reactor's
+// epoll set until it is done. In thread mode the connection's own thread
+// already is that thread.
+typedef struct {
+    client_t *client;
+    int put;
+    char filename[];
+} text_transfer_t;
+
+static void text_transfer_run(client_t *client, int put, char *filename) {
+    begin_file_transfer(client);
+    if (put) {
+        handle_file_put(client->socket, filename);
+    } else {
+        handle_file_get(client->socket, filename);
+    }
+    end_file_transfer(client);
+}
+
+static int text_transfer_watch(client_t *client) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = client;
+    return epoll_ctl(client->reactor->epoll_fd, EPOLL_CTL_ADD, client->socket, &ev);
+}
+
+void *text_transfer_thread(void *arg) {
+    text_transfer_t *job = arg;
+    client_t *client = job->client;
+    
+    text_transfer_run(client, job->put, job->filename[0] ? job->filename : NULL);
+    free(job);
+    // The reactor owns the client again from here; a peer that went away
+    // meanwhile shows up as a hangup there
+    if (text_transfer_watch(client) < 0) {
+        perror("Failed to hand connection back to its reactor");
+    }
+    return NULL;
+}
+
+// A NULL filename was refused by the command; the transfer still runs so
+// the client's side of it is answered (and a put's data consumed).
+void text_transfer_start(client_t *client, int put, char *filename) {
+    if (client->reactor == NULL) {
+        text_transfer_run(client, put, filename);
+        return;
+    }
+    
+    // No valid name is empty, so "" carries a refused one to the thread
+    if (filename == NULL) filename = "";
+    text_transfer_t *job = malloc(sizeof(text_transfer_t) + strlen(filename) + 1);
+    if (job == NULL) {
+        char response[] = "Server: Out of memory";
+        client_send(client, response, strlen(response));
+        return;
+    }
+    job->client = client;
+    job->put = put;
+    strcpy(job->filename, filename);
+    
+    // Stops client_read_input() on the reactor before the socket is shared
+    pthread_mutex_lock(&client->out_lock);
+    client->in_transfer = 1;
+    pthread_mutex_unlock(&client->out_lock);
+    epoll_ctl(client->reactor->epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
+    
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int started = pthread_create(&tid, &attr, text_transfer_thread, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!started) {
+        perror("Failed to create transfer thread");
+        free(job);
+        text_transfer_watch(client);
+        text_transfer_run(client, put, filename[0] ? filename : NULL);
+    }
+}
+
+// File names become paths under UPLOAD_DIR and STORE_DIR, so each must be
+// a single path component. Every file command checks before the store
+// sees the name.
+int file_name_ok(const char *name) {
+    size_t len = strnlen(name, FILE_NAME_MAX + 1);
+    return len > 0 && len <= FILE_NAME_MAX && strchr(name, '/') == NULL &&
+           strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// stat <file>
+int cmd_stat(client_t *client, char *args) {
+    if (!file_name_ok(args)) {
+        client_send_stream(client, client->cur_stream, BAD_FILE_NAME, strlen(BAD_FILE_NAME));
+        return 0;
+    }
+    framed_file_stat(client, client->cur_stream, args);
+    return 0;
+}
+
+// getrange <offset> <length> <file>
+int cmd_getrange(client_t *client, char *args) {
+    long offset, length;
+    int name = 0;
+    if (sscanf(args, "%ld %ld %n", &offset, &length, &name) < 2 || args[name] == '\0') {
+        client_send_stream(client, client->cur_stream, RANGE_USAGE, strlen(RANGE_USAGE));
+        return 0;
+    }
+    char *filename = args + name;
+    printf("User %s wants bytes %ld-%ld of file: %s\n", client->username, offset, offset + length, filename);
+    if (!file_name_ok(filename)) {
+        download_refuse(client, client->cur_stream, "Invalid file name");
+        return 0;
+    }
+    if (length < 0) {
+        download_refuse(client, client->cur_stream, "Bad range");
+        return 0;
+    }
+    framed_download_start(client, client->cur_stream, filename, offset, length, 1);
+    return 0;
+}
+
+// putrange <size> <crc32> <sha256> <file>
+int cmd_putrange(client_t *client, char *args) {
+    long size;
+    uint32_t crc;
+    char sha_hex[65];
+    unsigned char sha[32];
+    int name = 0;
+    if (sscanf(args, "%ld %x %64s %n", &size, &crc, sha_hex, &name) < 3 || args[name] == '\0' ||
+        size < 0 || strlen(sha_hex) != 64 || hex_decode(sha_hex, sha, 32) < 0) {
+        client_send_stream(client, client->cur_stream, RANGE_USAGE, strlen(RANGE_USAGE));
+        return 0;
+    }
+    char *filename = args + name;
+    printf("User %s wants to upload file: %s (%ld bytes, resumable)\n", client->username, filename, size);
+    if (!file_name_ok(filename)) {
+        client_send_stream(client, client->cur_stream, BAD_FILE_NAME, strlen(BAD_FILE_NAME));
+        return 0;
+    }
+    framed_file_put_range_begin(client, client->cur_stream, size, crc, sha, filename);
+    return 0;
+}
+
+int cmd_proto(client_t *client, char *args) {
+    if (strcmp(args, "framed") != 0) {
+        char error_msg[] = "Usage: /proto framed";
+        client_send(client, error_msg, strlen(error_msg));
+    } else if (!client->framed) {
+        client->in_len = 0;
+        // The acknowledgement is the last unframed message
+        client_send(client, PROTO_FRAMED_ACK, strlen(PROTO_FRAMED_ACK));
+        pthread_mutex_lock(&client->out_lock);
+        client->framed = 1;
+        pthread_mutex_unlock(&client->out_lock);
+    }
+    return 0;
+}
+
+int cmd_login(client_t *client, char *args) {
+    char *username = strtok(args, " ");
+    char *password = strtok(NULL, " ");
+    
+    time_t last_seen = 0;
+    if (username && password) {
+        if (is_user_logged_in(username)) {
+            char error_msg[] = "Error: User already logged in";
+            client_send(client, error_msg, strlen(error_msg));
+        } else if (authenticate_user(username, password, &last_seen)) {
+            if (set_client_user(client, username) < 0) {
+                logout_user(username);
+                char error_msg[] = "Error: Server out of memory, try again later";
+                client_send(client, error_msg, strlen(error_msg));
+                return 0;
+            }
+            if (server_mode == SERVER_MODE_SHARDED) {
+                set_user_shard(username, current_reactor->id);
+            }
+            char success_msg[] = "Login successful! You can now chat, send files, or use commands.";
+            client_send(client, success_msg, strlen(success_msg));
+            history_catch_up(client, last_seen);
+            mailbox_deliver(client);
+            
+            // Past join_notices online, one line per login to everyone is a
+            // storm; /presence on gets them batched instead
+            msg_buf_t *joined = presence_online() <= join_notices ?
+                                msg_buf_printf("%s joined the chat", username) : NULL;
+            if (joined) {
+                broadcast_buf(joined, client->id);
+                msg_buf_unref(joined);
+            }
+            printf("User %s logged in\n", username);
+        } else {
+            char error_msg[] = "Login failed: Invalid username or password";
+            client_send(client, error_msg, strlen(error_msg));
+        }
+    } else {
+        char error_msg[] = "Usage: /login <username> <password>";
+        client_send(client, error_msg, strlen(error_msg));
+    }
+    return 0;
+}
+
+int cmd_register(client_t *client, char *args) {
+    char *username = strtok(args, " ");
+    char *password = strtok(NULL, " ");
+    
+    if (username && password) {
+        int result = register_user(username, password);
+        if (result == 1) {
+            char success_msg[] = "Registration successful! You can now login.";
+            client_send(client, success_msg, strlen(success_msg));
+            printf("New user registered: %s\n", username);
+        } else if (result == 0) {
+            char error_msg[] = "Registration failed: Username already exists";
+            client_send(client, error_msg, strlen(error_msg));
+        } else {
+            char error_msg[] = "Registration failed: Server full";
+            client_send(client, error_msg, strlen(error_msg));
+        }
+    } else {
+        char error_msg[] = "Usage: /register <username> <password>";
+        client_send(client, error_msg, strlen(error_msg));
+    }
+    return 0;
+}
+
+int cmd_msg(client_t *client, char *args) {
+    char *target_user = strtok(args, " ");
+    char *msg_content = strtok(NULL, "");
+    
+    if (target_user && msg_content) {
+        handle_private_message(client->id, target_user, msg_content);
+    } else {
+        char error_msg[] = "Usage: /msg <username> <message>";
+        client_send(client, error_msg, strlen(error_msg));
+    }
+    return 0;
+}
+
+int cmd_users(client_t *client, char *args) {
+    list_online_users(client, args);
+    return 0;
+}
+
+int cmd_presence(client_t *client, char *args) {
+    handle_presence(client, args);
+    return 0;
+}
+
+int cmd_join(client_t *client, char *args) {
+    handle_join(client, args);
+    return 0;
+}
+
+int cmd_leave(client_t *client, char *args) {
+    handle_leave(client, args);
+    return 0;
+}
+
+int cmd_channels(client_t *client, char *args) {
+    (void)args;
+    list_channels(client);
+    return 0;
+}
+
+int cmd_history(client_t *client, char *args) {
+    handle_history(client, args);
+    return 0;
+}
+
+int cmd_stats(client_t *client, char *args) {
+    (void)args;
+    send_stats(client);
+    return 0;
+}
+
+int cmd_faq(client_t *client, char *args) {
+    if (strlen(args) > 0) {
+        printf("Client %s asked FAQ: %s\n", client->username, args);
+        // Answered from the corpus index right away, or later by the
+        // GPT-2 service; chat keeps flowing meanwhile
+        faq_submit(client, args);
+    } else {
+        char help_msg[] = "Usage: /faq <question>\nTry: /faq how to run, /faq how are you, /faq tell me a joke";
+        client_send(client, help_msg, strlen(help_msg));
+    }
+    return 0;
+}
+
+int cmd_put(client_t *client, char *args) {
+    printf("User %s wants to upload file: %s\n", client->username, args);
+    if (!file_name_ok(args)) {
+        if (client->framed) {
+            client_send_stream(client, client->cur_stream, BAD_FILE_NAME, strlen(BAD_FILE_NAME));
+        } else {
+            text_transfer_start(client, 1, NULL);
+        }
+    } else if (client->framed) {
+        framed_file_put_begin(client, client->cur_stream, args);
+    } else {
+        text_transfer_start(client, 1, args);
+    }
+    return 0;
+}
+
+int cmd_get(client_t *client, char *args) {
+    printf("User %s wants to download file: %s\n", client->username, args);
+    if (!file_name_ok(args)) {
+        if (client->framed) {
+            download_refuse(client, client->cur_stream, "Invalid file name");
+        } else {
+            text_transfer_start(client, 0, NULL);
+        }
+    } else if (client->framed) {
+        framed_download_start(client, client->cur_stream, args, 0, -1, 0);
+    } else {
+        text_transfer_start(client, 0, args);
+    }
+    return 0;
+}
+
+int cmd_exit(client_t *client, char *args) {
+    (void)args;
+    printf("User %s disconnected\n", client->username);
+    return 1;
+}
+
+// Command dispatch
+//
+// Every command is one entry here: its first word, how it takes arguments,
+// what the session needs, and the handler. Lines are looked up by their
+// first word in a perfect hash over this table, so a chat line costs one
+// short hash and at most one comparison however many commands there are.
+
+const command_t commands[] = {
+    { "/proto",    ARGS_REQUIRED, 0,          cmd_proto },
+    { "/login",    ARGS_REQUIRED, 0,          cmd_login },
+    { "/register", ARGS_REQUIRED, 0,          cmd_register },
+    { "/msg",      ARGS_REQUIRED, CMD_AUTH,   cmd_msg },
+    { "/users",    ARGS_OPTIONAL, CMD_AUTH,   cmd_users },
+    { "/presence", ARGS_OPTIONAL, CMD_AUTH,   cmd_presence },
+    { "/join",     ARGS_OPTIONAL, CMD_AUTH,   cmd_join },
+    { "/leave",    ARGS_OPTIONAL, CMD_AUTH,   cmd_leave },
+    { "/channels", ARGS_NONE,     CMD_AUTH,   cmd_channels },
+    { "/history",  ARGS_OPTIONAL, CMD_AUTH,   cmd_history },
+    { "/stats",    ARGS_NONE,     CMD_AUTH,   cmd_stats },
+    { "/faq",      ARGS_REQUIRED, CMD_AUTH,   cmd_faq },
+    { "put",       ARGS_REQUIRED, CMD_AUTH,   cmd_put },
+    { "get",       ARGS_REQUIRED, CMD_AUTH,   cmd_get },
+    { "stat",      ARGS_REQUIRED, CMD_AUTH | CMD_FRAMED, cmd_stat },
+    { "getrange",  ARGS_REQUIRED, CMD_AUTH | CMD_FRAMED, cmd_getrange },
+    { "putrange",  ARGS_REQUIRED, CMD_AUTH | CMD_FRAMED, cmd_putrange },
+    { "exit",      ARGS_NONE,     CMD_AUTH,   cmd_exit },
+};
+#define COMMAND_COUNT (int)(sizeof(commands) / sizeof(commands[0]))
+
+// The perfect hash: with COMMAND_SEED, every word above has a slot of its
+// own. Entry + 1 by slot, 0 for none. command_index_check() makes sure at
+// startup that this still matches the table, and prints a new one if not.
+#define COMMAND_SEED 23
+const uint8_t command_slots[COMMAND_SLOTS] = {
+    [4] = 18,     // exit
+    [6] = 3,      // /register
+    [8] = 2,      // /login
+    [13] = 12,    // /faq
+    [14] = 8,     // /leave
+    [27] = 4,     // /msg
+    [31] = 17,    // putrange
+    [32] = 15,    // stat
+    [34] = 11,    // /stats
+    [41] = 14,    // get
+    [42] = 10,    // /history
+    [43] = 5,     // /users
+    [45] = 13,    // put
+    [47] = 1,     // /proto
+    [55] = 7,     // /join
+    [61] = 6,     // /presence
+    [62] = 9,     // /channels
+    [63] = 16,    // getrange
+};
+
+static inline uint32_t command_hash(const char *word, size_t len, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)word[i]) * 16777619u;
+    }
+    return (hash ^ (hash >> 15)) & (COMMAND_SLOTS - 1);
+}
+
+// Whether command_slots finds every command under its own word. If a
+// command was added or renamed, searches for a seed that gives each word a
+// slot of its own and prints the lines to paste in, then returns -1.
+int command_index_check() {
+    int used = 0;
+    for (int i = 0; i < COMMAND_SLOTS; i++) used += command_slots[i] != 0;
+    int ok = used == COMMAND_COUNT;
+    for (int i = 0; ok && i < COMMAND_COUNT; i++) {
+        ok = command_slots[command_hash(commands[i].word, strlen(commands[i].word), COMMAND_SEED)] == i + 1;
+    }
+    if (ok) return 0;
+    
+    uint8_t slots[COMMAND_SLOTS];
+    for (uint32_t seed = 1; seed < 1000000; seed++) {
+        int i;
+        memset(slots, 0, sizeof(slots));
+        for (i = 0; i < COMMAND_COUNT; i++) {
+            uint32_t slot = command_hash(commands[i].word, strlen(commands[i].word), seed);
+            if (slots[slot]) break;
+            slots[slot] = i + 1;
+        }
+        if (i < COMMAND_COUNT) continue;
+        fprintf(stderr, "command_slots does not match commands[]; replace them with:\n");
+        fprintf(stderr, "#define COMMAND_SEED %u\n", seed);
+        for (int s = 0; s < COMMAND_SLOTS; s++) {
+            if (slots[s]) fprintf(stderr, "    [%d] = %d,  // %s\n", s, slots[s], commands[slots[s] - 1].word);
+        }
+        return -1;
+    }
+    fprintf(stderr, "No perfect hash for the command words; raise COMMAND_SLOTS\n");
+    return -1;
+}
+
+// The command a line starts with, and where its arguments begin. NULL for
+// chat, including a command word used the wrong way ("exit now").
+const command_t *command_find(char *line, char **args) {
+    size_t len = 0;
+    while (line[len] != ' ' && line[len] != '\0') {
+        if (++len > COMMAND_WORD_MAX) return NULL;
+    }
+    if (len == 0) return NULL;
+    
+    int entry = command_slots[command_hash(line, len, COMMAND_SEED)] - 1;
+    if (entry < 0 || strncmp(commands[entry].word, line, len) != 0 || commands[entry].word[len] != '\0') {
+        return NULL;
+    }
+    const command_t *cmd = &commands[entry];
+    if (line[len] == '\0') {
+        if (cmd->args == ARGS_REQUIRED) return NULL;
+        *args = line + len;
+    } else {
+        if (cmd->args == ARGS_NONE) return NULL;
+        *args = line + len + 1;
+    }
+    return cmd;
+}
+
+// Process one message from a client. Returns 1 when the client asked to exit.
+int handle_client_command(client_t *client, char *buffer) {
+    char *args;
+    const command_t *cmd = command_find(buffer, &args);
+    
+    if (!client->is_authenticated && (cmd == NULL || (cmd->flags & CMD_AUTH))) {
+        char error_msg[] = "Please login first using /login <username> <password>";
+        client_send(client, error_msg, strlen(error_msg));
+        return 0;
+    }
+    if (cmd) {
+        if ((cmd->flags & CMD_FRAMED) && !client->framed) {
+            char error_msg[] = "Error: resumable transfers need the framed protocol (/proto framed)";
+            client_send(client, error_msg, strlen(error_msg));
+            return 0;
+        }
+        return cmd->handler(client, args);
+    }
+    
+    history_append(client->channel ? client->channel->name : NULL, client->username, buffer);
+    if (client->channel) {
+        printf("[#%s] %s: %s\n", client->channel->name, client->username, buffer);
+        msg_buf_t *chat = msg_buf_printf("[#%s] %s: %s", client->channel->name, client->username, buffer);
+        if (chat) {
+            channel_post(client->channel, chat, client->id);
+            msg_buf_unref(chat);
+        }
+    } else {
+        printf("%s: %s\n", client->username, buffer);
+        msg_buf_t *chat = msg_buf_printf("%s: %s", client->username, buffer);
+        if (chat) {
+            broadcast_buf(chat, client->id);
+            msg_buf_unref(chat);
+        }
+    }
+    return 0;
+}
+
+// The session object comes from its reactor's pool, or the shared one
+// when there is no reactor (thread mode, benchmarks)
+client_t *create_client(int client_socket, struct sockaddr_in *client_addr, reactor_t *reactor) {
+    slab_pool_t *pool = reactor ? &reactor->client_pool : &client_pool;
+    client_t *client = slab_alloc(pool);
+    if (client == NULL) return NULL;
+    memset(client, 0, sizeof(client_t));
+    client->pool = pool;
+    client->reactor = reactor;
+    client->socket = client_socket;
+    client->address = *client_addr;
+    client->id = client_socket;
+    client->is_authenticated = 0;
+    strcpy(client->username, "");
+    pthread_mutex_init(&client->out_lock, NULL);
+    client->wake_fd = -1;
+    return client;
+}
+
+void free_client(client_t *client) {
+    out_msg_t *msg = client->out_head;
+    while (msg) {
+        out_msg_t *next = msg->next;
+        out_msg_free(msg);
+        msg = next;
+    }
+    if (client->wake_fd >= 0) close(client->wake_fd);
+    mailbox_drain_free(client);
+    while (client->downloads) {
+        out_transfer_t *t = client->downloads;
+        client->downloads = t->next;
+        stored_file_close(&t->sf);
+        free(t);
+        atomic_fetch_sub(&transfer_stats.downloads, 1);
+    }
+    if (client->upload_fp && client->upload_chunked) {
+        // Connection dropped mid-upload: the verified chunks stay for a resume
+        fclose(client->upload_fp);
+    } else if (client->upload_fp) {
+        // Connection dropped mid-upload: discard the partial file
+        char filepath[512];
+        fclose(client->upload_fp);
+        store_upload_path(filepath, sizeof(filepath), client->id);
+        unlink(filepath);
+    }
+    buf_pool_free(client->in_buf, IN_BUF_SIZE);
+    free(client->upload_name);
+    free(client->channels);
+    pthread_mutex_destroy(&client->out_lock);
+    slab_free(client->pool, client);
+}
+
+void greet_client(client_t *client) {
+    printf("Client %d connected from %s:%d\n", 
+           client->id, 
+           inet_ntoa(client->address.sin_addr), 
+           ntohs(client->address.sin_port));
+    
+    char auth_prompt[] = "Welcome! Please login or register.\nCommands: /login <username> <password> or /register <username> <password>";
+    client_send(client, auth_prompt, strlen(auth_prompt));
+}
+
+void disconnect_client(client_t *client) {
+    if (client->is_authenticated && presence_online() <= join_notices) {
+        msg_buf_t *left = msg_buf_printf("%s left the chat", client->username);
+        if (left) {
+            broadcast_buf(left, client->id);
+            msg_buf_unref(left);
+        }
+    }
+    
+    channel_leave_all(client);
+    if (client->is_authenticated) {
+        mailbox_logout(client->username);
+    }
+    remove_client(client->id);
+    close(client->socket);
+    free_client(client);
+}
+
+// Dispatch one frame. Returns 1 when the client asked to exit, -1 on a
+// protocol error.
+int handle_frame(client_t *client, uint8_t type, uint8_t flags, uint16_t stream,
+                 unsigned char *payload, size_t len) {
+    switch (type) {
+    case FRAME_TEXT: {
+        if (len >= BUFFER_SIZE) {
+            char error_msg[] = "Error: Message too long";
+            client_send(client, error_msg, strlen(error_msg));
+            return 0;
+        }
+        // Commands are parsed in place, so copy out of the input buffer
+        char *buffer = buf_pool_alloc(len + 1);
+        if (buffer == NULL) return 0;
+        memcpy(buffer, payload, len);
+        buffer[len] = '\0';
+        client->cur_stream = stream;
+        int result = handle_client_command(client, buffer);
+        buf_pool_free(buffer, len + 1);
+        return result;
+    }
+    case FRAME_FILE_DATA:
+        if (client->upload_fp && !client->upload_chunked && stream == client->upload_stream) {
+            if (fwrite(payload, 1, len, client->upload_fp) != len) {
+                framed_file_put_end(client, 1, NULL);
+            } else {
+                client->upload_bytes += len;
+            }
+        }
+        return 0;
+    case FRAME_FILE_CHUNK:
+        if (client->upload_fp && client->upload_chunked && stream == client->upload_stream) {
+            framed_file_put_chunk(client, payload, len);
+        }
+        return 0;
+    case FRAME_FILE_END:
+        if (client->upload_fp && stream == client->upload_stream) {
+            framed_file_put_end(client, flags & FRAME_FLAG_ERROR, NULL);
+        }
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+// Dispatch every complete frame in in_buf, keeping a trailing partial one
+int client_parse_frames(client_t *client) {
+    size_t pos = 0;
+    int result = 1;
+    
+    while (client->in_len - pos >= FRAME_HEADER_SIZE) {
+        unsigned char *hdr = client->in_buf + pos;
+        uint32_t length = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) |
+                          ((uint32_t)hdr[2] << 8) | hdr[3];
+        uint16_t stream = (hdr[6] << 8) | hdr[7];
+        
+        if (length > MAX_FRAME_PAYLOAD) {
+            printf("Client %d sent an oversized frame (%u bytes)\n", client->id, length);
+            result = -1;
+            break;
+        }
+        if (client->in_len - pos < FRAME_HEADER_SIZE + length) break;
+        
+        pos += FRAME_HEADER_SIZE + length;
+        if (handle_frame(client, hdr[4], hdr[5], stream, hdr + FRAME_HEADER_SIZE, length) != 0) {
+            result = -1;
+            break;
+        }
+    }
+    
+    if (pos > 0) {
+        memmove(client->in_buf, client->in_buf + pos, client->in_len - pos);
+        client->in_len -= pos;
+    }
+    return result;
+}
+
+// What client_read_input() returns for a recv() that got nothing
+static int recv_result(ssize_t bytes_received) {
+    if (bytes_received == 0) return -1;
+    if (errno == EINTR) return 1;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    return -1;
+}
+
+// Read once from the socket and dispatch what arrived. In the text
+// protocol each recv() is one message; framed input may hold several
+// frames or part of one. Returns 1 if data was handled, 0 if there was
+// nothing to read and -1 if the connection should be closed.
+int client_read_input(client_t *client) {
+    ssize_t bytes_received;
+    int result;
+    
+    // Handed to a transfer thread, which reads the socket until it is done
+    if (client->in_transfer) return 0;
+    if (client->framed) {
+        // Input buffers are pooled; a connection keeps one only while it
+        // holds an incomplete frame
+        if (client->in_buf == NULL && (client->in_buf = buf_pool_alloc(IN_BUF_SIZE)) == NULL) return -1;
+        bytes_received = recv(client->socket, client->in_buf + client->in_len, IN_BUF_SIZE - client->in_len, 0);
+        if (bytes_received > 0) {
+            client->in_len += bytes_received;
+            result = client_parse_frames(client);
+        } else {
+            result = recv_result(bytes_received);
+        }
+        if (client->in_len == 0) {
+            buf_pool_free(client->in_buf, IN_BUF_SIZE);
+            client->in_buf = NULL;
+        }
+        return result;
+    }
+    
+    char *buffer = buf_pool_alloc(BUFFER_SIZE);
+    if (buffer == NULL) return -1;
+    bytes_received = recv(client->socket, buffer, BUFFER_SIZE - 1, 0);
+    if (bytes_received > 0) {
+        buffer[bytes_received] = '\0';
+        result = handle_client_command(client, buffer) ? -1 : 1;
+    } else {
+        result = recv_result(bytes_received);
+    }
+    buf_pool_free(buffer, BUFFER_SIZE);
+    return result;
+}
+
+// Thread-per-connection mode. The socket is non-blocking like in the
+// reactor modes; the thread waits for input, for its queue to drain and
+// for wake_fd, which other threads signal when they queue output.
+void *handle_client(void *arg) {
+    client_t *client = (client_t *)arg;
+    
+    greet_client(client);
+    
+    while (1) {
+        struct pollfd pfds[2];
+        pfds[0].fd = client->socket;
+        pfds[0].events = POLLIN | (client_has_output(client) ? POLLOUT : 0);
+        pfds[1].fd = client->wake_fd;
+        pfds[1].events = POLLIN;
+        
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(client->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) break;
+        }
+        if (pfds[0].revents & POLLOUT) {
+            if (client_flush(client) < 0) break;
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (client_read_input(client) < 0) break;
+        }
+    }
+    
+    disconnect_client(client);
+    pthread_exit(NULL);
+}
+
+// Epoll mode: drain everything readable on an edge-triggered socket.
+// Returns -1 when the connection should be closed.
+int reactor_handle_readable(client_t *client) {
+    int result;
+    while ((result = client_read_input(client)) > 0) {
+    }
+    return result;
+}
+
+int create_listener(int reuseport) {
+    struct sockaddr_in server_addr;
+    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_socket < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    
+    int opt = 1;
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("Setsockopt failed");
+        close(server_socket);
+        return -1;
+    }
+    if (reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Setsockopt SO_REUSEPORT failed");
+        close(server_socket);
+        return -1;
+    }
+    
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(PORT);
+    
+    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(server_socket);
+        return -1;
+    }
+    
+    if (listen(server_socket, SOMAXCONN) < 0) {
+        perror("Listen failed");
+        close(server_socket);
+        return -1;
+    }
+    return server_socket;
+}
+
+// Sharded mode: accept everything pending on this shard's own listener.
+// The kernel spreads incoming connections over the SO_REUSEPORT group.
+void shard_accept(reactor_t *shard) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept(shard->listen_fd, (struct sockaddr*)&client_addr, &client_len);
+        if (client_socket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept failed");
+            return;
+        }
+        
+        client_t *client = create_client(client_socket, &client_addr, shard);
+        if (client == NULL) {
+            close(client_socket);
+            continue;
+        }
+        if (add_client(client) < 0) {
+            printf("Maximum clients reached. Rejecting new connection.\n");
+            close(client_socket);
+            free_client(client);
+            continue;
+        }
+        
+        struct epoll_event ev;
+        set_nonblocking(client_socket, 1);
+        greet_client(client);
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = client;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("epoll_ctl failed");
+            remove_client(client->id);
+            close(client_socket);
+            free_client(client);
+        }
+    }
+}
+
+void *reactor_loop(void *arg) {
+    reactor_t *reactor = (reactor_t *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    
+    current_reactor = reactor;
+    
+    while (1) {
+        int n = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &reactor->listen_fd) {
+                shard_accept(reactor);
+                continue;
+            }
+            if (events[i].data.ptr == &reactor->wake_fd) {
+                shard_drain_inbox(reactor);
+                continue;
+            }
+            
+            client_t *client = (client_t *)events[i].data.ptr;
+            int closing = 0;
+            
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                closing = 1;
+            }
+            if (!closing && (events[i].events & EPOLLOUT)) {
+                if (client_flush(client) < 0) closing = 1;
+            }
+            if (!closing && (events[i].events & EPOLLIN)) {
+                if (reactor_handle_readable(client) < 0) closing = 1;
+            }
+            
+            if (closing) {
+                epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
+                disconnect_client(client);
+            }
+        }
+    }
+    return NULL;
+}
+
+int start_reactors(int count) {
+    reactors = calloc(count, sizeof(reactor_t));
+    if (reactors == NULL) return -1;
+    reactor_count = count;
+    
+    for (int i = 0; i < count; i++) {
+        reactor_t *reactor = &reactors[i];
+        reactor->id = i;
+        slab_pool_init(&reactor->client_pool, sizeof(client_t));
+        reactor->listen_fd = -1;
+        reactor->wake_fd = -1;
+        atomic_init(&reactor->inbox, NULL);
+        reactor->epoll_fd = epoll_create1(0);
+        if (reactor->epoll_fd < 0) {
+            perror("epoll_create1 failed");
+            return -1;
+        }
+        
+        if (server_mode == SERVER_MODE_SHARDED) {
+            struct epoll_event ev;
+            reactor->listen_fd = create_listener(1);
+            reactor->wake_fd = eventfd(0, EFD_NONBLOCK);
+            if (reactor->listen_fd < 0 || reactor->wake_fd < 0) {
+                perror("Failed to set up shard");
+                return -1;
+            }
+            set_nonblocking(reactor->listen_fd, 1);
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = &reactor->listen_fd;
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev);
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = &reactor->wake_fd;
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &ev);
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_loop, &reactors[i]) != 0) {
+            perror("Failed to create reactor thread");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Hand a freshly accepted connection to a reactor (round robin).
+// Epoll mode: reactors take new connections in turn
+reactor_t *reactor_next() {
+    static unsigned int next_reactor = 0;
+    return &reactors[next_reactor++ % reactor_count];
+}
+
+int reactor_add_client(client_t *client) {
+    reactor_t *reactor = client->reactor;
+    struct epoll_event ev;
+    
+    set_nonblocking(client->socket, 1);
+    greet_client(client);
+    
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = client;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client->socket, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return -1;
+    }
+    return 0;
+}
+
+#define BENCH_QUERIES (1 << 20)
+
+volatile long bench_sink;    // Keeps benchmark results observable to the compiler
+
+typedef struct {
+    char (*queries)[24];
+    int count;
+    long found;
+} user_bench_arg_t;
+
+// Lookups take users_lock for reading, exactly like /login does
+void *user_bench_worker(void *arg) {
+    user_bench_arg_t *bench = (user_bench_arg_t *)arg;
+    for (int i = 0; i < bench->count; i++) {
+        pthread_rwlock_rdlock(&users_lock);
+        if (find_user(bench->queries[i & (BENCH_QUERIES - 1)]) != -1) bench->found++;
+        pthread_rwlock_unlock(&users_lock);
+    }
+    return NULL;
+}
+
+// Drop every account (benchmarks only)
+void reset_users() {
+    for (int i = 0; i < user_count - user_snap.count; i++) {
+        free(users[i].username);
+    }
+    if (user_snap.map) munmap(user_snap.map, user_snap.map_len);
+    free(user_snap.state);
+    memset(&user_snap, 0, sizeof(user_snap));
+    free(users);
+    free(user_index);
+    users = NULL;
+    user_index = NULL;
+    user_count = 0;
+    user_capacity = 0;
+}
+
+// The lookup this index replaced, kept for comparison
+int linear_find_user(char *username) {
+    for (int i = 0; i < user_count; i++) {
+        if (strcmp(user_name(i), username) == 0) return i;
+    }
+    return -1;
+}
+
+// ./server --bench users: lookups per second against user count
+void run_user_benchmark() {
+    int sizes[] = {1000, 10000, 100000, 1000000, 4000000};
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    char (*queries)[24] = malloc(sizeof(*queries) * BENCH_QUERIES);
+    unsigned int seed = 42;
+    
+    if (queries == NULL) return;
+    if (threads < 1) threads = 1;
+    if (threads > 64) threads = 64;
+    
+    printf("%10s %14s %16s %18s %16s\n", "users", "inserts/s", "lookups/s", "lookups/s", "linear scan/s");
+    printf("%10s %14s %16s %15d thr %16s\n", "", "", "1 thread", threads, "1 thread");
+    
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        char name[24];
+        
+        reset_users();
+        
+        double start = now_seconds();
+        for (int i = 0; i < n; i++) {
+            snprintf(name, sizeof(name), "benchuser%d", i);
+            add_user_record(name, "0", 0);
+        }
+        double insert_rate = n / (now_seconds() - start);
+        
+        // About 10% of the queries miss
+        for (int i = 0; i < BENCH_QUERIES; i++) {
+            snprintf(queries[i], sizeof(queries[i]), "benchuser%d", rand_r(&seed) % (n + n / 10));
+        }
+        
+        user_bench_arg_t single = { queries, 4 * BENCH_QUERIES, 0 };
+        start = now_seconds();
+        user_bench_worker(&single);
+        double single_rate = single.count / (now_seconds() - start);
+        
+        pthread_t tids[64];
+        user_bench_arg_t args[64];
+        start = now_seconds();
+        for (int t = 0; t < threads; t++) {
+            args[t] = single;
+            args[t].found = 0;
+            pthread_create(&tids[t], NULL, user_bench_worker, &args[t]);
+        }
+        for (int t = 0; t < threads; t++) pthread_join(tids[t], NULL);
+        double multi_rate = (double)single.count * threads / (now_seconds() - start);
+        
+        char linear[32] = "-";
+        if (n <= 100000) {
+            int count = 20000000 / n;
+            long found = 0;
+            start = now_seconds();
+            for (int i = 0; i < count; i++) {
+                if (linear_find_user(queries[i]) != -1) found++;
+            }
+            snprintf(linear, sizeof(linear), "%.0f", count / (now_seconds() - start));
+            bench_sink += found;
+        }
+        
+        printf("%10d %14.0f %16.0f %18.0f %16s\n", n, insert_rate, single_rate, multi_rate, linear);
+    }
+    free(queries);
+}
+
+// ./server --bench snapshot: cold start from text users.db vs users.snap
+void run_snapshot_benchmark() {
+    int sizes[] = {100000, 1000000, 4000000};
+    const char *text_path = "bench_users.db";
+    const char *snap_path = "bench_users.snap";
+    char name[24];
+    unsigned int seed = 42;
+    
+    printf("%10s %14s %14s %18s %10s\n", "users", "text load s", "snap write s", "map+1k lookups ms", "snap MB");
+    
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        struct stat st;
+        int count;
+        
+        reset_users();
+        FILE *fp = fopen(text_path, "w");
+        if (fp == NULL) return;
+        for (int i = 0; i < n; i++) {
+            snprintf(name, sizeof(name), "benchuser%d", i);
+            fprintf(fp, "%s %lu 0 %d\n", name, simple_hash(name), i);
+        }
+        fclose(fp);
+        
+        double start = now_seconds();
+        load_user_text(text_path);
+        double text_time = now_seconds() - start;
+        
+        start = now_seconds();
+        user_snap_entry_t *entries = collect_user_entries(&count);
+        if (entries == NULL || write_user_snapshot(snap_path, entries, count) < 0) {
+            free(entries);
+            return;
+        }
+        free(entries);
+        double write_time = now_seconds() - start;
+        
+        // What a restart pays before it can serve the first logins
+        reset_users();
+        long found = 0;
+        start = now_seconds();
+        if (map_user_snapshot(snap_path) != 1) return;
+        for (int i = 0; i < 1000; i++) {
+            snprintf(name, sizeof(name), "benchuser%d", rand_r(&seed) % n);
+            if (find_user(name) != -1) found++;
+        }
+        double map_time = now_seconds() - start;
+        bench_sink += found;
+        
+        stat(snap_path, &st);
+        printf("%10d %14.2f %14.2f %18.1f %10.1f\n", n, text_time, write_time, map_time * 1000,
+               st.st_size / 1048576.0);
+        unlink(text_path);
+        unlink(snap_path);
+    }
+    reset_users();
+}
+
+// ./server --bench faq: what the corpus index does with typical questions
+void run_faq_index_benchmark() {
+    static const char *questions[] = {
+        "how to run", "How do I compile this?", "what are the features", "how hard is it",
+        "how do I send a private message", "which commands can I use", "how are you",
+        "tell me a joke", "what is the capital of France", "server", NULL
+    };
+    const int rounds = 100000;
+    
+    if (faq_index_load(faq_corpus_path) < 0) return;
+    printf("%-34s %10s %8s %s\n", "question", "us/lookup", "match", "answer");
+    for (int q = 0; questions[q]; q++) {
+        double confidence = 0.0;
+        const char *answer = NULL;
+        double start = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            answer = faq_index_lookup(questions[q], &confidence);
+        }
+        double us = (now_seconds() - start) * 1e6 / rounds;
+        char first_line[56];
+        // Below the threshold the best match is thrown away and the question goes to the model
+        if (answer && confidence >= faq_min_confidence) {
+            snprintf(first_line, sizeof(first_line), "local: %s", answer);
+        } else {
+            snprintf(first_line, sizeof(first_line), "sent to service");
+        }
+        first_line[strcspn(first_line, "\n")] = '\0';
+        printf("%-34s %10.2f %8.2f %s\n", questions[q], us, confidence, first_line);
+    }
+}
+
+// ./server --bench channels: joins, leaves and posts with thousands of
+// channels whose sizes follow Zipf's law, against scanning every session
+#define BENCH_CHANNELS 20000
+#define BENCH_CHANNEL_CLIENTS 50000
+#define BENCH_CHANNELS_PER_CLIENT 8
+void run_channel_benchmark() {
+    client_t **sessions = calloc(BENCH_CHANNEL_CLIENTS, sizeof(client_t *));
+    double *cdf = malloc(BENCH_CHANNELS * sizeof(double));
+    struct sockaddr_in addr;
+    unsigned int seed = 42;
+    double total = 0;
+    char name[CHANNEL_NAME_MAX + 1];
+
+    if (sessions == NULL || cdf == NULL) return;
+    memset(&addr, 0, sizeof(addr));
+    // Channel c<r> is picked with weight 1/(r+1)
+    for (int i = 0; i < BENCH_CHANNELS; i++) {
+        total += 1.0 / (i + 1);
+        cdf[i] = total;
+    }
+    // Sessions without a socket that queue everything; keep the queues short
+    queue_limit = 4;
+    for (int i = 0; i < BENCH_CHANNEL_CLIENTS; i++) {
+        sessions[i] = create_client(-1, &addr, NULL);
+        if (sessions[i] == NULL) return;
+        sessions[i]->id = i;
+        sessions[i]->in_transfer = 1;
+        snprintf(sessions[i]->username, sizeof(sessions[i]->username), "benchuser%d", i);
+    }
+
+    unsigned long joins = 0;
+    double start = now_seconds();
+    for (int i = 0; i < BENCH_CHANNEL_CLIENTS; i++) {
+        for (int k = 0; k < BENCH_CHANNELS_PER_CLIENT; k++) {
+            double pick = rand_r(&seed) / (RAND_MAX + 1.0) * total;
+            int lo = 0, hi = BENCH_CHANNELS - 1;
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (cdf[mid] < pick) lo = mid + 1; else hi = mid;
+            }
+            snprintf(name, sizeof(name), "c%d", lo);
+            if (channel_find_member(sessions[i], name) == NULL && channel_join(sessions[i], name)) joins++;
+        }
+    }
+    double join_rate = joins / (now_seconds() - start);
+    printf("%d sessions in %d channels: %lu joins, %.0f joins/s\n\n",
+           BENCH_CHANNEL_CLIENTS, channel_table.count, joins, join_rate);
+
+    printf("%10s %10s %16s %16s %18s\n", "channel", "members", "us per post", "ns per member", "scan all, us");
+    int ranks[] = {0, 9, 99, 999, 9999};
+    msg_buf_t *buf = msg_buf_new("bench", 5);
+    for (size_t r = 0; r < sizeof(ranks) / sizeof(ranks[0]); r++) {
+        snprintf(name, sizeof(name), "c%d", ranks[r]);
+        pthread_rwlock_rdlock(&channel_table.lock);
+        channel_t *c = channel_table_find(name, simple_hash(name));
+        pthread_rwlock_unlock(&channel_table.lock);
+        if (c == NULL) continue;
+        int members = atomic_load(&c->members);
+
+        int posts = 2000000 / (members + 1) + 10;
+        start = now_seconds();
+        for (int i = 0; i < posts; i++) channel_post(c, buf, -1);
+        double post_us = (now_seconds() - start) * 1e6 / posts;
+
+        // What a broadcast filtered by membership would cost
+        int scans = 20;
+        start = now_seconds();
+        for (int i = 0; i < scans; i++) {
+            for (int j = 0; j < BENCH_CHANNEL_CLIENTS; j++) {
+                if (channel_find_member(sessions[j], name)) client_send_buf(sessions[j], buf);
+            }
+        }
+        double scan_us = (now_seconds() - start) * 1e6 / scans;
+
+        printf("%10s %10d %16.2f %16.1f %18.0f\n", name, members, post_us,
+               post_us * 1000 / members, scan_us);
+    }
+    msg_buf_unref(buf);
+
+    start = now_seconds();
+    for (int i = 0; i < BENCH_CHANNEL_CLIENTS; i++) {
+        channel_leave_all(sessions[i]);
+        free_client(sessions[i]);
+    }
+    printf("\n%.0f leaves/s, %d channels left\n", joins / (now_seconds() - start), channel_table.count);
+    free(sessions);
+    free(cdf);
+}
+
+// The other end of a benchmark transfer: drains a download or feeds an
+// upload over loopback, so the main thread only does the server's half.
+typedef struct {
+    int sock;
+    long len;
+    int feed;
+} transfer_peer_t;
+
+void *transfer_peer(void *arg) {
+    transfer_peer_t *peer = arg;
+    size_t size = 256 * 1024;
+    char *buffer = calloc(1, size);
+    long done = 0;
+    
+    while (buffer && done < peer->len) {
+        size_t want = (size_t)(peer->len - done) < size ? (size_t)(peer->len - done) : size;
+        ssize_t n = peer->feed ? send(peer->sock, buffer, want, MSG_NOSIGNAL) : recv(peer->sock, buffer, want, 0);
+        if (n <= 0) break;
+        done += n;
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Connected loopback TCP pair: *server_side plays the client's connection
+int transfer_socket_pair(int *server_side, int *peer) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    
+    if (listener < 0) return -1;
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &len) < 0) {
+        close(listener);
+        return -1;
+    }
+    *peer = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*peer, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(*peer);
+        close(listener);
+        return -1;
+    }
+    *server_side = accept(listener, NULL, NULL);
+    close(listener);
+    return *server_side < 0 ? -1 : 0;
+}
+
+double thread_cpu_seconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// ./server --bench transfer: get and put of one file over loopback, the
+// old buffered loops against sendfile()/splice(). CPU is the server
+// side's only; the peer's recv()/send() copies are not counted.
+void run_transfer_benchmark() {
+    const char *src_path = "bench_transfer.bin";
+    const char *dst_path = "bench_upload.bin";
+    const long len = (long)BENCH_TRANSFER_MB << 20;
+    static const char *names[] = {
+        "get read/send 2 KB (old)", "get read/send 16 KB", "get sendfile",
+        "put recv/write 2 KB (old)", "put recv/write 16 KB", "put splice"
+    };
+    char block[8 * BUFFER_SIZE];
     
-    if (file_size < 0) {
-        printf("Client reported file not found: %s\n", filename);
-        char response[] = "File not found on client side";
-        send(client_socket, response, strlen(response), 0);
+    // Written first so every download is served from the page cache
+    int fd = open(src_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("bench file");
+        return;
+    }
+    for (size_t i = 0; i < sizeof(block); i++) block[i] = (char)i;
+    for (long done = 0; done < len; done += sizeof(block)) {
+        if (write_all(fd, block, sizeof(block)) < 0) break;
+    }
+    close(fd);
+    
+    printf("%-26s %10s %12s\n", "path", "MB/s", "CPU s/GB");
+    for (int row = 0; row < 6; row++) {
+        int server_side, peer_sock;
+        int upload = row >= 3;
+        if (transfer_socket_pair(&server_side, &peer_sock) < 0) {
+            perror("loopback");
+            break;
+        }
+        fd = upload ? open(dst_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(src_path, O_RDONLY);
+        transfer_peer_t peer = { peer_sock, len, upload };
+        pthread_t tid;
+        pthread_create(&tid, NULL, transfer_peer, &peer);
+        
+        double cpu = thread_cpu_seconds();
+        double start = now_seconds();
+        long moved = 0;
+        off_t offset = 0;
+        switch (row % 3 + (upload ? 3 : 0)) {
+        case 0: moved = copy_file_to_socket(server_side, fd, &offset, len, BUFFER_SIZE) < 0 ? 0 : len; break;
+        case 1: moved = copy_file_to_socket(server_side, fd, &offset, len, COPY_BUFFER_SIZE) < 0 ? 0 : len; break;
+        case 2: moved = send_file_range(server_side, fd, &offset, len) < 0 ? 0 : len; break;
+        case 3: moved = copy_socket_to_file(server_side, fd, len, BUFFER_SIZE); break;
+        case 4: moved = copy_socket_to_file(server_side, fd, len, COPY_BUFFER_SIZE); break;
+        case 5: moved = recv_file_range(server_side, fd, len); break;
+        }
+        double elapsed = now_seconds() - start;
+        cpu = thread_cpu_seconds() - cpu;
+        
+        shutdown(server_side, SHUT_RDWR);
+        pthread_join(tid, NULL);
+        close(server_side);
+        close(peer_sock);
+        close(fd);
+        
+        if (moved != len) {
+            printf("%-26s failed after %ld bytes\n", names[row], moved);
+            continue;
+        }
+        printf("%-26s %10.0f %12.3f\n", names[row], len / 1048576.0 / elapsed, cpu / (len / 1073741824.0));
+    }
+    unlink(src_path);
+    unlink(dst_path);
+}
+
+// Drop the in-memory mailboxes and close the log (benchmarks only)
+void reset_mailboxes() {
+    for (size_t b = 0; mail.buckets && b <= mail.mask; b++) {
+        while (mail.buckets[b]) {
+            mailbox_t *mb = mail.buckets[b];
+            mail.buckets[b] = mb->next;
+            free(mb->entries);
+            free(mb);
+        }
+    }
+    free(mail.buckets);
+    if (mail.fd >= 0) close(mail.fd);
+    memset(&mail, 0, sizeof(mail));
+    pthread_mutex_init(&mail.lock, NULL);
+    mail.fd = -1;
+}
+
+// Write everything queued for a benchmark session
+static void bench_flush(client_t *client) {
+    while (client_has_output(client)) {
+        struct pollfd pfd = { .fd = client->socket, .events = POLLOUT };
+        poll(&pfd, 1, 1000);
+        if (client_flush(client) < 0) break;
+    }
+}
+
+// ./server --bench mailbox: a backlog of 100k messages for one offline
+// user, stored, reloaded at startup and delivered at login, against
+// delivering it one message per send
+#define BENCH_MAIL_MESSAGES 100000
+void run_mailbox_benchmark() {
+    const char *path = "bench_mailboxes.log";
+    char text[128];
+    struct sockaddr_in addr;
+
+    unlink(path);
+    mailbox_limit = BENCH_MAIL_MESSAGES;
+    fsync_policy = FSYNC_OFF;
+    queue_limit = BENCH_MAIL_MESSAGES + 16;
+    if (mail_init(path) < 0) return;
+
+    double start = now_seconds();
+    for (int i = 0; i < BENCH_MAIL_MESSAGES; i++) {
+        snprintf(text, sizeof(text), "message %d of the backlog, about as long as a typical chat line", i);
+        if (mailbox_store("benchuser", "benchsender", text) != MAIL_OK) {
+            printf("store %d failed\n", i);
+            return;
+        }
+    }
+    double store_s = now_seconds() - start;
+    uint64_t log_size = mail.size;
+
+    reset_mailboxes();
+    start = now_seconds();
+    mail_init(path);
+    double load_s = now_seconds() - start;
+    printf("%d messages: stored at %.0f/s (fsync off), log %.1f MB, reloaded at startup in %.0f ms\n\n",
+           BENCH_MAIL_MESSAGES, BENCH_MAIL_MESSAGES / store_s, log_size / 1048576.0, load_s * 1000);
+
+    printf("%-28s %12s %14s %14s\n", "delivery at login", "ms", "messages/s", "send calls");
+    memset(&addr, 0, sizeof(addr));
+    for (int batched = 0; batched <= 1; batched++) {
+        int server_side, peer_fd;
+        if (transfer_socket_pair(&server_side, &peer_fd) < 0) return;
+        transfer_peer_t peer = { peer_fd, LONG_MAX, 0 };
+        pthread_t tid;
+        pthread_create(&tid, NULL, transfer_peer, &peer);
+        client_t *client = create_client(server_side, &addr, NULL);
+        strcpy(client->username, "benchuser");
+        unsigned long calls = atomic_load(&queue_stats.send_calls);
+
+        start = now_seconds();
+        if (batched) {
+            mailbox_deliver(client);
+        } else {
+            // What delivery would cost with a read and a send per message
+            pthread_mutex_lock(&mail.lock);
+            mailbox_t *mb = mailbox_find("benchuser", simple_hash("benchuser"));
+            unsigned char buf[sizeof(mail_record_t) + 2 * 50 + BUFFER_SIZE + 8];
+            for (int i = 0; mb && i < mb->count; i++) {
+                if (pread(mail.fd, buf, mb->entries[i].size, mb->entries[i].offset) < 0) break;
+                const mail_record_t *rec = (const mail_record_t *)buf;
+                const char *body = (const char *)(rec + 1);
+                msg_buf_t *line = msg_buf_printf("[PRIVATE] %.*s: %.*s", rec->sender_len, body + rec->recipient_len,
+                                                 rec->text_len, body + rec->recipient_len + rec->sender_len);
+                if (line) {
+                    client_send_buf(client, line);
+                    msg_buf_unref(line);
+                }
+            }
+            pthread_mutex_unlock(&mail.lock);
+        }
+        bench_flush(client);
+        double elapsed = now_seconds() - start;
+        calls = atomic_load(&queue_stats.send_calls) - calls;
+
+        shutdown(server_side, SHUT_WR);
+        pthread_join(tid, NULL);
+        close(server_side);
+        close(peer_fd);
+        free_client(client);
+        printf("%-28s %12.1f %14.0f %14lu\n", batched ? "batched drain" : "one read+send per message",
+               elapsed * 1000, BENCH_MAIL_MESSAGES / elapsed, calls);
+    }
+    reset_mailboxes();
+    unlink(path);
+}
+
+// Registry operations at growing session counts, against scanning a plain
+// array the way the fixed clients[] table used to be searched
+#define BENCH_REGISTRY_MAX 200000
+
+void run_registry_benchmark() {
+    client_t **sessions = calloc(BENCH_REGISTRY_MAX, sizeof(client_t *));
+    int *order = malloc(BENCH_REGISTRY_MAX * sizeof(int));
+    struct sockaddr_in addr;
+    unsigned int seed = 42;
+
+    if (sessions == NULL || order == NULL) return;
+    memset(&addr, 0, sizeof(addr));
+    for (int i = 0; i < BENCH_REGISTRY_MAX; i++) {
+        sessions[i] = create_client(i, &addr, NULL);
+        if (sessions[i] == NULL) return;
+        snprintf(sessions[i]->username, sizeof(sessions[i]->username), "benchuser%d", i);
+    }
+
+    printf("%10s %10s %10s %12s %12s %10s %16s\n", "sessions", "add ns", "login ns",
+           "by id ns", "by name ns", "remove ns", "scan by name ns");
+    int sizes[] = {10, 1000, 10000, 100000, BENCH_REGISTRY_MAX};
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        int n = sizes[k];
+        // Ids 0..n-1 like the lowest free sockets, coming and going in random order
+        for (int i = 0; i < n; i++) order[i] = i;
+        for (int i = n - 1; i > 0; i--) {
+            int j = rand_r(&seed) % (i + 1);
+            int t = order[i]; order[i] = order[j]; order[j] = t;
+        }
+        client_registry_t r;
+        memset(&r, 0, sizeof(r));
+        volatile int found = 0;
+
+        double start = now_seconds();
+        for (int i = 0; i < n; i++) registry_add(&r, sessions[order[i]]);
+        double add_ns = (now_seconds() - start) * 1e9 / n;
+
+        start = now_seconds();
+        for (int i = 0; i < n; i++) {
+            sessions[order[i]]->is_authenticated = 1;
+            registry_set_name(&r, sessions[order[i]]);
+        }
+        double login_ns = (now_seconds() - start) * 1e9 / n;
+
+        int lookups = 1000000;
+        start = now_seconds();
+        for (int i = 0; i < lookups; i++) found += registry_get(&r, order[i % n]) != NULL;
+        double id_ns = (now_seconds() - start) * 1e9 / lookups;
+
+        start = now_seconds();
+        for (int i = 0; i < lookups; i++) {
+            found += registry_find_name(&r, sessions[order[i % n]]->username) != NULL;
+        }
+        double name_ns = (now_seconds() - start) * 1e9 / lookups;
+
+        // Every slot examined, as for a user who is not online
+        int scans = 20000000 / n + 1;
+        start = now_seconds();
+        for (int i = 0; i < scans; i++) {
+            const char *name = sessions[order[i % n]]->username;
+            for (int j = 0; j < n; j++) {
+                if (r.live[j] && strcmp(r.live[j]->username, name) == 0) found++;
+            }
+        }
+        double scan_ns = (now_seconds() - start) * 1e9 / scans;
+
+        start = now_seconds();
+        for (int i = 0; i < n; i++) registry_remove(&r, sessions[order[(i * 7919L) % n]]);
+        double remove_ns = (now_seconds() - start) * 1e9 / n;
+
+        printf("%10d %10.1f %10.1f %12.1f %12.1f %10.1f %16.0f\n", n, add_ns, login_ns,
+               id_ns, name_ns, remove_ns, scan_ns);
+        if (r.count != 0 || r.named != 0) printf("registry not empty after removing everything\n");
+        for (int i = 0; i < n; i++) sessions[order[i]]->is_authenticated = 0;
+        free(r.live);
+        free(r.slots);
+        free(r.names);
+    }
+
+    for (int i = 0; i < BENCH_REGISTRY_MAX; i++) free_client(sessions[i]);
+    free(sessions);
+    free(order);
+}
+
+// The branch the old if/else chain in handle_client_command picked for a
+// line (the login check left out), to compare with command_find()
+__attribute__((noinline)) int dispatch_chain(const char *b) {
+    if (strcmp(b, "/proto framed") == 0) return 0;
+    if (strncmp(b, "/login ", 7) == 0) return 1;
+    if (strncmp(b, "/register ", 10) == 0) return 2;
+    if (strncmp(b, "/msg ", 5) == 0) return 3;
+    if (strcmp(b, "/users") == 0 || strncmp(b, "/users ", 7) == 0) return 4;
+    if (strcmp(b, "/presence") == 0 || strncmp(b, "/presence ", 10) == 0) return 5;
+    if (strcmp(b, "/join") == 0 || strncmp(b, "/join ", 6) == 0) return 6;
+    if (strcmp(b, "/leave") == 0 || strncmp(b, "/leave ", 7) == 0) return 7;
+    if (strcmp(b, "/channels") == 0) return 8;
+    if (strcmp(b, "/history") == 0 || strncmp(b, "/history ", 9) == 0) return 9;
+    if (strcmp(b, "/stats") == 0) return 10;
+    if (strncmp(b, "/faq ", 5) == 0) return 11;
+    if (strncmp(b, "put ", 4) == 0) return 12;
+    if (strncmp(b, "get ", 4) == 0) return 13;
+    if (strncmp(b, "stat ", 5) == 0 || strncmp(b, "getrange ", 9) == 0 ||
+        strncmp(b, "putrange ", 9) == 0) return 14;
+    if (strcmp(b, "exit") == 0) return 15;
+    return -1;
+}
+
+// Dispatch cost per line for chat and for commands early and late in the
+// old chain
+void run_dispatch_benchmark() {
+    const char *lines[] = {
+        "see you all at the standup tomorrow",
+        "/login alice secret",
+        "/msg bob are you around?",
+        "/history 30m",
+        "/faq how do I upload a file",
+        "get report.pdf",
+        "exit",
+    };
+    int iterations = 5000000;
+    char line[BUFFER_SIZE];
+    volatile long sink = 0;
+
+    printf("%-40s %10s %10s\n", "line", "chain ns", "table ns");
+    for (size_t k = 0; k < sizeof(lines) / sizeof(lines[0]); k++) {
+        strcpy(line, lines[k]);
+        char *args;
+
+        double start = now_seconds();
+        for (int i = 0; i < iterations; i++) sink += dispatch_chain(line);
+        double chain_ns = (now_seconds() - start) * 1e9 / iterations;
+
+        start = now_seconds();
+        for (int i = 0; i < iterations; i++) sink += command_find(line, &args) != NULL;
+        double table_ns = (now_seconds() - start) * 1e9 / iterations;
+
+        printf("%-40s %10.1f %10.1f\n", lines[k], chain_ns, table_ns);
+    }
+}
+
+// Make room for --max-clients sockets on top of listeners, files and eventfds
+void raise_fd_limit() {
+    struct rlimit rl;
+    rlim_t want = (rlim_t)max_clients + 256;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= want) return;
+    rl.rlim_cur = rl.rlim_max < want ? rl.rlim_max : want;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur < want) {
+        fprintf(stderr, "Open file limit is %lu; fewer than %d clients may fit\n",
+                (unsigned long)rl.rlim_cur, max_clients);
+    }
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--mode thread|epoll|sharded] [--threads N] [--max-clients N]\n"
+                    "          [--queue-limit N] [--slow-policy P] [--fsync always|interval|off]\n"
+                    "          [--compact-interval SECONDS] [--zero-copy on|off]\n"
+                    "          [--history-mb N] [--mailbox-limit N] [--mailbox-days N] [--join-notices N]\n"
+                    "          [--faq-url URL]... [--faq-timeout MS] [--faq-hedge] [--faq-breaker N]\n"
+                    "          [--faq-concurrency N] [--faq-batch N] [--faq-batch-window MS]\n"
+                    "          [--faq-stream] [--faq-cache-ttl SECONDS] [--faq-cache-mb N]\n"
+                    "          [--faq-corpus FILE] [--faq-confidence X]\n"
+                    "       %s --convert-users [users.db] [users.snap]\n", prog, prog);
+    fprintf(stderr, "  --mode thread   one thread per client (blocking I/O)\n");
+    fprintf(stderr, "  --mode epoll    edge-triggered epoll reactors (default)\n");
+    fprintf(stderr, "  --mode sharded  reactors with their own SO_REUSEPORT listener and client table\n");
+    fprintf(stderr, "  --threads N     number of reactors/shards (default: CPU count)\n");
+    fprintf(stderr, "  --max-clients N             sessions open at once, across all threads (default: %d)\n", DEFAULT_MAX_CLIENTS);
+    fprintf(stderr, "  --queue-limit N             outbound messages queued per client (default: %d)\n", DEFAULT_QUEUE_LIMIT);
+    fprintf(stderr, "  --slow-policy drop-oldest   drop the oldest queued message when full (default)\n");
+    fprintf(stderr, "  --slow-policy disconnect    disconnect clients whose queue is full\n");
+    fprintf(stderr, "  --fsync always              users.journal is on disk before login/register returns\n");
+    fprintf(stderr, "  --fsync interval            fsync users.journal about once per second (default)\n");
+    fprintf(stderr, "  --fsync off                 leave flushing users.journal to the OS\n");
+    fprintf(stderr, "  --compact-interval N        fold the journal into users.snap every N seconds (default: %d)\n", DEFAULT_COMPACT_INTERVAL);
+    fprintf(stderr, "  --zero-copy on|off          put/get with splice()/sendfile() or through a buffer (default: on)\n");
+    fprintf(stderr, "  --history-mb N              message log kept on disk, 0 keeps none (default: %d)\n", DEFAULT_HISTORY_MB);
+    fprintf(stderr, "  --mailbox-limit N           private messages kept for one offline user (default: %d)\n", DEFAULT_MAILBOX_LIMIT);
+    fprintf(stderr, "  --mailbox-days N            days an undelivered message is kept, 0 forever (default: %d)\n", DEFAULT_MAILBOX_DAYS);
+    fprintf(stderr, "  --join-notices N            announce logins to everyone up to N users online, 0 never (default: %d)\n", DEFAULT_JOIN_NOTICES);
+    fprintf(stderr, "  --faq-url URL               GPT-2 FAQ service endpoint, repeat for replicas (default: %s)\n", FAQ_SERVICE_URL);
+    fprintf(stderr, "  --faq-timeout MS            longest a FAQ call may take; shorter once latency is known (default: %d)\n", DEFAULT_FAQ_TIMEOUT_MS);
+    fprintf(stderr, "  --faq-hedge                 ask a second replica when the first is slower than its p95\n");
+    fprintf(stderr, "  --faq-breaker N             failures in a row before a backend is skipped, 0 never (default: %d)\n", DEFAULT_FAQ_BREAKER);
+    fprintf(stderr, "  --faq-concurrency N         FAQ calls in flight at once (default: %d)\n", DEFAULT_FAQ_CONCURRENCY);
+    fprintf(stderr, "  --faq-batch N               questions per batched FAQ call, 1 disables (default: %d)\n", DEFAULT_FAQ_BATCH);
+    fprintf(stderr, "  --faq-batch-window MS       how long a question waits for its batch to fill (default: %d)\n", DEFAULT_FAQ_BATCH_WINDOW);
+    fprintf(stderr, "  --faq-stream                relay FAQ answers to framed clients as the model writes them\n");
+    fprintf(stderr, "  --faq-cache-ttl N           seconds a cached FAQ answer is reused, 0 disables (default: %d)\n", DEFAULT_FAQ_CACHE_TTL);
+    fprintf(stderr, "  --faq-cache-mb N            memory budget for cached FAQ answers (default: %d)\n", DEFAULT_FAQ_CACHE_MB);
+    fprintf(stderr, "  --faq-corpus FILE           questions answered in-process (default: %s)\n", FAQ_CORPUS_FILE);
+    fprintf(stderr, "  --faq-confidence X          match (0-1) needed to answer from the corpus, above 1 never (default: %.1f)\n", DEFAULT_FAQ_CONFIDENCE);
+    fprintf(stderr, "  --convert-users             convert a text users.db to the binary users.snap and exit\n");
+    fprintf(stderr, "  --bench users               benchmark user lookups against user count and exit\n");
+    fprintf(stderr, "  --bench snapshot            benchmark cold start from users.db vs users.snap and exit\n");
+    fprintf(stderr, "  --bench faq                 time corpus lookups for sample questions and exit\n");
+    fprintf(stderr, "  --bench transfer            throughput and CPU per GB of copying vs zero-copy put/get and exit\n");
+    fprintf(stderr, "  --bench channels            joins, leaves and posts across 20000 channels of skewed sizes and exit\n");
+    fprintf(stderr, "  --bench mailbox             store, reload and deliver 100k offline messages and exit\n");
+    fprintf(stderr, "  --bench registry            session add/lookup/remove cost from 10 to 200k sessions and exit\n");
+    fprintf(stderr, "  --bench dispatch            cost of finding the command for a line, chain vs table, and exit\n");
+}
+
+int main(int argc, char *argv[]) {
+    int server_socket, client_socket;
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    pthread_t thread_id;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "thread") == 0) {
+                server_mode = SERVER_MODE_THREAD;
+            } else if (strcmp(argv[i], "epoll") == 0) {
+                server_mode = SERVER_MODE_EPOLL;
+            } else if (strcmp(argv[i], "sharded") == 0) {
+                server_mode = SERVER_MODE_SHARDED;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "users") == 0) {
+                run_user_benchmark();
+            } else if (strcmp(argv[i], "snapshot") == 0) {
+                run_snapshot_benchmark();
+            } else if (strcmp(argv[i], "faq") == 0) {
+                run_faq_index_benchmark();
+            } else if (strcmp(argv[i], "transfer") == 0) {
+                run_transfer_benchmark();
+            } else if (strcmp(argv[i], "channels") == 0) {
+                run_channel_benchmark();
+            } else if (strcmp(argv[i], "mailbox") == 0) {
+                run_mailbox_benchmark();
+            } else if (strcmp(argv[i], "registry") == 0) {
+                run_registry_benchmark();
+            } else if (strcmp(argv[i], "dispatch") == 0) {
+                run_dispatch_benchmark();
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            return 0;
+        } else if (strcmp(argv[i], "--convert-users") == 0) {
+            const char *text_path = i + 1 < argc ? argv[i + 1] : USER_DB_FILE;
+            const char *snap_path = i + 2 < argc ? argv[i + 2] : USER_SNAP_FILE;
+            return convert_user_db(text_path, snap_path) < 0 ? EXIT_FAILURE : 0;
+        } else if (strcmp(argv[i], "--faq-concurrency") == 0 && i + 1 < argc) {
+            int limit = atoi(argv[++i]);
+            faq_concurrency = limit > 0 ? limit : 1;
+        } else if (strcmp(argv[i], "--faq-batch") == 0 && i + 1 < argc) {
+            int batch = atoi(argv[++i]);
+            faq_batch_max = batch < 1 ? 1 : batch > FAQ_BATCH_LIMIT ? FAQ_BATCH_LIMIT : batch;
+        } else if (strcmp(argv[i], "--faq-batch-window") == 0 && i + 1 < argc) {
+            faq_batch_window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--faq-stream") == 0) {
+            faq_stream = 1;
+        } else if (strcmp(argv[i], "--faq-cache-ttl") == 0 && i + 1 < argc) {
+            faq_cache_ttl = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--faq-cache-mb") == 0 && i + 1 < argc) {
+            int mb = atoi(argv[++i]);
+            faq_cache_budget = (size_t)(mb > 0 ? mb : 1) << 20;
+        } else if (strcmp(argv[i], "--faq-corpus") == 0 && i + 1 < argc) {
+            faq_corpus_path = argv[++i];
+        } else if (strcmp(argv[i], "--faq-confidence") == 0 && i + 1 < argc) {
+            faq_min_confidence = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--faq-url") == 0 && i + 1 < argc) {
+            i++;
+            if (faq_url_count < FAQ_MAX_BACKENDS) {
+                faq_urls[faq_url_count++] = argv[i];
+            } else {
+                fprintf(stderr, "Only %d --faq-url backends are supported, ignoring %s\n",
+                        FAQ_MAX_BACKENDS, argv[i]);
+            }
+        } else if (strcmp(argv[i], "--faq-timeout") == 0 && i + 1 < argc) {
+            int ms = atoi(argv[++i]);
+            faq_timeout_ms = ms > FAQ_TIMEOUT_FLOOR_MS ? ms : FAQ_TIMEOUT_FLOOR_MS;
+        } else if (strcmp(argv[i], "--faq-hedge") == 0) {
+            faq_hedge = 1;
+        } else if (strcmp(argv[i], "--faq-breaker") == 0 && i + 1 < argc) {
+            faq_breaker_failures = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
+            int limit = atoi(argv[++i]);
+            max_clients = limit > 0 ? limit : 1;
+        } else if (strcmp(argv[i], "--queue-limit") == 0 && i + 1 < argc) {
+            int limit = atoi(argv[++i]);
+            queue_limit = limit > 0 ? (size_t)limit : 1;
+        } else if (strcmp(argv[i], "--slow-policy") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "drop-oldest") == 0) {
+                slow_policy = SLOW_DROP_OLDEST;
+            } else if (strcmp(argv[i], "disconnect") == 0) {
+                slow_policy = SLOW_DISCONNECT;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--fsync") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "always") == 0) {
+                fsync_policy = FSYNC_ALWAYS;
+            } else if (strcmp(argv[i], "interval") == 0) {
+                fsync_policy = FSYNC_INTERVAL;
+            } else if (strcmp(argv[i], "off") == 0) {
+                fsync_policy = FSYNC_OFF;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--zero-copy") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "on") == 0) {
+                zero_copy_transfers = 1;
+            } else if (strcmp(argv[i], "off") == 0) {
+                zero_copy_transfers = 0;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--history-mb") == 0 && i + 1 < argc) {
+            history_mb = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mailbox-limit") == 0 && i + 1 < argc) {
+            int limit = atoi(argv[++i]);
+            mailbox_limit = limit > 0 ? limit : 1;
+        } else if (strcmp(argv[i], "--mailbox-days") == 0 && i + 1 < argc) {
+            mailbox_days = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--join-notices") == 0 && i + 1 < argc) {
+            join_notices = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compact-interval") == 0 && i + 1 < argc) {
+            int interval = atoi(argv[++i]);
+            compact_interval = interval > 0 ? interval : 1;
+        } else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (threads < 1) threads = 1;
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    raise_fd_limit();
+    
+    if (command_index_check() < 0 || load_users() < 0 || start_user_journal() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    faq_cache_init();
+    faq_index_load(faq_corpus_path);
+    if (faq_engine_start() < 0) {
+        fprintf(stderr, "FAQ engine unavailable; /faq will use built-in answers\n");
+    }
+    store_init();
+    if (history_mb > 0 && history_init() < 0) {
+        fprintf(stderr, "Message history unavailable\n");
+    }
+    if (mail_init(MAILBOX_FILE) < 0) {
+        fprintf(stderr, "Mailboxes unavailable; /msg to offline users will fail\n");
+    }
+    
+    // Sharded mode: every shard accepts on its own listener, nothing left for main()
+    if (server_mode == SERVER_MODE_SHARDED) {
+        if (start_reactors(threads) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        printf("Server listening on port %d\n", PORT);
+        printf("Upload directory: %s\n", UPLOAD_DIR);
+        printf("User database: %s\n", USER_SNAP_FILE);
+        printf("Mode: sharded (%d shards, SO_REUSEPORT)\n", reactor_count);
+        if (start_presence() < 0) {
+            fprintf(stderr, "Presence updates unavailable\n");
+        }
+        printf("Waiting for clients...\n");
+        for (int i = 0; i < reactor_count; i++) {
+            pthread_join(reactors[i].thread, NULL);
+        }
+        return 0;
+    }
+    
+    server_socket = create_listener(0);
+    if (server_socket < 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    printf("Server listening on port %d\n", PORT);
+    printf("Upload directory: %s\n", UPLOAD_DIR);
+    printf("User database: %s\n", USER_SNAP_FILE);
+    
+    if (server_mode == SERVER_MODE_EPOLL) {
+        if (start_reactors(threads) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < reactor_count; i++) {
+            pthread_detach(reactors[i].thread);
+        }
+        printf("Mode: epoll (%d reactor threads)\n", reactor_count);
+    } else {
+        printf("Mode: thread per client\n");
+    }
+    if (start_presence() < 0) {
+        fprintf(stderr, "Presence updates unavailable\n");
+    }
+    printf("Waiting for clients...\n");
+    
+    // Client threads no longer keep big buffers on the stack, so the default
+    // 8 MB reservation per thread is mostly wasted address space
+    pthread_attr_t client_attr;
+    pthread_attr_init(&client_attr);
+    pthread_attr_setstacksize(&client_attr, THREAD_STACK_SIZE);
+    pthread_attr_setdetachstate(&client_attr, PTHREAD_CREATE_DETACHED);
+    
+    while (1) {
+        client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
+        if (client_socket < 0) {
+            perror("Accept failed");
+            continue;
+        }
+        
+        client_t *client = create_client(client_socket, &client_addr,
+                                         server_mode == SERVER_MODE_EPOLL ? reactor_next() : NULL);
+        if (client == NULL) {
+            close(client_socket);
+            continue;
+        }
+        
+        if (add_client(client) < 0) {
+            printf("Maximum clients reached. Rejecting new connection.\n");
+            close(client_socket);
+            free_client(client);
+            continue;
+        }
+        
+        if (server_mode == SERVER_MODE_EPOLL) {
+            if (reactor_add_client(client) < 0) {
+                remove_client(client->id);
+                close(client_socket);
+                free_client(client);
+            }
+        } else if (set_nonblocking(client_socket, 1) < 0 ||
+                   (client->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+                   pthread_create(&thread_id, &client_attr, handle_client, (void*)client) != 0) {
+            perror("Failed to create thread");
+            remove_client(client->id);
+            close(client_socket);
+            free_client(client);
+        }
+    }
+    
+    close(server_socket);
+    return 0;
+}
+static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    struct http_response *mem = (struct http_response *)userp;
+    
+    // Double the buffer instead of a realloc() for every chunk curl hands over
+    if (mem->size + realsize + 1 > mem->cap) {
+        size_t cap = mem->cap ? mem->cap * 2 : 1024;
+        while (cap < mem->size + realsize + 1) cap *= 2;
+        char *ptr = buf_pool_alloc(cap);
+        if (!ptr) {
+            printf("Not enough memory for FAQ response\n");
+            return 0;
+        }
+        if (mem->size) memcpy(ptr, mem->memory, mem->size);
+        buf_pool_free(mem->memory, mem->cap);
+        mem->memory = ptr;
+        mem->cap = cap;
+    }
+    
+    memcpy(&(mem->memory[mem->size]), contents, realsize);
+    mem->size += realsize;
+    mem->memory[mem->size] = 0;
+    
+    return realsize;
+}
+
+// Write s as a quoted JSON string. out needs room for 6 * strlen(s) + 3.
+size_t json_escape(char *out, const char *s) {
+    size_t len = 0;
+    out[len++] = '"';
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            out[len++] = '\\';
+            out[len++] = *p;
+        } else if (*p == '\n') {
+            out[len++] = '\\';
+            out[len++] = 'n';
+        } else if (*p < 0x20) {
+            len += sprintf(out + len, "\\u%04x", *p);
+        } else {
+            out[len++] = *p;
+        }
+    }
+    out[len++] = '"';
+    out[len] = '\0';
+    return len;
+}
+
+static int json_hex4(const char *p) {
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return -1;
+    }
+    return value;
+}
+
+// Decode the JSON string starting at the opening quote at p into a new
+// buffer (at most max_len bytes kept). Returns the position after the
+// closing quote, or NULL if the string is malformed.
+const char *json_parse_string(const char *p, char **out, size_t max_len) {
+    if (*p != '"') return NULL;
+    char *result = malloc(strlen(p) + 1);
+    size_t len = 0;
+    if (result == NULL) return NULL;
+    
+    for (p++; *p && *p != '"'; p++) {
+        unsigned int c = (unsigned char)*p;
+        if (c == '\\') {
+            p++;
+            switch (*p) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'u': {
+                int cp = json_hex4(p + 1);
+                if (cp < 0) goto bad;
+                p += 4;
+                // Characters outside the BMP arrive as a surrogate pair
+                if (cp >= 0xD800 && cp < 0xDC00 && p[1] == '\\' && p[2] == 'u') {
+                    int low = json_hex4(p + 3);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+                if (cp < 0x80) {
+                    result[len++] = cp;
+                } else if (cp < 0x800) {
+                    result[len++] = 0xC0 | (cp >> 6);
+                    result[len++] = 0x80 | (cp & 0x3F);
+                } else if (cp < 0x10000) {
+                    result[len++] = 0xE0 | (cp >> 12);
+                    result[len++] = 0x80 | ((cp >> 6) & 0x3F);
+                    result[len++] = 0x80 | (cp & 0x3F);
+                } else {
+                    result[len++] = 0xF0 | (cp >> 18);
+                    result[len++] = 0x80 | ((cp >> 12) & 0x3F);
+                    result[len++] = 0x80 | ((cp >> 6) & 0x3F);
+                    result[len++] = 0x80 | (cp & 0x3F);
+                }
+                continue;
+            }
+            case '\0': goto bad;
+            default: c = (unsigned char)*p; break;    // \" \\ \/
+            }
+        }
+        result[len++] = c;
+    }
+    if (*p != '"') goto bad;
+    
+    if (len > max_len) len = max_len;
+    result[len] = '\0';
+    *out = result;
+    return p + 1;
+bad:
+    free(result);
+    return NULL;
+}
+
+// Position just after "key": in a JSON object, or NULL
+static const char *json_find_value(const char *json, const char *key) {
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    const char *p = strstr(json, quoted);
+    if (p == NULL) return NULL;
+    p += strlen(quoted);
+    while (isspace((unsigned char)*p)) p++;
+    if (*p != ':') return NULL;
+    p++;
+    while (isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+// Pull the "answer" string out of the service's JSON reply
+char *parse_faq_answer(const char *json) {
+    char *answer = NULL;
+    const char *p = json_find_value(json, "answer");
+    if (p == NULL || json_parse_string(p, &answer, 400) == NULL) return NULL;
+    return answer;
+}
+
+// Pull up to count strings out of the "answers" array of a batch reply.
+// Returns how many were found; missing answers stay NULL.
+int parse_faq_answers(const char *json, char **answers, int count) {
+    const char *p = json_find_value(json, "answers");
+    int found = 0;
+    if (p == NULL || *p != '[') return 0;
+    
+    for (p++; found < count; found++) {
+        while (isspace((unsigned char)*p) || *p == ',') p++;
+        if (*p != '"') break;
+        p = json_parse_string(p, &answers[found], 400);
+        if (p == NULL) break;
+    }
+    return found;
+}
+
+// Cache key for a question: lower case, punctuation dropped, runs of
+// whitespace collapsed to one space, no leading or trailing space.
+// "How to RUN?" and "  how to run " share an entry.
+char *faq_normalize(const char *question) {
+    char *key = malloc(strlen(question) + 1);
+    size_t len = 0;
+    int space = 0;
+    
+    if (key == NULL) return NULL;
+    for (const unsigned char *p = (const unsigned char *)question; *p; p++) {
+        if (isspace(*p)) {
+            space = len > 0;
+        } else if (!ispunct(*p)) {
+            if (space) key[len++] = ' ';
+            key[len++] = tolower(*p);
+            space = 0;
+        }
+    }
+    key[len] = '\0';
+    return key;
+}
+
+void faq_cache_init() {
+    for (int i = 0; i < FAQ_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&faq_cache[i].lock, NULL);
+    }
+}
+
+static faq_cache_shard_t *faq_cache_shard(unsigned long hash) {
+    return &faq_cache[hash & (FAQ_CACHE_SHARDS - 1)];
+}
+
+static faq_cache_entry_t **faq_cache_bucket(faq_cache_shard_t *shard, unsigned long hash) {
+    return &shard->buckets[((hash * 0x9E3779B97F4A7C15ULL) >> 32) & (FAQ_CACHE_BUCKETS - 1)];
+}
+
+// Unlink and free an entry. Caller holds the shard lock.
+static void faq_cache_remove(faq_cache_shard_t *shard, faq_cache_entry_t *entry) {
+    faq_cache_entry_t **link = faq_cache_bucket(shard, entry->hash);
+    while (*link != entry) link = &(*link)->chain;
+    *link = entry->chain;
+    
+    if (entry->prev) entry->prev->next = entry->next; else shard->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else shard->tail = entry->prev;
+    shard->bytes -= entry->cost;
+    shard->entries--;
+    msg_buf_unref(entry->answer);
+    free(entry);
+}
+
+static void faq_cache_push_front(faq_cache_shard_t *shard, faq_cache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head) shard->head->prev = entry; else shard->tail = entry;
+    shard->head = entry;
+}
+
+// Look up a normalized question. Returns a referenced answer buffer or NULL.
+msg_buf_t *faq_cache_get(const char *key) {
+    unsigned long hash = simple_hash(key);
+    faq_cache_shard_t *shard = faq_cache_shard(hash);
+    msg_buf_t *answer = NULL;
+    
+    pthread_mutex_lock(&shard->lock);
+    faq_cache_entry_t *entry = *faq_cache_bucket(shard, hash);
+    while (entry && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+        entry = entry->chain;
+    }
+    if (entry && entry->expires <= time(NULL)) {
+        faq_cache_remove(shard, entry);
+        entry = NULL;
+    }
+    if (entry) {
+        // Move to the front of the LRU list
+        if (entry != shard->head) {
+            entry->prev->next = entry->next;
+            if (entry->next) entry->next->prev = entry->prev; else shard->tail = entry->prev;
+            faq_cache_push_front(shard, entry);
+        }
+        answer = msg_buf_ref(entry->answer);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return answer;
+}
+
+// Remember a service answer, evicting least recently used entries to stay
+// within this shard's share of the memory budget
+void faq_cache_put(const char *key, const char *text) {
+    if (key == NULL || faq_cache_ttl <= 0) return;
+    
+    unsigned long hash = simple_hash(key);
+    faq_cache_shard_t *shard = faq_cache_shard(hash);
+    size_t key_len = strlen(key);
+    size_t text_len = strlen(text);
+    size_t cost = sizeof(faq_cache_entry_t) + key_len + 1 + sizeof(msg_buf_t) + text_len + 1;
+    size_t budget = faq_cache_budget / FAQ_CACHE_SHARDS;
+    
+    if (cost > budget) return;
+    faq_cache_entry_t *entry = malloc(sizeof(faq_cache_entry_t) + key_len + 1);
+    if (entry == NULL) return;
+    entry->answer = msg_buf_new(text, text_len);
+    if (entry->answer == NULL) {
+        free(entry);
         return;
     }
+    memcpy(entry->key, key, key_len + 1);
+    entry->hash = hash;
+    entry->cost = cost;
+    entry->expires = time(NULL) + faq_cache_ttl;
+    
+    pthread_mutex_lock(&shard->lock);
+    faq_cache_entry_t **bucket = faq_cache_bucket(shard, hash);
+    for (faq_cache_entry_t *old = *bucket; old; old = old->chain) {
+        if (old->hash == hash && strcmp(old->key, key) == 0) {
+            faq_cache_remove(shard, old);
+            break;
+        }
+    }
+    while (shard->tail && shard->bytes + cost > budget) {
+        faq_cache_remove(shard, shard->tail);
+        shard->evictions++;
+    }
+    entry->chain = *bucket;
+    *bucket = entry;
+    faq_cache_push_front(shard, entry);
+    shard->bytes += cost;
+    shard->entries++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Words that say nothing about which entry is meant
+static const char *faq_stopwords[] = {
+    "a", "about", "an", "and", "any", "are", "at", "be", "by", "can", "could", "did", "do",
+    "does", "for", "from", "has", "have", "how", "i", "if", "in", "is", "it", "me", "my",
+    "of", "on", "or", "should", "that", "the", "there", "this", "to", "was", "we", "what",
+    "when", "where", "which", "who", "why", "will", "with", "would", "you", "your", NULL
+};
+
+// Split text into index terms: lowercase words with stop words dropped and
+// a plural "s" stripped, so "Features?" and "feature" meet in the index
+static int faq_tokenize(const char *text, char terms[][FAQ_TERM_MAX], int max) {
+    const unsigned char *p = (const unsigned char *)text;
+    int count = 0;
+    
+    while (*p && count < max) {
+        char word[FAQ_TERM_MAX];
+        size_t len = 0;
+        while (*p && !isalnum(*p)) p++;
+        while (isalnum(*p)) {
+            if (len < FAQ_TERM_MAX - 1) word[len++] = tolower(*p);
+            p++;
+        }
+        if (len == 0) break;
+        word[len] = '\0';
+        
+        int stop = 0;
+        for (int i = 0; faq_stopwords[i] && !stop; i++) {
+            stop = strcmp(word, faq_stopwords[i]) == 0;
+        }
+        if (stop) continue;
+        if (len > 3 && word[len - 1] == 's' && word[len - 2] != 's') word[--len] = '\0';
+        memcpy(terms[count++], word, len + 1);
+    }
+    return count;
+}
+
+static faq_term_t *faq_index_find(const char *term, unsigned long hash) {
+    faq_term_t *t = faq_index.buckets[hash & (FAQ_INDEX_BUCKETS - 1)];
+    while (t && (t->hash != hash || strcmp(t->term, term) != 0)) t = t->chain;
+    return t;
+}
+
+// Count one occurrence of term in entry doc
+static int faq_index_add(const char *term, int doc) {
+    unsigned long hash = simple_hash(term);
+    faq_term_t *t = faq_index_find(term, hash);
+    
+    if (t == NULL) {
+        size_t len = strlen(term);
+        t = calloc(1, sizeof(faq_term_t) + len + 1);
+        if (t == NULL) return -1;
+        memcpy(t->term, term, len + 1);
+        t->hash = hash;
+        t->chain = faq_index.buckets[hash & (FAQ_INDEX_BUCKETS - 1)];
+        faq_index.buckets[hash & (FAQ_INDEX_BUCKETS - 1)] = t;
+        faq_index.terms++;
+    }
+    if (t->count > 0 && t->postings[t->count - 1].doc == doc) {
+        t->postings[t->count - 1].tf++;
+        return 0;
+    }
+    if (t->count == t->cap) {
+        int cap = t->cap ? t->cap * 2 : 4;
+        faq_posting_t *postings = realloc(t->postings, cap * sizeof(faq_posting_t));
+        if (postings == NULL) return -1;
+        t->postings = postings;
+        t->cap = cap;
+    }
+    t->postings[t->count].doc = doc;
+    t->postings[t->count].tf = 1;
+    t->count++;
+    return 0;
+}
+
+// Answer line with its "\n" escapes turned into line breaks
+static char *faq_corpus_answer(const char *text) {
+    char *answer = malloc(strlen(text) + 1);
+    size_t len = 0;
+    
+    if (answer == NULL) return NULL;
+    for (const char *p = text; *p; p++) {
+        if (p[0] == '\\' && p[1] == 'n') {
+            answer[len++] = '\n';
+            p++;
+        } else {
+            answer[len++] = *p;
+        }
+    }
+    answer[len] = '\0';
+    return answer;
+}
+
+// Load the FAQ corpus into the index. Entries are blank-line separated
+// ("#" lines are comments), each with "Q: " lines (the indexed text) and
+// one "A: " line (the answer).
+int faq_index_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    char line[4096];
+    char questions[8192];           // Q lines of the current entry
+    size_t questions_len = 0;
+    int line_no = 0, entry_line = 0;
+    long total_length = 0;
+    
+    if (file == NULL) {
+        printf("FAQ corpus %s not found, every question goes to the FAQ service\n", path);
+        return -1;
+    }
     
-    mkdir(UPLOAD_DIR, 0777);
+    char *answer = NULL;
+    int cap = 0;
+    for (int more = 1; more; ) {
+        more = fgets(line, sizeof(line), file) != NULL;
+        if (more) {
+            line[strcspn(line, "\r\n")] = '\0';
+            line_no++;
+        }
+        
+        // A blank line or the end of the file closes the entry
+        if (!more || line[0] == '\0') {
+            char terms[FAQ_QUERY_TERMS * 4][FAQ_TERM_MAX];
+            questions[questions_len] = '\0';
+            int n = faq_tokenize(questions, terms, FAQ_QUERY_TERMS * 4);
+            
+            if (answer && n > 0 && faq_index.doc_count == cap) {
+                faq_doc_t *docs = realloc(faq_index.docs, (cap ? cap * 2 : 16) * sizeof(faq_doc_t));
+                if (docs) {
+                    faq_index.docs = docs;
+                    cap = cap ? cap * 2 : 16;
+                }
+            }
+            if (answer && n > 0 && faq_index.doc_count < cap) {
+                faq_doc_t *doc = &faq_index.docs[faq_index.doc_count];
+                doc->answer = answer;
+                doc->length = 0;
+                for (int i = 0; i < n; i++) {
+                    if (faq_index_add(terms[i], faq_index.doc_count) == 0) doc->length++;
+                }
+                total_length += doc->length;
+                faq_index.doc_count++;
+                answer = NULL;
+            } else if (answer || questions_len > 0) {
+                fprintf(stderr, "FAQ corpus %s: entry at line %d needs Q: and A: lines, skipped\n",
+                        path, entry_line);
+            }
+            free(answer);
+            answer = NULL;
+            questions_len = 0;
+            entry_line = 0;
+            continue;
+        }
+        
+        if (line[0] == '#') continue;
+        if (entry_line == 0) entry_line = line_no;
+        if (strncmp(line, "Q:", 2) == 0) {
+            size_t len = strlen(line + 2);
+            if (questions_len + len + 2 <= sizeof(questions)) {
+                memcpy(questions + questions_len, line + 2, len);
+                questions_len += len;
+                questions[questions_len++] = '\n';
+            }
+        } else if (strncmp(line, "A:", 2) == 0) {
+            const char *text = line + 2;
+            while (*text == ' ') text++;
+            free(answer);
+            answer = faq_corpus_answer(text);
+        }
+    }
+    fclose(file);
     
-    char filepath[512];
-    snprintf(filepath, sizeof(filepath), "%s/%s", UPLOAD_DIR, filename);
+    if (faq_index.doc_count == 0) {
+        printf("FAQ corpus %s has no entries, every question goes to the FAQ service\n", path);
+        return -1;
+    }
     
-    FILE *fp = fopen(filepath, "wb");
-    if (fp == NULL) {
-        perror("Failed to create file");
-        char response[] = "Server: Failed to create file";
-        send(client_socket, response, strlen(response), 0);
-        return;
+    // BM25 IDF, never negative for terms in most entries
+    faq_index.avg_length = (double)total_length / faq_index.doc_count;
+    for (int b = 0; b < FAQ_INDEX_BUCKETS; b++) {
+        for (faq_term_t *t = faq_index.buckets[b]; t; t = t->chain) {
+            t->idf = log(1.0 + (faq_index.doc_count - t->count + 0.5) / (t->count + 0.5));
+        }
     }
+    printf("FAQ index: %d answers, %zu terms from %s\n", faq_index.doc_count, faq_index.terms, path);
+    return 0;
+}
+
+// Best corpus answer for a question, or NULL if no entry shares a term.
+// *confidence is the share of the question's IDF weight the answer's
+// questions cover; a near tie between two entries counts as no confidence.
+const char *faq_index_lookup(const char *question, double *confidence) {
+    char terms[FAQ_QUERY_TERMS][FAQ_TERM_MAX];
+    int n = faq_tokenize(question, terms, FAQ_QUERY_TERMS);
+    int docs = faq_index.doc_count;
     
-    char buffer[BUFFER_SIZE];
-    long total_received = 0;
-    ssize_t bytes_received;
+    *confidence = 0.0;
+    if (n == 0 || docs == 0) return NULL;
+    
+    double *score = calloc(2 * docs, sizeof(double));
+    double *matched = score + docs;
+    double weight = 0.0;
+    if (score == NULL) return NULL;
     
-    while (total_received < file_size) {
-        bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) break;
-        fwrite(buffer, 1, bytes_received, fp);
-        total_received += bytes_received;
+    for (int i = 0; i < n; i++) {
+        int repeated = 0;
+        for (int j = 0; j < i && !repeated; j++) repeated = strcmp(terms[i], terms[j]) == 0;
+        if (repeated) continue;
+        
+        faq_term_t *t = faq_index_find(terms[i], simple_hash(terms[i]));
+        if (t == NULL) {
+            // Unknown words weigh as much as the rarest possible term
+            weight += log(1.0 + (docs + 0.5) / 0.5);
+            continue;
+        }
+        weight += t->idf;
+        for (int p = 0; p < t->count; p++) {
+            const double k1 = 1.2, b = 0.75;
+            int d = t->postings[p].doc;
+            double tf = t->postings[p].tf;
+            double norm = k1 * (1.0 - b + b * faq_index.docs[d].length / faq_index.avg_length);
+            score[d] += t->idf * tf * (k1 + 1.0) / (tf + norm);
+            matched[d] += t->idf;
+        }
     }
-    fclose(fp);
     
-    if (total_received == file_size) {
-        printf("File '%s' uploaded successfully (%ld bytes)\n", filename, file_size);
-        char response[256];
-        snprintf(response, sizeof(response), "Server: File '%s' uploaded successfully", filename);
-        send(client_socket, response, strlen(response), 0);
-    } else {
-        printf("File upload failed. Expected %ld, got %ld\n", file_size, total_received);
-        char response[] = "Server: File upload failed";
-        send(client_socket, response, strlen(response), 0);
+    int best = -1, second = -1;
+    for (int d = 0; d < docs; d++) {
+        if (score[d] <= 0.0) continue;
+        if (best < 0 || score[d] > score[best]) {
+            second = best;
+            best = d;
+        } else if (second < 0 || score[d] > score[second]) {
+            second = d;
+        }
     }
+    if (best >= 0 && weight > 0.0 && (second < 0 || score[second] < 0.9 * score[best])) {
+        *confidence = matched[best] / weight;
+    }
+    free(score);
+    return best >= 0 ? faq_index.docs[best].answer : NULL;
 }
 
-void handle_file_get(int client_socket, char *filename) {
-    char filepath[512];
-    snprintf(filepath, sizeof(filepath), "%s/%s", UPLOAD_DIR, filename);
+// Hand an answer to the client that asked, wherever it lives now. With
+// more set it is a piece of a streamed answer and the client keeps the line open.
+void faq_deliver(faq_request_t *req, const char *answer, int more) {
+    msg_buf_t *buf = msg_buf_new(answer, strlen(answer));
+    if (buf == NULL) return;
+    buf->frame_flags = more ? FRAME_FLAG_MORE : 0;
+    buf->stream = req->stream;
+    session_deliver(req->client_id, req->shard, req->username, buf);
+    msg_buf_unref(buf);
+}
+
+void faq_request_free(faq_request_t *req) {
+    free(req->question);
+    free(req->fallback);
+    free(req->cache_key);
+    buf_pool_free(req->streamed.memory, req->streamed.cap);
+    free(req);
+}
+
+// One "data:" line of a streamed reply: {"token": "..."} while the model
+// writes, {"done": true} at the end. Tokens go straight to the client.
+void faq_stream_event(faq_request_t *req, const char *data) {
+    char *token = NULL;
+    const char *p = json_find_value(data, "token");
+    if (p == NULL || json_parse_string(p, &token, SIZE_MAX) == NULL) return;
     
-    FILE *fp = fopen(filepath, "rb");
-    long file_size;
+    if (token[0]) {
+        if (req->first_token_at == 0) req->first_token_at = now_seconds();
+        WriteMemoryCallback(token, 1, strlen(token), &req->streamed);
+        faq_deliver(req, token, 1);
+    }
+    free(token);
+}
+
+// Streaming replies are server-sent events; complete lines are handled as
+// they arrive and a partial line waits in the attempt's body for the next chunk
+static size_t FaqStreamCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    faq_attempt_t *attempt = (faq_attempt_t *)userp;
+    size_t realsize = size * nmemb;
+    if (WriteMemoryCallback(contents, size, nmemb, &attempt->body) != realsize) return 0;
     
-    if (fp == NULL) {
-        file_size = -1;
-        long net_size = htonl(file_size);
-        send(client_socket, &net_size, sizeof(net_size), 0);
-        printf("File '%s' not found for download\n", filename);
-        return;
+    char *line = attempt->body.memory;
+    char *end = attempt->body.memory + attempt->body.size;
+    char *newline;
+    while ((newline = memchr(line, '\n', end - line)) != NULL) {
+        *newline = '\0';
+        if (strncmp(line, "data:", 5) == 0) {
+            faq_stream_event(attempt->call->reqs, line + 5);
+        }
+        line = newline + 1;
+    }
+    attempt->body.size = end - line;
+    memmove(attempt->body.memory, line, attempt->body.size);
+    attempt->body.memory[attempt->body.size] = '\0';
+    return realsize;
+}
+
+// Account for one answered question. Caller holds faq_engine.lock.
+static void faq_record_latency(faq_request_t *req) {
+    double now = now_seconds();
+    double first = (req->first_token_at ? req->first_token_at : now) - req->queued_at;
+    faq_engine.first_token_total += first;
+    if (first > faq_engine.first_token_max) faq_engine.first_token_max = first;
+    faq_engine.complete_total += now - req->queued_at;
+}
+
+// Encode the questions of a call as the JSON body the service expects
+char *faq_call_payload(faq_call_t *call) {
+    size_t size = 32;
+    for (faq_request_t *req = call->reqs; req; req = req->next) {
+        size += strlen(req->question) * 6 + 4;
     }
+    char *payload = malloc(size);
+    if (payload == NULL) return NULL;
     
-    fseek(fp, 0, SEEK_END);
-    file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    if (call->count == 1) {
+        size_t len = sprintf(payload, "{\"question\": ");
+        len += json_escape(payload + len, call->reqs->question);
+        strcpy(payload + len, "}");
+        return payload;
+    }
+    size_t len = sprintf(payload, "{\"questions\": [");
+    for (faq_request_t *req = call->reqs; req; req = req->next) {
+        len += json_escape(payload + len, req->question);
+        if (req->next) payload[len++] = ',';
+    }
+    strcpy(payload + len, "]}");
+    return payload;
+}
+
+// Put a call's questions back at the front of the waiting list
+void faq_requeue(faq_call_t *call) {
+    faq_request_t *last = call->reqs;
+    while (last->next) last = last->next;
     
-    long net_size = htonl(file_size);
-    send(client_socket, &net_size, sizeof(net_size), 0);
+    pthread_mutex_lock(&faq_engine.lock);
+    last->next = faq_engine.wait_head;
+    faq_engine.wait_head = call->reqs;
+    if (faq_engine.wait_tail == NULL) faq_engine.wait_tail = last;
+    faq_engine.waiting += call->count;
+    pthread_mutex_unlock(&faq_engine.lock);
+}
+
+void faq_call_free(faq_call_t *call) {
+    while (call->reqs) {
+        faq_request_t *req = call->reqs;
+        call->reqs = req->next;
+        faq_request_free(req);
+    }
+    free(call->payload);
+    buf_pool_free(call->attempts[0].body.memory, call->attempts[0].body.cap);
+    buf_pool_free(call->attempts[1].body.memory, call->attempts[1].body.cap);
+    free(call);
+}
+
+// A call is over: forget it and free its slot. FAQ thread only.
+static void faq_call_done(faq_call_t *call) {
+    faq_call_t **link = &faq_engine.active;
+    while (*link && *link != call) link = &(*link)->next;
+    if (*link) *link = call->next;
+    faq_engine.in_flight--;
+    faq_call_free(call);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Update a backend's health after a try: latency percentiles, adaptive
+// timeout and circuit state. seconds < 0 records no latency sample.
+// Caller holds faq_engine.lock.
+static void faq_backend_record(faq_backend_t *b, int healthy, double seconds) {
+    b->calls++;
+    if (seconds >= 0) {
+        double sorted[FAQ_LATENCY_SAMPLES];
+        b->samples[b->next_sample] = seconds;
+        b->next_sample = (b->next_sample + 1) % FAQ_LATENCY_SAMPLES;
+        if (b->sample_count < FAQ_LATENCY_SAMPLES) b->sample_count++;
+        memcpy(sorted, b->samples, b->sample_count * sizeof(double));
+        qsort(sorted, b->sample_count, sizeof(double), compare_doubles);
+        b->p50 = sorted[(b->sample_count - 1) * 50 / 100];
+        b->p95 = sorted[(b->sample_count - 1) * 95 / 100];
+        b->p99 = sorted[(b->sample_count - 1) * 99 / 100];
+        
+        // Three times the p99 leaves room for a slow answer but cuts off
+        // calls that are stuck
+        if (b->sample_count >= FAQ_MIN_SAMPLES) {
+            long timeout = (long)(b->p99 * 3000);
+            b->timeout_ms = timeout < FAQ_TIMEOUT_FLOOR_MS ? FAQ_TIMEOUT_FLOOR_MS :
+                            timeout > faq_timeout_ms ? faq_timeout_ms : timeout;
+        }
+    }
     
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-        if (send(client_socket, buffer, bytes_read, 0) < 0) {
-            perror("Failed to send file chunk");
-            break;
+    if (healthy) {
+        if (b->circuit != CIRCUIT_CLOSED) {
+            printf("FAQ backend %s is back\n", b->url);
+        }
+        b->circuit = CIRCUIT_CLOSED;
+        b->consecutive_failures = 0;
+        return;
+    }
+    b->failures++;
+    b->consecutive_failures++;
+    if (b->circuit == CIRCUIT_HALF_OPEN ||
+        (b->circuit == CIRCUIT_CLOSED && faq_breaker_failures > 0 &&
+         b->consecutive_failures >= faq_breaker_failures)) {
+        if (b->circuit == CIRCUIT_CLOSED) {
+            printf("FAQ backend %s failed %d times in a row, skipping it for %d s\n",
+                   b->url, b->consecutive_failures, FAQ_BREAKER_COOLDOWN);
+            b->trips++;
         }
+        b->circuit = CIRCUIT_OPEN;
+        b->retry_at = now_seconds() + FAQ_BREAKER_COOLDOWN;
     }
-    fclose(fp);
+}
+
+// Backend for the next try. An open circuit whose cooldown is over comes
+// first so it gets its probe (a failed probe fails over); otherwise the
+// least loaded healthy one, earlier --faq-url entries first on a tie.
+// NULL if every circuit is open. FAQ thread only.
+static faq_backend_t *faq_pick_backend(faq_backend_t *exclude) {
+    double now = now_seconds();
+    faq_backend_t *best = NULL;
     
-    printf("File '%s' sent to client (%ld bytes)\n", filename, file_size);
+    for (int i = 0; i < faq_engine.backend_count; i++) {
+        faq_backend_t *b = &faq_engine.backends[i];
+        if (b == exclude) continue;
+        if (b->circuit == CIRCUIT_OPEN && now >= b->retry_at) return b;
+        if (b->circuit != CIRCUIT_CLOSED) continue;
+        if (best == NULL || b->in_flight < best->in_flight) best = b;
+    }
+    return best;
 }
 
-void *handle_client(void *arg) {
-    client_t *client = (client_t *)arg;
-    char buffer[BUFFER_SIZE];
-    char message[BUFFER_SIZE + 100];
-    ssize_t bytes_received;
+// Start one try of a call on a backend. FAQ thread only.
+static int faq_attempt_start(faq_call_t *call, int slot, faq_backend_t *backend) {
+    faq_attempt_t *attempt = &call->attempts[slot];
+    CURL *curl = faq_engine.idle_count > 0 ? faq_engine.idle[--faq_engine.idle_count] : curl_easy_init();
+    if (curl == NULL) return -1;
     
-    printf("Client %d connected from %s:%d\n", 
-           client->id, 
-           inet_ntoa(client->address.sin_addr), 
-           ntohs(client->address.sin_port));
+    // Probes and streams get the full timeout: a probe is the backend's one
+    // chance to prove it is back, a stream runs as long as the model writes
+    pthread_mutex_lock(&faq_engine.lock);
+    long timeout = backend->timeout_ms;
+    if (backend->circuit == CIRCUIT_OPEN) {
+        backend->circuit = CIRCUIT_HALF_OPEN;
+        timeout = faq_timeout_ms;
+    }
+    backend->in_flight++;
+    pthread_mutex_unlock(&faq_engine.lock);
+    if (call->streaming) timeout = faq_timeout_ms;
     
-    char auth_prompt[] = "Welcome! Please login or register.\nCommands: /login <username> <password> or /register <username> <password>";
-    send(client->socket, auth_prompt, strlen(auth_prompt), 0);
+    attempt->call = call;
+    attempt->curl = curl;
+    attempt->backend = backend;
+    attempt->started = now_seconds();
+    attempt->body.size = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, call->streaming ? backend->stream_url :
+                                        call->count > 1 ? backend->batch_url : backend->url);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, call->payload);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, faq_engine.headers);
+    if (call->streaming) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, FaqStreamCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)attempt);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&attempt->body);
+    }
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                     timeout < FAQ_CONNECT_TIMEOUT_MS ? timeout : (long)FAQ_CONNECT_TIMEOUT_MS);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, attempt);
+    curl_multi_add_handle(faq_engine.multi, curl);
+    call->tries++;
+    return 0;
+}
+
+// Take a try out of the multi handle, keeping its easy handle for reuse.
+// With cancel set the try lost a hedge race; if it was a probe, the
+// backend gets another one soon. FAQ thread only.
+static void faq_attempt_stop(faq_attempt_t *attempt, int cancel) {
+    curl_multi_remove_handle(faq_engine.multi, attempt->curl);
+    faq_engine.idle[faq_engine.idle_count++] = attempt->curl;
+    attempt->curl = NULL;
     
-    while ((bytes_received = recv(client->socket, buffer, BUFFER_SIZE, 0)) > 0) {
-        buffer[bytes_received] = '\0';
-        
-        if (strncmp(buffer, "/login ", 7) == 0) {
-            char *username = strtok(buffer + 7, " ");
-            char *password = strtok(NULL, " ");
-            
-            if (username && password) {
-                if (find_client_by_username(username)) {
-                    char error_msg[] = "Error: User already logged in";
-                    send(client->socket, error_msg, strlen(error_msg), 0);
-                } else if (authenticate_user(username, password)) {
-                    strcpy(client->username, username);
-                    client->is_authenticated = 1;
-                    char success_msg[] = "Login successful! You can now chat, send files, or use commands.";
-                    send(client->socket, success_msg, strlen(success_msg), 0);
-                    
-                    snprintf(message, sizeof(message), "%s joined the chat", username);
-                    send_message_to_all(message, client->id);
-                    printf("User %s logged in\n", username);
-                } else {
-                    char error_msg[] = "Login failed: Invalid username or password";
-                    send(client->socket, error_msg, strlen(error_msg), 0);
-                }
-            } else {
-                char error_msg[] = "Usage: /login <username> <password>";
-                send(client->socket, error_msg, strlen(error_msg), 0);
-            }
-        }
-        else if (strncmp(buffer, "/register ", 10) == 0) {
-            char *username = strtok(buffer + 10, " ");
-            char *password = strtok(NULL, " ");
-            
-            if (username && password) {
-                int result = register_user(username, password);
-                if (result == 1) {
-                    char success_msg[] = "Registration successful! You can now login.";
-                    send(client->socket, success_msg, strlen(success_msg), 0);
-                    printf("New user registered: %s\n", username);
-                } else if (result == 0) {
-                    char error_msg[] = "Registration failed: Username already exists";
-                    send(client->socket, error_msg, strlen(error_msg), 0);
-                } else {
-                    char error_msg[] = "Registration failed: Server full";
-                    send(client->socket, error_msg, strlen(error_msg), 0);
-                }
-            } 
+    pthread_mutex_lock(&faq_engine.lock);
+    attempt->backend->in_flight--;
+    if (cancel && attempt->backend->circuit == CIRCUIT_HALF_OPEN) {
+        attempt->backend->circuit = CIRCUIT_OPEN;
+        attempt->backend->retry_at = now_seconds();
+    }
+    pthread_mutex_unlock(&faq_engine.lock);
+}
 
-else if (strncmp(buffer, "/faq ", 5) == 0) {
-    char *question = buffer + 5;
-    if (strlen(question) > 0) {
-        printf("Client %s asked FAQ: %s\n", client->username, question);
-        
-        // Try to get answer from GPT-2 service
-        char *gpt_answer = ask_gpt2_faq(question);
-        
-        if (gpt_answer && strlen(gpt_answer) > 0) {
-            send(client->socket, gpt_answer, strlen(gpt_answer), 0);
-            free(gpt_answer);
-        } else {
-            // Fallback to simple responses if service fails
-            char response[1000];
-            if (strstr(question, "run") != NULL) {
-                strcpy(response, "FAQ Bot: To run this project:\n1. gcc server.c -o server -lpthread -lcurl -ljson-c\n2. gcc client.c -o client -lpthread\n3. ./server\n4. ./client 127.0.0.1");
-            } else if (strstr(question, "difficulty") != NULL) {
-                strcpy(response, "FAQ Bot: Difficulty: Intermediate C programming. Needs: sockets, threading, file I/O knowledge.");
-            } else if (strstr(question, "features") != NULL) {
-                strcpy(response, "FAQ Bot: Features: Multi-threading, authentication, private messages, file transfer, 50 concurrent users.");
-            } else {
-                strcpy(response, "FAQ Bot: I'm a smart assistant! Try asking about the project, general questions, or say hello!");
-            }
-            send(client->socket, response, strlen(response), 0);
-        }
-        
-    } else {
-        char help_msg[] = "Usage: /faq <question>\nTry: /faq how to run, /faq how are you";
-        send(client->socket, help_msg, strlen(help_msg), 0);
+// Every circuit is open: answer everything waiting from the corpus right
+// away instead of letting it sit in the queue for a dead backend
+static void faq_fail_fast() {
+    pthread_mutex_lock(&faq_engine.lock);
+    faq_request_t *req = faq_engine.wait_head;
+    faq_engine.failed += faq_engine.waiting;
+    faq_engine.failed_fast += faq_engine.waiting;
+    faq_engine.wait_head = faq_engine.wait_tail = NULL;
+    faq_engine.waiting = 0;
+    pthread_mutex_unlock(&faq_engine.lock);
+    
+    while (req) {
+        faq_request_t *next = req->next;
+        faq_deliver(req, req->fallback, 0);
+        faq_request_free(req);
+        req = next;
     }
 }
-else {
-                char error_msg[] = "Usage: /register <username> <password>";
-                send(client->socket, error_msg, strlen(error_msg), 0);
-            }
-        }
-        else if (!client->is_authenticated) {
-            char error_msg[] = "Please login first using /login <username> <password>";
-            send(client->socket, error_msg, strlen(error_msg), 0);
+
+// Start calls while there are free slots. With batching, questions are held
+// until faq_batch_max are waiting or the oldest has waited
+// faq_batch_window ms. Returns how long the FAQ thread may sleep, in ms.
+// FAQ thread only.
+int faq_start_waiting() {
+    while (faq_engine.in_flight < faq_concurrency) {
+        faq_backend_t *backend = faq_pick_backend(NULL);
+        if (backend == NULL) {
+            faq_fail_fast();
+            return 1000;
         }
-        else if (strncmp(buffer, "/msg ", 5) == 0) {
-            char *target_user = strtok(buffer + 5, " ");
-            char *msg_content = strtok(NULL, "");
-            
-            if (target_user && msg_content) {
-                handle_private_message(client->id, target_user, msg_content);
-            } else {
-                char error_msg[] = "Usage: /msg <username> <message>";
-                send(client->socket, error_msg, strlen(error_msg), 0);
+        faq_call_t *call = calloc(1, sizeof(faq_call_t));
+        if (call == NULL) return 1000;
+        
+        pthread_mutex_lock(&faq_engine.lock);
+        faq_request_t *head = faq_engine.wait_head;
+        int stream = head && faq_stream && head->framed;
+        if (head && !stream && faq_batch_max > 1 && faq_engine.waiting < faq_batch_max) {
+            int waited = (int)((now_seconds() - head->queued_at) * 1000);
+            if (waited < faq_batch_window) {
+                pthread_mutex_unlock(&faq_engine.lock);
+                free(call);
+                return faq_batch_window - waited;
             }
         }
-        else if (strcmp(buffer, "/users") == 0) {
-            list_online_users(client->socket);
+        if (head == NULL) {
+            pthread_mutex_unlock(&faq_engine.lock);
+            free(call);
+            return 1000;
         }
-        // Add this AFTER your existing command handlers
-else if (strncmp(buffer, "/faq ", 5) == 0) {
-    char *question = buffer + 5;
-    if (strlen(question) > 0) {
-        printf("Client %s asked FAQ: %s\n", client->username, question);
         
-        // Try GPT-2 service first
-        char *gpt_answer = ask_gpt2_faq(question);
+        // A streamed question gets a call of its own; text-protocol
+        // clients cannot show partial answers, so theirs are batched
+        faq_request_t *last = head;
+        call->reqs = head;
+        call->count = 1;
+        call->streaming = stream;
+        while (!stream && call->count < faq_batch_max && last->next &&
+               !(faq_stream && last->next->framed)) {
+            last = last->next;
+            call->count++;
+        }
+        faq_engine.wait_head = last->next;
+        if (faq_engine.wait_head == NULL) faq_engine.wait_tail = NULL;
+        last->next = NULL;
+        faq_engine.waiting -= call->count;
+        faq_engine.calls++;
+        pthread_mutex_unlock(&faq_engine.lock);
         
-        if (gpt_answer) {
-            printf("GPT-2 response: %s\n", gpt_answer);
-            send(client->socket, gpt_answer, strlen(gpt_answer), 0);
-            free(gpt_answer);
-        } else {
-            // Fallback to project-specific answers
-            printf("GPT-2 service failed, using fallback\n");
-            char response[1000];
-            if (strstr(question, "run") != NULL) {
-                strcpy(response, "FAQ Bot: To run this project:\n1. gcc server.c -o server -lpthread -lcurl -ljson-c\n2. gcc client.c -o client -lpthread\n3. ./server\n4. ./client 127.0.0.1");
-            } else if (strstr(question, "you") != NULL || strstr(question, "are") != NULL) {
-                strcpy(response, "FAQ Bot: I'm your helpful chat server assistant! Ask me anything about the project or general questions.");
-            } else if (strstr(question, "joke") != NULL) {
-                strcpy(response, "FAQ Bot: Why do programmers prefer dark mode? Because light attracts bugs! 🐛");
-            } else {
-                strcpy(response, "FAQ Bot: Service temporarily unavailable. Try asking about 'how to run', or say hello!");
+        call->payload = faq_call_payload(call);
+        if (call->payload == NULL || faq_attempt_start(call, 0, backend) < 0) {
+            for (faq_request_t *req = call->reqs; req; req = req->next) {
+                faq_deliver(req, req->fallback, 0);
             }
-            send(client->socket, response, strlen(response), 0);
+            faq_call_free(call);
+            continue;
+        }
+        call->next = faq_engine.active;
+        faq_engine.active = call;
+        faq_engine.in_flight++;
+        
+        // Hedge once this takes longer than 95% of the backend's recent
+        // calls; a stream can't be hedged, its text is already on screen
+        if (faq_hedge && !call->streaming && faq_engine.backend_count > 1 &&
+            backend->sample_count >= FAQ_MIN_SAMPLES) {
+            call->hedge_at = call->attempts[0].started + backend->p95;
         }
-    } else {
-        char help_msg[] = "Usage: /faq <question>\nTry: /faq how are you, /faq tell me a joke";
-        send(client->socket, help_msg, strlen(help_msg), 0);
     }
+    return 1000;
 }
 
-        else if (strncmp(buffer, "put ", 4) == 0) {
-            char *filename = buffer + 4;
-            printf("User %s wants to upload file: %s\n", client->username, filename);
-            handle_file_put(client->socket, filename);
-        }
-        else if (strncmp(buffer, "get ", 4) == 0) {
-            char *filename = buffer + 4;
-            printf("User %s wants to download file: %s\n", client->username, filename);
-            handle_file_get(client->socket, filename);
-        }
-        else if (strcmp(buffer, "exit") == 0) {
-            printf("User %s disconnected\n", client->username);
-            break;
+// Send a second try to another backend for calls whose first try is slow.
+// Returns ms until the next hedge is due. FAQ thread only.
+int faq_send_hedges() {
+    double now = now_seconds();
+    int wait = 1000;
+    
+    for (faq_call_t *call = faq_engine.active; call; call = call->next) {
+        if (call->hedge_at == 0 || call->tries >= 2) continue;
+        if (now < call->hedge_at) {
+            int ms = (int)((call->hedge_at - now) * 1000) + 1;
+            if (ms < wait) wait = ms;
+            continue;
         }
-        else {
-            printf("%s: %s\n", client->username, buffer);
-            snprintf(message, sizeof(message), "%s: %s", client->username, buffer);
-            send_message_to_all(message, client->id);
+        call->hedge_at = 0;
+        faq_backend_t *backend = faq_pick_backend(call->attempts[0].backend);
+        if (backend && faq_attempt_start(call, 1, backend) == 0) {
+            pthread_mutex_lock(&faq_engine.lock);
+            faq_engine.hedges++;
+            pthread_mutex_unlock(&faq_engine.lock);
         }
     }
+    return wait;
+}
+
+// A streamed answer ended: close the client's line and cache the full text
+void faq_finish_stream(faq_call_t *call, int ok) {
+    faq_request_t *req = call->reqs;
+    int answered = req->streamed.size > 0;
     
-    if (client->is_authenticated) {
-        snprintf(message, sizeof(message), "%s left the chat", client->username);
-        send_message_to_all(message, client->id);
+    if (answered) {
+        faq_deliver(req, "", 0);
+        if (ok) {
+            faq_cache_put(req->cache_key, req->streamed.memory);
+        }
+        printf("FAQ for %s: first text after %.0f ms, full answer after %.0f ms\n", req->username,
+               (req->first_token_at - req->queued_at) * 1000, (now_seconds() - req->queued_at) * 1000);
+    } else {
+        printf("FAQ service failed for %s: stream ended without an answer\n", req->username);
+        faq_deliver(req, req->fallback, 0);
     }
     
-    close(client->socket);
-    remove_client(client->id);
-    free(client);
-    pthread_exit(NULL);
+    pthread_mutex_lock(&faq_engine.lock);
+    if (answered) {
+        faq_record_latency(req);
+        faq_engine.answered++;
+        faq_engine.streams++;
+    } else {
+        faq_engine.failed++;
+    }
+    pthread_mutex_unlock(&faq_engine.lock);
 }
 
-
-int main() {
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    pthread_t thread_id;
+// A try finished. The first good reply answers every client of the call
+// and cancels a hedge still running; a failed try waits for the other one
+// or fails over to another backend once before falling back.
+void faq_finish(CURL *curl, CURLcode res) {
+    faq_attempt_t *attempt = NULL;
+    long status = 0;
+    long connects = 0;
+    char *answers[FAQ_BATCH_LIMIT] = { NULL };
+    unsigned long answered = 0;
     
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        clients[i] = NULL;
-    }
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&attempt);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    faq_call_t *call = attempt->call;
+    faq_backend_t *backend = attempt->backend;
+    faq_attempt_t *other = &call->attempts[attempt == &call->attempts[0] ? 1 : 0];
+    int ok = res == CURLE_OK && status == 200;
     
-    load_users();
+    // A 4xx still means the backend is up; streams are too long to say
+    // anything about latency. Timeouts aren't samples either: a backend that
+    // really got slower shows its new latency through the next probe call.
+    double elapsed = now_seconds() - attempt->started;
+    int healthy = res == CURLE_OK && status < 500;
+    faq_attempt_stop(attempt, 0);
+    pthread_mutex_lock(&faq_engine.lock);
+    faq_backend_record(backend, healthy, call->streaming || !healthy ? -1.0 : elapsed);
+    faq_engine.connects += connects;
+    pthread_mutex_unlock(&faq_engine.lock);
     
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+    if (res == CURLE_OK && status == 404 && call->count > 1) {
+        // An older service without /faq/batch: ask one question at a time
+        printf("FAQ service has no batch endpoint; batching disabled\n");
+        faq_batch_max = 1;
+        if (other->curl) faq_attempt_stop(other, 1);
+        faq_requeue(call);
+        call->reqs = NULL;
+        faq_call_done(call);
+        return;
     }
-    
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("Setsockopt failed");
-        exit(EXIT_FAILURE);
+    if (!ok) {
+        printf("FAQ backend %s failed for %d question(s): %s\n", backend->url, call->count,
+               res != CURLE_OK ? curl_easy_strerror(res) : "bad HTTP status");
+        if (other->curl) return;
+        
+        // Nothing relayed yet, so another backend can still take it
+        faq_backend_t *next = NULL;
+        if (call->tries < 2 && !(call->streaming && call->reqs->streamed.size > 0)) {
+            next = faq_pick_backend(backend);
+        }
+        if (next && faq_attempt_start(call, attempt - call->attempts, next) == 0) {
+            pthread_mutex_lock(&faq_engine.lock);
+            faq_engine.failovers++;
+            pthread_mutex_unlock(&faq_engine.lock);
+            return;
+        }
+    } else if (other->curl) {
+        // First good answer wins; drop the slower try
+        faq_attempt_stop(other, 1);
+        if (attempt == &call->attempts[1]) {
+            pthread_mutex_lock(&faq_engine.lock);
+            backend->hedges_won++;
+            pthread_mutex_unlock(&faq_engine.lock);
+        }
     }
     
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
-    
-    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        exit(EXIT_FAILURE);
+    if (call->streaming) {
+        faq_finish_stream(call, ok);
+        faq_call_done(call);
+        return;
     }
-    
-    if (listen(server_socket, MAX_CLIENTS) < 0) {
-        perror("Listen failed");
-        exit(EXIT_FAILURE);
+    if (ok && attempt->body.memory) {
+        if (call->count == 1) {
+            answers[0] = parse_faq_answer(attempt->body.memory);
+        } else {
+            parse_faq_answers(attempt->body.memory, answers, call->count);
+        }
     }
     
-    printf("Server listening on port %d\n", PORT);
-    printf("Upload directory: %s\n", UPLOAD_DIR);
-    printf("User database: %s\n", USER_DB_FILE);
-    printf("Waiting for clients...\n");
+    int i = 0;
+    for (faq_request_t *req = call->reqs; req; req = req->next, i++) {
+        if (answers[i] && strlen(answers[i]) > 0) {
+            printf("GPT-2 response: %s\n", answers[i]);
+            faq_deliver(req, answers[i], 0);
+            faq_cache_put(req->cache_key, answers[i]);
+            answered++;
+        } else {
+            faq_deliver(req, req->fallback, 0);
+        }
+    }
     
-    mkdir(UPLOAD_DIR, 0777);
+    pthread_mutex_lock(&faq_engine.lock);
+    i = 0;
+    for (faq_request_t *req = call->reqs; req; req = req->next, i++) {
+        if (answers[i] && answers[i][0]) faq_record_latency(req);
+        free(answers[i]);
+    }
+    faq_engine.answered += answered;
+    faq_engine.failed += call->count - answered;
+    pthread_mutex_unlock(&faq_engine.lock);
     
+    faq_call_done(call);
+}
+
+void *faq_thread(void *arg) {
+    (void)arg;
     while (1) {
-        client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        if (client_socket < 0) {
-            perror("Accept failed");
-            continue;
-        }
-        
-        if (client_count >= MAX_CLIENTS) {
-            printf("Maximum clients reached. Rejecting new connection.\n");
-            close(client_socket);
-            continue;
-        }
-        
-        client_t *client = (client_t*)malloc(sizeof(client_t));
-        client->socket = client_socket;
-        client->address = client_addr;
-        client->id = client_socket;
-        client->is_authenticated = 0;
-        strcpy(client->username, "");
+        int running, queued;
+        CURLMsg *msg;
         
-        add_client(client);
-        
-        if (pthread_create(&thread_id, NULL, handle_client, (void*)client) != 0) {
-            perror("Failed to create thread");
-            free(client);
-            close(client_socket);
-        } else {
-            pthread_detach(thread_id);
+        curl_multi_perform(faq_engine.multi, &running);
+        while ((msg = curl_multi_info_read(faq_engine.multi, &queued))) {
+            if (msg->msg == CURLMSG_DONE) {
+                faq_finish(msg->easy_handle, msg->data.result);
+            }
         }
+        int timeout = faq_start_waiting();
+        int hedge_wait = faq_send_hedges();
+        if (hedge_wait < timeout) timeout = hedge_wait;
+        // Woken early by faq_submit() through curl_multi_wakeup()
+        curl_multi_poll(faq_engine.multi, NULL, 0, timeout, NULL);
     }
-    
-    close(server_socket);
-    return 0;
+    return NULL;
 }
-static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    struct http_response *mem = (struct http_response *)userp;
+
+int faq_engine_start() {
+    pthread_t tid;
     
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if (!ptr) {
-        printf("Not enough memory (realloc returned NULL)\n");
-        return 0;
-    }
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) return -1;
+    faq_engine.multi = curl_multi_init();
+    // A call can have a hedge running next to it
+    faq_engine.idle = calloc(2 * faq_concurrency, sizeof(CURL *));
+    if (faq_engine.multi == NULL || faq_engine.idle == NULL) return -1;
     
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
+    // Keep one idle connection per slot instead of curl's small default
+    curl_multi_setopt(faq_engine.multi, CURLMOPT_MAXCONNECTS, (long)(2 * faq_concurrency));
+    curl_multi_setopt(faq_engine.multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)(2 * faq_concurrency));
+    faq_engine.headers = curl_slist_append(NULL, "Content-Type: application/json");
     
-    return realsize;
+    if (faq_url_count == 0) faq_urls[faq_url_count++] = FAQ_SERVICE_URL;
+    for (int i = 0; i < faq_url_count; i++) {
+        faq_backend_t *b = &faq_engine.backends[i];
+        b->url = faq_urls[i];
+        snprintf(b->batch_url, sizeof(b->batch_url), "%s/batch", b->url);
+        snprintf(b->stream_url, sizeof(b->stream_url), "%s/stream", b->url);
+        b->circuit = CIRCUIT_CLOSED;
+        b->timeout_ms = faq_timeout_ms;
+    }
+    faq_engine.backend_count = faq_url_count;
+    
+    if (pthread_create(&tid, NULL, faq_thread, NULL) != 0) {
+        perror("Failed to create FAQ thread");
+        curl_multi_cleanup(faq_engine.multi);
+        faq_engine.multi = NULL;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
 }
 
-char* ask_gpt2_faq(const char* question) {
-    CURL *curl;
-    CURLcode res;
-    struct http_response chunk;
+// Answer a question from the corpus index when it is a confident match.
+// Otherwise queue it for the service and return at once; the answer (or
+// the closest corpus answer if the service fails) is delivered to the
+// client when the call completes.
+void faq_submit(client_t *client, const char *question) {
+    double confidence = 0.0;
+    double start = now_seconds();
+    const char *local = faq_index_lookup(question, &confidence);
+    atomic_fetch_add(&faq_index.lookup_ns, (unsigned long)((now_seconds() - start) * 1e9));
+    atomic_fetch_add(&faq_index.lookups, 1);
+    if (local && confidence >= faq_min_confidence) {
+        atomic_fetch_add(&faq_index.local, 1);
+        client_send(client, local, strlen(local));
+        return;
+    }
+    const char *fallback = local ? local : FAQ_DEFAULT_FALLBACK;
+    faq_request_t *req = calloc(1, sizeof(faq_request_t));
     
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    // Repeated questions are answered from the cache without a model call
+    char *key = faq_normalize(question);
+    if (key && faq_cache_ttl > 0) {
+        msg_buf_t *cached = faq_cache_get(key);
+        if (cached) {
+            client_send_buf(client, cached);
+            msg_buf_unref(cached);
+            free(key);
+            free(req);
+            return;
+        }
+    }
     
-    printf("DEBUG: Connecting to GPT-2 service on Windows...\n");
+    if (req == NULL || faq_engine.multi == NULL) {
+        free(key);
+        client_send(client, fallback, strlen(fallback));
+        free(req);
+        return;
+    }
+    req->client_id = client->id;
+    req->shard = current_reactor ? current_reactor->id : 0;
+    req->framed = client->framed;
+    req->stream = client->framed ? client->cur_stream : 0;
+    snprintf(req->username, sizeof(req->username), "%s", client->username);
+    req->question = strdup(question);
+    req->fallback = strdup(fallback);
+    req->cache_key = key;
+    req->queued_at = now_seconds();
+    if (req->question == NULL || req->fallback == NULL) {
+        client_send(client, fallback, strlen(fallback));
+        faq_request_free(req);
+        return;
+    }
     
-    curl = curl_easy_init();
-    if (curl) {
-        char payload[1024];
-        snprintf(payload, sizeof(payload), "{\"question\": \"%s\"}", question);
-        printf("DEBUG: Sending: %s\n", payload);
-        
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        
-        // ONLY use Windows IP (since we know it works)
-        curl_easy_setopt(curl, CURLOPT_URL, "http://10.14.94.221:5005/faq");
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
-        
-        res = curl_easy_perform(curl);
-        
-        if (res == CURLE_OK && chunk.memory) {
-            printf("DEBUG: Success! Raw response: %.200s\n", chunk.memory);
-            
-            // Parse JSON response
-            char *answer_start = strstr(chunk.memory, "\"answer\":\"");
-            if (answer_start) {
-                answer_start += 10; // Skip "answer":"
-                char *answer_end = strstr(answer_start, "\"}");
-                if (!answer_end) {
-                    answer_end = strchr(answer_start, '"');
-                }
-                
-                if (answer_end) {
-                    size_t answer_len = answer_end - answer_start;
-                    if (answer_len > 400) answer_len = 400; // Limit length
-                    
-                    char *result = malloc(answer_len + 1);
-                    strncpy(result, answer_start, answer_len);
-                    result[answer_len] = '\0';
-                    
-                    printf("DEBUG: Parsed answer: %s\n", result);
-                    
-                    free(chunk.memory);
-                    curl_easy_cleanup(curl);
-                    curl_slist_free_all(headers);
-                    return result;
-                }
-            }
-        } else {
-            printf("DEBUG: CURL failed: %s\n", curl_easy_strerror(res));
-        }
-        
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
+    pthread_mutex_lock(&faq_engine.lock);
+    if (faq_engine.waiting >= FAQ_QUEUE_MAX) {
+        faq_engine.failed++;
+        pthread_mutex_unlock(&faq_engine.lock);
+        client_send(client, fallback, strlen(fallback));
+        faq_request_free(req);
+        return;
+    }
+    if (faq_engine.wait_tail) {
+        faq_engine.wait_tail->next = req;
+    } else {
+        faq_engine.wait_head = req;
     }
+    faq_engine.wait_tail = req;
+    faq_engine.waiting++;
+    faq_engine.asked++;
+    pthread_mutex_unlock(&faq_engine.lock);
     
-    if (chunk.memory) free(chunk.memory);
-    return NULL;
+    curl_multi_wakeup(faq_engine.multi);
 }